@@ -0,0 +1,462 @@
+/* $Id$ */
+
+/* This software may be copied, modified, and used for any purpose
+ * without fee, provided that (1) the above copyright notice is
+ * retained, and (2) modified versions are clearly marked as having
+ * been modified, with the modifier's name and the date included.  */
+
+/*
+ * xtrs-batch: run a list of TRS-80 jobs, several at once.  Each job
+ * gets a freshly powered-on machine of its own, with the null display
+ * backend, and runs on one of a pool of threads until the program
+ * exits (emt_misc function 1, or "\q" in its key script), reaches a
+ * trap address, or uses up its T-state budget.  The heartbeat timer
+ * counts T-states rather than host time, so a job does the same thing
+ * however many others are running beside it.
+ *
+ * The manifest has one job per line, as words of the form key=value;
+ * blank lines and words from "#" to the end of the line are ignored.
+ * See xtrs.man for the keys.  One tab-separated line of results per
+ * job is printed, in manifest order.
+ *
+ * Usage: xtrs-batch [-j n] [-blockcache] [-bulkmove] [manifest]
+ */
+
+#define _DEFAULT_SOURCE /* string.h: strdup() */
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "z80.h"
+#include "trs.h"
+#include "trs_disk.h"
+#include "trs_hard.h"
+#include "trs_uart.h"
+
+char *program_name;
+
+#define NDISKS 8
+
+/* Run length if the job does not give one: about 9 minutes on a
+   Model I, 4 on a Model 4 */
+#define DEFAULT_TSTATES 1000000000UL
+
+/* Longest wait for one TRS_EV_STOP event; longer budgets are made of
+   several */
+#define STOP_CHUNK 1000000000
+
+struct job {
+  /* From the manifest */
+  char *name;
+  int model;
+  char *rom;
+  char *disk[NDISKS];
+  char *hard[TRS_HARD_MAXDRIVES];
+  char *keys;
+  char *snapshot;	/* start from here instead of power-on */
+  tstate_t tstates;	/* budget; 0 for none */
+  Uchar *traps;		/* NULL if none */
+  char *screen;
+  char *printer;
+  int emtsafe;
+
+  /* Results */
+  int done;
+  const char *result;
+  tstate_t used;
+  int pc;
+  double seconds;
+};
+
+static struct job *jobs;
+static int njobs;
+static FILE *discard;
+
+/* Jobs are handed out in manifest order to whichever thread is free,
+   and reported in manifest order as they finish */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_job, next_report;
+
+/* The budget of the job running on this thread */
+static __thread tstate_t stop_tcount;
+static __thread int budget_spent;
+
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+batch_stop(int arg)
+{
+  tstate_t left = stop_tcount - z80_state.t_count;
+
+  if (left > 0 && left < TSTATE_T_MID) {
+    trs_schedule_event(TRS_EV_STOP, batch_stop, 0,
+		       left > STOP_CHUNK ? STOP_CHUNK : (int) left);
+    return;
+  }
+  budget_spent = 1;
+  trs_continuous = 0;
+}
+
+static void
+load_rom(struct job *j)
+{
+  if (j->rom) {
+    trs_load_rom(j->rom);
+  } else if (j->model == 1) {
+    trs_load_compiled_rom(trs_rom1_size, trs_rom1);
+  } else if (j->model <= 4) {
+    trs_load_compiled_rom(trs_rom3_size, trs_rom3);
+  } else {
+    trs_load_compiled_rom(trs_rom4p_size, trs_rom4p);
+  }
+}
+
+static FILE *
+open_output(const char *name)
+{
+  FILE *f = fopen(name, "w");
+  if (f == NULL) fatal("could not write %s", name);
+  return f;
+}
+
+/* Power on a new machine, run the job on it, and throw it away */
+static void
+run_job(struct job *j)
+{
+  struct trs_machine *m;
+  FILE *screen = NULL, *printer = NULL;
+  double start = now();
+  tstate_t t0;
+  int i, debug;
+
+  m = trs_machine_new();
+  trs_cur = m;
+  trs_model = j->model;
+  trs_emtsafe = j->emtsafe;
+  trs_uart_name = NULL;  /* no serial port */
+  trs_tstate_timer = TRUE;
+  trs_exit_stops = TRUE;
+  z80_traps = j->traps;
+  trs_kb_bracket(trs_model >= 4);
+  if (j->screen) screen = open_output(j->screen);
+  if (j->printer) printer = open_output(j->printer);
+  trs_printer_file = printer ? printer : discard;
+  trs_screen_dump_to(screen);
+
+  mem_init();
+  load_rom(j);
+  trs_timer_init();
+  trs_disk_init();
+  trs_hard_init();
+  stringy_init();
+  for (i = 0; i < NDISKS; i++) {
+    trs_disk_setsize(i, i < 4 ? 5 : 8);
+    trs_disk_setstep(i, 1);
+    trs_disk_set_name(i, j->disk[i]);
+  }
+  for (i = 0; i < TRS_HARD_MAXDRIVES; i++) {
+    trs_hard_set_name(i, j->hard[i]);
+  }
+  if (j->keys) trs_screen_keys(j->keys);
+  trs_reset(1);
+
+  budget_spent = 0;
+  if (j->snapshot && trs_snapshot_load(j->snapshot) < 0) {
+    j->result = "error";
+    t0 = z80_state.t_count;
+    goto done;
+  }
+  t0 = z80_state.t_count;
+  if (j->tstates) {
+    stop_tcount = t0 + j->tstates;
+    batch_stop(0);
+  }
+  for (;;) {
+    debug = z80_run(TRUE);
+    if (trs_exited) {
+      j->result = "exit";
+    } else if (debug) {
+      j->result = "debug";
+    } else if (z80_traps && z80_traps[REG_PC]) {
+      j->result = "trap";
+    } else if (budget_spent) {
+      j->result = "budget";
+    } else {
+      continue;
+    }
+    break;
+  }
+ done:
+  j->used = z80_state.t_count - t0;
+  j->pc = REG_PC;
+
+  trs_screen_dump();
+  trs_screen_keys(NULL);
+  for (i = 0; i < NDISKS; i++) trs_disk_set_name(i, NULL);
+  for (i = 0; i < TRS_HARD_MAXDRIVES; i++) trs_hard_set_name(i, NULL);
+  if (screen) fclose(screen);
+  if (printer) fclose(printer);
+  trs_cur = &trs_machine0;
+  trs_machine_free(m);
+  j->seconds = now() - start;
+}
+
+static void
+report(struct job *j)
+{
+  printf("%s\t%s\t%" TSTATE_T_LEN "\t%04x\t%.3f\n",
+	 j->name, j->result, j->used, j->pc, j->seconds);
+  fflush(stdout);
+}
+
+static void *
+worker(void *arg)
+{
+  int i;
+
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    i = next_job < njobs ? next_job++ : -1;
+    pthread_mutex_unlock(&lock);
+    if (i < 0) return NULL;
+
+    run_job(&jobs[i]);
+
+    pthread_mutex_lock(&lock);
+    jobs[i].done = 1;
+    while (next_report < njobs && jobs[next_report].done) {
+      report(&jobs[next_report++]);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+
+/* Manifest parsing */
+
+static const char *manifest_name;
+static int manifest_line;
+
+static void
+manifest_error(const char *msg, const char *word)
+{
+  fatal("%s:%d: %s %s", manifest_name, manifest_line, msg, word);
+}
+
+/* Return a copy of a file name, after checking it can be read */
+static char *
+input_file(const char *name)
+{
+  if (access(name, R_OK) != 0) manifest_error("cannot read", name);
+  return strdup(name);
+}
+
+static int
+parse_model(const char *value)
+{
+  if (strcmp(value, "1") == 0 || strcasecmp(value, "I") == 0) return 1;
+  if (strcmp(value, "3") == 0 || strcasecmp(value, "III") == 0) return 3;
+  if (strcmp(value, "4") == 0 || strcasecmp(value, "IV") == 0) return 4;
+  if (strcasecmp(value, "4P") == 0 || strcasecmp(value, "IVp") == 0) return 5;
+  manifest_error("unknown model", value);
+  return 0;
+}
+
+static void
+parse_traps(struct job *j, char *value)
+{
+  char *p = value, *end;
+  unsigned long addr;
+
+  if (j->traps == NULL) {
+    j->traps = (Uchar *) calloc(Z80_ADDRESS_LIMIT, 1);
+    if (j->traps == NULL) fatal("out of memory");
+  }
+  for (;;) {
+    addr = strtoul(p, &end, 16);
+    if (end == p || addr >= Z80_ADDRESS_LIMIT ||
+	(*end != ',' && *end != '\0')) {
+      manifest_error("bad trap address in", value);
+    }
+    j->traps[addr] = 1;
+    if (*end == '\0') break;
+    p = end + 1;
+  }
+}
+
+/* Use the same ROM that xtrs would, if none is given */
+static void
+default_rom(struct job *j)
+{
+  struct stat st;
+  const char *file = NULL;
+  int size;
+
+  switch (j->model) {
+  case 1:
+#ifdef DEFAULT_ROM
+    file = DEFAULT_ROM;
+#endif
+    size = trs_rom1_size;
+    break;
+  case 3: case 4:
+#ifdef DEFAULT_ROM3
+    file = DEFAULT_ROM3;
+#endif
+    size = trs_rom3_size;
+    break;
+  default:
+#ifdef DEFAULT_ROM4P
+    file = DEFAULT_ROM4P;
+#endif
+    size = trs_rom4p_size;
+    break;
+  }
+  if (file && stat(file, &st) == 0) {
+    j->rom = strdup(file);
+  } else if (size <= 0) {
+    manifest_error("no ROM for job", j->name);
+  }
+}
+
+static void
+parse_word(struct job *j, char *word)
+{
+  char *value = strchr(word, '=');
+  int n;
+
+  if (value == NULL) manifest_error("expected key=value, not", word);
+  *value++ = '\0';
+  if (strcmp(word, "name") == 0) {
+    j->name = strdup(value);
+  } else if (strcmp(word, "model") == 0) {
+    j->model = parse_model(value);
+  } else if (strcmp(word, "rom") == 0) {
+    j->rom = input_file(value);
+  } else if (sscanf(word, "disk%d", &n) == 1 && n >= 0 && n < NDISKS) {
+    j->disk[n] = input_file(value);
+  } else if (sscanf(word, "hard%d", &n) == 1 &&
+	     n >= 0 && n < TRS_HARD_MAXDRIVES) {
+    j->hard[n] = input_file(value);
+  } else if (strcmp(word, "keys") == 0) {
+    j->keys = input_file(value);
+  } else if (strcmp(word, "snapshot") == 0) {
+    j->snapshot = input_file(value);
+  } else if (strcmp(word, "tstates") == 0) {
+    j->tstates = strtoul(value, NULL, 0);
+  } else if (strcmp(word, "trap") == 0) {
+    parse_traps(j, value);
+  } else if (strcmp(word, "screen") == 0) {
+    j->screen = strdup(value);
+  } else if (strcmp(word, "printer") == 0) {
+    j->printer = strdup(value);
+  } else if (strcmp(word, "emtsafe") == 0) {
+    j->emtsafe = strtol(value, NULL, 0) != 0;
+  } else {
+    manifest_error("unknown key", word);
+  }
+}
+
+static void
+read_manifest(const char *name)
+{
+  FILE *f;
+  char *line = NULL, *word;
+  size_t size = 0;
+  int max = 0;
+  struct job *j;
+
+  manifest_name = name;
+  f = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+  if (f == NULL) fatal("could not read %s", name);
+  while (getline(&line, &size, f) != -1) {
+    manifest_line++;
+    word = strtok(line, " \t\r\n");
+    if (word == NULL || word[0] == '#') continue;
+
+    if (njobs == max) {
+      max = max ? max * 2 : 64;
+      jobs = (struct job *) realloc(jobs, max * sizeof(struct job));
+      if (jobs == NULL) fatal("out of memory");
+    }
+    j = &jobs[njobs++];
+    memset(j, 0, sizeof(*j));
+    j->model = 1;
+    j->tstates = DEFAULT_TSTATES;
+    j->emtsafe = TRUE;
+    for (; word != NULL && word[0] != '#'; word = strtok(NULL, " \t\r\n")) {
+      parse_word(j, word);
+    }
+    if (j->name == NULL) {
+      char buf[32];
+      sprintf(buf, "%d", manifest_line);
+      j->name = strdup(buf);
+    }
+    if (j->rom == NULL) default_rom(j);
+  }
+  free(line);
+  if (f != stdin) fclose(f);
+}
+
+int
+main(int argc, char *argv[])
+{
+  pthread_t *threads;
+  int i, nthreads = 0;
+
+  program_name = strrchr(argv[0], '/');
+  program_name = program_name ? program_name + 1 : argv[0];
+  trs_machine_init(&trs_machine0);
+
+  for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      nthreads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-blockcache") == 0) {
+      z80_block_cache = TRUE;
+    } else if (strcmp(argv[i], "-bulkmove") == 0) {
+      z80_bulk_move = TRUE;
+    } else {
+      break;
+    }
+  }
+  if (i < argc - 1 || (i < argc && argv[i][0] == '-' && argv[i][1] != '\0')) {
+    fatal("usage: %s [-j n] [-blockcache] [-bulkmove] [manifest]",
+	  program_name);
+  }
+  read_manifest(i < argc ? argv[i] : "-");
+
+  discard = fopen("/dev/null", "w");
+  if (discard == NULL) fatal("could not open /dev/null");
+  if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > njobs) nthreads = njobs;
+  if (nthreads <= 0) nthreads = 1;
+
+  printf("job\tresult\ttstates\tpc\tseconds\n");
+  fflush(stdout);
+  threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+  if (threads == NULL) fatal("out of memory");
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+      fatal("could not create thread");
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  return 0;
+}
@@ -0,0 +1,414 @@
+/* $Id$ */
+
+/* This software may be copied, modified, and used for any purpose
+ * without fee, provided that (1) the above copyright notice is
+ * retained, and (2) modified versions are clearly marked as having
+ * been modified, with the modifier's name and the date included.  */
+
+/*
+ * xtrs-bench: measure the speed of the emulator core.  Runs a fixed
+ * set of Model I workloads with the null display backend and no host
+ * timer, so the emulated work done is the same on every run, and
+ * prints one tab-separated line of results per workload.  Each line
+ * ends with a checksum of the registers and RAM the workload left
+ * behind, which is checked against the known answer where there is
+ * one, so that a fast but broken core does not pass unnoticed.
+ *
+ * Usage: xtrs-bench [-blockcache] [-bulkmove] [-repeat n] [workload ...]
+ */
+
+#define _DEFAULT_SOURCE /* stdlib.h: mkdtemp() */
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "z80.h"
+#include "trs.h"
+#include "trs_disk.h"
+#include "trs_hard.h"
+
+char *program_name;
+
+#define CODE_START 0x8000
+
+/* Limit on any one run, in case a workload goes astray */
+#define MAX_TSTATES 2000000000
+
+/* RAM covered by the checksum: all of a 48K Model I */
+#define RAM_START 0x4000
+
+/* Instruction exerciser style ALU sweep.  For every pair of 8-bit
+   operands, does the 8-bit ALU operations and adds each result and
+   its flags into HL.  4 passes, counted at 9000h.  */
+static const Uchar alu_code[] = {
+  0xf3,			/*       di */
+  0x31, 0x00, 0xff,	/*       ld sp,0ff00h */
+  0x3e, 0x04,		/*       ld a,4 */
+  0x32, 0x00, 0x90,	/*       ld (9000h),a */
+  0x21, 0x00, 0x00,	/* pass: ld hl,0 */
+  0x01, 0x00, 0x00,	/*       ld bc,0 */
+  0x78, 0x81, 0xcd, 0x54, 0x80,		/* loop: ld a,b; add a,c; call fold */
+  0x78, 0x89, 0xcd, 0x54, 0x80,		/* ld a,b; adc a,c; call fold */
+  0x78, 0x91, 0xcd, 0x54, 0x80,		/* ld a,b; sub c; call fold */
+  0x78, 0x99, 0xcd, 0x54, 0x80,		/* ld a,b; sbc a,c; call fold */
+  0x78, 0xa1, 0xcd, 0x54, 0x80,		/* ld a,b; and c; call fold */
+  0x78, 0xa9, 0xcd, 0x54, 0x80,		/* ld a,b; xor c; call fold */
+  0x78, 0xb1, 0xcd, 0x54, 0x80,		/* ld a,b; or c; call fold */
+  0x78, 0xb9, 0xcd, 0x54, 0x80,		/* ld a,b; cp c; call fold */
+  0x78, 0x3c, 0x27, 0xcd, 0x54, 0x80,	/* ld a,b; inc a; daa; call fold */
+  0x78, 0x3d, 0x17, 0xcd, 0x54, 0x80,	/* ld a,b; dec a; rla; call fold */
+  0x0c,			/*       inc c */
+  0x20, 0xc9,		/*       jr nz,loop */
+  0x04,			/*       inc b */
+  0x20, 0xc6,		/*       jr nz,loop */
+  0x3a, 0x00, 0x90,	/*       ld a,(9000h) */
+  0x3d,			/*       dec a */
+  0x32, 0x00, 0x90,	/*       ld (9000h),a */
+  0x20, 0xb7,		/*       jr nz,pass */
+  0xed, 0x2f,		/*       emt_debug (end) */
+  0xf5,			/* fold: push af */
+  0xd1,			/*       pop de */
+  0x19,			/*       add hl,de */
+  0xc9,			/*       ret */
+};
+
+/* Block moves: copy 4K up with LDIR, then back down with LDDR.
+   256 passes. */
+static const Uchar ldir_code[] = {
+  0xf3,			/*       di */
+  0x31, 0x00, 0xff,	/*       ld sp,0ff00h */
+  0x16, 0x00,		/*       ld d,0 */
+  0xd5,			/* pass: push de */
+  0x21, 0x00, 0xc0,	/*       ld hl,0c000h */
+  0x11, 0x00, 0xd0,	/*       ld de,0d000h */
+  0x01, 0x00, 0x10,	/*       ld bc,1000h */
+  0xed, 0xb0,		/*       ldir */
+  0x21, 0xff, 0xdf,	/*       ld hl,0dfffh */
+  0x11, 0xff, 0xef,	/*       ld de,0efffh */
+  0x01, 0x00, 0x10,	/*       ld bc,1000h */
+  0xed, 0xb8,		/*       lddr */
+  0xd1,			/*       pop de */
+  0x15,			/*       dec d */
+  0x20, 0xe5,		/*       jr nz,pass */
+  0xed, 0x2f,		/*       emt_debug (end) */
+};
+
+/* Floppy reads: seek to each track of a 35-track single density disk
+   in drive 0 and read its 10 sectors through the memory-mapped FDC,
+   polling for DRQ.  4 passes. */
+#define DISK_TRACKS  35
+#define DISK_SECTORS 10
+static const Uchar disk_code[] = {
+  0xf3,			/*       di */
+  0x31, 0x00, 0xff,	/*       ld sp,0ff00h */
+  0x16, 0x04,		/*       ld d,4 */
+  0x0e, 0x00,		/* pass: ld c,0 */
+  0x3e, 0x01,		/* trk:  ld a,1 */
+  0x32, 0xe1, 0x37,	/*       ld (37e1h),a	; select drive 0 */
+  0x79,			/*       ld a,c */
+  0x32, 0xef, 0x37,	/*       ld (37efh),a	; data = track */
+  0x3e, 0x10,		/*       ld a,10h	; seek */
+  0x32, 0xec, 0x37,	/*       ld (37ech),a */
+  0xcd, 0x50, 0x80,	/*       call wait */
+  0x1e, 0x00,		/*       ld e,0 */
+  0x3e, 0x01,		/* sec:  ld a,1 */
+  0x32, 0xe1, 0x37,	/*       ld (37e1h),a */
+  0x7b,			/*       ld a,e */
+  0x32, 0xee, 0x37,	/*       ld (37eeh),a	; sector */
+  0x3e, 0x88,		/*       ld a,88h	; read sector */
+  0x32, 0xec, 0x37,	/*       ld (37ech),a */
+  0x21, 0x00, 0xa0,	/*       ld hl,0a000h */
+  0x3a, 0xec, 0x37,	/* rd:   ld a,(37ech) */
+  0xcb, 0x4f,		/*       bit 1,a	; DRQ? */
+  0x20, 0x05,		/*       jr nz,data */
+  0x0f,			/*       rrca		; busy? */
+  0x38, 0xf6,		/*       jr c,rd */
+  0x18, 0x07,		/*       jr next */
+  0x3a, 0xef, 0x37,	/* data: ld a,(37efh) */
+  0x77,			/*       ld (hl),a */
+  0x23,			/*       inc hl */
+  0x18, 0xed,		/*       jr rd */
+  0x1c,			/* next: inc e */
+  0x7b,			/*       ld a,e */
+  0xfe, DISK_SECTORS,	/*       cp DISK_SECTORS */
+  0x20, 0xd6,		/*       jr nz,sec */
+  0x0c,			/*       inc c */
+  0x79,			/*       ld a,c */
+  0xfe, DISK_TRACKS,	/*       cp DISK_TRACKS */
+  0x20, 0xbd,		/*       jr nz,trk */
+  0x15,			/*       dec d */
+  0x20, 0xb8,		/*       jr nz,pass */
+  0xed, 0x2f,		/*       emt_debug (end) */
+  0x3a, 0xec, 0x37,	/* wait: ld a,(37ech) */
+  0x0f,			/*       rrca */
+  0x38, 0xfa,		/*       jr c,wait */
+  0xc9,			/*       ret */
+};
+
+/* Typed into the built-in ROM before timing the "rom" workload.  With
+   a Level II BASIC ROM, this answers MEMORY SIZE? and starts a loop
+   in the BASIC interpreter. */
+static const char rom_keys[] = "\n10 A=A+1:B=A*2:GOTO 10\nRUN\n";
+#define ROM_TSTATES 100000000
+
+static char *disk_dir;
+static FILE *results;
+
+
+static void
+bench_stop(int arg)
+{
+  trs_continuous = 0;
+}
+
+/* Run until the program ends (emt_debug) or tstates have passed */
+static void
+run_for(int tstates)
+{
+  trs_schedule_event(TRS_EV_STOP, bench_stop, 0, tstates);
+  z80_run(TRUE);
+  trs_cancel_event(TRS_EV_STOP);
+}
+
+/* Power on with the built-in ROM and the bench disk in drive 0 */
+static void
+power_on()
+{
+  trs_load_compiled_rom(trs_rom1_size, trs_rom1);
+  trs_reset(1);
+}
+
+static void
+load_code(const Uchar *code, int size)
+{
+  int i;
+
+  power_on();
+  for (i = 0; i < size; i++) {
+    mem_write(CODE_START + i, code[i]);
+  }
+  REG_PC = CODE_START;
+}
+
+static int setup_alu() { load_code(alu_code, sizeof(alu_code)); return 1; }
+static int setup_ldir() { load_code(ldir_code, sizeof(ldir_code)); return 1; }
+static int setup_disk() { load_code(disk_code, sizeof(disk_code)); return 1; }
+
+/* Returns 0 if the built-in ROM does not read the keyboard, in which
+   case there is nothing worth timing */
+static int
+setup_rom()
+{
+  const char *p;
+  int keysym, tries;
+
+  power_on();
+  run_for(2000000);  /* let it get to the first prompt */
+  for (p = rom_keys; *p; p++) {
+    keysym = (*p == '\n') ? 0xff0d : *p;  /* XK_Return */
+    trs_xlate_keysym(keysym);
+    trs_xlate_keysym(0x10000 | keysym);
+    for (tries = 0; !trs_kb_idle() && tries < 1000; tries++) {
+      run_for(10000);
+    }
+    if (!trs_kb_idle()) {
+      clear_key_queue();
+      return 0;
+    }
+  }
+  run_for(2000000);  /* let the program start */
+  return 1;
+}
+
+struct workload {
+  const char *name;
+  int (*setup)(void);
+  int tstates;  /* run length, or 0 to run until the program ends */
+  unsigned long checksum;  /* known answer, or 0 if none */
+};
+
+/* The rom workload's answer depends on which ROM is built in */
+static struct workload workloads[] = {
+  { "alu",  setup_alu,  0,           0x335de397 },
+  { "ldir", setup_ldir, 0,           0x00ae3cf1 },
+  { "rom",  setup_rom,  ROM_TSTATES, 0 },
+  { "disk", setup_disk, 0,           0xd9e4f730 },
+  { NULL, NULL, 0, 0 }
+};
+
+static unsigned long
+crc32(unsigned long crc, int byte)
+{
+  int i;
+
+  crc ^= byte;
+  for (i = 0; i < 8; i++) {
+    crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+  }
+  return crc;
+}
+
+/* CRC-32 of AF, BC, DE, HL, IX, IY, SP, and RAM */
+static unsigned long
+checksum()
+{
+  int regs[7];
+  unsigned long crc = 0xffffffff;
+  int i;
+
+  regs[0] = REG_AF;
+  regs[1] = REG_BC;
+  regs[2] = REG_DE;
+  regs[3] = REG_HL;
+  regs[4] = REG_IX;
+  regs[5] = REG_IY;
+  regs[6] = REG_SP;
+  for (i = 0; i < 7; i++) {
+    crc = crc32(crc, regs[i] & 0xff);
+    crc = crc32(crc, (regs[i] >> 8) & 0xff);
+  }
+  for (i = RAM_START; i < Z80_ADDRESS_LIMIT; i++) {
+    crc = crc32(crc, mem_read(i));
+  }
+  return crc ^ 0xffffffff;
+}
+
+
+/* Make a blank single density disk (JV1) for the disk workload */
+static void
+make_disk()
+{
+  static char template[] = "/tmp/xtrs-bench.XXXXXX";
+  char name[64];
+  Uchar sector[256];
+  FILE *f;
+  int i;
+
+  disk_dir = mkdtemp(template);
+  if (disk_dir == NULL) fatal("could not create temporary directory");
+  sprintf(name, "%s/disk1-0", disk_dir);
+  f = fopen(name, "w");
+  if (f == NULL) fatal("could not create %s", name);
+  memset(sector, 0xe5, sizeof(sector));
+  for (i = 0; i < DISK_TRACKS * DISK_SECTORS; i++) {
+    fwrite(sector, sizeof(sector), 1, f);
+  }
+  fclose(f);
+  trs_disk_dir = disk_dir;
+}
+
+static void
+remove_disk()
+{
+  char name[64];
+
+  sprintf(name, "%s/disk1-0", disk_dir);
+  unlink(name);
+  rmdir(disk_dir);
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns 0 if the workload gave the wrong answer */
+static int
+bench(struct workload *w)
+{
+  tstate_t t0, i0;
+  double start, secs;
+  unsigned long long tstates, insns;
+  unsigned long sum;
+
+  if (!w->setup()) {
+    error("skipping workload %s: the built-in ROM does not read the keyboard",
+	  w->name);
+    return 1;
+  }
+  t0 = z80_state.t_count;
+  i0 = z80_state.i_count;
+  start = now();
+  run_for(w->tstates ? w->tstates : MAX_TSTATES);
+  secs = now() - start;
+  tstates = z80_state.t_count - t0;
+  insns = z80_state.i_count - i0;
+  if (w->tstates == 0 && tstates >= MAX_TSTATES) {
+    error("workload %s did not finish", w->name);
+  }
+  sum = checksum();
+  fprintf(results, "%s\t%llu\t%llu\t%.6f\t%.2f\t%.3f\t%.0f\t%08lx\n",
+	  w->name, tstates, insns, secs, tstates / secs / 1e6,
+	  secs * 1e9 / insns, tstates / secs, sum);
+  fflush(results);
+  if (w->checksum && sum != w->checksum) {
+    error("workload %s gave checksum %08lx, not %08lx", w->name,
+	  sum, w->checksum);
+    return 0;
+  }
+  return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct workload *w;
+  int i, r, repeat = 1, any = 0, ok = 1;
+
+  program_name = strrchr(argv[0], '/');
+  program_name = program_name ? program_name + 1 : argv[0];
+  trs_machine_init(&trs_machine0);
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-blockcache") == 0) {
+      z80_block_cache = TRUE;
+    } else if (strcmp(argv[i], "-bulkmove") == 0) {
+      z80_bulk_move = TRUE;
+    } else if (strcmp(argv[i], "-repeat") == 0 && i + 1 < argc) {
+      repeat = atoi(argv[++i]);
+    } else {
+      fatal("usage: %s [-blockcache] [-bulkmove] [-repeat n] [workload ...]",
+	    program_name);
+    }
+  }
+
+  /* Emulated printer output goes to stdout; keep it out of the way */
+  results = fdopen(dup(fileno(stdout)), "w");
+  if (results == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    fatal("could not redirect standard output");
+  }
+
+  trs_model = 1;
+  make_disk();
+  mem_init();
+  trs_disk_init();
+  trs_hard_init();
+  stringy_init();
+
+  fprintf(results, "workload\ttstates\tinstructions\tseconds\t"
+	 "emulated_mhz\tns_per_instruction\ttstates_per_second\tchecksum\n");
+  for (r = 0; r < repeat; r++) {
+    for (w = workloads; w->name; w++) {
+      if (i < argc) {
+	int j;
+	for (j = i; j < argc; j++) {
+	  if (strcmp(argv[j], w->name) == 0) break;
+	}
+	if (j == argc) continue;
+      }
+      if (!bench(w)) ok = 0;
+      any = 1;
+    }
+  }
+  remove_disk();
+  if (!any) fatal("no such workload");
+  return ok ? 0 : 1;
+}
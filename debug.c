@@ -22,8 +22,11 @@
 
 #include "z80.h"
 #include "trs.h"
+#include "trs_profile.h"
 
 #include <stdlib.h>
+#include <stddef.h> /* offsetof() */
+#include <ctype.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
@@ -38,7 +41,7 @@
 
 #define MAXLINE		(256)
 #define ADDRESS_SPACE	(0x10000)
-#define MAX_TRAPS	(100)
+#define MAX_TRAPS	(1000)
 
 #define BREAKPOINT_FLAG		(0x1)
 #define TRACE_FLAG		(0x2)
@@ -46,11 +49,20 @@
 #define DISASSEMBLE_OFF_FLAG	(0x8)
 #define BREAK_ONCE_FLAG		(0x10)
 #define WATCHPOINT_FLAG		(0x20)
+#define READ_WATCHPOINT_FLAG	(0x40)
+#define IN_WATCHPOINT_FLAG	(0x80)
+#define OUT_WATCHPOINT_FLAG	(0x100)
+
+/* Watchpoints are kept in z80_watch, not traps */
+#define ANY_WATCHPOINT_FLAG	(WATCHPOINT_FLAG | READ_WATCHPOINT_FLAG | \
+				 IN_WATCHPOINT_FLAG | OUT_WATCHPOINT_FLAG)
 
 static Uchar *traps;
+static struct z80_watches *watch;
 static int num_traps;
 static int print_instructions;
 static int stop_signaled;
+static int watch_triggered;
 static unsigned int num_watchpoints = 0;
 
 static char help_message[] =
@@ -98,6 +110,25 @@ Printing:\n\
         Disable tracing.\n\
     diskdump\n\
         Print the state of the floppy disk controller emulation.\n\
+Profiling:\n\
+    profile on\n\
+    profile off\n\
+        Start or stop counting the instructions and T-states executed at\n\
+        each address, in each bank of memory, and in each routine.\n\
+    profile reset\n\
+        Set the counts back to zero.\n\
+    profile\n\
+    profile <n>\n\
+        Disassemble the 20 (or n) instructions that took the most T-states.\n\
+    profile routines\n\
+    profile routines <n>\n\
+        Show the 20 (or n) routines that took the most T-states, with and\n\
+        without the routines they called.\n\
+    profile banks\n\
+        Show the counts for each 32K bank of RAM, and the rest of memory.\n\
+    profile fold <file>\n\
+        Write the T-states for each chain of calls to a file, in the\n\
+        folded stack format that flamegraph.pl reads.\n\
 Traps:\n\
     status\n\
         Show all traps (breakpoints, tracepoints, watchpoints).\n\
@@ -108,7 +139,20 @@ Traps:\n\
         Delete trap n, or all traps.\n\
     stop at <address>\n\
     break <address>\n\
-        Set a breakpoint at the specified hex address.\n\
+    break <address> if <condition>\n\
+        Set a breakpoint at the specified hex address.  With a condition,\n\
+        stop there only when the condition is nonzero.  Conditions are C\n\
+        expressions over hex numbers, registers ($a, $hl, $sp, $af', ...),\n\
+        flags ($zf, $cf, $sf, $pf, $vf, $hf, $nf), the T-state counter\n\
+        ($t), memory bytes and words ([addr], w[addr]), and the last values\n\
+        read from and written to I/O ports (in[port], out[port]).\n\
+        Example: break 402d if $hl == 5200 && w[$sp] != 0\n\
+    condition <n> <condition>\n\
+    condition <n>\n\
+        Give breakpoint n a new condition, or remove its condition.\n\
+    ignore <n> <count>\n\
+        Pass breakpoint n (when its condition holds) count more times\n\
+        before stopping there.\n\
     trace <address>\n\
         Set a trap to trace execution at the specified hex address.\n\
     traceon at <address>\n\
@@ -116,7 +160,18 @@ Traps:\n\
     traceoff at <address>\n\
         Set a trap to disable tracing at the specified hex address.\n\
     watch <address>\n\
-        Set a trap to watch specified hex address for changes.\n\
+    watch <start addr> , <end addr>\n\
+        Set a watchpoint that stops after any instruction that writes to\n\
+        the hex address or range of addresses.\n\
+    watch read <address>\n\
+    watch read <start addr> , <end addr>\n\
+        Set a watchpoint that stops after any instruction that reads data\n\
+        from the hex address or range.  Instruction fetches don't count.\n\
+    watch in <port>\n\
+    watch out <port>\n\
+        Set a watchpoint that stops after any instruction that reads from\n\
+        or writes to the hex I/O port.  Watchpoints see only the Z80's own\n\
+        accesses, not those of the emulator traps.\n\
 Miscellaneous:\n\
     assign $<reg> = <value>\n\
     assign I<port> = <value>\n\
@@ -125,6 +180,14 @@ Miscellaneous:\n\
     timeroff\n\
     timeron\n\
         Disable/enable the emulated TRS-80 real time clock interrupt.\n\
+    turbo on\n\
+    turbo off\n\
+    turbo auto\n\
+        Run unthrottled always, never, or only during disk and cassette I/O.\n\
+    snapshot <file>\n\
+        Save the state of the emulated machine to a snapshot file.\n\
+    restore <file>\n\
+        Restore the emulated machine from a snapshot file.\n\
     diskdebug <hexval>\n\
         Set floppy disk controller debug flags to hexval.\n\
         1=FDC register I/O, 2=FDC commands, 4=VTOS 3.0 JV3 kludges, 8=Gaps,\n\
@@ -139,12 +202,353 @@ Miscellaneous:\n\
     quit\n\
         Exit from xtrs.\n";
 
+/*
+ * Breakpoint conditions.  A condition is compiled once, when it is
+ * set, into code for a little stack machine, which is run each time
+ * the breakpoint's address is reached.
+ *
+ * The syntax is C's, without assignment, over hex numbers and these:
+ *   $a $f $b $c ... $af $bc $de $hl $ix $iy $sp $pc $i $r  registers
+ *   $af' $bc' $de' $hl'                                     alternates
+ *   $sf $zf $hf $pf $vf $nf $cf                             flags, 0 or 1
+ *   $t                                                      T-states
+ *   [expr]  w[expr]                    memory byte or word at expr
+ *   in[port]  out[port]                last byte read from or written
+ *                                      to port by the Z80
+ */
+
+#define COND_MAX 64  /* ops in one condition; also bounds its stack */
+
+enum cond_opcode {
+    C_NUM, C_REG8, C_REG16, C_R, C_FLAG, C_T, C_MEM8, C_MEM16, C_IN, C_OUT,
+    C_NEG, C_NOT, C_COM, C_MUL, C_DIV, C_MOD, C_ADD, C_SUB, C_SHL, C_SHR,
+    C_LT, C_LE, C_GT, C_GE, C_EQ, C_NE, C_AND, C_XOR, C_OR,
+    C_ANDAND, C_OROR, C_BOOL
+};
+
+struct cond
+{
+    char *text;
+    int len;
+    struct { int op; long long arg; } code[COND_MAX];
+};
+
+#define COND_REG(field) offsetof(struct z80_state_struct, field)
+
+static const struct
+{
+    const char *name;
+    int op;
+    int arg;  /* where the register is in z80_state, or the flag's mask */
+} cond_names[] = {
+    { "a",   C_REG8,  COND_REG(af.byte.high) },
+    { "f",   C_REG8,  COND_REG(af.byte.low) },
+    { "b",   C_REG8,  COND_REG(bc.byte.high) },
+    { "c",   C_REG8,  COND_REG(bc.byte.low) },
+    { "d",   C_REG8,  COND_REG(de.byte.high) },
+    { "e",   C_REG8,  COND_REG(de.byte.low) },
+    { "h",   C_REG8,  COND_REG(hl.byte.high) },
+    { "l",   C_REG8,  COND_REG(hl.byte.low) },
+    { "i",   C_REG8,  COND_REG(i) },
+    { "r",   C_R,     0 },
+    { "af",  C_REG16, COND_REG(af.word) },
+    { "bc",  C_REG16, COND_REG(bc.word) },
+    { "de",  C_REG16, COND_REG(de.word) },
+    { "hl",  C_REG16, COND_REG(hl.word) },
+    { "ix",  C_REG16, COND_REG(ix.word) },
+    { "iy",  C_REG16, COND_REG(iy.word) },
+    { "sp",  C_REG16, COND_REG(sp.word) },
+    { "pc",  C_REG16, COND_REG(pc.word) },
+    { "af'", C_REG16, COND_REG(af_prime.word) },
+    { "bc'", C_REG16, COND_REG(bc_prime.word) },
+    { "de'", C_REG16, COND_REG(de_prime.word) },
+    { "hl'", C_REG16, COND_REG(hl_prime.word) },
+    { "sf",  C_FLAG,  SIGN_MASK },
+    { "zf",  C_FLAG,  ZERO_MASK },
+    { "hf",  C_FLAG,  HALF_CARRY_MASK },
+    { "pf",  C_FLAG,  PARITY_MASK },
+    { "vf",  C_FLAG,  OVERFLOW_MASK },
+    { "nf",  C_FLAG,  SUBTRACT_MASK },
+    { "cf",  C_FLAG,  CARRY_MASK },
+    { "t",   C_T,     0 },
+};
+
+/* Binary operators, loosest first; each level is one row */
+static const struct
+{
+    const char *name;
+    int op;
+} cond_binary[][5] = {
+    { { "||", C_OROR } },
+    { { "&&", C_ANDAND } },
+    { { "|", C_OR } },
+    { { "^", C_XOR } },
+    { { "&", C_AND } },
+    { { "==", C_EQ }, { "!=", C_NE } },
+    { { "<=", C_LE }, { ">=", C_GE }, { "<", C_LT }, { ">", C_GT } },
+    { { "<<", C_SHL }, { ">>", C_SHR } },
+    { { "+", C_ADD }, { "-", C_SUB } },
+    { { "*", C_MUL }, { "/", C_DIV }, { "%", C_MOD } },
+};
+#define COND_LEVELS (sizeof(cond_binary) / sizeof(cond_binary[0]))
+
+static const char *cond_p;   /* the compiler's place in the text */
+static const char *cond_err; /* the first error, if any */
+
+static void cond_emit(struct cond *c, int op, long long arg)
+{
+    if(c->len == COND_MAX)
+    {
+	if(!cond_err) cond_err = "condition is too long";
+	return;
+    }
+    c->code[c->len].op = op;
+    c->code[c->len].arg = arg;
+    c->len++;
+}
+
+static int cond_match(const char *s)
+{
+    while(isspace((unsigned char) *cond_p)) cond_p++;
+    if(strncmp(cond_p, s, strlen(s))) return 0;
+    cond_p += strlen(s);
+    return 1;
+}
+
+static void cond_binary_level(struct cond *c, int level);
+
+static void cond_unary(struct cond *c)
+{
+    char name[8];
+    int i, n;
+    char *end;
+    long long value;
+
+    if(cond_err) return;
+    if(cond_match("!")) { cond_unary(c); cond_emit(c, C_NOT, 0); return; }
+    if(cond_match("~")) { cond_unary(c); cond_emit(c, C_COM, 0); return; }
+    if(cond_match("-")) { cond_unary(c); cond_emit(c, C_NEG, 0); return; }
+    if(cond_match("("))
+    {
+	cond_binary_level(c, 0);
+	if(!cond_match(")") && !cond_err) cond_err = "missing )";
+	return;
+    }
+    if(cond_match("["))
+    {
+	cond_binary_level(c, 0);
+	if(!cond_match("]") && !cond_err) cond_err = "missing ]";
+	cond_emit(c, C_MEM8, 0);
+	return;
+    }
+    if(cond_match("w[") || cond_match("in[") || cond_match("out["))
+    {
+	int op = cond_p[-2] == 'w' ? C_MEM16 : cond_p[-2] == 'n' ? C_IN : C_OUT;
+	cond_binary_level(c, 0);
+	if(!cond_match("]") && !cond_err) cond_err = "missing ]";
+	cond_emit(c, op, 0);
+	return;
+    }
+    if(cond_match("$"))
+    {
+	for(n = 0; n < sizeof(name) - 1 &&
+		(isalpha((unsigned char) cond_p[n]) || cond_p[n] == '\''); n++)
+	{
+	    name[n] = tolower((unsigned char) cond_p[n]);
+	}
+	name[n] = '\0';
+	for(i = 0; i < sizeof(cond_names) / sizeof(cond_names[0]); i++)
+	{
+	    if(strcmp(name, cond_names[i].name)) continue;
+	    cond_p += n;
+	    cond_emit(c, cond_names[i].op, cond_names[i].arg);
+	    return;
+	}
+	cond_err = "unknown register or flag";
+	return;
+    }
+    value = strtoll(cond_p, &end, 16);
+    if(end == cond_p)
+    {
+	cond_err = "syntax error";
+	return;
+    }
+    cond_p = end;
+    cond_emit(c, C_NUM, value);
+}
+
+static void cond_binary_level(struct cond *c, int level)
+{
+    int i, op, jump;
+
+    if(level == COND_LEVELS)
+    {
+	cond_unary(c);
+	return;
+    }
+    cond_binary_level(c, level + 1);
+    for(;;)
+    {
+	if(cond_err) return;
+	op = 0;
+	for(i = 0; i < 5 && cond_binary[level][i].name; i++)
+	{
+	    if(cond_match(cond_binary[level][i].name))
+	    {
+		op = cond_binary[level][i].op;
+		break;
+	    }
+	}
+	if(op == 0) return;
+	/* "|" and "&" must not take the first half of "||" or "&&" */
+	if((op == C_OR && *cond_p == '|') || (op == C_AND && *cond_p == '&'))
+	{
+	    cond_p--;
+	    return;
+	}
+	if(op == C_ANDAND || op == C_OROR)
+	{
+	    jump = c->len;
+	    cond_emit(c, op, 0);
+	    cond_binary_level(c, level + 1);
+	    cond_emit(c, C_BOOL, 0);
+	    c->code[jump].arg = c->len;
+	}
+	else
+	{
+	    cond_binary_level(c, level + 1);
+	    cond_emit(c, op, 0);
+	}
+    }
+}
+
+/* Returns NULL, after saying why, if text isn't a good condition */
+static struct cond *cond_compile(const char *text)
+{
+    struct cond *c = (struct cond *) calloc(1, sizeof(struct cond));
+
+    if(c == NULL) fatal("out of memory");
+    while(isspace((unsigned char) *text)) text++;
+    cond_p = text;
+    cond_err = NULL;
+    cond_binary_level(c, 0);
+    while(isspace((unsigned char) *cond_p)) cond_p++;
+    if(!cond_err && *cond_p) cond_err = "syntax error";
+    if(cond_err)
+    {
+	if(*cond_p)
+	{
+	    printf("Bad condition: %s at \"%s\"\n", cond_err, cond_p);
+	}
+	else
+	{
+	    printf("Bad condition: %s at end\n", cond_err);
+	}
+	free(c);
+	return NULL;
+    }
+    c->text = (char *) malloc(strlen(text) + 1);
+    if(c->text == NULL) fatal("out of memory");
+    strcpy(c->text, text);
+    while(isspace((unsigned char) c->text[strlen(c->text) - 1]))
+    {
+	c->text[strlen(c->text) - 1] = '\0';
+    }
+    return c;
+}
+
+static void cond_free(struct cond *c)
+{
+    if(c)
+    {
+	free(c->text);
+	free(c);
+    }
+}
+
+static long long cond_eval(struct cond *c)
+{
+    long long stack[COND_MAX];
+    char *regs = (char *) &z80_state;
+    int pc, sp = 0;
+    long long x;
+
+    for(pc = 0; pc < c->len; pc++)
+    {
+	x = c->code[pc].arg;
+	switch(c->code[pc].op)
+	{
+	  case C_NUM:   stack[sp++] = x; continue;
+	  case C_REG8:  stack[sp++] = *(Uchar *) (regs + x); continue;
+	  case C_REG16: stack[sp++] = *(Ushort *) (regs + x); continue;
+	  case C_R:     stack[sp++] = REG_R; continue;
+	  case C_FLAG:  stack[sp++] = (REG_F & x) != 0; continue;
+	  case C_T:     stack[sp++] = z80_state.t_count; continue;
+	  case C_ANDAND:
+	    if(stack[sp - 1] == 0) pc = x - 1;
+	    else sp--;
+	    continue;
+	  case C_OROR:
+	    if(stack[sp - 1] != 0)
+	    {
+		stack[sp - 1] = 1;
+		pc = x - 1;
+	    }
+	    else sp--;
+	    continue;
+	}
+
+	/* Operators on the top one or two values */
+	x = stack[--sp];
+	switch(c->code[pc].op)
+	{
+	  case C_MEM8:  x = mem_read(x & 0xffff); break;
+	  case C_MEM16: x = mem_read_word(x & 0xffff); break;
+	  case C_IN:    x = z80_last_in[x & 0xff]; break;
+	  case C_OUT:   x = z80_last_out[x & 0xff]; break;
+	  case C_NEG:   x = -x; break;
+	  case C_NOT:   x = !x; break;
+	  case C_COM:   x = ~x; break;
+	  case C_BOOL:  x = x != 0; break;
+	  default:
+	    {
+		long long y = x;
+		x = stack[--sp];
+		switch(c->code[pc].op)
+		{
+		  case C_MUL: x *= y; break;
+		  case C_DIV: x = y ? x / y : 0; break;
+		  case C_MOD: x = y ? x % y : 0; break;
+		  case C_ADD: x += y; break;
+		  case C_SUB: x -= y; break;
+		  case C_SHL: x <<= (y & 63); break;
+		  case C_SHR: x >>= (y & 63); break;
+		  case C_LT:  x = x < y; break;
+		  case C_LE:  x = x <= y; break;
+		  case C_GT:  x = x > y; break;
+		  case C_GE:  x = x >= y; break;
+		  case C_EQ:  x = x == y; break;
+		  case C_NE:  x = x != y; break;
+		  case C_AND: x &= y; break;
+		  case C_XOR: x ^= y; break;
+		  case C_OR:  x |= y; break;
+		}
+	    }
+	}
+	stack[sp++] = x;
+    }
+    return stack[0];
+}
+
 static struct
 {
     int   valid;
     int   address;
+    int   end; /* last address of a watchpoint's range */
     int   flag;
-    Uchar byte; /* used only by watchpoints */
+    struct cond *cond; /* breakpoints only; NULL if none */
+    int   ignore;
+    int   hits;
 } trap_table[MAX_TRAPS];
 
 static char *trap_name(int flag)
@@ -163,6 +567,12 @@ static char *trap_name(int flag)
 	return "temporary breakpoint";
       case WATCHPOINT_FLAG:
 	return "watchpoint";
+      case READ_WATCHPOINT_FLAG:
+	return "read watchpoint";
+      case IN_WATCHPOINT_FLAG:
+	return "input watchpoint";
+      case OUT_WATCHPOINT_FLAG:
+	return "output watchpoint";
       default:
 	return "unknown trap";
     }
@@ -183,6 +593,94 @@ static void show_zbxinfo()
 #endif
 }
 
+/*
+ * Rebuild z80_watch from the watchpoints in the trap table.
+ */
+static void update_watches()
+{
+    int i, a;
+
+    if(num_watchpoints == 0)
+    {
+	z80_watch = NULL;
+	mem_watch_pages();
+	return;
+    }
+    if(watch == NULL)
+    {
+	watch = (struct z80_watches *) malloc(sizeof(struct z80_watches));
+	if(watch == NULL) fatal("out of memory");
+    }
+    memset(watch, 0, sizeof(struct z80_watches));
+    for(i = 0; i < MAX_TRAPS; ++i)
+    {
+	if(!trap_table[i].valid) continue;
+	for(a = trap_table[i].address; a <= trap_table[i].end; a++)
+	{
+	    switch(trap_table[i].flag)
+	    {
+	      case WATCHPOINT_FLAG:
+		watch->mem[a] |= WATCH_WRITE;
+		break;
+	      case READ_WATCHPOINT_FLAG:
+		watch->mem[a] |= WATCH_READ;
+		break;
+	      case IN_WATCHPOINT_FLAG:
+		watch->port[a] |= WATCH_IN;
+		break;
+	      case OUT_WATCHPOINT_FLAG:
+		watch->port[a] |= WATCH_OUT;
+		break;
+	    }
+	}
+    }
+    for(a = 0; a < ADDRESS_SPACE; a++)
+    {
+	watch->page[a >> 8] |= watch->mem[a];
+    }
+    z80_watch = watch;
+    mem_watch_pages();
+}
+
+/*
+ * Called by the Z80 for each access to a watched address or port.
+ * Report it, and stop after the instruction that made it.
+ */
+void trs_watch_hit(int address, int value, int kind)
+{
+    int old;
+
+    switch(kind)
+    {
+      case WATCH_READ:
+	printf("Memory location 0x%.4x read, value 0x%.2x.\n",
+	       address, value);
+	break;
+      case WATCH_WRITE:
+	old = mem_read(address);
+	if(old != value)
+	{
+	    printf("Memory location 0x%.4x changed value from "
+		   "0x%.2x to 0x%.2x.\n", address, old, value);
+	}
+	else
+	{
+	    printf("Memory location 0x%.4x written with the same value "
+		   "0x%.2x.\n", address, value);
+	}
+	break;
+      case WATCH_IN:
+	printf("Port 0x%.2x read, value 0x%.2x.\n", address, value);
+	break;
+      case WATCH_OUT:
+	printf("Port 0x%.2x written, value 0x%.2x.\n", address, value);
+	break;
+    }
+    watch_triggered = 1;
+    trs_continuous = -1;  /* not even an interrupt first */
+    z80_wakeup = 1;
+}
+
 static void clear_all_traps()
 {
     int i;
@@ -190,12 +688,33 @@ static void clear_all_traps()
     {
 	if(trap_table[i].valid)
 	{
-	    traps[trap_table[i].address] &= ~(trap_table[i].flag);
+	    if(!(trap_table[i].flag & ANY_WATCHPOINT_FLAG))
+	    {
+		traps[trap_table[i].address] &= ~(trap_table[i].flag);
+	    }
+	    cond_free(trap_table[i].cond);
 	    trap_table[i].valid = 0;
 	}
     }
     num_traps = 0;
     num_watchpoints = 0;
+    update_watches();
+}
+
+static void print_trap_place(int i)
+{
+    if(trap_table[i].flag & (IN_WATCHPOINT_FLAG | OUT_WATCHPOINT_FLAG))
+    {
+	printf("port %.2x", trap_table[i].address);
+    }
+    else if(trap_table[i].end != trap_table[i].address)
+    {
+	printf("%.4x-%.4x", trap_table[i].address, trap_table[i].end);
+    }
+    else
+    {
+	printf("%.4x", trap_table[i].address);
+    }
 }
 
 static void print_traps()
@@ -208,8 +727,23 @@ static void print_traps()
 	{
 	    if(trap_table[i].valid)
 	    {
-		printf("[%d] %.4x (%s)\n", i, trap_table[i].address,
-		       trap_name(trap_table[i].flag));
+		printf("[%d] ", i);
+		print_trap_place(i);
+		printf(" (%s)", trap_name(trap_table[i].flag));
+		if(trap_table[i].cond)
+		{
+		    printf(" if %s", trap_table[i].cond->text);
+		}
+		if(trap_table[i].flag == BREAKPOINT_FLAG)
+		{
+		    printf(", hit %d time%s", trap_table[i].hits,
+			   trap_table[i].hits == 1 ? "" : "s");
+		}
+		if(trap_table[i].ignore)
+		{
+		    printf(", ignoring %d more", trap_table[i].ignore);
+		}
+		printf("\n");
 	    }
 	}
     }
@@ -219,13 +753,15 @@ static void print_traps()
     }
 }
 
-static void set_trap(int address, int flag)
+/* Returns the trap's number, or -1 if there is no room */
+static int set_trap_range(int address, int end, int flag)
 {
     int i;
 
     if(num_traps == MAX_TRAPS)
     {
 	printf("Cannot set more than %d traps.\n", MAX_TRAPS);
+	return -1;
     }
     else
     {
@@ -234,20 +770,31 @@ static void set_trap(int address, int flag)
 	
 	trap_table[i].valid = 1;
 	trap_table[i].address = address;
+	trap_table[i].end = end;
 	trap_table[i].flag = flag;
-	if (trap_table[i].flag == WATCHPOINT_FLAG) {
-	    /* Initialize the byte field to current memory contents. */
-	    trap_table[i].byte = mem_read(address);
-	    /* Increment number of set watchpoints. */
+	trap_table[i].cond = NULL;
+	trap_table[i].ignore = 0;
+	trap_table[i].hits = 0;
+	num_traps++;
+	if (flag & ANY_WATCHPOINT_FLAG) {
 	    num_watchpoints++;
+	    update_watches();
+	} else {
+	    traps[address] |= flag;
 	}
-	traps[address] |= flag;
-	num_traps++;
 
-	printf("Set %s [%d] at %.4x\n", trap_name(flag), i, address);
+	printf("Set %s [%d] at ", trap_name(flag), i);
+	print_trap_place(i);
+	printf("\n");
+	return i;
     }
 }
 
+static int set_trap(int address, int flag)
+{
+    return set_trap_range(address, address, flag);
+}
+
 static void clear_trap(int i)
 {
     if((i < 0) || (i > MAX_TRAPS) || !trap_table[i].valid)
@@ -256,16 +803,44 @@ static void clear_trap(int i)
     }
     else
     {
-	traps[trap_table[i].address] &= ~(trap_table[i].flag);
 	trap_table[i].valid = 0;
-	if (trap_table[i].flag == WATCHPOINT_FLAG) {
-	    /* Decrement number of set watchpoints. */
+	cond_free(trap_table[i].cond);
+	trap_table[i].cond = NULL;
+	num_traps--;
+	if (trap_table[i].flag & ANY_WATCHPOINT_FLAG) {
 	    num_watchpoints--;
+	    update_watches();
+	} else {
+	    traps[trap_table[i].address] &= ~(trap_table[i].flag);
 	}
-	num_traps--;
-	printf("Cleared %s [%d] at %.4x\n",
-	       trap_name(trap_table[i].flag), i, trap_table[i].address);
+	printf("Cleared %s [%d] at ", trap_name(trap_table[i].flag), i);
+	print_trap_place(i);
+	printf("\n");
+    }
+}
+
+/*
+ * The Z80 has reached a breakpoint address.  Returns 1 if one of the
+ * breakpoints there should stop it.
+ */
+static int breakpoint_stops(int address)
+{
+    int i, stop = 0;
+
+    for(i = 0; i < MAX_TRAPS; ++i)
+    {
+	if(!trap_table[i].valid || trap_table[i].address != address ||
+	   trap_table[i].flag != BREAKPOINT_FLAG) continue;
+	if(trap_table[i].cond && cond_eval(trap_table[i].cond) == 0) continue;
+	trap_table[i].hits++;
+	if(trap_table[i].ignore > 0)
+	{
+	    trap_table[i].ignore--;
+	    continue;
+	}
+	stop = 1;
     }
+    return stop;
 }
 
 static void clear_trap_address(int address, int flag)
@@ -303,6 +878,7 @@ void debug_print_registers()
 	   REG_D, REG_E, REG_PC, REG_DE_PRIME);
     printf("H L: %.2x %.2x    SP: %.4x    HL': %.4x\n",
 	   REG_H, REG_L, REG_SP, REG_HL_PRIME);
+    printf("I R: %.2x %.2x\n", REG_I, REG_R);
 
     printf("\nT-state counter: %" TSTATE_T_LEN "    ", z80_state.t_count);
     printf("Delay setting: %d (%s)\n",
@@ -314,6 +890,7 @@ static void signal_handler()
 {
     stop_signaled = 1;
     if (trs_continuous > 0) trs_continuous = 0;
+    z80_wakeup = 1;
     trs_skip_next_kbwait();
 }
 
@@ -321,6 +898,7 @@ void trs_debug()
 {
     stop_signaled = 1;
     if (trs_continuous > 0) trs_continuous = 0;
+    z80_wakeup = 1;
     trs_skip_next_kbwait();
 }
 
@@ -333,6 +911,9 @@ void debug_init()
 
     for(i = 0; i < MAX_TRAPS; ++i) trap_table[i].valid = 0;
 
+    /* z80_run stops by itself before any address with a trap */
+    z80_traps = traps;
+
     printf("Type \"help\" for a list of commands.\n");
 }
 
@@ -378,15 +959,13 @@ static void debug_run()
 {
     void (*old_signal_handler)();
     Uchar t;
-    Uchar byte;
     int continuous;
-    int i;
-    int watch_triggered = 0;
 
     /* catch control-c signal */
     old_signal_handler = signal(SIGINT, signal_handler);
 
     stop_signaled = 0;
+    watch_triggered = 0;
 
     t = traps[REG_PC];
     while(!stop_signaled)
@@ -410,14 +989,16 @@ static void debug_run()
 	
 	if(print_instructions) disassemble(REG_PC);
 	
-	continuous = (!print_instructions && num_traps == 0);
+	/* Breakpoints and tracepoints stop z80_run through z80_traps,
+	   and watchpoints through trs_watch_hit */
+	continuous = !print_instructions;
 	if (z80_run(continuous)) {
 	  printf("emt_debug instruction executed.\n");
 	  stop_signaled = 1;
 	}
 
 	t = traps[REG_PC];
-	if(t & BREAKPOINT_FLAG)
+	if((t & BREAKPOINT_FLAG) && breakpoint_stops(REG_PC))
 	{
 	    stop_signaled = 1;
 	}
@@ -427,41 +1008,11 @@ static void debug_run()
 	    clear_trap_address(REG_PC, BREAK_ONCE_FLAG);
 	}
 
-	/*
-	 * Iterate over the trap list looking for watchpoints only if we
-	 * know there are any to be found.
-	 */
-	if (num_watchpoints)
+	if(watch_triggered)
 	{
-	    for (i = 0; i < MAX_TRAPS; ++i)
-	    {
-		if (trap_table[i].valid &&
-		    trap_table[i].flag == WATCHPOINT_FLAG)
-		{
-		    byte = mem_read(trap_table[i].address);
-		    if (byte != trap_table[i].byte)
-		    {
-			/*
-			 * If a watched memory location has changed, report
-			 * it, update the watch entry in the trap table to
-			 * reflect the new value, and set the
-			 * watch_triggered flag so that we stop after all
-			 * watchpoints have been processed.
-			 */
-			printf("Memory location 0x%.4x changed value from "
-			       "0x%.2x to 0x%.2x.\n", trap_table[i].address,
-			       trap_table[i].byte, byte);
-			trap_table[i].byte = byte;
-			watch_triggered = 1;
-		    }
-		}
-	    }
-	    if (watch_triggered)
-	    {
-		stop_signaled = 1;
-	    }
+	    stop_signaled = 1;
+	    watch_triggered = 0;
 	}
-
     }
     signal(SIGINT, old_signal_handler);
     printf("Stopped at %.4x\n", REG_PC);
@@ -735,6 +1286,8 @@ void debug_shell()
 			REG_IY = value;
 		    } else if(!strcasecmp(regname, "i")) {
 			REG_I = value;
+		    } else if(!strcasecmp(regname, "r")) {
+			z80_state.r = z80_state.r7 = value;
 		    } else {
 			printf("Unrecognized register name %s.\n", regname);
 		    }
@@ -762,7 +1315,9 @@ void debug_shell()
 	    }
 	    else if(!strcmp(command, "stop") || !strcmp(command, "break"))
 	    {
-		int address;
+		int address, i;
+		char *cond = strstr(input, " if ");
+		struct cond *c = NULL;
 
 		if(sscanf(input, "stop at %x", &address) != 1 &&
 		   sscanf(input, "break %x", &address) != 1)
@@ -770,7 +1325,45 @@ void debug_shell()
 		    address = REG_PC;
 		}
 		address %= ADDRESS_SPACE;
-		set_trap(address, BREAKPOINT_FLAG);
+		if(cond == NULL || (c = cond_compile(cond + 4)) != NULL)
+		{
+		    i = set_trap(address, BREAKPOINT_FLAG);
+		    if(i >= 0) trap_table[i].cond = c;
+		    else cond_free(c);
+		}
+	    }
+	    else if(!strcmp(command, "condition") ||
+		    !strcmp(command, "ignore"))
+	    {
+		int i, n, count;
+		struct cond *c = NULL;
+
+		if(sscanf(input, "%*s %d%n", &i, &n) != 1)
+		{
+		    printf("A trap must be specified.\n");
+		}
+		else if(i < 0 || i >= MAX_TRAPS || !trap_table[i].valid ||
+			trap_table[i].flag != BREAKPOINT_FLAG)
+		{
+		    printf("[%d] is not a breakpoint.\n", i);
+		}
+		else if(!strcmp(command, "ignore"))
+		{
+		    if(sscanf(input + n, "%d", &count) != 1 || count < 0)
+		    {
+			printf("Usage: ignore <n> <count>\n");
+		    }
+		    else
+		    {
+			trap_table[i].ignore = count;
+		    }
+		}
+		else if(strspn(input + n, " \t\n") == strlen(input + n) ||
+			(c = cond_compile(input + n)) != NULL)
+		{
+		    cond_free(trap_table[i].cond);
+		    trap_table[i].cond = c;
+		}
 	    }
 	    else if(!strcmp(command, "trace"))
 	    {
@@ -817,12 +1410,57 @@ void debug_shell()
 	    }
 	    else if(!strcmp(command, "watch"))
 	    {
-		int address;
+		char kind[MAXLINE];
+		int address, end, flag = 0;
 
-		if(sscanf(input, "watch %x", &address) == 1)
+		if(sscanf(input, "watch %x , %x", &address, &end) == 2)
+		{
+		    flag = WATCHPOINT_FLAG;
+		}
+		else if(sscanf(input, "watch %x", &address) == 1)
+		{
+		    flag = WATCHPOINT_FLAG;
+		    end = address;
+		}
+		else if(sscanf(input, "watch %s", kind) == 1 &&
+			!strcmp(kind, "read"))
+		{
+		    if(sscanf(input, "watch read %x , %x", &address, &end) == 2)
+		    {
+			flag = READ_WATCHPOINT_FLAG;
+		    }
+		    else if(sscanf(input, "watch read %x", &address) == 1)
+		    {
+			flag = READ_WATCHPOINT_FLAG;
+			end = address;
+		    }
+		}
+		else if(sscanf(input, "watch %s %x", kind, &address) == 2 &&
+			(!strcmp(kind, "in") || !strcmp(kind, "out")))
+		{
+		    flag = !strcmp(kind, "in") ?
+			IN_WATCHPOINT_FLAG : OUT_WATCHPOINT_FLAG;
+		    address %= 0x100;
+		    end = address;
+		}
+
+		if(flag == 0)
+		{
+		    printf("Usage: watch [read] <address> [, <end address>]\n"
+			   "       watch in|out <port>\n");
+		}
+		else
 		{
 		    address %= ADDRESS_SPACE;
-		    set_trap(address, WATCHPOINT_FLAG);
+		    end %= ADDRESS_SPACE;
+		    if(end < address)
+		    {
+			printf("The range ends before it starts.\n");
+		    }
+		    else
+		    {
+			set_trap_range(address, end, flag);
+		    }
 		}
 	    }
 	    else if(!strcmp(command, "timeroff"))
@@ -835,6 +1473,93 @@ void debug_shell()
 	        /* Turn off emulated real time clock interrupt */
 	        trs_timer_on();
             }
+	    else if(!strcmp(command, "turbo"))
+	    {
+		char mode[MAXLINE];
+
+		if(sscanf(input, "turbo %s", mode) != 1)
+		{
+		    printf("Turbo is %s.\n", trs_turbo ? "on" :
+			   trs_autoturbo ? "auto" : "off");
+		}
+		else if(!strcmp(mode, "on"))
+		{
+		    trs_turbo = 1;
+		}
+		else if(!strcmp(mode, "off"))
+		{
+		    trs_turbo = trs_autoturbo = 0;
+		}
+		else if(!strcmp(mode, "auto"))
+		{
+		    trs_turbo = 0;
+		    trs_autoturbo = 1;
+		}
+		else
+		{
+		    printf("Usage: turbo on|off|auto\n");
+		}
+		trs_turbo_check();
+	    }
+	    else if(!strcmp(command, "snapshot") || !strcmp(command, "restore"))
+	    {
+		char file[MAXLINE];
+
+		if(sscanf(input, "%*s %s", file) != 1)
+		{
+		    printf("Usage: %s <file>\n", command);
+		}
+		else if(!strcmp(command, "snapshot"))
+		{
+		    trs_snapshot_save(file);
+		}
+		else
+		{
+		    trs_snapshot_load(file);
+		}
+	    }
+	    else if(!strcmp(command, "profile"))
+	    {
+		char what[MAXLINE], file[MAXLINE];
+		int n = 20;
+
+		if(sscanf(input, "profile %s", what) != 1 ||
+		   sscanf(input, "profile %d", &n) == 1)
+		{
+		    trs_profile_print(n);
+		}
+		else if(!strcmp(what, "on"))
+		{
+		    trs_profile_on();
+		}
+		else if(!strcmp(what, "off"))
+		{
+		    trs_profile_off();
+		}
+		else if(!strcmp(what, "reset"))
+		{
+		    trs_profile_reset();
+		}
+		else if(!strcmp(what, "routines"))
+		{
+		    sscanf(input, "profile routines %d", &n);
+		    trs_profile_routines(n);
+		}
+		else if(!strcmp(what, "banks"))
+		{
+		    trs_profile_banks();
+		}
+		else if(!strcmp(what, "fold") &&
+			sscanf(input, "profile fold %s", file) == 1)
+		{
+		    trs_profile_fold(file);
+		}
+		else
+		{
+		    printf("Usage: profile [on|off|reset|<n>|routines [<n>]|"
+			   "banks|fold <file>]\n");
+		}
+	    }
 	    else if(!strcmp(command, "diskdump"))
 	    {
 		trs_disk_debug();
@@ -25,11 +25,7 @@
 #include "trs.h"
 #include "trs_disk.h"
 #include "trs_hard.h"
-#include "load_cmd.h"
 
-int trs_model = 1;
-int trs_paused = 1;
-int trs_autodelay = 0;
 char *program_name;
 
 static void check_endian()
@@ -43,65 +39,6 @@ static void check_endian()
     }
 }
 
-void trs_load_rom(char *filename)
-{
-    FILE *program;
-    int c;
-
-    if((program = fopen(filename, "r")) == NULL)
-    {
-	char message[100];
-	sprintf(message, "could not read %s", filename);
-	fatal(message);
-    }
-    c = getc(program);
-    if (c == ':') {
-        /* Assume Intel hex format */
-        rewind(program);
-        trs_rom_size = load_hex(program);
-	fclose(program);
-	return;
-    } else if (c == 1 || c == 5) {
-	/* Assume MODELA/III file */
-	int res;
-	extern Uchar *rom; /*!! fixme*/
-	Uchar loadmap[Z80_ADDRESS_LIMIT];
-	rewind(program);
-	res = load_cmd(program, rom, loadmap, 0, NULL, -1, NULL, NULL, 1);
-	if (res == LOAD_CMD_OK) {
-	    trs_rom_size = Z80_ADDRESS_LIMIT;
-	    while (trs_rom_size > 0) {
-		if (loadmap[--trs_rom_size] != 0) {
-		    trs_rom_size++;
-		    break;
-		}
-	    }
-	    fclose(program);
-	    return;
-	} else {
-	    /* Guess it wasn't one */
-	    rewind(program);
-	    c = getc(program);
-	}
-    }
-    trs_rom_size = 0;
-    while (c != EOF) {
-        mem_write_rom(trs_rom_size++, c);
-	c = getc(program);
-    }
-}
-
-void trs_load_compiled_rom(int size, unsigned char rom[])
-{
-    int i;
-    
-    trs_rom_size = size;
-    for(i = 0; i < size; ++i)
-    {
-	mem_write_rom(i, rom[i]);
-    }
-}
-
 int main(int argc, char *argv[])
 {
     int debug = FALSE;
@@ -117,10 +54,12 @@ int main(int argc, char *argv[])
 
     check_endian();
 
+    trs_machine_init(&trs_machine0);
     argc = trs_parse_command_line(argc, argv, &debug);
     if (argc > 1) {
       fatal("erroneous argument %s", argv[1]);
     }
+    trs_journal_open();
     mem_init();
     trs_screen_init();
     trs_timer_init();
@@ -129,6 +68,10 @@ int main(int argc, char *argv[])
     stringy_init();
 
     trs_reset(1);
+    if (trs_snapshot_file && trs_snapshot_load(trs_snapshot_file) < 0) {
+      exit(1);
+    }
+    trs_journal_start();
     if (!debug) {
       /* Run continuously until exit or request to enter debugger */
       z80_run(TRUE);
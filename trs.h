@@ -32,17 +32,28 @@
 #define ALTERNATE 4
 
 extern char *program_name;
-extern int trs_model; /* 1, 3, 4, 5(=4p) */
-extern int trs_paused;
-extern int trs_autodelay;
-void trs_suspend_delay(void);
-void trs_restore_delay(void);
-extern int trs_continuous; /* 1= run continuously,
-			      0= enter debugger after instruction,
-			     -1= suppress interrupt and enter debugger */
 extern int trs_disk_debug_flags;
 extern int trs_io_debug_flags;
-extern int trs_emtsafe;
+
+/* Per-machine settings and state; see trs_machine.h */
+#define trs_model      (trs_cur->model) /* 1, 3, 4, 5(=4p) */
+#define trs_paused     (trs_cur->paused)
+#define trs_autodelay  (trs_cur->autodelay)
+#define trs_pace       (trs_cur->pace)
+#define trs_turbo      (trs_cur->turbo)
+#define trs_autoturbo  (trs_cur->autoturbo)
+#define trs_continuous (trs_cur->continuous) /* 1= run continuously,
+			      0= enter debugger after instruction,
+			     -1= suppress interrupt and enter debugger */
+#define trs_emtsafe    (trs_cur->emtsafe)
+#define trs_tstate_timer (trs_cur->tstate_timer)
+#define trs_exit_stops (trs_cur->exit_stops)
+#define trs_exited     (trs_cur->exited)
+
+void trs_pace_start(void);
+void trs_turbo_check(void);
+void trs_suspend_delay(void);
+void trs_restore_delay(void);
 
 int trs_parse_command_line(int argc, char **argv, int *debug);
 
@@ -67,13 +78,19 @@ void trs_xlate_keysym(int keysym);
 void queue_key(int key);
 int dequeue_key(void);
 void clear_key_queue(void);
+int trs_kb_idle(void);
 void trs_skip_next_kbwait(void);
-extern int stretch_amount;
+#define stretch_amount (trs_cur->key_stretch)
 
 void trs_get_event(int wait);
-extern volatile int x_poll_count;
+/* Null backend only */
+void trs_screen_keys(const char *name);
+void trs_screen_dump_to(FILE *f);
+void trs_screen_dump(void);
+#define x_poll_count (trs_cur->poll_count)
 void trs_x_flush(void);
 
+#define trs_printer_file (trs_cur->printer) /* NULL = stdout */
 void trs_printer_write(int value);
 int trs_printer_read(void);
 
@@ -85,7 +102,7 @@ void trs_sound_out(int value);
 
 int trs_joystick_in(void);
 
-extern int trs_rom_size;
+#define trs_rom_size (trs_cur->rom_size)
 extern int trs_rom1_size;
 extern int trs_rom3_size;
 extern int trs_rom4p_size;
@@ -93,7 +110,7 @@ extern unsigned char trs_rom1[];
 extern unsigned char trs_rom3[];
 extern unsigned char trs_rom4p[];
 
-extern void trs_load_compiled_rom(int size, unsigned char rom[]);
+extern void trs_load_compiled_rom(int size, unsigned char image[]);
 extern void trs_load_rom(char *filename);
 
 unsigned char trs_interrupt_latch_read(void);
@@ -112,32 +129,36 @@ void trs_timer_init(void);
 void trs_timer_off(void);
 void trs_timer_on(void);
 void trs_timer_speed(int flag);
+void trs_timer_restart(void);
 void trs_cassette_rise_interrupt(int dummy);
 void trs_cassette_fall_interrupt(int dummy);
 void trs_cassette_clear_interrupts(void);
 int trs_cassette_interrupts_enabled(void);
 void trs_cassette_update(int dummy);
-extern int cassette_default_sample_rate;
+#define cassette_default_sample_rate (trs_cur->sample_rate)
 void trs_orch90_out(int chan, int value);
 void trs_cassette_reset(void);
+int trs_cassette_busy(void);
 
 const char *trs_disk_get_name(int drive);
 int trs_disk_set_name(int drive, const char *newname);
 int trs_disk_create(const char *newname);
 void trs_disk_change_all(void);
+void trs_disk_unshare(void);
 void trs_disk_debug(void);
 int trs_disk_motoroff(void);
+int trs_disk_busy(void);
 
 void trs_change_all(void);
 
-extern int huffman_ram;
-extern int hypermem;
-extern int supermem;
-extern int selector;
+#define huffman_ram (trs_cur->huffman)
+#define hypermem (trs_cur->hyper)
+#define supermem (trs_cur->super)
+#define selector (trs_cur->selector_on)
 
 extern void selector_out(unsigned char);
 
-extern int lowercase;
+#define lowercase (trs_cur->lower)
 void mem_video_page(int which);
 void mem_bank(int which);
 void mem_bank_base(int bits);
@@ -147,12 +168,76 @@ void mem_romin(int state);
 
 void trs_debug(void);
 
+/* Event sources; each can have one event pending at a time */
+#define TRS_EV_ANY      (-1)
+#define TRS_EV_DISK     0
+#define TRS_EV_UART_RCV 1
+#define TRS_EV_UART_SND 2
+#define TRS_EV_CASSETTE 3
+#define TRS_EV_RESET    4
+#define TRS_EV_PACE     5
+#define TRS_EV_STOP     6  /* end of a timed run (xtrs-bench, xtrs-batch) */
+#define TRS_EV_TIMER    7  /* heartbeat, with trs_tstate_timer */
+#define TRS_EV_JOURNAL  8  /* next input in a -replay journal */
+#define TRS_EV_NSOURCES 9
+
 typedef void (*trs_event_func)(int arg);
-void trs_schedule_event(trs_event_func f, int arg, int tstates);
-void trs_schedule_event_us(trs_event_func f, int arg, int us);
+void trs_schedule_event(int src, trs_event_func f, int arg, int tstates);
 void trs_do_event(void);
-void trs_cancel_event(void);
-trs_event_func trs_event_scheduled(void);
+void trs_wait_event(int src);
+void trs_cancel_event(int src);
+void trs_cancel_all_events(void);
+trs_event_func trs_event_scheduled(int src);
+void trs_event_shift(int src, tstate_t tstates);
+
+/* Snapshots; see trs_snapshot.c */
+extern char *trs_snapshot_file; /* -snapshot */
+int trs_snapshot_save(const char *name);
+int trs_snapshot_load(const char *name);
+void trs_snapshot_put(const char *tag, const void *data, int len);
+const void *trs_snapshot_get(const char *tag, int len);
+void trs_event_snapshot_save(int src, const trs_event_func funcs[]);
+void trs_event_snapshot_load(int src, const trs_event_func funcs[]);
+void trs_io_snapshot_save(void);
+void trs_io_snapshot_load(void);
+void mem_snapshot_save(void);
+void mem_snapshot_load(void);
+void trs_interrupt_snapshot_save(void);
+void trs_interrupt_snapshot_load(void);
+void trs_kb_snapshot_save(void);
+void trs_kb_snapshot_load(void);
+void trs_disk_snapshot_save(void);
+void trs_disk_snapshot_load(void);
+void trs_hard_snapshot_save(void);
+void trs_hard_snapshot_load(void);
+void trs_uart_snapshot_save(void);
+void trs_uart_snapshot_load(void);
+void stringy_snapshot_save(void);
+void stringy_snapshot_load(void);
+void trs_cassette_snapshot_save(void);
+void trs_cassette_snapshot_load(void);
+
+/* Deterministic mode and input journal; see trs_journal.c */
+#define TRS_JOURNAL_KEY    1  /* trs_xlate_keysym; value is the keysym */
+#define TRS_JOURNAL_RESET  2  /* trs_reset; value is poweron */
+#define TRS_JOURNAL_CHANGE 3  /* trs_change_all */
+extern int trs_deterministic;          /* -deterministic */
+extern char *trs_journal_record_file;  /* -record */
+extern char *trs_journal_replay_file;  /* -replay */
+void trs_journal_open(void);
+void trs_journal_start(void);
+int trs_journal_replaying(void);
+int trs_journal_input(int type, int value);
+void trs_journal_poll(void);
+void trs_journal_mouse(int *x, int *y, unsigned int *buttons);
+int trs_journal_uart(Uchar *buf, int len);
+time_t trs_time(void);
+void trs_time_speed(void);
+struct tm *trs_localtime(const time_t *t, struct tm *tm);
+
+/* Fork server; see trs_forkserver.c */
+int trs_fork_server(const char *path, tstate_t budget);
+void trs_fork_unshare(FILE *f, char **name);
 
 void grafyx_write_x(int value);
 void grafyx_write_y(int value);
@@ -173,7 +258,7 @@ void hrg_onoff(int enable);
 void hrg_write_addr(int addr, int mask);
 void hrg_write_data(int data);
 int hrg_read_data(void);
-int lowe_le18;
+#define lowe_le18 (trs_cur->le18)
 void lowe_le18_reset(void);
 void lowe_le18_write_x(int);
 void lowe_le18_write_y(int);
@@ -195,6 +280,7 @@ int stringy_in(int unit);
 void stringy_out(int unit, int value);
 void stringy_reset(void);
 void stringy_change_all(void);
+void stringy_unshare(void);
 
 int put_twobyte(Ushort n, FILE* f);
 int put_fourbyte(Uint n, FILE* f);
@@ -95,40 +95,105 @@ static char *format_name[] = {
 
 #define FLUSH -500  /* special fake signal value used when turning off motor */
 
-static char cassette_filename[256];
-static int cassette_position;
-static int cassette_format;
-static int cassette_state = CLOSE;
-static int cassette_motor = 0;
-static FILE *cassette_file;
-static float cassette_avg;
-static float cassette_env;
-static int cassette_noisefloor;
-static int cassette_sample_rate;
-int cassette_default_sample_rate = DEFAULT_SAMPLE_RATE;
-static int cassette_stereo = 0;
-#if HAVE_OSS
-static int cassette_afmt = AFMT_U8;
-#endif
-
-/* For bit-level emulation */
-static tstate_t cassette_transition;
-static tstate_t last_sound;
-static tstate_t cassette_firstoutread;
-static int cassette_value, cassette_next, cassette_flipflop;
-static int cassette_lastnonzero;
-static int cassette_transitionsout;
-static unsigned long cassette_delta;
-static float cassette_roundoff_error;
-
-/* For bit/byte conversion (.cas file i/o) */
-static int cassette_byte;
-static int cassette_bitnumber;
-static int cassette_pulsestate;
 #define SPEED_500     0
 #define SPEED_1500    1
 #define SPEED_250     2
-int cassette_speed = SPEED_500;
+
+#define WAVE_RIFFSIZE_OFFSET 0x04
+#define WAVE_RIFF_OFFSET 0x08
+#define WAVE_DATAID_OFFSET 0x24
+#define WAVE_DATASIZE_OFFSET 0x28
+#define WAVE_DATA_OFFSET 0x2c
+
+/* Per-machine state; -samplerate is in struct trs_machine */
+struct trs_cassette_machine {
+  char filename[256];
+  int position;
+  int format;
+  int state;
+  int motor;
+  FILE *file;
+  float avg;
+  float env;
+  int noisefloor;
+  int sample_rate;
+  int stereo;
+  int afmt;
+
+  /* For bit-level emulation */
+  tstate_t transition;
+  tstate_t last_sound;
+  tstate_t firstoutread;
+  int value, next, flipflop;
+  int lastnonzero;
+  int transitionsout;
+  unsigned long delta;
+  float roundoff_error;
+
+  /* For bit/byte conversion (.cas file i/o) */
+  int byte;
+  int bitnumber;
+  int pulsestate;
+  int speed;
+
+  /* Wave file layout */
+  long wave_dataid_offset;
+  long wave_datasize_offset;
+  long wave_data_offset;
+
+  /* Orchestra 80/85/90 stuff */
+  int orch90_left, orch90_right;
+};
+
+#define cassette_filename       (trs_cur->cassette->filename)
+#define cassette_position       (trs_cur->cassette->position)
+#define cassette_format         (trs_cur->cassette->format)
+#define cassette_state          (trs_cur->cassette->state)
+#define cassette_motor          (trs_cur->cassette->motor)
+#define cassette_file           (trs_cur->cassette->file)
+#define cassette_avg            (trs_cur->cassette->avg)
+#define cassette_env            (trs_cur->cassette->env)
+#define cassette_noisefloor     (trs_cur->cassette->noisefloor)
+#define cassette_sample_rate    (trs_cur->cassette->sample_rate)
+#define cassette_stereo         (trs_cur->cassette->stereo)
+#define cassette_afmt           (trs_cur->cassette->afmt)
+#define cassette_transition     (trs_cur->cassette->transition)
+#define last_sound              (trs_cur->cassette->last_sound)
+#define cassette_firstoutread   (trs_cur->cassette->firstoutread)
+#define cassette_value          (trs_cur->cassette->value)
+#define cassette_next           (trs_cur->cassette->next)
+#define cassette_flipflop       (trs_cur->cassette->flipflop)
+#define cassette_lastnonzero    (trs_cur->cassette->lastnonzero)
+#define cassette_transitionsout (trs_cur->cassette->transitionsout)
+#define cassette_delta          (trs_cur->cassette->delta)
+#define cassette_roundoff_error (trs_cur->cassette->roundoff_error)
+#define cassette_byte           (trs_cur->cassette->byte)
+#define cassette_bitnumber      (trs_cur->cassette->bitnumber)
+#define cassette_pulsestate     (trs_cur->cassette->pulsestate)
+#define cassette_speed          (trs_cur->cassette->speed)
+#define wave_dataid_offset      (trs_cur->cassette->wave_dataid_offset)
+#define wave_datasize_offset    (trs_cur->cassette->wave_datasize_offset)
+#define wave_data_offset        (trs_cur->cassette->wave_data_offset)
+#define orch90_left             (trs_cur->cassette->orch90_left)
+#define orch90_right            (trs_cur->cassette->orch90_right)
+
+void
+trs_cassette_machine_init(struct trs_machine *m)
+{
+  m->cassette = (struct trs_cassette_machine *)
+    calloc(1, sizeof(struct trs_cassette_machine));
+  if (m->cassette == NULL) fatal("out of memory");
+  cassette_default_sample_rate = DEFAULT_SAMPLE_RATE;
+  cassette_state = CLOSE;
+#if HAVE_OSS
+  cassette_afmt = AFMT_U8;
+#endif
+  cassette_speed = SPEED_500;
+  wave_dataid_offset = WAVE_DATAID_OFFSET;
+  wave_datasize_offset = WAVE_DATASIZE_OFFSET;
+  wave_data_offset = WAVE_DATA_OFFSET;
+  orch90_left = orch90_right = 128;
+}
 
 /* Pulse shapes for conversion from .cas on input */
 #define CAS_MAXSTATES 8
@@ -217,19 +282,6 @@ Uchar value_to_sample[] = { 127, /* 0.46 V */
 #define WAVE_FORMAT_STEREO 2
 #define WAVE_FORMAT_8BIT 8
 #define WAVE_FORMAT_16BIT 16
-#define WAVE_RIFFSIZE_OFFSET 0x04
-#define WAVE_RIFF_OFFSET 0x08
-#define WAVE_DATAID_OFFSET 0x24
-#define WAVE_DATASIZE_OFFSET 0x28
-#define WAVE_DATA_OFFSET 0x2c
-static long wave_dataid_offset = WAVE_DATAID_OFFSET;
-static long wave_datasize_offset = WAVE_DATASIZE_OFFSET;
-static long wave_data_offset = WAVE_DATA_OFFSET;
-
-#if HAVE_OSS
-/* Orchestra 80/85/90 stuff */
-static int orch90_left = 128, orch90_right = 128;
-#endif
 
 #if !HAVE_OSS
 static void
@@ -758,14 +810,15 @@ transition_out(int value)
 	ddelta_us = 20000.0;
 	cassette_roundoff_error = 0.0;
       }
-      if (trs_event_scheduled() == transition_out ||
-	  trs_event_scheduled() == (trs_event_func) assert_state) {
-	trs_cancel_event();
+      if (trs_event_scheduled(TRS_EV_CASSETTE) == transition_out ||
+	  trs_event_scheduled(TRS_EV_CASSETTE) == (trs_event_func) assert_state) {
+	trs_cancel_event(TRS_EV_CASSETTE);
       }
       if (value == FLUSH) {
-	trs_schedule_event((trs_event_func)assert_state, CLOSE, 5000000);
+	trs_schedule_event(TRS_EV_CASSETTE, (trs_event_func)assert_state,
+			   CLOSE, 5000000);
       } else {
-	trs_schedule_event(transition_out, FLUSH,
+	trs_schedule_event(TRS_EV_CASSETTE, transition_out, FLUSH,
 			   (int)(25000 * z80_state.clockMHz));
       }
     }
@@ -1088,6 +1141,13 @@ trs_cassette_kickoff(int dummy)
   }
 }
 
+/* True if the motor is on and the cassette is a file, so that the
+   emulation need not run in real time */
+int trs_cassette_busy()
+{
+  return cassette_motor && cassette_format != DIRECT_FORMAT;
+}
+
 /* Z80 program is turning motor on or off */
 void trs_cassette_motor(int value)
 {
@@ -1115,7 +1175,7 @@ void trs_cassette_motor(int value)
       cassette_transitionsout = 0;
       if (trs_model > 1) {
 	/* Get 1500bps reading started after 1 second */
-	trs_schedule_event(trs_cassette_kickoff, 0,
+	trs_schedule_event(TRS_EV_CASSETTE, trs_cassette_kickoff, 0,
 			   (tstate_t) (1000000 * z80_state.clockMHz));
       }
     }
@@ -1246,14 +1306,15 @@ trs_orch90_out(int channels, int value)
     put_sample(orch90_right, TRUE, cassette_file);
   }
 
-  if (trs_event_scheduled() == orch90_flush ||
-      trs_event_scheduled() == (trs_event_func) assert_state) {
-    trs_cancel_event();
+  if (trs_event_scheduled(TRS_EV_CASSETTE) == orch90_flush ||
+      trs_event_scheduled(TRS_EV_CASSETTE) == (trs_event_func) assert_state) {
+    trs_cancel_event(TRS_EV_CASSETTE);
   }
   if (value == FLUSH) {
-    trs_schedule_event((trs_event_func)assert_state, CLOSE, 5000000);
+    trs_schedule_event(TRS_EV_CASSETTE, (trs_event_func)assert_state,
+		       CLOSE, 5000000);
   } else {
-    trs_schedule_event(orch90_flush, FLUSH,
+    trs_schedule_event(TRS_EV_CASSETTE, orch90_flush, FLUSH,
 		       (int)(250000 * z80_state.clockMHz));
   }
 
@@ -1297,15 +1358,15 @@ trs_cassette_update(int dummy)
     /* Schedule an interrupt on the 1500-bps cassette input if needed */
     if (newtrans && cassette_speed == SPEED_1500) {
       if (cassette_next == 2 && cassette_lastnonzero != 2) {
-	trs_schedule_event(trs_cassette_fall_interrupt, 1,
+	trs_schedule_event(TRS_EV_CASSETTE, trs_cassette_fall_interrupt, 1,
 			   cassette_delta -
 			   (z80_state.t_count - cassette_transition));
       } else if (cassette_next == 1 && cassette_lastnonzero != 1) {
-	trs_schedule_event(trs_cassette_rise_interrupt, 1,
+	trs_schedule_event(TRS_EV_CASSETTE, trs_cassette_rise_interrupt, 1,
 			   cassette_delta -
 			   (z80_state.t_count - cassette_transition));
       } else {
-	trs_schedule_event(trs_cassette_update, 0,
+	trs_schedule_event(TRS_EV_CASSETTE, trs_cassette_update, 0,
 			   cassette_delta -
 			   (z80_state.t_count - cassette_transition));
       }
@@ -1354,3 +1415,41 @@ trs_cassette_reset()
 {
   assert_state(CLOSE);
 }
+
+/* A snapshot holds the cassette port and bit-level state, but not the
+   tape: restoring closes any cassette file, and the next read or
+   write opens it at the position in the control file, as usual */
+static const trs_event_func cassette_event_funcs[] = {
+  trs_cassette_kickoff, trs_cassette_fall_interrupt,
+  trs_cassette_rise_interrupt, trs_cassette_update,
+#if HAVE_OSS
+  (trs_event_func) assert_state, transition_out, orch90_flush,
+#endif
+  NULL
+};
+
+void
+trs_cassette_snapshot_save()
+{
+  trs_snapshot_put("CASS", trs_cur->cassette,
+		   sizeof(struct trs_cassette_machine));
+  trs_event_snapshot_save(TRS_EV_CASSETTE, cassette_event_funcs);
+}
+
+void
+trs_cassette_snapshot_load()
+{
+  struct trs_cassette_machine *c = trs_cur->cassette;
+  struct trs_cassette_machine saved;
+
+  trs_cassette_reset();
+  saved = *(const struct trs_cassette_machine *)
+    trs_snapshot_get("CASS", sizeof(struct trs_cassette_machine));
+  memcpy(saved.filename, c->filename, sizeof(saved.filename));
+  saved.position = c->position;
+  saved.format = c->format;
+  saved.state = c->state;
+  saved.file = c->file;
+  *c = saved;
+  trs_event_snapshot_load(TRS_EV_CASSETTE, cassette_event_funcs);
+}
@@ -54,12 +54,8 @@
 
 #define NDRIVES 8
 
-int trs_disk_nocontroller = 0;
-int trs_disk_doubler = TRSDISK_BOTH;
-char *trs_disk_dir = DISKDIR;
 static int trs_disk_needchange = 0;
 float trs_disk_holewidth = 0.01;
-int trs_disk_truedam = 0;
 int trs_disk_debug_flags = 0;
 char *trs_disk_name[NDRIVES];
 
@@ -89,8 +85,6 @@ typedef struct {
   tstate_t motor_timeout;       /* 0 if stopped, else time when it stops */
 } FDCState;
 
-FDCState state, other_state;
-
 /* Format states - what is expected next? */
 #define FMT_GAP0    0
 #define FMT_IAM     1
@@ -293,7 +287,28 @@ typedef struct {
   } u;
 } DiskState;
 
-DiskState disk[NDRIVES];
+/* Per-machine state; the -doubler, -diskdir, and -truedam options are
+   in struct trs_machine */
+struct trs_disk_machine {
+  FDCState state, other_state;
+  DiskState disk[NDRIVES];
+  int nocontroller;
+};
+
+#define state                 (trs_cur->fdc->state)
+#define other_state           (trs_cur->fdc->other_state)
+#define disk                  (trs_cur->fdc->disk)
+#define trs_disk_nocontroller (trs_cur->fdc->nocontroller)
+
+void
+trs_disk_machine_init(struct trs_machine *m)
+{
+  m->fdc = (struct trs_disk_machine *)
+    calloc(1, sizeof(struct trs_disk_machine));
+  if (m->fdc == NULL) fatal("out of memory");
+  trs_disk_doubler = TRSDISK_BOTH;
+  trs_disk_dir = DISKDIR;
+}
 
 /* Emulate interleave in JV1 mode */
 unsigned char jv1_interleave[10] = {0, 5, 1, 6, 2, 7, 3, 8, 4, 9};
@@ -449,7 +464,7 @@ trs_disk_reset(void)
   state.controller = (trs_model == 1) ? TRSDISK_P1771 : TRSDISK_P1791;
   state.last_readadr = -1;
   state.motor_timeout = 0;
-  trs_cancel_event();
+  trs_cancel_event(TRS_EV_DISK);
 
   /*
    * Emulate no controller if there is no disk in drive 0 at reset time,
@@ -492,7 +507,7 @@ trs_disk_firstdrq(int bits)
 {
   state.status |= TRSDISK_DRQ | bits;
   trs_disk_drq_interrupt(1);
-  trs_schedule_event(trs_disk_lostdata, state.currcommand,
+  trs_schedule_event(TRS_EV_DISK, trs_disk_lostdata, state.currcommand,
 		     500000 * z80_state.clockMHz);
 }
 
@@ -503,7 +518,7 @@ trs_disk_unimpl(unsigned char cmd, char* more)
   state.bytecount = state.format_bytecount = 0;
   state.format = FMT_DONE;
   trs_disk_drq_interrupt(0);
-  trs_schedule_event(trs_disk_done, 0, 0);
+  trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 0);
   error("trs_disk_command(0x%02x) not implemented - %s", cmd, more);
 }
 
@@ -881,6 +896,80 @@ trs_disk_change_all(void)
   }
 }
 
+/* In a job forked by trs_fork_server, stop sharing the images */
+void
+trs_disk_unshare(void)
+{
+  int i;
+  for (i=0; i<NDRIVES; i++) {
+    trs_fork_unshare(disk[i].file, &disk[i].name);
+  }
+}
+
+/* What a snapshot holds of the floppy controller: the FDC itself, the
+   head position of each drive, and the track buffer of the selected
+   drive if it is DMK, since a read or write track may be partway
+   through it.  Everything else comes from the disk images. */
+struct trs_disk_snapshot {
+  FDCState fdc, other_fdc;
+  int nocontroller;
+  int phytrack[NDRIVES];
+  DMKState dmk;
+};
+
+static const trs_event_func disk_event_funcs[] = {
+  trs_disk_done, trs_disk_lostdata, trs_disk_firstdrq, NULL
+};
+
+void
+trs_disk_snapshot_save(void)
+{
+  struct trs_disk_snapshot s;
+  DiskState *d = &disk[state.curdrive];
+  int i;
+
+  memset(&s, 0, sizeof(s));
+  s.fdc = state;
+  s.other_fdc = other_state;
+  s.nocontroller = trs_disk_nocontroller;
+  for (i=0; i<NDRIVES; i++) {
+    s.phytrack[i] = disk[i].phytrack;
+  }
+  if (d->emutype == DMK) {
+    s.dmk = d->u.dmk;
+  } else {
+    s.dmk.curtrack = s.dmk.curside = -1;
+  }
+  trs_snapshot_put("FDC ", &s, sizeof(s));
+  trs_event_snapshot_save(TRS_EV_DISK, disk_event_funcs);
+}
+
+void
+trs_disk_snapshot_load(void)
+{
+  const struct trs_disk_snapshot *s =
+    (const struct trs_disk_snapshot *) trs_snapshot_get("FDC ", sizeof(*s));
+  DiskState *d;
+  int i;
+
+  trs_disk_change_all();
+  state = s->fdc;
+  other_state = s->other_fdc;
+  trs_disk_nocontroller = s->nocontroller;
+  for (i=0; i<NDRIVES; i++) {
+    disk[i].phytrack = s->phytrack[i];
+  }
+  d = &disk[state.curdrive];
+  if (d->emutype == DMK && s->dmk.curtrack >= 0) {
+    d->u.dmk.curtrack = s->dmk.curtrack;
+    d->u.dmk.curside = s->dmk.curside;
+    d->u.dmk.curbyte = s->dmk.curbyte;
+    d->u.dmk.nextidam = s->dmk.nextidam;
+    memcpy(d->u.dmk.buf, s->dmk.buf, sizeof(d->u.dmk.buf));
+  }
+  trs_event_snapshot_load(TRS_EV_DISK, disk_event_funcs);
+}
+
 const char *
 trs_disk_get_name(int drive)
 {
@@ -957,6 +1046,15 @@ trs_disk_motoroff()
   return stopped;
 }
 
+/* True if a command is in progress or the drive motor is running.
+   Unlike trs_disk_motoroff, has no side effects on the FDC state. */
+int
+trs_disk_busy()
+{
+  return (state.status & TRSDISK_BUSY) ||
+    !(state.motor_timeout - z80_state.t_count > TSTATE_T_MID);
+}
+
 /* Get the on-disk track data from the current track/side into the buffer */
 void
 dmk_get_track(DiskState* d)
@@ -1256,10 +1354,9 @@ trs_disk_select_write(unsigned char data)
     if (data & TRSDISK3_WAIT) {
       /* If there was an event pending, simulate waiting until
 	 it was due. */
-      if (trs_event_scheduled() != NULL &&
-	  trs_event_scheduled() != trs_disk_lostdata) {
-	z80_state.t_count = z80_state.sched;
-	trs_do_event();
+      if (trs_event_scheduled(TRS_EV_DISK) != NULL &&
+	  trs_event_scheduled(TRS_EV_DISK) != trs_disk_lostdata) {
+	trs_wait_event(TRS_EV_DISK);
       }
     }
   }
@@ -1445,10 +1542,10 @@ trs_disk_data_read(void)
 	state.bytecount = 0;
 	state.status &= ~TRSDISK_DRQ;
         trs_disk_drq_interrupt(0);
-	if (trs_event_scheduled() == trs_disk_lostdata) {
-	  trs_cancel_event();
+	if (trs_event_scheduled(TRS_EV_DISK) == trs_disk_lostdata) {
+	  trs_cancel_event(TRS_EV_DISK);
 	}
-	trs_schedule_event(trs_disk_done, 0, 64);
+	trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 64);
       }
     } 
     break;
@@ -1540,10 +1637,10 @@ trs_disk_data_read(void)
       state.bytecount = 0;
       state.status &= ~TRSDISK_DRQ;
       trs_disk_drq_interrupt(0);
-      if (trs_event_scheduled() == trs_disk_lostdata) {
-	trs_cancel_event();
+      if (trs_event_scheduled(TRS_EV_DISK) == trs_disk_lostdata) {
+	trs_cancel_event(TRS_EV_DISK);
       }
-      trs_schedule_event(trs_disk_done, 0, 64);
+      trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 64);
     }
     break;
 
@@ -1559,10 +1656,10 @@ trs_disk_data_read(void)
       state.bytecount = 0;
       state.status &= ~TRSDISK_DRQ;
       trs_disk_drq_interrupt(0);
-      if (trs_event_scheduled() == trs_disk_lostdata) {
-	trs_cancel_event();
+      if (trs_event_scheduled(TRS_EV_DISK) == trs_disk_lostdata) {
+	trs_cancel_event(TRS_EV_DISK);
       }
-      trs_schedule_event(trs_disk_done, 0, 64);
+      trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 64);
     }
     break;
 
@@ -1664,10 +1761,10 @@ trs_disk_data_write(unsigned char data)
 	state.bytecount = 0;
 	state.status &= ~TRSDISK_DRQ;
         trs_disk_drq_interrupt(0);
-	if (trs_event_scheduled() == trs_disk_lostdata) {
-	  trs_cancel_event();
+	if (trs_event_scheduled(TRS_EV_DISK) == trs_disk_lostdata) {
+	  trs_cancel_event(TRS_EV_DISK);
 	}
-	trs_schedule_event(trs_disk_done, 0, 64);
+	trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 64);
 	c = fflush(d->file);
 	if (c == EOF) state.status |= TRSDISK_WRITEFLT;
       }
@@ -1698,10 +1795,10 @@ trs_disk_data_write(unsigned char data)
 	  c = fflush(d->file);
 	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	  trs_disk_drq_interrupt(0);
-	  if (trs_event_scheduled() == trs_disk_lostdata) {
-	    trs_cancel_event();
+	  if (trs_event_scheduled(TRS_EV_DISK) == trs_disk_lostdata) {
+	    trs_cancel_event(TRS_EV_DISK);
 	  }
-	  trs_schedule_event(trs_disk_done, 0, 64);
+	  trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 64);
 	}
       } else {
 	switch (data) {
@@ -1839,10 +1936,10 @@ trs_disk_data_write(unsigned char data)
 	if (c == EOF) state.status |= TRSDISK_WRITEFLT;
       }
       trs_disk_drq_interrupt(0);
-      if (trs_event_scheduled() == trs_disk_lostdata) {
-	trs_cancel_event();
+      if (trs_event_scheduled(TRS_EV_DISK) == trs_disk_lostdata) {
+	trs_cancel_event(TRS_EV_DISK);
       }
-      trs_schedule_event(trs_disk_done, 0, 64);
+      trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 64);
       break;
     }
     switch (state.format) {
@@ -2272,9 +2369,9 @@ trs_disk_command_write(unsigned char cmd)
   }
 
   /* Cancel any ongoing command */
-  event = trs_event_scheduled();
+  event = trs_event_scheduled(TRS_EV_DISK);
   if (event == trs_disk_lostdata || event == trs_disk_intrq_interrupt) {
-    trs_cancel_event();
+    trs_cancel_event(TRS_EV_DISK);
   }
   trs_disk_intrq_interrupt(0);
   state.bytecount = 0;
@@ -2292,7 +2389,7 @@ trs_disk_command_write(unsigned char cmd)
     if (d->emutype == REAL) real_restore(state.curdrive);
     /* Should this set lastdirection? */
     if (cmd & TRSDISK_VBIT) verify();
-    trs_schedule_event(trs_disk_done, 0, 2000);
+    trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 2000);
     break;
 
   case TRSDISK_SEEK:
@@ -2312,7 +2409,7 @@ trs_disk_command_write(unsigned char cmd)
     if (d->emutype == REAL) real_seek();
     /* Should this set lastdirection? */
     if (cmd & TRSDISK_VBIT) verify();
-    trs_schedule_event(trs_disk_done, 0, 2000);
+    trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 2000);
     break;
 
   case TRSDISK_STEP:
@@ -2337,7 +2434,7 @@ trs_disk_command_write(unsigned char cmd)
     }
     if (d->emutype == REAL) real_seek();
     if (cmd & TRSDISK_VBIT) verify();
-    trs_schedule_event(trs_disk_done, 0, 2000);
+    trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 2000);
     break;
 
   case TRSDISK_STEPIN:
@@ -2391,7 +2488,7 @@ trs_disk_command_write(unsigned char cmd)
     id_index = search(state.sector, goal_side);
     if (id_index == -1) {
       state.status |= TRSDISK_BUSY;
-      trs_schedule_event(trs_disk_done, 0, 512);
+      trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 512);
     } else {
       if (d->emutype == JV1) {
 
@@ -2490,7 +2587,7 @@ trs_disk_command_write(unsigned char cmd)
 	if (damlimit < 0) {
 	  /* found ID with good CRC but no following DAM; fail */
 	  state.status |= TRSDISK_BUSY;
-	  trs_schedule_event(trs_disk_done, TRSDISK_NOTFOUND, 512);
+	  trs_schedule_event(TRS_EV_DISK, trs_disk_done, TRSDISK_NOTFOUND, 512);
 	  break;
 	}
 
@@ -2544,7 +2641,7 @@ trs_disk_command_write(unsigned char cmd)
       } /* end if (d->emutype == ...) */
 
       state.status |= TRSDISK_BUSY;
-      trs_schedule_event(trs_disk_firstdrq, new_status, 64);
+      trs_schedule_event(TRS_EV_DISK, trs_disk_firstdrq, new_status, 64);
     }
     break;
 
@@ -2589,7 +2686,7 @@ trs_disk_command_write(unsigned char cmd)
     if (d->emutype == REAL) {
       state.status = TRSDISK_BUSY|TRSDISK_DRQ;
       trs_disk_drq_interrupt(1);
-      trs_schedule_event(trs_disk_lostdata, state.currcommand,
+      trs_schedule_event(TRS_EV_DISK, trs_disk_lostdata, state.currcommand,
 			 500000 * z80_state.clockMHz);
       state.bytecount = size_code_to_size(d->u.real.size_code);
       break;
@@ -2601,7 +2698,7 @@ trs_disk_command_write(unsigned char cmd)
     id_index = search(state.sector, goal_side);
     if (id_index == -1) {
       state.status |= TRSDISK_BUSY;
-      trs_schedule_event(trs_disk_done, 0, 512);
+      trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 512);
     } else {
       int jv3dam = 0, dam = 0;
       if (state.controller == TRSDISK_P1771) {
@@ -2766,7 +2863,7 @@ trs_disk_command_write(unsigned char cmd)
 
       state.status |= TRSDISK_BUSY|TRSDISK_DRQ;
       trs_disk_drq_interrupt(1);
-      trs_schedule_event(trs_disk_lostdata, state.currcommand,
+      trs_schedule_event(TRS_EV_DISK, trs_disk_lostdata, state.currcommand,
 			 500000 * z80_state.clockMHz);
     }
     break;
@@ -2802,7 +2899,7 @@ trs_disk_command_write(unsigned char cmd)
       if (id_index == -1) {
 	state.status = TRSDISK_BUSY;
 	state.bytecount = 0;
-	trs_schedule_event(trs_disk_done, TRSDISK_NOTFOUND,
+	trs_schedule_event(TRS_EV_DISK, trs_disk_done, TRSDISK_NOTFOUND,
 			   1000000*z80_state.clockMHz);
 	break;
       }
@@ -2851,7 +2948,7 @@ trs_disk_command_write(unsigned char cmd)
 	  /* No sectors of the correct density */
 	  state.status = TRSDISK_BUSY;
 	  state.bytecount = 0;
-	  trs_schedule_event(trs_disk_done, TRSDISK_NOTFOUND,
+	  trs_schedule_event(TRS_EV_DISK, trs_disk_done, TRSDISK_NOTFOUND,
 			     1000000*z80_state.clockMHz);
 	  break;
 	}
@@ -2887,7 +2984,7 @@ trs_disk_command_write(unsigned char cmd)
       state.status = TRSDISK_BUSY;
       state.last_readadr = i;
       state.bytecount = 6;
-      trs_schedule_event(trs_disk_firstdrq, 0, ts);
+      trs_schedule_event(TRS_EV_DISK, trs_disk_firstdrq, 0, ts);
       if (trs_disk_debug_flags & DISKDEBUG_READADR) {
 	debug("readadr phytrack %d angle %f i %d ts %d\n",
 	      d->phytrack, a, i, ts);
@@ -2925,7 +3022,7 @@ trs_disk_command_write(unsigned char cmd)
       /* no suitable ID found */
       state.status = TRSDISK_BUSY;
       state.bytecount = 0;
-      trs_schedule_event(trs_disk_done, TRSDISK_NOTFOUND,
+      trs_schedule_event(TRS_EV_DISK, trs_disk_done, TRSDISK_NOTFOUND,
 			 1000000*z80_state.clockMHz);
       break;
     found:
@@ -2941,7 +3038,7 @@ trs_disk_command_write(unsigned char cmd)
 			     : 0xffff),
 			    d->u.dmk.buf[idamp]);
       d->u.dmk.curbyte = idamp + dmk_incr(d);
-      trs_schedule_event(trs_disk_firstdrq, 0, ts);
+      trs_schedule_event(TRS_EV_DISK, trs_disk_firstdrq, 0, ts);
       if (trs_disk_debug_flags & DISKDEBUG_READADR) {
 	debug("readadr phytrack %d angle %f i %d ts %d\n",
 	      d->phytrack, a, i, ts);
@@ -2979,7 +3076,7 @@ trs_disk_command_write(unsigned char cmd)
     }
     state.status = TRSDISK_BUSY|TRSDISK_DRQ;
     trs_disk_drq_interrupt(1);
-    trs_schedule_event(trs_disk_lostdata, state.currcommand,
+    trs_schedule_event(TRS_EV_DISK, trs_disk_lostdata, state.currcommand,
 		       500000 * z80_state.clockMHz);
     break;
 
@@ -3041,7 +3138,7 @@ trs_disk_command_write(unsigned char cmd)
       }
       state.status |= TRSDISK_BUSY|TRSDISK_DRQ;
       trs_disk_drq_interrupt(1);
-      trs_schedule_event(trs_disk_lostdata, state.currcommand,
+      trs_schedule_event(TRS_EV_DISK, trs_disk_lostdata, state.currcommand,
 			 500000 * z80_state.clockMHz);
       state.format = FMT_GAP0;
       state.format_gapcnt = 0;
@@ -3058,7 +3155,7 @@ trs_disk_command_write(unsigned char cmd)
       debug("forceint 0x%02x\n", cmd);
     }
     /* Stop whatever is going on and forget it */
-    trs_cancel_event();
+    trs_cancel_event(TRS_EV_DISK);
     state.status = 0;
     type1_status();
     if ((cmd & 0x07) != 0) {
@@ -3314,7 +3411,7 @@ real_read()
       if ((new_status & TRSDISK_NOTFOUND) == 0) {
 	/* Start read */
 	state.status = TRSDISK_BUSY;
-	trs_schedule_event(trs_disk_firstdrq, new_status, 64);
+	trs_schedule_event(TRS_EV_DISK, trs_disk_firstdrq, new_status, 64);
 	state.bytecount = size_code_to_size(d->u.real.size_code);
 	return;
       }
@@ -3323,7 +3420,7 @@ real_read()
   }
   /* Sector not found; fail */
   state.status = TRSDISK_BUSY;
-  trs_schedule_event(trs_disk_done, new_status, 512);
+  trs_schedule_event(TRS_EV_DISK, trs_disk_done, new_status, 512);
 #else
   trs_disk_unimpl(state.currcommand, "read real floppy");
 #endif
@@ -3413,10 +3510,10 @@ real_write()
   state.bytecount = 0;
   trs_disk_drq_interrupt(0);
   state.status |= TRSDISK_BUSY;
-  if (trs_event_scheduled() == trs_disk_lostdata) {
-    trs_cancel_event();
+  if (trs_event_scheduled(TRS_EV_DISK) == trs_disk_lostdata) {
+    trs_cancel_event(TRS_EV_DISK);
   }
-  trs_schedule_event(trs_disk_done, 0, 512);
+  trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 512);
 #else
   trs_disk_unimpl(state.currcommand, "write real floppy");
 #endif
@@ -3468,7 +3565,7 @@ real_readadr()
     if (raw_cmd.reply[2] & 0x13) new_status |= TRSDISK_NOTFOUND;
     if ((new_status & TRSDISK_NOTFOUND) == 0) {
       state.status = TRSDISK_BUSY;
-      trs_schedule_event(trs_disk_firstdrq, new_status, 64);
+      trs_schedule_event(TRS_EV_DISK, trs_disk_firstdrq, new_status, 64);
       memcpy(d->u.real.buf, &raw_cmd.reply[3], 4);
       d->u.real.buf[4] = d->u.real.buf[5] = 0; /* CRC not emulated */
       state.bytecount = 6;
@@ -3479,7 +3576,8 @@ real_readadr()
   state.last_readadr = -1;
   /* Sector not found; fail */
   state.status = TRSDISK_BUSY;
-  trs_schedule_event(trs_disk_done, new_status, 200000*z80_state.clockMHz);
+  trs_schedule_event(TRS_EV_DISK, trs_disk_done, new_status,
+		     200000*z80_state.clockMHz);
 #else
   trs_disk_unimpl(state.currcommand, "read address on real floppy");
 #endif
@@ -3588,10 +3686,10 @@ real_writetrk()
   state.bytecount = 0;
   trs_disk_drq_interrupt(0);
   state.status |= TRSDISK_BUSY;
-  if (trs_event_scheduled() == trs_disk_lostdata) {
-    trs_cancel_event();
+  if (trs_event_scheduled(TRS_EV_DISK) == trs_disk_lostdata) {
+    trs_cancel_event(TRS_EV_DISK);
   }
-  trs_schedule_event(trs_disk_done, 0, 512);
+  trs_schedule_event(TRS_EV_DISK, trs_disk_done, 0, 512);
 #else
   trs_disk_unimpl(state.currcommand, "write track on real floppy");
 #endif
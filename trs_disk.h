@@ -29,10 +29,10 @@ int trs_disk_getstep(int unit);
 void trs_disk_setsize(int unit, int value);
 int trs_disk_getsize(int unit);
 
-extern int trs_disk_doubler;
-extern char* trs_disk_dir;
-extern unsigned short trs_changecount;
-extern int trs_disk_truedam;
+#define trs_disk_doubler (trs_cur->disk_doubler)
+#define trs_disk_dir (trs_cur->disk_dir)
+#define trs_changecount (trs_cur->changecount)
+#define trs_disk_truedam (trs_cur->disk_truedam)
 
 /* Values for trs_disk_doubler flag word */
 #define TRSDISK_NODOUBLER 0
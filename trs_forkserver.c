@@ -0,0 +1,241 @@
+/* $Id$ */
+
+/* This software may be copied, modified, and used for any purpose
+ * without fee, provided that (1) the above copyright notice is
+ * retained, and (2) modified versions are clearly marked as having
+ * been modified, with the modifier's name and the date included.  */
+
+/*
+ * trs_forkserver.c -- run jobs on copies of one booted machine
+ *
+ * trs_fork_server makes the process a "zygote": it stops emulating,
+ * listens on a UNIX-domain socket, and forks a child for each
+ * connection.  The child carries on from exactly where the zygote
+ * stopped, sharing all of its memory copy-on-write, so a job starts in
+ * the time it takes to fork instead of the time it takes to boot.  Only
+ * the children return from trs_fork_server; the zygote accepts
+ * connections until SIGTERM or SIGHUP.
+ *
+ * Forked processes share open file offsets, and writes to a disk
+ * image would be seen by every later job, so each child first gives
+ * itself private copies of the floppy, hard disk, and wafer images that
+ * are open for writing, and its own file offsets on those open only
+ * for reading.  The copies are unlinked temporary files that vanish
+ * when the child exits; the drives' names are changed to /dev/fd/N so
+ * that reopening a drive finds the copy again.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "z80.h"
+#include "trs.h"
+#include "trs_hard.h"
+
+/* Longest wait for one TRS_EV_STOP event; longer budgets are made of
+   several */
+#define STOP_CHUNK 1000000000
+
+static volatile sig_atomic_t zygote_quit = 0;
+static tstate_t stop_tcount;
+
+static void
+zygote_signal(int signo)
+{
+  zygote_quit = 1;
+}
+
+/* End the job when its T-state budget is used up */
+static void
+fork_stop(int arg)
+{
+  tstate_t left = stop_tcount - z80_state.t_count;
+
+  if (left > 0 && left < TSTATE_T_MID) {
+    trs_schedule_event(TRS_EV_STOP, fork_stop, 0,
+		       left > STOP_CHUNK ? STOP_CHUNK : (int) left);
+    return;
+  }
+  trs_exit();
+}
+
+/* Returns 0 if OK, errno value otherwise */
+static int
+unshare_file(FILE *f, char **name)
+{
+  struct stat st;
+  char buf[65536], newname[32];
+  long pos;
+  off_t off;
+  ssize_t n;
+  int fd, keep;
+  FILE *copy;
+
+  if (f == NULL || fstat(fileno(f), &st) < 0 || !S_ISREG(st.st_mode)) {
+    return 0;
+  }
+  pos = ftell(f);
+
+  if ((fcntl(fileno(f), F_GETFL) & O_ACCMODE) == O_RDONLY) {
+    fd = open(*name, O_RDONLY);
+    if (fd < 0) return errno;
+    keep = -1;
+  } else {
+    copy = tmpfile();
+    if (copy == NULL) return errno;
+    fd = fileno(copy);
+    for (off = 0; (n = pread(fileno(f), buf, sizeof(buf), off)) > 0;
+	 off += n) {
+      if (write(fd, buf, n) != n) {
+	n = -1;
+	break;
+      }
+    }
+    keep = n < 0 ? -1 : dup(fd);
+    if (keep < 0) {
+      int err = errno;
+      fclose(copy);
+      return err;
+    }
+    fclose(copy);
+    fd = keep;
+  }
+
+  /* Swap the new file in underneath the stdio stream, so the
+     emulation can carry on with it unchanged */
+  fflush(f);
+  dup2(fd, fileno(f));
+  if (keep < 0) close(fd);
+  fseek(f, pos, SEEK_SET);
+
+  if (keep >= 0) {
+    sprintf(newname, "/dev/fd/%d", keep);
+    free(*name);
+    *name = strdup(newname);
+  }
+  return 0;
+}
+
+/*
+ * Give this process its own copy of the image open as f, if f is
+ * open for writing, or its own file offset on it if not.  *name is
+ * the drive's file name (malloc'd), which is replaced by a name for
+ * the copy.  Devices and such are left alone.
+ */
+void
+trs_fork_unshare(FILE *f, char **name)
+{
+  int err = unshare_file(f, name);
+
+  if (err) {
+    error("could not make a private copy of %s: %s", *name, strerror(err));
+  }
+}
+
+/*
+ * Become a fork server on the socket path.  Returns only in a child,
+ * with the connection to its client.  budget is the child's T-state
+ * budget, or 0 for none; when it runs out, the child calls trs_exit.
+ */
+int
+trs_fork_server(const char *path, tstate_t budget)
+{
+  struct sockaddr_un addr;
+  struct sigaction sa, old_term, old_hup, old_chld;
+  struct itimerval off;
+  struct stat st;
+  sigset_t quit_sigs, old_mask;
+  fd_set fds;
+  int s, n, conn;
+  pid_t pid;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fatal("fork server socket name %s is too long", path);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);  /* left over from an earlier server */
+  }
+  s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0 || bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(s, SOMAXCONN) < 0 ||
+      fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK) < 0) {
+    fatal("could not listen on %s: %s", path, strerror(errno));
+  }
+
+  /* The zygote does no emulation, so it needs no heartbeat.  SIGTERM
+     and SIGHUP are blocked except inside pselect, so one that comes
+     just before we wait is not lost; children reap themselves. */
+  memset(&off, 0, sizeof(off));
+  setitimer(ITIMER_REAL, &off, NULL);
+  sigemptyset(&quit_sigs);
+  sigaddset(&quit_sigs, SIGTERM);
+  sigaddset(&quit_sigs, SIGHUP);
+  sigprocmask(SIG_BLOCK, &quit_sigs, &old_mask);
+  sa.sa_handler = zygote_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGTERM, &sa, &old_term);
+  sigaction(SIGHUP, &sa, &old_hup);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGCHLD, &sa, &old_chld);
+  fflush(NULL);
+
+  for (;;) {
+    FD_ZERO(&fds);
+    FD_SET(s, &fds);
+    n = pselect(s + 1, &fds, NULL, NULL, NULL, &old_mask);
+    if (n < 0 && errno != EINTR) {
+      fatal("select failed on %s: %s", path, strerror(errno));
+    }
+    if (zygote_quit) {
+      unlink(path);
+      exit(0);
+    }
+    /* After EINTR, fds is left as it was, not cleared */
+    if (n <= 0 || !FD_ISSET(s, &fds)) continue;
+    /* The socket is nonblocking, in case the client went away */
+    conn = accept(s, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ||
+	  errno == ECONNABORTED) continue;
+      fatal("accept failed on %s: %s", path, strerror(errno));
+    }
+    pid = fork();
+    if (pid == 0) break;
+    if (pid < 0) error("fork failed: %s", strerror(errno));
+    close(conn);
+  }
+
+  /* In the child */
+  close(s);
+  sigaction(SIGTERM, &old_term, NULL);
+  sigaction(SIGHUP, &old_hup, NULL);
+  sigaction(SIGCHLD, &old_chld, NULL);
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  trs_disk_unshare();
+  trs_hard_unshare();
+  stringy_unshare();
+  trs_timer_restart();
+  if (budget) {
+    stop_tcount = z80_state.t_count + budget;
+    trs_cancel_event(TRS_EV_STOP);
+    fork_stop(0);
+  }
+  return conn;
+}
@@ -73,6 +73,12 @@ static int trs_charset;
 static int scale_x = 1;
 static int scale_y = 0;
 
+/* There is only one screen, so its state is not per machine; see
+   trs_machine.h */
+void trs_screen_machine_init(struct trs_machine *m)
+{
+}
+
 GtkWidget *main_window;
 GtkWidget *about_dialog;
 GtkWidget *quit_dialog;
@@ -296,53 +302,68 @@ char *opt_sizemap = NULL;
 
 struct option options[] = {
   /* Name, takes argument?, store int value at, value to store */
-  {"iconic",         FALSE, &opt_iconic,       TRUE  },
-  {"noiconic",       FALSE, &opt_iconic,       FALSE },
-  {"background",     TRUE,  NULL,              0     },
-  {"bg",	     TRUE,  NULL,              0     },
-  {"foreground",     TRUE,  NULL,              0     },
-  {"fg",             TRUE,  NULL,              0     },
-  {"title",          TRUE,  NULL,              0     },
-  {"borderwidth",    TRUE,  NULL,              0     },
-  {"scale",          TRUE,  NULL,              0     },
-  {"scale1",         FALSE, &scale_x,          1     },
-  {"scale2",         FALSE, &scale_x,          2     },
-  {"scale3",         FALSE, &scale_x,          3     },
-  {"scale4",         FALSE, &scale_x,          4     },
-  {"resize",	     FALSE, &resize,           TRUE  },
-  {"noresize",	     FALSE, &resize,           FALSE },
-  {"charset",        TRUE,  NULL,              0     },
-  {"microlabs",      FALSE, &grafyx_microlabs, TRUE  },
-  {"nomicrolabs",    FALSE, &grafyx_microlabs, FALSE },
-  {"debug",	     FALSE, &opt_debug,        TRUE  },
-  {"nodebug",        FALSE, &opt_debug,        FALSE },
-  {"romfile",	     TRUE,  NULL,              0     },
-  {"romfile3",	     TRUE,  NULL,              0     },
-  {"romfile4p",      TRUE,  NULL,              0     },
-  {"model",          TRUE,  NULL,              0     },
-  {"model1",         FALSE, &trs_model,        1     },
-  {"model3",         FALSE, &trs_model,        3     },
-  {"model4",         FALSE, &trs_model,        4     },
-  {"model4p",        FALSE, &trs_model,        5     },
-  {"delay",          TRUE,  NULL,              0     },
-  {"autodelay",      FALSE, &trs_autodelay,    TRUE  },
-  {"noautodelay",    FALSE, &trs_autodelay,    FALSE },
-  {"keystretch",     TRUE,  NULL,              0     },
-  {"shiftbracket",   FALSE, &opt_shiftbracket, TRUE  },
-  {"noshiftbracket", FALSE, &opt_shiftbracket, FALSE },
-  {"diskdir",        TRUE,  NULL,              0     },
-  {"doubler",        TRUE,  NULL,              0     },
-  {"doublestep",     FALSE, &opt_stepdefault,  2     },
-  {"nodoublestep",   FALSE, &opt_stepdefault,  1     },
-  {"stepmap",        TRUE,  NULL,              0     },
-  {"sizemap",        TRUE,  NULL,              0     },
-  {"truedam",        FALSE, &trs_disk_truedam, TRUE  },
-  {"notruedam",      FALSE, &trs_disk_truedam, FALSE },
-  {"samplerate",     TRUE,  NULL,              0     },
-  {"serial",         TRUE,  NULL,              0     },
-  {"switches",       TRUE,  NULL,              0     },
-  {"emtsafe",        FALSE, &trs_emtsafe,      TRUE  },
-  {"noemtsafe",      FALSE, &trs_emtsafe,      FALSE },
+  {"iconic",         FALSE, &opt_iconic,                TRUE  },
+  {"noiconic",       FALSE, &opt_iconic,                FALSE },
+  {"background",     TRUE,  NULL,                       0     },
+  {"bg",	     TRUE,  NULL,                       0     },
+  {"foreground",     TRUE,  NULL,                       0     },
+  {"fg",             TRUE,  NULL,                       0     },
+  {"title",          TRUE,  NULL,                       0     },
+  {"borderwidth",    TRUE,  NULL,                       0     },
+  {"scale",          TRUE,  NULL,                       0     },
+  {"scale1",         FALSE, &scale_x,                   1     },
+  {"scale2",         FALSE, &scale_x,                   2     },
+  {"scale3",         FALSE, &scale_x,                   3     },
+  {"scale4",         FALSE, &scale_x,                   4     },
+  {"resize",	     FALSE, &resize,                    TRUE  },
+  {"noresize",	     FALSE, &resize,                    FALSE },
+  {"charset",        TRUE,  NULL,                       0     },
+  {"microlabs",      FALSE, &grafyx_microlabs,          TRUE  },
+  {"nomicrolabs",    FALSE, &grafyx_microlabs,          FALSE },
+  {"debug",	     FALSE, &opt_debug,                 TRUE  },
+  {"nodebug",        FALSE, &opt_debug,                 FALSE },
+  {"romfile",	     TRUE,  NULL,                       0     },
+  {"romfile3",	     TRUE,  NULL,                       0     },
+  {"romfile4p",      TRUE,  NULL,                       0     },
+  {"model",          TRUE,  NULL,                       0     },
+  {"model1",         FALSE, &trs_machine0.model,        1     },
+  {"model3",         FALSE, &trs_machine0.model,        3     },
+  {"model4",         FALSE, &trs_machine0.model,        4     },
+  {"model4p",        FALSE, &trs_machine0.model,        5     },
+  {"delay",          TRUE,  NULL,                       0     },
+  {"autodelay",      FALSE, &trs_machine0.autodelay,    TRUE  },
+  {"noautodelay",    FALSE, &trs_machine0.autodelay,    FALSE },
+  {"pace",           FALSE, &trs_machine0.pace,         TRUE  },
+  {"nopace",         FALSE, &trs_machine0.pace,         FALSE },
+  {"turbo",          FALSE, &trs_machine0.turbo,        TRUE  },
+  {"noturbo",        FALSE, &trs_machine0.turbo,        FALSE },
+  {"autoturbo",      FALSE, &trs_machine0.autoturbo,    TRUE  },
+  {"noautoturbo",    FALSE, &trs_machine0.autoturbo,    FALSE },
+  {"keystretch",     TRUE,  NULL,                       0     },
+  {"shiftbracket",   FALSE, &opt_shiftbracket,          TRUE  },
+  {"noshiftbracket", FALSE, &opt_shiftbracket,          FALSE },
+  {"diskdir",        TRUE,  NULL,                       0     },
+  {"doubler",        TRUE,  NULL,                       0     },
+  {"doublestep",     FALSE, &opt_stepdefault,           2     },
+  {"nodoublestep",   FALSE, &opt_stepdefault,           1     },
+  {"stepmap",        TRUE,  NULL,                       0     },
+  {"sizemap",        TRUE,  NULL,                       0     },
+  {"truedam",        FALSE, &trs_machine0.disk_truedam, TRUE  },
+  {"notruedam",      FALSE, &trs_machine0.disk_truedam, FALSE },
+  {"samplerate",     TRUE,  NULL,                       0     },
+  {"snapshot",       TRUE,  NULL,                       0     },
+  {"deterministic",  FALSE, &trs_deterministic,         TRUE  },
+  {"nodeterministic",FALSE, &trs_deterministic,         FALSE },
+  {"record",         TRUE,  NULL,                       0     },
+  {"replay",         TRUE,  NULL,                       0     },
+  {"serial",         TRUE,  NULL,                       0     },
+  {"switches",       TRUE,  NULL,                       0     },
+  {"emtsafe",        FALSE, &trs_machine0.emtsafe,      TRUE  },
+  {"noemtsafe",      FALSE, &trs_machine0.emtsafe,      FALSE },
+  {"blockcache",     FALSE, &z80_block_cache,           TRUE  },
+  {"noblockcache",   FALSE, &z80_block_cache,           FALSE },
+  {"bulkmove",       FALSE, &z80_bulk_move,             TRUE  },
+  {"nobulkmove",     FALSE, &z80_bulk_move,             FALSE },
   {NULL, 0, 0, 0}
 };
 
@@ -447,6 +468,12 @@ trs_parse_command_line(int argc, char **argv, int *debug)
       opt_sizemap = optarg;
     } else if (strcmp(name, "samplerate") == 0) {
       cassette_default_sample_rate = strtol(optarg, NULL, 0);
+    } else if (strcmp(name, "snapshot") == 0) {
+      trs_snapshot_file = optarg;
+    } else if (strcmp(name, "record") == 0) {
+      trs_journal_record_file = optarg;
+    } else if (strcmp(name, "replay") == 0) {
+      trs_journal_replay_file = optarg;
     } else if (strcmp(name, "serial") == 0) {
       trs_uart_name = strdup(optarg);
     } else if (strcmp(name, "switches") == 0) {
@@ -1039,14 +1066,14 @@ void
 on_reset_menu_item_activate(GtkMenuItem *menuitem,
 			    gpointer user_data)
 {
-  trs_reset(0);
+  if (trs_journal_input(TRS_JOURNAL_RESET, 0)) trs_reset(0);
 }
 
 void
 on_hard_reset_menu_item_activate(GtkMenuItem *menuitem,
 				 gpointer user_data)
 {
-  trs_reset(1);
+  if (trs_journal_input(TRS_JOURNAL_RESET, 1)) trs_reset(1);
 }
 
 //XXX not used
@@ -1054,7 +1081,7 @@ void
 on_disk_change_menu_item_activate(GtkMenuItem *menuitem,
 				  gpointer user_data)
 {
-  trs_change_all();
+  if (trs_journal_input(TRS_JOURNAL_CHANGE, 0)) trs_change_all();
 }
 
 
@@ -1281,7 +1308,7 @@ on_drawing_area_key_press_event(GtkWidget *widget,
     /* Trap some function keys here */
   case GDK_F10: //XXX something eats this key and opens the file menu
   case GDK_F12:
-    trs_reset(0);
+    if (trs_journal_input(TRS_JOURNAL_RESET, 0)) trs_reset(0);
     keysym = 0;
     break;
   case GDK_F9:
@@ -1295,7 +1322,7 @@ on_drawing_area_key_press_event(GtkWidget *widget,
     keysym = 0;
     break;
   case GDK_F7:
-    trs_change_all();
+    if (trs_journal_input(TRS_JOURNAL_CHANGE, 0)) trs_change_all();
     keysym = 0;
     break;
   default:
@@ -17,7 +17,9 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include "trs.h"
+#include "trs_disk.h"
 #include "trs_hard.h"
 #include "reed.h"
 
@@ -25,6 +27,9 @@
 /*#define HARDDEBUG2 1*/  /* show all commands */
 /*#define HARDDEBUG3 1*/  /* show failure to open a drive */
 
+/* How long the drive counts as busy after a command, for -autoturbo */
+#define HARD_BUSY_USEC 500000
+
 /* Private types and data */
 
 /* Structure describing one drive */
@@ -58,11 +63,27 @@ typedef struct {
   /* Number of bytes already done in current read/write */
   int bytesdone;
 
+  /* Time when the most recent command is considered finished */
+  tstate_t busy_timeout;
+
   /* Drive geometries and files */
   Drive d[TRS_HARD_MAXDRIVES];
 } State;
 
-static State state;
+/* Per-machine state */
+struct trs_hard_machine {
+  State state;
+};
+
+#define state (trs_cur->hard->state)
+
+void
+trs_hard_machine_init(struct trs_machine *m)
+{
+  m->hard = (struct trs_hard_machine *)
+    calloc(1, sizeof(struct trs_hard_machine));
+  if (m->hard == NULL) fatal("out of memory");
+}
 
 /* Forward */
 static int hard_data_in();
@@ -75,6 +96,7 @@ static void hard_format(int cmd);
 static void hard_init(int cmd);
 static void hard_seek(int cmd);
 static int open_drive(int drive);
+static long sector_offset(Drive *d);
 static int find_sector(int newstatus);
 static void set_dir_cyl(int cyl);
 
@@ -148,6 +170,45 @@ void trs_hard_change_all(void)
   }
 }
 
+/* In a job forked by trs_fork_server, stop sharing the images */
+void trs_hard_unshare(void)
+{
+  int i;
+  for (i=0; i<TRS_HARD_MAXDRIVES; i++) {
+    trs_fork_unshare(state.d[i].file, &state.d[i].name);
+  }
+}
+
+/* A snapshot holds the controller registers, which are the fields of
+   State before the drives */
+#define HARD_SNAPSHOT_LEN offsetof(State, d)
+
+void trs_hard_snapshot_save(void)
+{
+  trs_snapshot_put("HARD", &state, HARD_SNAPSHOT_LEN);
+}
+
+void trs_hard_snapshot_load(void)
+{
+  Drive *d;
+  int present;
+
+  trs_hard_change_all();
+  present = state.present;
+  memcpy(&state, trs_snapshot_get("HARD", HARD_SNAPSHOT_LEN),
+	 HARD_SNAPSHOT_LEN);
+  state.present = present;
+
+  /* A sector read or write may be partway done */
+  d = &state.d[state.drive];
+  if (((state.command & TRS_HARD_CMDMASK) == TRS_HARD_READ ||
+       (state.command & TRS_HARD_CMDMASK) == TRS_HARD_WRITE) &&
+      (state.status & TRS_HARD_ERR) == 0 &&
+      state.bytesdone < TRS_HARD_SECSIZE && d->file != NULL) {
+    fseek(d->file, sector_offset(d) + state.bytesdone, 0);
+  }
+}
+
 /* Read from an I/O port mapped to the controller */
 int trs_hard_in(int port)
 {
@@ -204,6 +265,14 @@ int trs_hard_in(int port)
   return v;
 }
 
+/* True if a command was issued recently.  Commands complete
+   instantly in the emulation, so treat the drive as busy for a while
+   afterward, the way the floppy motor stays on after a command. */
+int trs_hard_busy(void)
+{
+  return !(state.busy_timeout - z80_state.t_count > TSTATE_T_MID);
+}
+
 /* Write to an I/O port mapped to the controller */
 void trs_hard_out(int port, int value)
 {
@@ -259,6 +328,8 @@ void trs_hard_out(int port, int value)
 
   case TRS_HARD_COMMAND:
     state.bytesdone = 0;
+    state.busy_timeout = z80_state.t_count +
+      HARD_BUSY_USEC * z80_state.clockMHz;
     state.command = value;
     switch (value & TRS_HARD_CMDMASK) {
     default:
@@ -460,6 +531,15 @@ static int open_drive(int drive)
   return err;
 }    
 
+/* Where the current sector starts in the drive's image */
+static long sector_offset(Drive *d)
+{
+  return sizeof(ReedHardHeader) +
+    TRS_HARD_SECSIZE * (state.cyl * d->heads * d->secs +
+			state.head * d->secs +
+			(state.secnum % d->secs));
+}
+
 /*
  * Check whether the current position is in bounds for the geometry.
  * If not, return 0 and set the controller error status.  If so, fseek
@@ -479,12 +559,7 @@ static int find_sector(int newstatus)
     state.error = TRS_HARD_NFERR;
     return 0;
   }
-  fseek(d->file,
-	sizeof(ReedHardHeader) +
-	TRS_HARD_SECSIZE * (state.cyl * d->heads * d->secs +
-			    state.head * d->secs +
-			    (state.secnum % d->secs)),
-	0);
+  fseek(d->file, sector_offset(d), 0);
   state.status = newstatus;
   return 1;
 }
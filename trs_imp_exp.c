@@ -30,24 +30,38 @@
 #include "trs_disk.h"
 #include "trs_hard.h"
 
-/*
-   If the following option is set, potentially dangerous emulator traps
-   will be blocked, including file writes to the host filesystem and shell
-   command execution.
- */
-int trs_emtsafe = TRUE;
-
 /* New emulator traps */
 
 #define MAX_OPENDIR 32
-DIR *dir[MAX_OPENDIR] = { NULL, };
 
 typedef struct {
   int fd;
   int inuse;
 } OpenDisk;
 #define MAX_OPENDISK 32
-OpenDisk od[MAX_OPENDISK];
+
+/* Per-machine state */
+struct trs_imp_exp_machine {
+  DIR *dir[MAX_OPENDIR];
+  OpenDisk od[MAX_OPENDISK];
+};
+
+#define dir (trs_cur->imp_exp->dir)
+#define od  (trs_cur->imp_exp->od)
+
+void trs_imp_exp_machine_init(struct trs_machine *m)
+{
+  m->imp_exp = (struct trs_imp_exp_machine *)
+    calloc(1, sizeof(struct trs_imp_exp_machine));
+  if (m->imp_exp == NULL) fatal("out of memory");
+
+  /*
+     If the following option is set, potentially dangerous emulator traps
+     will be blocked, including file writes to the host filesystem and shell
+     command execution.
+   */
+  trs_emtsafe = TRUE;
+}
 
 void do_emt_system()
 {
@@ -76,6 +90,7 @@ void do_emt_mouse()
   switch (REG_B) {
   case 1:
     trs_get_mouse_pos(&x, &y, &buttons);
+    trs_journal_mouse(&x, &y, &buttons);
     REG_HL = x;
     REG_DE = y;
     REG_A = buttons;
@@ -313,15 +328,17 @@ void do_emt_strerror()
 
 void do_emt_time()
 {
-  time_t now = time(0);
+  time_t now = trs_time();
   if (REG_A == 1) {
 #if __alpha
-    struct tm *loctm = localtime(&now);
-    now += loctm->tm_gmtoff;
+    struct tm loctm;
+    now += trs_localtime(&now, &loctm)->tm_gmtoff;
 #else
-    struct tm loctm = *(localtime(&now));
-    struct tm gmtm = *(gmtime(&now));
-    int daydiff = loctm.tm_mday - gmtm.tm_mday;
+    struct tm loctm, gmtm;
+    int daydiff;
+    trs_localtime(&now, &loctm);
+    gmtm = *(gmtime(&now));
+    daydiff = loctm.tm_mday - gmtm.tm_mday;
     now += (loctm.tm_sec - gmtm.tm_sec)
       + (loctm.tm_min - gmtm.tm_min) * 60
       + (loctm.tm_hour - gmtm.tm_hour) * 3600;
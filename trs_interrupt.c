@@ -10,18 +10,77 @@
  * Emulate interrupts
  */
 
-#define _XOPEN_SOURCE 500 /* signal.h: SA_RESTART */
+#define _XOPEN_SOURCE 600 /* signal.h: SA_RESTART; time.h: clock_nanosleep */
 
 #include "z80.h"
 #include "trs.h"
+#include "trs_hard.h"
 #include <stdio.h>
 #include <sys/time.h>
 #include <time.h>
 #include <signal.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 /*#define IDEBUG 1*/
 /*#define IDEBUG2 1*/
 
+/* Per-machine state; the speed control options are in struct
+   trs_machine */
+struct trs_interrupt_machine {
+  unsigned char interrupt_latch;
+  unsigned char interrupt_mask;
+  unsigned char nmi_latch;
+  unsigned char nmi_mask;
+  int timer_hz;
+  int timer_on;
+  int saved_delay;
+
+  /* Speed control */
+  int turbo_on;
+  int turbo_saved_delay;
+  struct timeval oldtv;
+  int increment;
+  int oldtoofast;
+  tstate_t oldtcount;
+  struct timespec pace_time;  /* when pace_tcount is due */
+  tstate_t pace_tcount;
+
+  /* Event queue */
+  struct {
+    tstate_t when;
+    unsigned long seq;
+    trs_event_func func;
+    int arg;
+  } event[TRS_EV_NSOURCES];
+  int event_heap[TRS_EV_NSOURCES];  /* sources, soonest first */
+  int event_pos[TRS_EV_NSOURCES];   /* index in event_heap + 1, or 0 */
+  int event_count;
+  unsigned long event_seq;
+};
+
+#define interrupt_latch   (trs_cur->interrupt->interrupt_latch)
+#define interrupt_mask    (trs_cur->interrupt->interrupt_mask)
+#define nmi_latch         (trs_cur->interrupt->nmi_latch)
+#define nmi_mask          (trs_cur->interrupt->nmi_mask)
+#define timer_hz          (trs_cur->interrupt->timer_hz)
+#define timer_on          (trs_cur->interrupt->timer_on)
+#define saved_delay       (trs_cur->interrupt->saved_delay)
+#define turbo_on          (trs_cur->interrupt->turbo_on)
+#define turbo_saved_delay (trs_cur->interrupt->turbo_saved_delay)
+#define oldtv             (trs_cur->interrupt->oldtv)
+#define increment         (trs_cur->interrupt->increment)
+#define oldtoofast        (trs_cur->interrupt->oldtoofast)
+#define oldtcount         (trs_cur->interrupt->oldtcount)
+#define pace_time         (trs_cur->interrupt->pace_time)
+#define pace_tcount       (trs_cur->interrupt->pace_tcount)
+#define event             (trs_cur->interrupt->event)
+#define event_heap        (trs_cur->interrupt->event_heap)
+#define event_pos         (trs_cur->interrupt->event_pos)
+#define event_count       (trs_cur->interrupt->event_count)
+#define event_seq         (trs_cur->interrupt->event_seq)
+
 /* IRQs */
 #define M1_TIMER_BIT    0x80
 #define M1_DISK_BIT     0x40
@@ -32,20 +91,35 @@
 #define M3_TIMER_BIT    0x04
 #define M3_CASSFALL_BIT 0x02
 #define M3_CASSRISE_BIT 0x01
-static unsigned char interrupt_latch = 0;
-static unsigned char interrupt_mask = 0;
 
 /* NMIs (M3/4/4P only) */
 #define M3_INTRQ_BIT    0x80  /* FDC chip INTRQ line */
 #define M3_MOTOROFF_BIT 0x40  /* FDC motor timed out (stopped) */
 #define M3_RESET_BIT    0x20  /* User pressed Reset button */
-static unsigned char nmi_latch = 1; /* ?? One diagnostic program needs this */
-static unsigned char nmi_mask = M3_RESET_BIT;
+
+/* Changing an interrupt line wakes up z80_run, which otherwise does
+   not look at the lines until an event or host poll is due. */
+static void
+set_irq(int state)
+{
+  if (z80_state.irq != state) {
+    z80_state.irq = state;
+    z80_wakeup = 1;
+  }
+}
+
+static void
+set_nmi(int state)
+{
+  if (z80_state.nmi != state) {
+    z80_state.nmi = state;
+    z80_wakeup = 1;
+  }
+}
 
 #define TIMER_HZ_1 40
 #define TIMER_HZ_3 30
 #define TIMER_HZ_4 60
-static int timer_hz;
 
 #define CLOCK_MHZ_1 1.77408
 #define CLOCK_MHZ_3 2.02752
@@ -91,7 +165,19 @@ static int timer_hz;
 #define NEWDOS3_MIN                 0x42cd
 #define NEWDOS3_SEC                 0x42cc
 
-static int timer_on = 1;
+void
+trs_interrupt_machine_init(struct trs_machine *m)
+{
+  m->interrupt = (struct trs_interrupt_machine *)
+    calloc(1, sizeof(struct trs_interrupt_machine));
+  if (m->interrupt == NULL) fatal("out of memory");
+  nmi_latch = 1; /* ?? One diagnostic program needs this */
+  nmi_mask = M3_RESET_BIT;
+  timer_on = 1;
+  increment = 1;
+  trs_paused = 1;
+}
+
 #ifdef IDEBUG
 long lost_timer_interrupts = 0;
 #endif
@@ -107,7 +193,7 @@ trs_cassette_rise_interrupt(int dummy)
 {
   interrupt_latch = (interrupt_latch & ~M3_CASSRISE_BIT) |
     (interrupt_mask & M3_CASSRISE_BIT);
-  z80_state.irq = (interrupt_latch & interrupt_mask) != 0;
+  set_irq((interrupt_latch & interrupt_mask) != 0);
   trs_cassette_update(0);
 }
 
@@ -116,7 +202,7 @@ trs_cassette_fall_interrupt(int dummy)
 {
   interrupt_latch = (interrupt_latch & ~M3_CASSFALL_BIT) |
     (interrupt_mask & M3_CASSFALL_BIT);
-  z80_state.irq = (interrupt_latch & interrupt_mask) != 0;
+  set_irq((interrupt_latch & interrupt_mask) != 0);
   trs_cassette_update(0);
 }
 
@@ -124,7 +210,7 @@ void
 trs_cassette_clear_interrupts()
 {
   interrupt_latch &= ~(M3_CASSRISE_BIT|M3_CASSFALL_BIT);
-  z80_state.irq = (interrupt_latch & interrupt_mask) != 0;
+  set_irq((interrupt_latch & interrupt_mask) != 0);
 }
 
 int
@@ -142,7 +228,7 @@ trs_timer_interrupt(int state)
       if (interrupt_latch & M1_TIMER_BIT) lost_timer_interrupts++;
 #endif
       interrupt_latch |= M1_TIMER_BIT;
-      z80_state.irq = 1;
+      set_irq(1);
     } else {
       interrupt_latch &= ~M1_TIMER_BIT;
     }
@@ -155,7 +241,7 @@ trs_timer_interrupt(int state)
     } else {
       interrupt_latch &= ~M3_TIMER_BIT;
     }
-    z80_state.irq = (interrupt_latch & interrupt_mask) != 0;
+    set_irq((interrupt_latch & interrupt_mask) != 0);
   }
 }
 
@@ -165,7 +251,7 @@ trs_disk_intrq_interrupt(int state)
   if (trs_model == 1) {
     if (state) {
       interrupt_latch |= M1_DISK_BIT;
-      z80_state.irq = 1;
+      set_irq(1);
     } else {
       interrupt_latch &= ~M1_DISK_BIT;
     }
@@ -175,7 +261,7 @@ trs_disk_intrq_interrupt(int state)
     } else {
       nmi_latch &= ~M3_INTRQ_BIT;
     }
-    z80_state.nmi = (nmi_latch & nmi_mask) != 0;
+    set_nmi((nmi_latch & nmi_mask) != 0);
     if (!z80_state.nmi) z80_state.nmi_seen = 0;
   }
 }
@@ -192,7 +278,7 @@ trs_disk_motoroff_interrupt(int state)
     } else {
       nmi_latch &= ~M3_MOTOROFF_BIT;
     }
-    z80_state.nmi = (nmi_latch & nmi_mask) != 0;
+    set_nmi((nmi_latch & nmi_mask) != 0);
     if (!z80_state.nmi) z80_state.nmi_seen = 0;
   }
 }
@@ -212,7 +298,7 @@ trs_uart_err_interrupt(int state)
     } else {
       interrupt_latch &= ~M3_UART_ERR_BIT;
     }
-    z80_state.irq = (interrupt_latch & interrupt_mask) != 0;
+    set_irq((interrupt_latch & interrupt_mask) != 0);
   }
 }
 
@@ -225,7 +311,7 @@ trs_uart_rcv_interrupt(int state)
     } else {
       interrupt_latch &= ~M3_UART_RCV_BIT;
     }
-    z80_state.irq = (interrupt_latch & interrupt_mask) != 0;
+    set_irq((interrupt_latch & interrupt_mask) != 0);
   }
 }
 
@@ -238,7 +324,7 @@ trs_uart_snd_interrupt(int state)
     } else {
       interrupt_latch &= ~M3_UART_SND_BIT;
     }
-    z80_state.irq = (interrupt_latch & interrupt_mask) != 0;
+    set_irq((interrupt_latch & interrupt_mask) != 0);
   }
 }
 
@@ -246,14 +332,14 @@ void
 trs_reset_button_interrupt(int state)
 {
   if (trs_model == 1) {
-    z80_state.nmi = state;
+    set_nmi(state);
   } else {  
     if (state) {
       nmi_latch |= M3_RESET_BIT;
     } else {
       nmi_latch &= ~M3_RESET_BIT;
     }
-    z80_state.nmi = (nmi_latch & nmi_mask) != 0;
+    set_nmi((nmi_latch & nmi_mask) != 0);
   }
   if (!z80_state.nmi) z80_state.nmi_seen = 0;
 }
@@ -264,7 +350,7 @@ trs_interrupt_latch_read()
   unsigned char tmp = interrupt_latch;
   if (trs_model == 1) {
     trs_timer_interrupt(0); /* acknowledge this one (only) */
-    z80_state.irq = (interrupt_latch != 0);
+    set_irq((interrupt_latch != 0));
     return tmp;
   } else {
     return ~tmp;
@@ -275,7 +361,7 @@ void
 trs_interrupt_mask_write(unsigned char value)
 {
   interrupt_mask = value;
-  z80_state.irq = (interrupt_latch & interrupt_mask) != 0;
+  set_irq((interrupt_latch & interrupt_mask) != 0);
 }
 
 /* M3 only */
@@ -289,7 +375,7 @@ void
 trs_nmi_mask_write(unsigned char value)
 {
   nmi_mask = value | M3_RESET_BIT;
-  z80_state.nmi = (nmi_latch & nmi_mask) != 0;
+  set_nmi((nmi_latch & nmi_mask) != 0);
 #if IDEBUG2
   if (z80_state.nmi && !z80_state.nmi_seen) {
     debug("mask write caused nmi, mask %02x latch %02x\n",
@@ -300,7 +386,6 @@ trs_nmi_mask_write(unsigned char value)
 }
 
 #if SUSPEND_DELAY
-static int saved_delay;
 /* Temporarily reduce the delay, until trs_restore_delay is called.
    Useful if we know we're about to do something that's emulated more
    slowly than most instructions, such as video or real-time sound.
@@ -337,6 +422,58 @@ void trs_suspend_delay() { }
 void trs_restore_delay() { }
 #endif
 
+/* Turbo mode.  While turbo is in effect, all speed control is off:
+   the -delay/-autodelay spin is zeroed and -pace does not sleep.  It
+   is in effect all the time with -turbo, or with -autoturbo while the
+   floppy, hard disk, or cassette is active, so that booting and
+   loading programs don't take real-machine time.  Checked once per
+   timer tick. */
+
+void
+trs_turbo_check()
+{
+  int on = trs_turbo ||
+    (trs_autoturbo && (trs_disk_busy() || trs_hard_busy() ||
+		       trs_cassette_busy()));
+  if (on == turbo_on) return;
+  turbo_on = on;
+  if (on) {
+    turbo_saved_delay = z80_state.delay;
+    z80_state.delay = 0;
+  } else {
+    z80_state.delay = turbo_saved_delay;
+    trs_paused = 1;  /* keep autodelay from measuring the turbo period */
+  }
+}
+
+/* What happens on every tick of the heartbeat timer, however timed */
+static void
+trs_timer_tick()
+{
+  if (timer_on) {
+    trs_timer_interrupt(1); /* generate */
+    trs_disk_motoroff_interrupt(trs_disk_motoroff());
+    trs_kb_heartbeat(); /* part of keyboard stretch kludge */
+  }
+  x_poll_count = 0; /* be sure to flush and check for X events */
+  z80_wakeup = 1;
+}
+
+/* With trs_tstate_timer, the heartbeat is an event that recurs every
+   1/timer_hz second of emulated time, instead of a SIGALRM every
+   1/timer_hz second of host time.  That leaves the process's signals
+   and itimer alone, so several machines can run at once on separate
+   threads, and the emulated program sees the same interrupts at the
+   same points however fast the host is.  xtrs-batch uses it. */
+static void
+trs_timer_tstate_event(int dummy)
+{
+  trs_turbo_check();
+  trs_timer_tick();
+  trs_schedule_event(TRS_EV_TIMER, trs_timer_tstate_event, 0,
+		     (int) (z80_state.clockMHz * 1000000 / timer_hz));
+}
+
 #define UP_F   1.50
 #define DOWN_F 0.50 
 
@@ -347,15 +484,8 @@ trs_timer_event(int signo)
   struct itimerval it;
 
   gettimeofday(&tv, NULL);
-  if (trs_autodelay) {
-      static struct timeval oldtv;
-      static int increment = 1;
-      static int oldtoofast = 0;
-#if __GNUC__
-      static unsigned long long oldtcount;
-#else
-      static unsigned long oldtcount;
-#endif
+  trs_turbo_check();
+  if (trs_autodelay && !trs_pace && !turbo_on) {
       if (!trs_paused) {
 	int toofast = (z80_state.t_count - oldtcount) >
 	  ((tv.tv_sec*1000000 + tv.tv_usec) -
@@ -382,12 +512,7 @@ trs_timer_event(int signo)
       oldtcount = z80_state.t_count;
   }
 
-  if (timer_on) {
-    trs_timer_interrupt(1); /* generate */
-    trs_disk_motoroff_interrupt(trs_disk_motoroff());
-    trs_kb_heartbeat(); /* part of keyboard stretch kludge */
-  }
-  x_poll_count = 0; /* be sure to flush and check for X events */
+  trs_timer_tick();
 
   /* Schedule next tick.  We do it this way because the host system
      probably didn't wake us up at exactly the right time.  For
@@ -403,11 +528,59 @@ trs_timer_event(int signo)
   setitimer(ITIMER_REAL, &it, NULL);
 }
 
+/* Real-time pacing.  Instead of spinning before every instruction,
+   let the Z80 run for a slice of PACE_SLICE_US worth of t-states, then
+   sleep until the wall-clock time at which a real machine would have
+   finished that slice.  Host CPU use then scales with the emulated
+   clock speed.  If we fall more than PACE_MAX_LAG_US behind (slow
+   host, debugger, etc.), forget the debt rather than racing to catch
+   up. */
+#define PACE_SLICE_US   2000
+#define PACE_MAX_LAG_US 100000
+
+static void
+trs_pace_event(int dummy)
+{
+  struct timespec now;
+  long long ns, lag;
+
+  ns = (long long) ((z80_state.t_count - pace_tcount) * 1000.0 /
+		    z80_state.clockMHz);
+  pace_tcount = z80_state.t_count;
+  ns += pace_time.tv_nsec;
+  pace_time.tv_sec += ns / 1000000000;
+  pace_time.tv_nsec = ns % 1000000000;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  lag = (now.tv_sec - pace_time.tv_sec) * 1000000000LL +
+    (now.tv_nsec - pace_time.tv_nsec);
+  if (turbo_on || lag > PACE_MAX_LAG_US * 1000LL) {
+    pace_time = now;
+  } else {
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			   &pace_time, NULL) == EINTR) /* retry */;
+  }
+
+  trs_schedule_event(TRS_EV_PACE, trs_pace_event, 0,
+		     (int) (PACE_SLICE_US * z80_state.clockMHz));
+}
+
+/* Start (or restart) pacing from the current time, if enabled */
+void
+trs_pace_start()
+{
+  if (!trs_pace) return;
+  clock_gettime(CLOCK_MONOTONIC, &pace_time);
+  pace_tcount = z80_state.t_count;
+  trs_schedule_event(TRS_EV_PACE, trs_pace_event, 0,
+		     (int) (PACE_SLICE_US * z80_state.clockMHz));
+}
+
 void
 trs_timer_init()
 {
   struct sigaction sa;
-  struct tm *lt;
+  struct tm *lt, ltbuf;
   time_t tt;
 
   if (trs_model == 1) {
@@ -419,17 +592,21 @@ trs_timer_init()
       z80_state.clockMHz = CLOCK_MHZ_3;
   }
 
-  sa.sa_handler = trs_timer_event;
-  sigemptyset(&sa.sa_mask);
-  sigaddset(&sa.sa_mask, SIGALRM);
-  sa.sa_flags = SA_RESTART;
-  sigaction(SIGALRM, &sa, NULL);
+  if (trs_tstate_timer) {
+    trs_timer_tstate_event(0);
+  } else {
+    sa.sa_handler = trs_timer_event;
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGALRM);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &sa, NULL);
 
-  trs_timer_event(SIGALRM);
+    trs_timer_event(SIGALRM);
+  }
 
   /* Also initialize the clock in memory - hack */
-  tt = time(NULL);
-  lt = localtime(&tt);
+  tt = trs_time();
+  lt = trs_localtime(&tt, &ltbuf);
   if (trs_model == 1) {
       mem_write(LDOS_MONTH, (lt->tm_mon + 1) ^ 0x50);
       mem_write(LDOS_DAY, lt->tm_mday);
@@ -456,14 +633,26 @@ trs_timer_init()
       mem_write(NEWDOS3_SEC, lt->tm_sec);
 
       if (trs_model >= 4) {
-        extern Uchar memory[];
-	memory[LDOS4_MONTH] = lt->tm_mon + 1;
-	memory[LDOS4_DAY] = lt->tm_mday;
-	memory[LDOS4_YEAR] = lt->tm_year;
+	mem_write_ram(LDOS4_MONTH, lt->tm_mon + 1);
+	mem_write_ram(LDOS4_DAY, lt->tm_mday);
+	mem_write_ram(LDOS4_YEAR, lt->tm_year);
       }
   }
 }
 
+/* Restart the host-timed heartbeat and pacing from now, in a child of
+   trs_fork_server, which does not inherit its parent's itimer */
+void
+trs_timer_restart()
+{
+  trs_paused = 1;
+  if (!trs_tstate_timer) {
+    trs_timer_event(SIGALRM);
+  }
+  trs_cancel_event(TRS_EV_PACE);
+  trs_pace_start();
+}
+
 void
 trs_timer_off()
 {
@@ -475,13 +664,19 @@ trs_timer_on()
 {
   if (!timer_on) {
     timer_on = 1;
-    trs_timer_event(SIGALRM);
+    if (trs_tstate_timer) {
+      trs_cancel_event(TRS_EV_TIMER);
+      trs_timer_tstate_event(0);
+    } else {
+      trs_timer_event(SIGALRM);
+    }
   }
 }
 
 void
 trs_timer_speed(int fast)
 {
+    trs_time_speed();
     if (trs_model >= 4) {
 	timer_hz = fast ? TIMER_HZ_4 : TIMER_HZ_3;
 	z80_state.clockMHz = fast ? CLOCK_MHZ_4 : CLOCK_MHZ_3;
@@ -491,8 +686,83 @@ trs_timer_speed(int fast)
     }
 }
 
-static trs_event_func event_func = NULL;
-static int event_arg;
+/* Pending events, at most one per source, kept in a binary heap
+   ordered by due time.  Events due at the same time run in the order
+   they were scheduled.  z80_state.sched mirrors the due time of the
+   heap top, so z80_run has only one deadline to watch. */
+
+static int
+event_before(int a, int b)
+{
+    tstate_t diff = event[a].when - event[b].when;
+    if (diff == 0) return event[a].seq - event[b].seq > ~0UL/2;
+    return diff > TSTATE_T_MID;  /* subtraction wrapped; a is sooner */
+}
+
+static void
+event_place(int i, int src)
+{
+    event_heap[i] = src;
+    event_pos[src] = i + 1;
+}
+
+static void
+event_sift(int i)
+{
+    int src = event_heap[i];
+    while (i > 0 && event_before(src, event_heap[(i - 1)/2])) {
+	event_place(i, event_heap[(i - 1)/2]);
+	i = (i - 1)/2;
+    }
+    for (;;) {
+	int c = 2*i + 1;
+	if (c >= event_count) break;
+	if (c + 1 < event_count && event_before(event_heap[c + 1], event_heap[c])) c++;
+	if (!event_before(event_heap[c], src)) break;
+	event_place(i, event_heap[c]);
+	i = c;
+    }
+    event_place(i, src);
+}
+
+static void
+event_update_sched(void)
+{
+    z80_state.sched = event_count ? event[event_heap[0]].when : 0;
+    z80_wakeup = 1;
+}
+
+static void
+event_remove(int src)
+{
+    int i = event_pos[src] - 1;
+    if (i < 0) return;
+    event_pos[src] = 0;
+    event[src].func = NULL;
+    if (i != --event_count) {
+	event_place(i, event_heap[event_count]);
+	event_sift(i);
+    }
+    event_update_sched();
+}
+
+static void
+event_insert(int src)
+{
+    event_place(event_count++, src);
+    event_sift(event_count - 1);
+    event_update_sched();
+}
+
+/* Run the given source's pending event now, whether due or not */
+static void
+event_run(int src)
+{
+    trs_event_func f = event[src].func;
+    int arg = event[src].arg;
+    event_remove(src);
+    f(arg);
+}
 
 /* Schedule an event to occur after "countdown" more t-states have
  *  executed.  0 makes the event happen immediately -- that is, at
@@ -500,55 +770,209 @@ static int event_arg;
  *  for interrupts.  It is legal for an event function to call 
  *  trs_schedule_event.  
  *
- * Only one event can be buffered.  If you try to schedule a second
- *  event while one is still pending, the pending event (along with
- *  any further events that it schedules) is executed immediately.
+ * Each source (TRS_EV_DISK, etc.) can have one event buffered.  If a
+ *  source schedules a second event while one is still pending, the
+ *  pending event (along with any further events that it schedules)
+ *  is executed immediately.  Events of other sources are unaffected.
  */
 void
-trs_schedule_event(trs_event_func f, int arg, int countdown)
+trs_schedule_event(int src, trs_event_func f, int arg, int countdown)
 {
-    while (event_func) {
+    while (event[src].func) {
 #if EDEBUG	
-	error("warning: trying to schedule two events");
+	error("warning: trying to schedule two events on source %d", src);
 #endif
-	trs_do_event();
+	event_run(src);
     }
-    event_func = f;
-    event_arg = arg;
-    z80_state.sched = z80_state.t_count + (tstate_t) countdown;
-    if (z80_state.sched == 0) z80_state.sched--;
+    event[src].func = f;
+    event[src].arg = arg;
+    event[src].when = z80_state.t_count + (tstate_t) countdown;
+    if (event[src].when == 0) event[src].when--;
+    event[src].seq = event_seq++;
+    event_insert(src);
 }
 
 /*
- * If an event is scheduled, do it now.  (If the event function
- * schedules a new event, however, leave that one pending.)
+ * Do all events that are due, soonest first.  (If an event function
+ * schedules a new event, however, leave that one pending until
+ * more t-states have passed.)
  */
 void
 trs_do_event()
 {
-    trs_event_func f = event_func;
-    if (f) {
-	event_func = NULL;
-	z80_state.sched = 0;
-	f(event_arg);    
+    while (event_count &&
+	   (event[event_heap[0]].when - z80_state.t_count > TSTATE_T_MID)) {
+	event_run(event_heap[0]);
+    }
+}
+
+/*
+ * Simulate waiting until the given source's pending event is due:
+ * advance the clock to it, then do it along with any other events
+ * that would have happened first.
+ */
+void
+trs_wait_event(int src)
+{
+    if (event[src].func) {
+	z80_state.t_count = event[src].when;
+	trs_do_event();
+	if (event[src].func) event_run(src);
     }
 }
 
 /*
- * Cancel scheduled event, if any.
+ * Cancel scheduled event of the given source, if any.
  */
 void
-trs_cancel_event()
+trs_cancel_event(int src)
 {
-    event_func = NULL;
-    z80_state.sched = 0;
+    event_remove(src);
+}
+
+/*
+ * Cancel all scheduled events of the emulated hardware.  TRS_EV_STOP
+ * belongs to whoever is running the emulator, TRS_EV_TIMER stands in
+ * for the host timer, and TRS_EV_JOURNAL to the journal being
+ * replayed, so they survive resets.
+ */
+void
+trs_cancel_all_events()
+{
+    int src;
+
+    for (src = 0; src < TRS_EV_NSOURCES; src++) {
+	if (src != TRS_EV_STOP && src != TRS_EV_TIMER &&
+	    src != TRS_EV_JOURNAL) event_remove(src);
+    }
 }
 
 /*
- * Check event scheduled
+ * Check event scheduled for the given source, or the soonest of all
+ * for TRS_EV_ANY.
  */
 trs_event_func
-trs_event_scheduled()
+trs_event_scheduled(int src)
 {
-    return event_func;
+    if (src == TRS_EV_ANY) {
+	return event_count ? event[event_heap[0]].func : NULL;
+    }
+    return event[src].func;
+}
+
+/*
+ * Make the given source's pending event, if any, due the given
+ * number of t-states later.
+ */
+void
+trs_event_shift(int src, tstate_t tstates)
+{
+    int i = event_pos[src] - 1;
+    if (i < 0) return;
+    event[src].when += tstates;
+    if (event[src].when == 0) event[src].when--;
+    event_sift(i);
+    event_update_sched();
+}
+
+/*
+ * A source's pending event as saved in a snapshot.  The function is
+ * saved as its index in a NULL-terminated list that the source's
+ * owner supplies, since its address can change from one build (or
+ * run) to the next.
+ */
+struct event_snapshot {
+    int func;  /* index in the list, or -1 if none pending */
+    int arg;
+    tstate_t when;
+    unsigned long seq;
+};
+
+void
+trs_event_snapshot_save(int src, const trs_event_func funcs[])
+{
+    struct event_snapshot e;
+    char tag[] = "EV0 ";
+    int i;
+
+    memset(&e, 0, sizeof(e));
+    e.func = -1;
+    if (event[src].func) {
+	for (i = 0; funcs[i]; i++) {
+	    if (funcs[i] == event[src].func) break;
+	}
+	if (funcs[i] == NULL) {
+	    error("snapshot: can't save event on source %d", src);
+	} else {
+	    e.func = i;
+	    e.arg = event[src].arg;
+	    e.when = event[src].when;
+	    e.seq = event[src].seq;
+	}
+    }
+    tag[2] += src;
+    trs_snapshot_put(tag, &e, sizeof(e));
+}
+
+void
+trs_event_snapshot_load(int src, const trs_event_func funcs[])
+{
+    const struct event_snapshot *e;
+    char tag[] = "EV0 ";
+    int i;
+
+    tag[2] += src;
+    e = (const struct event_snapshot *) trs_snapshot_get(tag, sizeof(*e));
+    event_remove(src);
+    if (e->func < 0) return;
+    for (i = 0; i <= e->func; i++) {
+	if (funcs[i] == NULL) return;
+    }
+    event[src].func = funcs[e->func];
+    event[src].arg = e->arg;
+    event[src].when = e->when;
+    event[src].seq = e->seq;
+    if ((long) (e->seq - event_seq) >= 0) event_seq = e->seq + 1;
+    event_insert(src);
+}
+
+/* The interrupt hardware is the fields of trs_interrupt_machine up to
+   saved_delay; the rest is host timing and the event queue.  (The
+   field names are macros, so offsetof won't do.) */
+#define INTERRUPT_SNAPSHOT_LEN \
+  ((char *) &saved_delay - (char *) trs_cur->interrupt)
+
+static const trs_event_func reset_event_funcs[] = {
+  trs_reset_button_interrupt, NULL
+};
+static const trs_event_func timer_event_funcs[] = {
+  trs_timer_tstate_event, NULL
+};
+
+void
+trs_interrupt_snapshot_save()
+{
+  trs_snapshot_put("INT ", trs_cur->interrupt, INTERRUPT_SNAPSHOT_LEN);
+  trs_event_snapshot_save(TRS_EV_RESET, reset_event_funcs);
+  trs_event_snapshot_save(TRS_EV_TIMER, timer_event_funcs);
+}
+
+void
+trs_interrupt_snapshot_load()
+{
+  memcpy(trs_cur->interrupt, trs_snapshot_get("INT ", INTERRUPT_SNAPSHOT_LEN),
+	 INTERRUPT_SNAPSHOT_LEN);
+  trs_event_snapshot_load(TRS_EV_RESET, reset_event_funcs);
+  if (trs_tstate_timer) {
+    /* Keep the heartbeat in step with the saved machine if it had
+       one timed the same way, else start it now */
+    trs_event_snapshot_load(TRS_EV_TIMER, timer_event_funcs);
+    if (event[TRS_EV_TIMER].func == NULL) {
+      trs_schedule_event(TRS_EV_TIMER, trs_timer_tstate_event, 0,
+			 (int) (z80_state.clockMHz * 1000000 / timer_hz));
+    }
+  }
+  /* Pacing goes by the host clock; start over */
+  trs_cancel_event(TRS_EV_PACE);
+  trs_pace_start();
 }
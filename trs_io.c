@@ -25,6 +25,7 @@
 #define IODEBUG_OUT (2<<0)  /* OUT instructions */
 
 #include <time.h>
+#include <stdlib.h>
 
 #include "z80.h"
 #include "trs.h"
@@ -32,10 +33,26 @@
 #include "trs_hard.h"
 #include "trs_uart.h"
 
-static int modesel = 0;     /* Model I */
-static int modeimage = 0x8; /* Model III/4/4p */
-static int ctrlimage = 0;   /* Model 4/4p */
-static int rominimage = 0;  /* Model 4p */
+/* Per-machine state */
+struct trs_io_machine {
+  int modesel;     /* Model I */
+  int modeimage;   /* Model III/4/4p */
+  int ctrlimage;   /* Model 4/4p */
+  int rominimage;  /* Model 4p */
+};
+
+#define modesel    (trs_cur->io->modesel)
+#define modeimage  (trs_cur->io->modeimage)
+#define ctrlimage  (trs_cur->io->ctrlimage)
+#define rominimage (trs_cur->io->rominimage)
+
+void
+trs_io_machine_init(struct trs_machine *m)
+{
+  m->io = (struct trs_io_machine *) calloc(1, sizeof(struct trs_io_machine));
+  if (m->io == NULL) fatal("out of memory");
+  modeimage = 0x8;
+}
 
 int trs_io_debug_flags = 0;
 
@@ -325,11 +342,11 @@ int z80_in(int port)
   if ((port >= 0x70 && port <= 0x7C)
       || (port >= 0xB0 && port <= 0xBC)
       /*|| (port >= 0xC0 && port <= 0xCC)*/) {
-    struct tm *time_info;
+    struct tm *time_info, tm;
     time_t time_secs;
 
-    time_secs = time(NULL);
-    time_info = localtime(&time_secs);
+    time_secs = trs_time();
+    time_info = trs_localtime(&time_secs, &tm);
 
     switch (port & 0x0F) {
     case 0xC: /* year (high) */
@@ -525,3 +542,27 @@ int z80_in(int port)
 
   return value;
 }
+
+void
+trs_io_snapshot_save()
+{
+  trs_snapshot_put("IO  ", trs_cur->io, sizeof(struct trs_io_machine));
+}
+
+/* Restore the port images and the display modes they select */
+void
+trs_io_snapshot_load()
+{
+  *trs_cur->io = *(const struct trs_io_machine *)
+    trs_snapshot_get("IO  ", sizeof(struct trs_io_machine));
+  if (trs_model == 1) {
+    trs_screen_expanded(modesel);
+  } else {
+    trs_screen_expanded((modeimage & 0x04) >> 2);
+    trs_screen_alternate(!((modeimage & 0x08) >> 3));
+    if (trs_model >= 4) {
+      trs_screen_inverse((ctrlimage & 0x08) >> 3);
+      trs_screen_80x24((ctrlimage & 0x04) >> 2);
+    }
+  }
+}
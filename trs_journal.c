@@ -0,0 +1,556 @@
+/* $Id$ */
+
+/* This software may be copied, modified, and used for any purpose
+ * without fee, provided that (1) the above copyright notice is
+ * retained, and (2) modified versions are clearly marked as having
+ * been modified, with the modifier's name and the date included.  */
+
+/*
+ * trs_journal.c -- deterministic mode, and a journal of the inputs
+ * that lets a deterministic run be replayed exactly
+ *
+ * In deterministic mode a run depends only on where it starts and on
+ * what comes in from outside.  The heartbeat is an event timed by
+ * T-states (trs_tstate_timer) instead of a SIGALRM, the real-time
+ * clock runs on emulated time from a fixed starting point (see
+ * trs_time), and the refresh register counts opcode fetches as on
+ * the real chip.  Host speed, -delay, -autodelay, and -pace then
+ * change only how long the run takes.
+ *
+ * What comes in from outside is keys (including the keypad joystick),
+ * the reset button, the disk change signal, the mouse, and bytes from
+ * the serial port.  With -record, each is written to the journal with
+ * the T-state at which the machine saw it; with -replay, they are fed
+ * back at the same T-states and the host's own input is ignored until
+ * the journal runs out, after which the run carries on live.
+ *
+ * Keys, reset, and disk changes arrive whenever the interface happens
+ * to poll the host, which can be partway through an instruction.  So
+ * in deterministic mode trs_journal_input holds them back, and
+ * trs_journal_poll, which z80_run calls between instructions when it
+ * polls the host, hands them to the machine.  A replay stops z80_run
+ * at the same point with a TRS_EV_JOURNAL event.  The mouse and the
+ * serial port are read by the Z80 program itself, in the middle of an
+ * instruction; for these the journal keeps what each read returned,
+ * numbering the reads so that two at the same T-state can't be
+ * confused, and leaves out reads that returned what the last one did
+ * (mouse) or nothing (serial port).
+ *
+ * Replaying needs the same starting point as recording: the same
+ * options, ROM, and snapshot, and disk, wafer, and tape images as they
+ * were when recording started (a recording that writes to a disk
+ * changes the image under it, so record with copies).  The journal
+ * does not hold debugger commands, files read through the emt_* calls,
+ * or anything else outside the machine.  It is one machine's, so
+ * xtrs-batch doesn't offer it.
+ *
+ * The journal is a header followed by records.  Numbers are unsigned
+ * LEB128 varints, or zigzag-encoded first when they can be negative.
+ * The header is JOURNAL_MAGIC, then the version, the model, the
+ * T-state count at the start, and the clock's starting time and
+ * offset from UTC.  Each record is a type byte, the T-states since
+ * the previous record, and what the type needs: a keysym, reset's
+ * poweron flag, the mouse's read number, x, y, and buttons, or the
+ * serial port's read number, byte count, and bytes.  A JOURNAL_END
+ * record marks the point where recording stopped.
+ */
+
+#define _DEFAULT_SOURCE /* time.h: tm_gmtoff */
+#define _XOPEN_SOURCE 600 /* time.h: localtime_r(), gmtime_r() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "z80.h"
+#include "trs.h"
+
+#define JOURNAL_MAGIC   "xtrsJRNL"
+#define JOURNAL_VERSION 1
+
+/* Record types, besides the TRS_JOURNAL_* inputs in trs.h */
+#define JOURNAL_MOUSE 8
+#define JOURNAL_UART  9
+#define JOURNAL_END   10
+
+#define JOURNAL_OFF    0
+#define JOURNAL_RECORD 1
+#define JOURNAL_REPLAY 2
+
+/* Deterministic clock start without a journal: 1 Jan 2000, 00:00 UTC */
+#define DEFAULT_CLOCK_START 946684800
+
+/* Longest wait for one TRS_EV_JOURNAL event; longer gaps are made of
+   several */
+#define JOURNAL_CHUNK 1000000000
+
+/* Most inputs held back between two polls */
+#define PENDING_MAX 64
+
+#define UART_MAX 256  /* BUFSIZE in trs_uart.c */
+
+struct journal_record {
+  int type;
+  tstate_t when;
+  int value;                /* keysym or poweron */
+  unsigned long count;      /* read number, for mouse and serial port */
+  int x, y;
+  unsigned int buttons;
+  int len;
+  Uchar data[UART_MAX];
+};
+
+int trs_deterministic = FALSE;
+char *trs_journal_record_file = NULL;
+char *trs_journal_replay_file = NULL;
+
+static int mode = JOURNAL_OFF;
+static FILE *journal;
+static const char *journal_name;
+static tstate_t last_when;        /* of the previous record */
+static int applying;              /* replaying or applying an input */
+static struct journal_record next;  /* next record to replay */
+static unsigned long long start_model, start_tcount;  /* from the header */
+
+static struct {
+  int type, value;
+} pending[PENDING_MAX];
+static int npending;
+
+static unsigned long mouse_reads, uart_reads;
+static int mouse_x, mouse_y;
+static unsigned int mouse_buttons;
+
+/* The deterministic clock: clock_seconds of emulated time had passed
+   since clock_start at T-state clock_tcount */
+static time_t clock_start = DEFAULT_CLOCK_START;
+static long clock_gmtoff = 0;
+static double clock_seconds;
+static tstate_t clock_tcount;
+
+static void
+put_number(unsigned long long n)
+{
+  while (n >= 0x80) {
+    putc((n & 0x7f) | 0x80, journal);
+    n >>= 7;
+  }
+  putc(n, journal);
+}
+
+static void
+put_signed(long long n)
+{
+  put_number(n < 0 ? ~((unsigned long long) n << 1)
+	     : (unsigned long long) n << 1);
+}
+
+/* Returns 0 at end of file */
+static int
+get_number(unsigned long long *n)
+{
+  int c, shift = 0;
+
+  *n = 0;
+  do {
+    c = getc(journal);
+    if (c == EOF || shift > 63) return 0;
+    *n |= (unsigned long long) (c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 1;
+}
+
+static int
+get_signed(long long *n)
+{
+  unsigned long long u;
+
+  if (!get_number(&u)) return 0;
+  *n = (u & 1) ? (long long) ~(u >> 1) : (long long) (u >> 1);
+  return 1;
+}
+
+static void
+put_record(int type)
+{
+  putc(type, journal);
+  put_number(z80_state.t_count - last_when);
+  last_when = z80_state.t_count;
+}
+
+static void
+journal_end(void)
+{
+  if (mode != JOURNAL_RECORD) return;
+  put_record(JOURNAL_END);
+  if (fclose(journal) == EOF) {
+    error("could not write journal %s: %s", journal_name, strerror(errno));
+  }
+  mode = JOURNAL_OFF;
+}
+
+/* Go live, at the end of the journal or if the run has strayed from it */
+static void
+replay_stop(void)
+{
+  fclose(journal);
+  mode = JOURNAL_OFF;
+  trs_cancel_event(TRS_EV_JOURNAL);
+}
+
+static int
+read_record(struct journal_record *r)
+{
+  unsigned long long n, delta;
+  long long x, y;
+  int c, i;
+
+  c = getc(journal);
+  if (c == EOF || !get_number(&delta)) return 0;
+  memset(r, 0, sizeof(*r));
+  r->type = c;
+  r->when = last_when + delta;
+  last_when = r->when;
+  switch (c) {
+  case TRS_JOURNAL_KEY:
+  case TRS_JOURNAL_RESET:
+    if (!get_number(&n)) return 0;
+    r->value = n;
+    return 1;
+  case TRS_JOURNAL_CHANGE:
+  case JOURNAL_END:
+    return 1;
+  case JOURNAL_MOUSE:
+    if (!get_number(&n) || !get_signed(&x) || !get_signed(&y)) return 0;
+    r->count = n;
+    r->x = x;
+    r->y = y;
+    if (!get_number(&n)) return 0;
+    r->buttons = n;
+    return 1;
+  case JOURNAL_UART:
+    if (!get_number(&n)) return 0;
+    r->count = n;
+    if (!get_number(&n) || n > UART_MAX) return 0;
+    r->len = n;
+    for (i = 0; i < r->len; i++) {
+      if ((c = getc(journal)) == EOF) return 0;
+      r->data[i] = c;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/* Make z80_run stop and poll when the next record is due.  (Unless
+   it is due now, in which case trs_journal_poll is already at it.) */
+static void
+journal_event(int due)
+{
+  tstate_t left = next.when - 1 - z80_state.t_count;
+
+  if (left < TSTATE_T_MID) {
+    trs_schedule_event(TRS_EV_JOURNAL, journal_event, 1,
+		       left > JOURNAL_CHUNK ? JOURNAL_CHUNK : (int) left);
+  } else if (due) {
+    x_poll_count = 0;
+  }
+}
+
+/* Read the next record to replay, and schedule the event for it if
+   the machine won't ask for it itself */
+static void
+replay_next(void)
+{
+  if (!read_record(&next)) {
+    error("journal %s ends early", journal_name);
+    next.type = JOURNAL_END;
+    next.when = z80_state.t_count;
+  }
+  trs_cancel_event(TRS_EV_JOURNAL);
+  if (next.type != JOURNAL_MOUSE && next.type != JOURNAL_UART &&
+      next.when != z80_state.t_count) {
+    journal_event(0);
+  }
+}
+
+static void
+apply_input(int type, int value)
+{
+  applying = TRUE;
+  switch (type) {
+  case TRS_JOURNAL_KEY:
+    trs_xlate_keysym(value);
+    break;
+  case TRS_JOURNAL_RESET:
+    trs_reset(value);
+    break;
+  case TRS_JOURNAL_CHANGE:
+    trs_change_all();
+    break;
+  }
+  applying = FALSE;
+}
+
+/* The replay has gone wrong if a record is overdue */
+static int
+replay_check(const char *what)
+{
+  if (next.when - z80_state.t_count > TSTATE_T_MID) {
+    error("replay of %s is out of step at T-state %" TSTATE_T_LEN
+	  " (%s); going live", journal_name, z80_state.t_count, what);
+    replay_stop();
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Open the journal, if any, and set up deterministic mode.  Called
+ * after the command line is parsed and before the timer and memory
+ * are initialized.
+ */
+void
+trs_journal_open(void)
+{
+  unsigned long long version;
+  long long start = 0, gmtoff = 0;
+  char magic[8];
+  struct tm tm;
+  time_t now;
+
+  if (trs_journal_record_file && trs_journal_replay_file) {
+    fatal("-record and -replay can't be used together");
+  }
+  if (trs_journal_record_file) {
+    journal_name = trs_journal_record_file;
+    journal = fopen(journal_name, "wb");
+    if (journal == NULL) {
+      fatal("could not create journal %s: %s", journal_name, strerror(errno));
+    }
+    mode = JOURNAL_RECORD;
+    now = time(NULL);
+    localtime_r(&now, &tm);
+    clock_start = now;
+    clock_gmtoff = tm.tm_gmtoff;
+  } else if (trs_journal_replay_file) {
+    journal_name = trs_journal_replay_file;
+    journal = fopen(journal_name, "rb");
+    if (journal == NULL) {
+      fatal("could not open journal %s: %s", journal_name, strerror(errno));
+    }
+    if (fread(magic, 8, 1, journal) != 1 ||
+	memcmp(magic, JOURNAL_MAGIC, 8) != 0 ||
+	!get_number(&version) || version != JOURNAL_VERSION) {
+      fatal("%s is not a journal from this version of xtrs", journal_name);
+    }
+    if (!get_number(&start_model) || !get_number(&start_tcount) ||
+	!get_signed(&start) || !get_signed(&gmtoff)) {
+      fatal("journal %s is truncated", journal_name);
+    }
+    mode = JOURNAL_REPLAY;
+    clock_start = start;
+    clock_gmtoff = gmtoff;
+  }
+  if (mode != JOURNAL_OFF) trs_deterministic = TRUE;
+  if (trs_deterministic) trs_tstate_timer = TRUE;
+}
+
+/*
+ * Start recording or replaying, from where the machine is now: after
+ * the reset at power on, and after restoring the -snapshot if any.
+ */
+void
+trs_journal_start(void)
+{
+  clock_seconds = 0;
+  clock_tcount = z80_state.t_count;
+  last_when = z80_state.t_count;
+
+  if (mode == JOURNAL_RECORD) {
+    fwrite(JOURNAL_MAGIC, 8, 1, journal);
+    put_number(JOURNAL_VERSION);
+    put_number(trs_model);
+    put_number(z80_state.t_count);
+    put_signed(clock_start);
+    put_signed(clock_gmtoff);
+    atexit(journal_end);
+  } else if (mode == JOURNAL_REPLAY) {
+    if (start_model != trs_model ||
+	(tstate_t) start_tcount != z80_state.t_count) {
+      fatal("journal %s was recorded on a different model or from a "
+	    "different starting point", journal_name);
+    }
+    replay_next();
+  }
+}
+
+int
+trs_journal_replaying(void)
+{
+  return mode == JOURNAL_REPLAY;
+}
+
+/*
+ * Called by the interfaces with an input from the host.  Returns true
+ * if the caller should act on it now.  In deterministic mode, the
+ * input is held back for trs_journal_poll, or during a replay,
+ * dropped.
+ */
+int
+trs_journal_input(int type, int value)
+{
+  if (applying || !trs_deterministic) return TRUE;
+  if (mode == JOURNAL_REPLAY) return FALSE;
+  if (npending == PENDING_MAX) {
+    error("too many inputs at once; dropping some");
+    return FALSE;
+  }
+  pending[npending].type = type;
+  pending[npending].value = value;
+  npending++;
+  return FALSE;
+}
+
+/*
+ * Called by z80_run between instructions, after it polls the host:
+ * hand the machine the inputs that have come in, or that the journal
+ * says came in at this T-state.
+ */
+void
+trs_journal_poll(void)
+{
+  int i;
+
+  if (!trs_deterministic) return;
+  if (mode == JOURNAL_REPLAY) {
+    while (replay_check("input") && next.when == z80_state.t_count) {
+      if (next.type == JOURNAL_END) {
+	replay_stop();
+	break;
+      }
+      if (next.type == JOURNAL_MOUSE || next.type == JOURNAL_UART) break;
+      apply_input(next.type, next.value);
+      replay_next();
+    }
+    return;
+  }
+  for (i = 0; i < npending; i++) {
+    if (mode == JOURNAL_RECORD) {
+      put_record(pending[i].type);
+      if (pending[i].type != TRS_JOURNAL_CHANGE) {
+	put_number(pending[i].value);
+      }
+    }
+    apply_input(pending[i].type, pending[i].value);
+  }
+  npending = 0;
+}
+
+/*
+ * Called with what the emt_mouse call got from the host.  During a
+ * replay, replaces it with what the recorded run got.
+ */
+void
+trs_journal_mouse(int *x, int *y, unsigned int *buttons)
+{
+  if (mode == JOURNAL_OFF) return;
+  mouse_reads++;
+  if (mode == JOURNAL_RECORD) {
+    if (*x != mouse_x || *y != mouse_y || *buttons != mouse_buttons) {
+      put_record(JOURNAL_MOUSE);
+      put_number(mouse_reads);
+      put_signed(*x);
+      put_signed(*y);
+      put_number(*buttons);
+      mouse_reads = 0;
+      mouse_x = *x;
+      mouse_y = *y;
+      mouse_buttons = *buttons;
+    }
+  } else if (replay_check("mouse")) {
+    if (next.type == JOURNAL_MOUSE && next.count == mouse_reads) {
+      mouse_reads = 0;
+      mouse_x = next.x;
+      mouse_y = next.y;
+      mouse_buttons = next.buttons;
+      replay_next();
+    }
+    *x = mouse_x;
+    *y = mouse_y;
+    *buttons = mouse_buttons;
+  }
+}
+
+/*
+ * Called with the len bytes the UART read from the host serial port
+ * into buf; returns how many there are.  During a replay, the UART
+ * doesn't read the port, and this supplies what the recorded run read.
+ */
+int
+trs_journal_uart(Uchar *buf, int len)
+{
+  if (mode == JOURNAL_OFF) return len;
+  uart_reads++;
+  if (mode == JOURNAL_RECORD) {
+    if (len > 0) {
+      put_record(JOURNAL_UART);
+      put_number(uart_reads);
+      put_number(len);
+      fwrite(buf, 1, len, journal);
+      uart_reads = 0;
+    }
+    return len;
+  }
+  if (replay_check("serial port") &&
+      next.type == JOURNAL_UART && next.count == uart_reads) {
+    uart_reads = 0;
+    len = next.len;
+    memcpy(buf, next.data, len);
+    replay_next();
+    return len;
+  }
+  return 0;
+}
+
+/*
+ * The time of day, as time() would give it.  In deterministic mode it
+ * starts at the time recorded in the journal (or DEFAULT_CLOCK_START)
+ * and runs on emulated time.
+ */
+time_t
+trs_time(void)
+{
+  if (!trs_deterministic) return time(NULL);
+  return clock_start + (time_t)
+    (clock_seconds + (z80_state.t_count - clock_tcount) /
+     (z80_state.clockMHz * 1000000.0));
+}
+
+/* Note that the clock speed is about to change */
+void
+trs_time_speed(void)
+{
+  if (!trs_deterministic) return;
+  clock_seconds += (z80_state.t_count - clock_tcount) /
+    (z80_state.clockMHz * 1000000.0);
+  clock_tcount = z80_state.t_count;
+}
+
+/*
+ * The local time at *t, as localtime_r would give it.  In
+ * deterministic mode, the local time zone is the one the journal was
+ * recorded in, so that a replay on another host sees the same times.
+ */
+struct tm *
+trs_localtime(const time_t *t, struct tm *tm)
+{
+  time_t local;
+
+  if (!trs_deterministic) return localtime_r(t, tm);
+  local = *t + clock_gmtoff;
+  return gmtime_r(&local, tm);
+}
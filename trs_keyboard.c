@@ -29,15 +29,12 @@
 #include "z80.h"
 #include "trs.h"
 #include <unistd.h>
+#include <stdlib.h>
 
 /*
  * Key event queue
  */
 #define KEY_QUEUE_SIZE	(32)
-static int key_queue[KEY_QUEUE_SIZE];
-static int key_queue_head;
-static int key_queue_entries;
-static int skip_next_kbwait;
 
 /*
  * TRS-80 key matrix
@@ -335,7 +332,7 @@ KeyTable ascii_key_table[] = {
 /* 0xc1 */    { TK_NULL, TK_Neutral },
 /* 0xc2 */    { TK_NULL, TK_Neutral },
 /* 0xc3 */    { TK_NULL, TK_Neutral },
-/* 0xc4 */    { TK_LeftBracket, TK_ForceShift },    /*  */
+/* 0xc4 */    { TK_LeftBracket, TK_ForceShift },    /* � */
 /* 0xc5 */    { TK_NULL, TK_Neutral },
 /* 0xc6 */    { TK_NULL, TK_Neutral },
 /* 0xc7 */    { TK_NULL, TK_Neutral },
@@ -353,21 +350,21 @@ KeyTable ascii_key_table[] = {
 /* 0xd3 */    { TK_NULL, TK_Neutral },
 /* 0xd4 */    { TK_NULL, TK_Neutral },
 /* 0xd5 */    { TK_NULL, TK_Neutral },
-/* 0xd6 */    { TK_Backslash, TK_ForceShift },      /*  */
+/* 0xd6 */    { TK_Backslash, TK_ForceShift },      /* � */
 /* 0xd7 */    { TK_NULL, TK_Neutral },
 /* 0xd8 */    { TK_NULL, TK_Neutral },
 /* 0xd9 */    { TK_NULL, TK_Neutral },
 /* 0xda */    { TK_NULL, TK_Neutral },
 /* 0xdb */    { TK_NULL, TK_Neutral },
-/* 0xdc */    { TK_RightBracket, TK_ForceShift },   /*  */
+/* 0xdc */    { TK_RightBracket, TK_ForceShift },   /* � */
 /* 0xdd */    { TK_NULL, TK_Neutral },
 /* 0xde */    { TK_NULL, TK_Neutral },
-/* 0xdf */    { TK_Caret, TK_ForceNoShift },        /*  */
+/* 0xdf */    { TK_Caret, TK_ForceNoShift },        /* � */
 /* 0xe0 */    { TK_NULL, TK_Neutral },
 /* 0xe1 */    { TK_NULL, TK_Neutral },
 /* 0xe2 */    { TK_NULL, TK_Neutral },
 /* 0xe3 */    { TK_NULL, TK_Neutral },
-/* 0xe4 */    { TK_LeftBracket, TK_ForceNoShift },  /*  */
+/* 0xe4 */    { TK_LeftBracket, TK_ForceNoShift },  /* � */
 /* 0xe5 */    { TK_NULL, TK_Neutral },
 /* 0xe6 */    { TK_NULL, TK_Neutral },
 /* 0xe7 */    { TK_NULL, TK_Neutral },
@@ -385,13 +382,13 @@ KeyTable ascii_key_table[] = {
 /* 0xf3 */    { TK_NULL, TK_Neutral },
 /* 0xf4 */    { TK_NULL, TK_Neutral },
 /* 0xf5 */    { TK_NULL, TK_Neutral },
-/* 0xf6 */    { TK_Backslash, TK_ForceNoShift },    /*  */
+/* 0xf6 */    { TK_Backslash, TK_ForceNoShift },    /* � */
 /* 0xf7 */    { TK_NULL, TK_Neutral },
 /* 0xf8 */    { TK_NULL, TK_Neutral },
 /* 0xf9 */    { TK_NULL, TK_Neutral },
 /* 0xfa */    { TK_NULL, TK_Neutral },
 /* 0xfb */    { TK_NULL, TK_Neutral },
-/* 0xfc */    { TK_RightBracket, TK_ForceNoShift }, /*  */
+/* 0xfc */    { TK_RightBracket, TK_ForceNoShift }, /* � */
 /* 0xfd */    { TK_NULL, TK_Neutral },
 /* 0xfe */    { TK_NULL, TK_Neutral },
 /* 0xff */    { TK_NULL, TK_Neutral }
@@ -709,21 +706,65 @@ KeyTable function_key_table[] = {
 /* 0xffff   XK_Delete      */    { TK_Left, TK_Neutral }
 };
 
-static int keystate[8] = { 0, };
-static int force_shift = TK_Neutral;
-static int joystate = 0;
-
 /* Avoid changing state too fast so keystrokes aren't lost. */
 #define STRETCH_AMOUNT 4000
-static tstate_t key_stretch_timeout;
-int stretch_amount = STRETCH_AMOUNT;
+
+/* Per-machine state; -keystretch is in struct trs_machine */
+struct trs_kb_machine {
+  int key_queue[KEY_QUEUE_SIZE];
+  int key_queue_head;
+  int key_queue_entries;
+  int skip_next_kbwait;
+  int keystate[8];
+  int force_shift;
+  int joystate;
+  tstate_t key_stretch_timeout;
+  int key_heartbeat;
+  int xlate_shift;   /* for trs_xlate_keysym */
+  int bracket_shifted;  /* set by trs_kb_bracket */
+  int recursion;     /* for trs_kb_mem_read */
+  int timesseen;
+};
+
+#define key_queue           (trs_cur->kb->key_queue)
+#define key_queue_head      (trs_cur->kb->key_queue_head)
+#define key_queue_entries   (trs_cur->kb->key_queue_entries)
+#define skip_next_kbwait    (trs_cur->kb->skip_next_kbwait)
+#define keystate            (trs_cur->kb->keystate)
+#define force_shift         (trs_cur->kb->force_shift)
+#define joystate            (trs_cur->kb->joystate)
+#define key_stretch_timeout (trs_cur->kb->key_stretch_timeout)
+#define key_heartbeat       (trs_cur->kb->key_heartbeat)
+#define recursion           (trs_cur->kb->recursion)
+#define timesseen           (trs_cur->kb->timesseen)
+#define xlate_shift         (trs_cur->kb->xlate_shift)
+#define bracket_shifted     (trs_cur->kb->bracket_shifted)
+
+void trs_kb_machine_init(struct trs_machine *m)
+{
+  m->kb = (struct trs_kb_machine *) calloc(1, sizeof(struct trs_kb_machine));
+  if (m->kb == NULL) fatal("out of memory");
+  force_shift = TK_Neutral;
+  xlate_shift = TK_Neutral;
+  stretch_amount = STRETCH_AMOUNT;
+}
+
+void trs_kb_snapshot_save()
+{
+  trs_snapshot_put("KBD ", trs_cur->kb, sizeof(struct trs_kb_machine));
+}
+
+void trs_kb_snapshot_load()
+{
+  *trs_cur->kb = *(const struct trs_kb_machine *)
+    trs_snapshot_get("KBD ", sizeof(struct trs_kb_machine));
+}
 
 void trs_kb_reset()
 {
   key_stretch_timeout = z80_state.t_count;
 }
 
-int key_heartbeat = 0;
 void trs_kb_heartbeat()
 {
   /* Don't hold keys in queue too long */
@@ -738,16 +779,10 @@ void trs_kb_bracket(int shifted)
      other keyboard drivers either ignore them or decode them with
      [ unshifted and { shifted.  We default to the latter.  Note that
      these keys didn't exist on real machines anyway.
+     The setting is per machine, so trs_xlate_keysym applies it
+     rather than ascii_key_table holding it.
   */
-  int i;
-  for (i=0x5b; i<=0x5f; i++) {
-    ascii_key_table[i].shift_action =
-      shifted ? TK_ForceShift : TK_ForceNoShift;
-  }
-  for (i=0x7b; i<=0x7f; i++) {
-    ascii_key_table[i].shift_action =
-      shifted ? TK_ForceNoShift : TK_ForceShift;
-  }
+  bracket_shifted = shifted;
 }
 
 /* Emulate joystick with the keypad */
@@ -774,12 +809,14 @@ void trs_xlate_keysym(int keysym)
 {
     int key_down;
     KeyTable* kt;
-    static int shift_action = TK_Neutral;
+    int shift_action;
+
+    if (!trs_journal_input(TRS_JOURNAL_KEY, keysym)) return;
 
     if (keysym == 0x10000) {
 	/* force all keys up */
 	queue_key(TK_AllKeysUp);
-	shift_action = TK_Neutral;
+	xlate_shift = TK_Neutral;
 	return;
     }
 
@@ -792,19 +829,27 @@ void trs_xlate_keysym(int keysym)
     if (kt->bit_action == TK_NULL) return;
     if (trs_emulate_joystick(key_down, kt->bit_action)) return;
 
+    shift_action = kt->shift_action;
+    if ((keysym & 0xff00) == 0 &&
+	(keysym & 0xdf) >= 0x5b && (keysym & 0xdf) <= 0x5f) {
+      /* See trs_kb_bracket */
+      shift_action = (bracket_shifted != ((keysym & 0x20) != 0)) ?
+	TK_ForceShift : TK_ForceNoShift;
+    }
+
     if (key_down) {
-      if (shift_action != TK_ForceShiftPersistent &&
-	  shift_action != kt->shift_action) {
-	shift_action = kt->shift_action;
-	queue_key(shift_action);
+      if (xlate_shift != TK_ForceShiftPersistent &&
+	  xlate_shift != shift_action) {
+	xlate_shift = shift_action;
+	queue_key(xlate_shift);
       }
       queue_key(kt->bit_action);
     } else {
       queue_key(kt->bit_action | 0x10000);
-      if (shift_action != TK_Neutral &&
-	  shift_action == kt->shift_action) {
-	shift_action = TK_Neutral;
-	queue_key(shift_action);
+      if (xlate_shift != TK_Neutral &&
+	  xlate_shift == shift_action) {
+	xlate_shift = TK_Neutral;
+	queue_key(xlate_shift);
       }
     }
 }
@@ -880,8 +925,6 @@ int trs_kb_mem_read(int address)
 {
     int key = -1;
     int i, wait;
-    static int recursion = 0;
-    static int timesseen;
 
     /* Prevent endless recursive calls to this routine (by mem_read_word
        below) if REG_SP happens to point to keyboard memory. */
@@ -941,6 +984,12 @@ int trs_kb_mem_read(int address)
     return kb_mem_value(address);
 }
 
+/* True if all queued key events have been seen by the Z80 program */
+int trs_kb_idle()
+{
+  return key_queue_entries == 0;
+}
+
 void clear_key_queue()
 {
   key_queue_head = 0;
@@ -996,7 +1045,7 @@ int trs_next_key(int wait)
       if ((rval = dequeue_key()) >= 0) break;
       if ((z80_state.nmi && !z80_state.nmi_seen) ||
 	  (z80_state.irq && z80_state.iff1) ||
-	  trs_event_scheduled() || skip_next_kbwait) {
+	  trs_event_scheduled(TRS_EV_ANY) || skip_next_kbwait) {
 	if (skip_next_kbwait) skip_next_kbwait--;
 	rval = -1;
 	break;
@@ -0,0 +1,74 @@
+/* $Id$ */
+
+/* This software may be copied, modified, and used for any purpose
+ * without fee, provided that (1) the above copyright notice is
+ * retained, and (2) modified versions are clearly marked as having
+ * been modified, with the modifier's name and the date included.  */
+
+/*
+ * trs_machine.c -- create and destroy emulated machines
+ */
+
+#include <stdlib.h>
+#include "trs.h"
+
+struct trs_machine trs_machine0;
+__thread struct trs_machine *trs_cur = &trs_machine0;
+
+/* Set up a machine with the default options.  Call before parsing
+   options into it and before trs_reset. */
+void
+trs_machine_init(struct trs_machine *m)
+{
+  struct trs_machine *save = trs_cur;
+
+  trs_cur = m;
+  z80_machine_init(m);
+  mem_machine_init(m);
+  trs_io_machine_init(m);
+  trs_interrupt_machine_init(m);
+  trs_disk_machine_init(m);
+  trs_hard_machine_init(m);
+  trs_cassette_machine_init(m);
+  trs_kb_machine_init(m);
+  trs_uart_machine_init(m);
+  stringy_machine_init(m);
+  trs_imp_exp_machine_init(m);
+  trs_screen_machine_init(m);
+  trs_cur = save;
+}
+
+struct trs_machine *
+trs_machine_new(void)
+{
+  struct trs_machine *m;
+
+  m = (struct trs_machine *) calloc(1, sizeof(struct trs_machine));
+  if (m == NULL) fatal("out of memory");
+  trs_machine_init(m);
+  return m;
+}
+
+/* Release a machine made by trs_machine_new.  Files the emulated
+   machine has open (disks, cassette, printer) are not closed. */
+void
+trs_machine_free(struct trs_machine *m)
+{
+  struct trs_machine *save = trs_cur;
+
+  trs_cur = m;
+  z80_machine_free(m);
+  mem_machine_free(m);
+  trs_cur = save;
+  free(m->io);
+  free(m->interrupt);
+  free(m->fdc);
+  free(m->hard);
+  free(m->cassette);
+  free(m->kb);
+  free(m->uart);
+  free(m->stringy);
+  free(m->imp_exp);
+  free(m->screen);
+  if (m != &trs_machine0) free(m);
+}
@@ -0,0 +1,144 @@
+/* $Id$ */
+
+/* This software may be copied, modified, and used for any purpose
+ * without fee, provided that (1) the above copyright notice is
+ * retained, and (2) modified versions are clearly marked as having
+ * been modified, with the modifier's name and the date included.  */
+
+/*
+ * trs_machine.h -- per-machine state
+ *
+ * Everything that describes one emulated TRS-80 -- the Z80 registers,
+ * memory, the devices, the event queue, and the options that say what
+ * hardware it has -- lives in a struct trs_machine.  The emulator code
+ * works on the machine that trs_cur points to.  trs_cur is
+ * thread-local, so one process can run any number of machines, each
+ * on its own thread, or several taking turns on one thread by
+ * switching trs_cur between calls to z80_run.
+ *
+ * The code still uses the old global variable names; each is a macro
+ * for a field of *trs_cur.  Fields that more than one module uses, or
+ * that an option sets, are kept here in the open, with their macros in
+ * the module's header; they have shorter names so that the macros do
+ * not get in the way of naming them directly, as the option tables do
+ * with trs_machine0.
+ * Each module keeps the rest of its state in a private struct that it
+ * allocates in its _machine_init routine and reaches through one of
+ * the pointers at the end.
+ *
+ * The display backends other than the null one drive a single screen,
+ * so they keep their own state in ordinary globals; a process that
+ * uses them should run only trs_machine0.  The debugger likewise
+ * works on whichever machine is current.
+ */
+
+#ifndef _TRS_MACHINE_H
+#define _TRS_MACHINE_H
+
+#include "z80.h"
+
+struct trs_machine {
+    /* z80.c */
+    struct z80_state_struct regs;
+    int continuous;
+    volatile int poll_count;
+    volatile int wakeup;
+    Uchar code_page[256];
+    Uchar *traps;	/* z80_run stops before addresses marked here */
+    struct trs_profile *profile;  /* see trs_profile.c */
+    struct z80_watches *watch;	/* debugger watchpoints, or NULL */
+    Uchar last_in[256];		/* last value read from each port */
+    Uchar last_out[256];	/* ...and written to it */
+
+    /* trs_memory.c */
+    Uchar *read_page[256];
+    Uchar *write_page[256];
+    int model;	/* 1, 3, 4, 5(=4p) */
+    int rom_size;
+    int huffman;
+    int hyper;
+    int super;
+    int selector_on;
+    int lower;
+    int le18;
+    unsigned short changecount;
+
+    /* trs_interrupt.c */
+    int paused;
+    int autodelay;
+    int pace;
+    int turbo;
+    int autoturbo;
+    int tstate_timer;	/* time the heartbeat by T-states, not SIGALRM */
+
+    /* trs_disk.c */
+    int disk_doubler;
+    char *disk_dir;
+    int disk_truedam;
+
+    /* trs_keyboard.c */
+    int key_stretch;
+
+    /* trs_cassette.c */
+    int sample_rate;
+
+    /* trs_uart.c */
+    char *uart_name;
+    int uart_switches;
+
+    /* trs_imp_exp.c */
+    int emtsafe;
+
+    /* trs_printer.c */
+    FILE *printer;
+
+    /* trs_exit() */
+    int exit_stops;	/* just stop z80_run rather than exiting */
+    int exited;
+
+    /* Private state of each module */
+    struct z80_machine *z80;
+    struct mem_machine *mem;
+    struct trs_io_machine *io;
+    struct trs_interrupt_machine *interrupt;
+    struct trs_disk_machine *fdc;
+    struct trs_hard_machine *hard;
+    struct trs_cassette_machine *cassette;
+    struct trs_kb_machine *kb;
+    struct trs_uart_machine *uart;
+    struct stringy_machine *stringy;
+    struct trs_imp_exp_machine *imp_exp;
+    struct trs_screen_machine *screen;
+};
+
+/* The machine being run by this thread */
+extern __thread struct trs_machine *trs_cur;
+
+/* The machine that xtrs itself runs, and the initial value of trs_cur
+   in every thread.  Command-line options apply to it. */
+extern struct trs_machine trs_machine0;
+
+void trs_machine_init(struct trs_machine *m);
+struct trs_machine *trs_machine_new(void);
+void trs_machine_free(struct trs_machine *m);
+
+/* Called by trs_machine_init and trs_machine_free with trs_cur set to
+   m, so they can use the usual names.  The _init routines allocate a
+   module's private state and set its defaults; the _free routines
+   release anything else a module allocated. */
+void z80_machine_init(struct trs_machine *m);
+void z80_machine_free(struct trs_machine *m);
+void mem_machine_init(struct trs_machine *m);
+void mem_machine_free(struct trs_machine *m);
+void trs_io_machine_init(struct trs_machine *m);
+void trs_interrupt_machine_init(struct trs_machine *m);
+void trs_disk_machine_init(struct trs_machine *m);
+void trs_hard_machine_init(struct trs_machine *m);
+void trs_cassette_machine_init(struct trs_machine *m);
+void trs_kb_machine_init(struct trs_machine *m);
+void trs_uart_machine_init(struct trs_machine *m);
+void stringy_machine_init(struct trs_machine *m);
+void trs_imp_exp_machine_init(struct trs_machine *m);
+void trs_screen_machine_init(struct trs_machine *m);
+
+#endif /*_TRS_MACHINE_H*/
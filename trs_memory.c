@@ -29,8 +29,11 @@
 #include "z80.h"
 #include "trs.h"
 #include <stdlib.h>
+#include <string.h>
 #include "trs_disk.h"
 #include "trs_hard.h"
+#include "trs_profile.h"
+#include "load_cmd.h"
 
 #define MAX_ROM_SIZE	(0x3800)
 #define MAX_VIDEO_SIZE	(0x0800)
@@ -53,32 +56,75 @@
 /* Interrupt latch register in EI (Model 1) */
 #define TRS_INTLATCH(addr) (((addr)&~3) == 0x37e0)
 
-/* We allow for 2MB of banked memory via port 0x94. That is the extreme limit
-   of the port mods rather than anything normal (512K might be more 'normal' */
-Uchar memory[0x200001]; /* +1 so strings from mem_pointer are NUL-terminated */
-Uchar *rom;
-int trs_rom_size;
-Uchar *video;
-int trs_video_size;
-
-int memory_map = 0;
-int bank_offset[2];
 #define VIDEO_PAGE_0 0
 #define VIDEO_PAGE_1 1024
-int video_offset = (-VIDEO_START + VIDEO_PAGE_0);
-int lowercase;
-int romin = 0; /* Model 4p */
-unsigned short trs_changecount = 0;
-unsigned int bank_base = 0x10000;
-unsigned char mem_command = 0;
-int huffman_ram = 0;
-int supermem = 0;
-Uchar *supermem_ram;
-int supermem_base;
-unsigned int supermem_hi;
-int hypermem = 0;
-int selector = 0;
-int selector_reg = 0;
+
+/*
+ * Per-machine memory state.  trs_model, trs_rom_size, the memory
+ * expansion options, and the page tables are in struct trs_machine.
+ *
+ * Page tables.  For each 256-byte page of the Z80 address space,
+ * mem_read_page and mem_write_page point to the memory that backs it
+ * in the current memory map, or are NULL if the page holds
+ * memory-mapped I/O (or is otherwise not plain memory) and must go
+ * through mem_read_io or mem_write_io.  mem_map_pages rebuilds both
+ * tables whenever the memory map changes.
+ */
+struct mem_machine {
+    /* We allow for 2MB of banked memory via port 0x94. That is the
+       extreme limit of the port mods rather than anything normal
+       (512K might be more 'normal' */
+    Uchar memory[0x200001]; /* +1 so strings from mem_pointer are
+			       NUL-terminated */
+    Uchar rom[MAX_ROM_SIZE+1];
+    Uchar video[MAX_VIDEO_SIZE+1];
+    int trs_video_size;
+
+    int memory_map;
+    int bank_offset[2];
+    int video_offset;
+    int romin; /* Model 4p */
+    unsigned int bank_base;
+    unsigned char mem_command;
+    Uchar *supermem_ram;
+    int supermem_base;
+    unsigned int supermem_hi;
+    int selector_reg;
+};
+
+#define memory         (trs_cur->mem->memory)
+#define rom            (trs_cur->mem->rom)
+#define video          (trs_cur->mem->video)
+#define trs_video_size (trs_cur->mem->trs_video_size)
+#define memory_map     (trs_cur->mem->memory_map)
+#define bank_offset    (trs_cur->mem->bank_offset)
+#define video_offset   (trs_cur->mem->video_offset)
+#define romin          (trs_cur->mem->romin)
+#define bank_base      (trs_cur->mem->bank_base)
+#define mem_command    (trs_cur->mem->mem_command)
+#define supermem_ram   (trs_cur->mem->supermem_ram)
+#define supermem_base  (trs_cur->mem->supermem_base)
+#define supermem_hi    (trs_cur->mem->supermem_hi)
+#define selector_reg   (trs_cur->mem->selector_reg)
+
+void mem_machine_init(struct trs_machine *m)
+{
+    /* The memory is mostly untouched; calloc lets the host supply
+       zero pages as they are used */
+    m->mem = (struct mem_machine *) calloc(1, sizeof(struct mem_machine));
+    if (m->mem == NULL) fatal("out of memory");
+    trs_model = 1;
+    video_offset = -VIDEO_START + VIDEO_PAGE_0;
+    bank_base = 0x10000;
+}
+
+void mem_machine_free(struct trs_machine *m)
+{
+    free(supermem_ram);
+    free(m->mem);
+}
+
+static void mem_map_pages(void);
 
 /*SUPPRESS 53*/
 /*SUPPRESS 112*/
@@ -86,6 +132,7 @@ int selector_reg = 0;
 void mem_video_page(int which)
 {
     video_offset = -VIDEO_START + (which ? VIDEO_PAGE_1 : VIDEO_PAGE_0);
+    mem_map_pages();
 }
 
 void mem_bank(int command)
@@ -121,6 +168,7 @@ void mem_bank(int command)
 	break;
     }
     mem_command = command;
+    mem_map_pages();
 }
 
 /*
@@ -173,6 +221,7 @@ void mem_bank_base(int bits)
                     supermem_hi = 0x0000;
                 else
                     supermem_hi = 0x8000;
+		mem_map_pages();
 	}
 }
 
@@ -206,6 +255,7 @@ void selector_out(unsigned char value)
 			bank_base += 32768;
 	} else
 		bank_base = 0;
+	mem_map_pages();
 }
 
 /* Check for changes in all floppy, hard, and stringy drives. */
@@ -258,9 +308,10 @@ void trs_reset(int poweron)
 	bank_base = 0;
 	selector_reg = 0;
     }
+    mem_map_pages();
     trs_kb_reset();  /* Part of keyboard stretch kludge */
 
-    trs_cancel_event();
+    trs_cancel_all_events();
     trs_timer_interrupt(0);
     if (poweron || trs_model >= 4) {
         /* Reset processor */
@@ -268,8 +319,9 @@ void trs_reset(int poweron)
     } else {
 	/* Signal a nonmaskable interrupt. */
 	trs_reset_button_interrupt(1);
-	trs_schedule_event(trs_reset_button_interrupt, 0, 2000);
+	trs_schedule_event(TRS_EV_RESET, trs_reset_button_interrupt, 0, 2000);
     }
+    trs_pace_start();
 
     /*
      * Need to skip kbwait twice.  The first gets us out of the kbwait
@@ -287,19 +339,18 @@ void trs_reset(int poweron)
 void mem_map(int which)
 {
     memory_map = which + (trs_model << 4) + (romin << 2);
+    mem_map_pages();
 }
 
 void mem_romin(int state)
 {
     romin = (state & 1);
     memory_map = (memory_map & ~4) + (romin << 2);
+    mem_map_pages();
 }
 
 void mem_init()
 {
-    /* +1 so strings from mem_pointer are NUL-terminated */
-    rom = (Uchar *) calloc(MAX_ROM_SIZE+1, 1);
-    video = (Uchar *) calloc(MAX_VIDEO_SIZE+1, 1);
     if (trs_model < 4)
         trs_video_size = 1024;
     else
@@ -307,7 +358,7 @@ void mem_init()
 
     /* We map the SuperMem separately, otherwise it can get really
        confusing when combining with other stuff */
-    if (supermem)
+    if (supermem && supermem_ram == NULL)
         supermem_ram = (Uchar *) calloc(MAX_SUPERMEM_SIZE + 1, 1);
     mem_map(0);
     mem_bank(0);
@@ -317,14 +368,54 @@ void mem_init()
     }
 }
 
+/*
+ * All of memory, ROM, and video, with the mapping registers, go in
+ * one section; the SuperMem in another if there is one.
+ */
+void mem_snapshot_save(void)
+{
+    trs_snapshot_put("MEM ", trs_cur->mem, sizeof(struct mem_machine));
+    if (supermem) {
+	trs_snapshot_put("SMEM", supermem_ram, MAX_SUPERMEM_SIZE + 1);
+    }
+}
+
+void mem_snapshot_load(void)
+{
+    Uchar *save_supermem_ram = supermem_ram;
+    int i;
+
+    memcpy(trs_cur->mem, trs_snapshot_get("MEM ", sizeof(struct mem_machine)),
+	   sizeof(struct mem_machine));
+    supermem_ram = save_supermem_ram;
+    if (supermem) {
+	memcpy(supermem_ram, trs_snapshot_get("SMEM", MAX_SUPERMEM_SIZE + 1),
+	       MAX_SUPERMEM_SIZE + 1);
+    }
+    mem_map_pages();
+    for (i = 0; i < trs_video_size; i++) {
+	trs_screen_write_char(i, video[i]);
+    }
+}
+
 /*
  * hack to let us initialize the ROM memory
  */
 void mem_write_rom(int address, int value)
 {
     address &= 0xffff;
+    if (address > MAX_ROM_SIZE) return;
 
     rom[address] = value;
+    z80_block_flush();
+}
+
+/*
+ * Store into RAM at a physical address, ignoring the memory map
+ */
+void mem_write_ram(int address, int value)
+{
+    memory[address] = value;
 }
 
 /* Called by load_hex */
@@ -333,6 +424,69 @@ void hex_data(int address, int value)
     mem_write_rom(address, value);
 }
 
+void trs_load_rom(char *filename)
+{
+    FILE *program;
+    int c;
+
+    if((program = fopen(filename, "r")) == NULL)
+    {
+	char message[100];
+	sprintf(message, "could not read %s", filename);
+	fatal(message);
+    }
+    c = getc(program);
+    if (c == ':') {
+        /* Assume Intel hex format */
+        rewind(program);
+        trs_rom_size = load_hex(program);
+	fclose(program);
+	return;
+    } else if (c == 1 || c == 5) {
+	/* Assume MODELA/III file */
+	int res, i;
+	Uchar image[Z80_ADDRESS_LIMIT];
+	Uchar loadmap[Z80_ADDRESS_LIMIT];
+	rewind(program);
+	res = load_cmd(program, image, loadmap, 0, NULL, -1, NULL, NULL, 1);
+	if (res == LOAD_CMD_OK) {
+	    trs_rom_size = Z80_ADDRESS_LIMIT;
+	    while (trs_rom_size > 0) {
+		if (loadmap[--trs_rom_size] != 0) {
+		    trs_rom_size++;
+		    break;
+		}
+	    }
+	    for (i = 0; i < trs_rom_size; i++) {
+		if (loadmap[i]) mem_write_rom(i, image[i]);
+	    }
+	    fclose(program);
+	    return;
+	} else {
+	    /* Guess it wasn't one */
+	    rewind(program);
+	    c = getc(program);
+	}
+    }
+    trs_rom_size = 0;
+    while (c != EOF) {
+        mem_write_rom(trs_rom_size++, c);
+	c = getc(program);
+    }
+    fclose(program);
+}
+
+void trs_load_compiled_rom(int size, unsigned char image[])
+{
+    int i;
+    
+    trs_rom_size = size;
+    for(i = 0; i < size; ++i)
+    {
+	mem_write_rom(i, image[i]);
+    }
+}
+
 /* Called by load_hex */
 void hex_transfer_address(int address)
 {
@@ -384,10 +538,11 @@ static int trs80_model1_mmio(int address)
   return 0xff;
 }
 
-int mem_read(int address)
+/*
+ * Full emulation of a read, for pages that mem_read_page doesn't map
+ */
+static int mem_read_io(int address)
 {
-    address &= 0xffff; /* allow callers to be sloppy */
-
     /* There are some adapters that sit above the system and
        either intercept before the hardware proper, or adjust
        the address. Deal with these first so that we take their
@@ -558,10 +713,11 @@ void trs80_model1_write_mmio(int address, int value)
 }
 
 
-void mem_write(int address, int value)
+/*
+ * Full emulation of a write, for pages that mem_write_page doesn't map
+ */
+static void mem_write_io(int address, int value)
 {
-    address &= 0xffff;
-
     /* The SuperMem sits between the system and the Z80 */
     if (supermem) {
       if (!((address ^ supermem_hi) & 0x8000)) {
@@ -675,6 +831,46 @@ void mem_write(int address, int value)
     }
 }
 
+int mem_read(int address)
+{
+    Uchar *p;
+
+    address &= 0xffff; /* allow callers to be sloppy */
+
+    p = mem_read_page[address >> 8];
+    if (p) return p[address & 0xff];
+    return mem_read_io(address);
+}
+
+void mem_write(int address, int value)
+{
+    Uchar *p;
+
+    address &= 0xffff;
+
+    /* Throw away any cached Z80 code on this page */
+    if (z80_code_page[address >> 8]) z80_block_invalidate(address);
+
+    p = mem_write_page[address >> 8];
+    if (p) {
+	p[address & 0xff] = value;
+	return;
+    }
+    mem_write_io(address, value);
+}
+
+/*
+ * Return 1 if the 256-byte page containing address is plain RAM or
+ * ROM in the current memory map: reading it has no side effects, and
+ * it changes only through mem_write, mem_pointer, or a change to the
+ * memory map.  The Z80 block cache uses this to decide what it may
+ * keep copies of.
+ */
+int mem_page_cacheable(int address)
+{
+    return mem_read_page[(address >> 8) & 0xff] != NULL;
+}
+
 /*
  * Words are stored with the low-order byte in the lower address.
  */
@@ -743,6 +939,9 @@ Uchar *mem_pointer(int address, int writing)
 {
     address &= 0xffff;
 
+    /* The caller may write any amount through the pointer */
+    if (writing) z80_block_flush();
+
     /* The SuperMem sits between the system and the Z80 */
     if (supermem) {
       if (!((address ^ supermem_hi) & 0x8000))
@@ -854,6 +1053,205 @@ Uchar *mem_pointer(int address, int writing)
     return NULL;
 }
 
+/*
+ * Page table construction.  These mirror mem_read_io and
+ * mem_write_io: a page gets a pointer only if every address in it
+ * would be handled as a plain load or store from the same block of
+ * memory.
+ */
+static Uchar *model1_mmio_page(int page)
+{
+    if (page >= VIDEO_START) return video + page + video_offset;
+    if (page + 0x100 <= trs_rom_size) return rom + page;
+    return NULL;
+}
+
+static Uchar *model1_write_page(int page)
+{
+    /* See trs80_model1_write_mem */
+    if (trs_model == 1 && (selector_reg & 7) == 6 && page >= 0xC000 &&
+	!(selector_reg & 8)) return NULL;
+    return trs80_model1_ram_addr(page);
+}
+
+static Uchar *read_page_addr(int page)
+{
+    if (supermem && !((page ^ supermem_hi) & 0x8000))
+      return supermem_ram + supermem_base + (page & 0x7FFF);
+
+    switch (memory_map) {
+      case 0x10: /* Model I */
+	if (page < RAM_START) return model1_mmio_page(page);
+	return trs80_model1_ram_addr(page);
+      case 0x11: /* Model 1: selector mode 1 */
+	if (page == (0xF7E0 & 0xff00)) return NULL;
+	return trs80_model1_ram_addr(page);
+      case 0x12: /* Model 1 selector mode 2 */
+	if (page < (0x37E0 & 0xff00) || page >= RAM_START)
+	  return trs80_model1_ram_addr(page);
+	if (page == (0x37E0 & 0xff00)) return NULL;
+	return model1_mmio_page(page);
+      case 0x13: /* Model 1: selector mode 3 */
+	if (page < (0xF7E0 & 0xff00)) return trs80_model1_ram_addr(page);
+	if (page == (0xF7E0 & 0xff00)) return NULL;
+	return model1_mmio_page(page & 0x3FFF);
+      case 0x14: /* Model 1: All RAM banking high */
+      case 0x15: /* Model 1: All RAM banking low */
+	return trs80_model1_ram_addr(page);
+      case 0x16: /* Model 1: Low 16K in top 16K */
+	if (page < RAM_START) return model1_mmio_page(page);
+	return trs80_model1_ram_addr(page);
+      case 0x17:
+	return NULL;
+
+      case 0x30: /* Model III */
+	if (page >= RAM_START) return memory + page;
+	if (page == (PRINTER_ADDRESS & 0xff00)) return NULL;
+	if (page + 0x100 <= trs_rom_size) return rom + page;
+	/* Video goes through the Grafyx Solution interception */
+	return NULL;
+
+      case 0x40: /* Model 4 map 0 */
+	if (page >= RAM_START) return memory + page + bank_offset[page >> 15];
+	if (page == (PRINTER_ADDRESS & 0xff00)) return NULL;
+	if (page + 0x100 <= trs_rom_size) return rom + page;
+	if (page >= VIDEO_START) return video + page + video_offset;
+	return NULL;
+
+      case 0x54: /* Model 4P map 0, boot ROM in */
+      case 0x55: /* Model 4P map 1, boot ROM in */
+	if (page < trs_rom_size) {
+	  if (page + 0x100 <= trs_rom_size) return rom + page;
+	  return NULL;
+	}
+	/* else fall thru */
+      case 0x41: /* Model 4 map 1 */
+      case 0x50: /* Model 4P map 0, boot ROM out */
+      case 0x51: /* Model 4P map 1, boot ROM out */
+	if (page >= RAM_START || page < KEYBOARD_START)
+	  return memory + page + bank_offset[page >> 15];
+	if (page >= VIDEO_START) return video + page + video_offset;
+	return NULL;
+
+      case 0x42: /* Model 4 map 2 */
+      case 0x52: /* Model 4P map 2, boot ROM out */
+      case 0x56: /* Model 4P map 2, boot ROM in */
+	if (page < 0xf400) return memory + page + bank_offset[page >> 15];
+	if (page >= 0xf800) return video + page - 0xf800;
+	return NULL;
+
+      case 0x43: /* Model 4 map 3 */
+      case 0x53: /* Model 4P map 3, boot ROM out */
+      case 0x57: /* Model 4P map 3, boot ROM in */
+	return memory + page + bank_offset[page >> 15];
+    }
+    return NULL;
+}
+
+static Uchar *write_page_addr(int page)
+{
+    if (supermem && !((page ^ supermem_hi) & 0x8000))
+      return supermem_ram + supermem_base + (page & 0x7FFF);
+
+    switch (memory_map) {
+      case 0x10: /* Model I */
+	if (page < RAM_START) return NULL;
+	return model1_write_page(page);
+      case 0x11: /* Model 1: selector mode 1 */
+	if (page == (0xF7E0 & 0xff00)) return NULL;
+	return model1_write_page(page);
+      case 0x12: /* Model 1 selector mode 2 */
+	if (page < (0x37E0 & 0xff00) || page >= RAM_START)
+	  return model1_write_page(page);
+	return NULL;
+      case 0x13: /* Model 1: selector mode 3 */
+	if (page < (0xF7E0 & 0xff00)) return model1_write_page(page);
+	return NULL;
+      case 0x14: /* Model 1: All RAM banking high */
+      case 0x15: /* Model 1: All RAM banking low */
+	return model1_write_page(page);
+      case 0x16: /* Model 1: Low 16K in top 16K */
+      case 0x17:
+	return NULL;
+
+      case 0x30: /* Model III */
+	if (page >= RAM_START) return memory + page;
+	return NULL;
+
+      case 0x40: /* Model 4 map 0 */
+      case 0x50: /* Model 4P map 0, boot ROM out */
+      case 0x54: /* Model 4P map 0, boot ROM in */
+	if (page >= RAM_START) return memory + page + bank_offset[page >> 15];
+	return NULL;
+
+      case 0x41: /* Model 4 map 1 */
+      case 0x51: /* Model 4P map 1, boot ROM out */
+      case 0x55: /* Model 4P map 1, boot ROM in */
+	if (page >= RAM_START || page < KEYBOARD_START)
+	  return memory + page + bank_offset[page >> 15];
+	return NULL;
+
+      case 0x42: /* Model 4 map 2 */
+      case 0x52: /* Model 4P map 2, boot ROM out */
+      case 0x56: /* Model 4P map 2, boot ROM in */
+	if (page < 0xf400) return memory + page + bank_offset[page >> 15];
+	return NULL;
+
+      case 0x43: /* Model 4 map 3 */
+      case 0x53: /* Model 4P map 3, boot ROM out */
+      case 0x57: /* Model 4P map 3, boot ROM in */
+	return memory + page + bank_offset[page >> 15];
+    }
+    return NULL;
+}
+
+static void mem_map_pages(void)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+	mem_read_page[i] = read_page_addr(i << 8);
+	mem_write_page[i] = write_page_addr(i << 8);
+    }
+    if (z80_watch) {
+	for (i = 0; i < 256; i++) {
+	    if (z80_watch->page[i] & WATCH_READ) mem_read_page[i] = NULL;
+	    if (z80_watch->page[i] & WATCH_WRITE) mem_write_page[i] = NULL;
+	}
+    }
+    z80_block_flush();
+    if (z80_profile) trs_profile_map();
+}
+
+/* Called when the watchpoints change */
+void mem_watch_pages(void)
+{
+    mem_map_pages();
+}
+
+/*
+ * Where in the RAM array the byte that address reads is, or -1 if
+ * address is not mapped to plain RAM.
+ */
+int mem_ram_offset(int address)
+{
+    Uchar *p = mem_read_page[(address >> 8) & 0xff];
+
+    if (p < memory || p >= memory + sizeof(memory)) return -1;
+    return p - memory + (address & 0xff);
+}
+
+/* Report a byte of a block move to any watchpoints on it */
+static void watch_move(Ushort dest, Ushort source, int value)
+{
+    if (z80_watch->mem[source] & WATCH_READ) {
+	trs_watch_hit(source, value, WATCH_READ);
+    }
+    if (z80_watch->mem[dest] & WATCH_WRITE) {
+	trs_watch_hit(dest, value, WATCH_WRITE);
+    }
+}
+
 /*
  * Block move instructions, for LDIR and LDDR instructions.
  *
@@ -884,7 +1282,10 @@ mem_block_transfer(Ushort dest, Ushort source, int direction, Ushort count)
 	{
 	    do
 	    {
-		mem_write(dest++, ret = mem_read(source++));
+		ret = mem_read(source);
+		if (z80_watch) watch_move(dest, source, ret);
+		mem_write(dest++, ret);
+		source++;
 		count--;
 	    }
 	    while(count);
@@ -893,7 +1294,10 @@ mem_block_transfer(Ushort dest, Ushort source, int direction, Ushort count)
 	{
 	    do
 	    {
-		mem_write(dest--, ret = mem_read(source--));
+		ret = mem_read(source);
+		if (z80_watch) watch_move(dest, source, ret);
+		mem_write(dest--, ret);
+		source--;
 		count--;
 	    }
 	    while(count);
@@ -0,0 +1,1070 @@
+/* $Id$ */
+
+/* This software may be copied, modified, and used for any purpose
+ * without fee, provided that (1) the above copyright notice is
+ * retained, and (2) modified versions are clearly marked as having
+ * been modified, with the modifier's name and the date included.  */
+
+/*
+ * Headless display/input backend.  Keeps the video state in memory
+ * the same way trs_xinterface.c does, but draws nothing.  Keyboard
+ * input comes from a script file (-keys), and the text screen is
+ * written out (-dump) at exit and whenever SIGUSR1 arrives.  Useful
+ * for running TRS-80 programs in batch with no X server.
+ */
+
+#define _DEFAULT_SOURCE /* string.h: strcasecmp() */
+#define _XOPEN_SOURCE 500 /* string.h: strdup() */
+
+#include <stdio.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "trs_iodefs.h"
+#include "trs.h"
+#include "z80.h"
+#include "trs_disk.h"
+#include "trs_uart.h"
+
+/* Private data */
+static volatile sig_atomic_t dump_requested = 0;
+static volatile sig_atomic_t quit_requested = 0;
+
+/* Support for Micro Labs Grafyx Solution and Radio Shack hi-res card */
+
+/* True size of graphics memory -- some is offscreen */
+#define G_XSIZE 128
+#define G_YSIZE 256
+
+/* Port 0x83 (grafyx_mode) bits */
+#define G_ENABLE    1
+#define G_UL_NOTEXT 2   /* Micro Labs only */
+#define G_RS_WAIT   2   /* Radio Shack only */
+#define G_XDEC      4
+#define G_YDEC      8
+#define G_XNOCLKR   16
+#define G_YNOCLKR   32
+#define G_XNOCLKW   64
+#define G_YNOCLKW   128
+
+/* Port 0xFF (grafyx_m3_mode) bits */
+#define G3_COORD    0x80
+#define G3_ENABLE   0x40
+#define G3_COMMAND  0x20
+#define G3_YLOW(v)  (((v)&0x1e)>>1)
+
+#define HRG_MEMSIZE (1024 * 12)	/* 12k * 8 bit graphics memory */
+
+/* Per-machine state: the screen memory of each machine */
+struct trs_screen_machine {
+  unsigned char trs_screen[2048];
+  int screen_chars;
+  int row_chars;
+  int col_chars;
+  int currentmode;
+  int text80x24, screen640x240;
+
+  unsigned char grafyx_unscaled[G_YSIZE][G_XSIZE];
+  unsigned char grafyx_microlabs;
+  unsigned char grafyx_x, grafyx_y, grafyx_mode;
+  unsigned char grafyx_enable;
+  unsigned char grafyx_overlay;
+  unsigned char grafyx_xoffset, grafyx_yoffset;
+
+  unsigned char hrg_screen[HRG_MEMSIZE];
+  int hrg_enable;
+  int hrg_addr;
+
+  unsigned char le18_x, le18_y, le18_on;
+
+  int mouse_x_size, mouse_y_size;
+  int mouse_sens;
+  int mouse_last_x, mouse_last_y;
+  unsigned int mouse_last_buttons;
+  int mouse_old_style;
+
+  char *key_script;  /* remaining keyboard input */
+  char *key_buf;
+  FILE *dump_file;
+};
+
+#define trs_screen         (trs_cur->screen->trs_screen)
+#define screen_chars       (trs_cur->screen->screen_chars)
+#define row_chars          (trs_cur->screen->row_chars)
+#define col_chars          (trs_cur->screen->col_chars)
+#define currentmode        (trs_cur->screen->currentmode)
+#define text80x24          (trs_cur->screen->text80x24)
+#define screen640x240      (trs_cur->screen->screen640x240)
+#define grafyx_unscaled    (trs_cur->screen->grafyx_unscaled)
+#define grafyx_microlabs   (trs_cur->screen->grafyx_microlabs)
+#define grafyx_x           (trs_cur->screen->grafyx_x)
+#define grafyx_y           (trs_cur->screen->grafyx_y)
+#define grafyx_mode        (trs_cur->screen->grafyx_mode)
+#define grafyx_enable      (trs_cur->screen->grafyx_enable)
+#define grafyx_overlay     (trs_cur->screen->grafyx_overlay)
+#define grafyx_xoffset     (trs_cur->screen->grafyx_xoffset)
+#define grafyx_yoffset     (trs_cur->screen->grafyx_yoffset)
+#define hrg_screen         (trs_cur->screen->hrg_screen)
+#define hrg_enable         (trs_cur->screen->hrg_enable)
+#define hrg_addr           (trs_cur->screen->hrg_addr)
+#define le18_x             (trs_cur->screen->le18_x)
+#define le18_y             (trs_cur->screen->le18_y)
+#define le18_on            (trs_cur->screen->le18_on)
+#define mouse_x_size       (trs_cur->screen->mouse_x_size)
+#define mouse_y_size       (trs_cur->screen->mouse_y_size)
+#define mouse_sens         (trs_cur->screen->mouse_sens)
+#define mouse_last_x       (trs_cur->screen->mouse_last_x)
+#define mouse_last_y       (trs_cur->screen->mouse_last_y)
+#define mouse_last_buttons (trs_cur->screen->mouse_last_buttons)
+#define mouse_old_style    (trs_cur->screen->mouse_old_style)
+#define key_script         (trs_cur->screen->key_script)
+#define key_buf            (trs_cur->screen->key_buf)
+#define dump_file          (trs_cur->screen->dump_file)
+
+void trs_screen_machine_init(struct trs_machine *m)
+{
+  m->screen = (struct trs_screen_machine *)
+    calloc(1, sizeof(struct trs_screen_machine));
+  if (m->screen == NULL) fatal("out of memory");
+  screen_chars = 1024;
+  row_chars = 64;
+  col_chars = 16;
+  currentmode = NORMAL;
+  mouse_x_size = 640;
+  mouse_y_size = 240;
+  mouse_sens = 3;
+  mouse_last_x = mouse_last_y = -1;
+  mouse_last_buttons = 7;
+  memset(trs_screen, ' ', sizeof(trs_screen));
+}
+
+
+/*
+ * Command line parsing.  Takes the same options as xtrs, minus the
+ * ones that only make sense with a display, which are accepted and
+ * ignored so that the same command line works for both.
+ */
+
+int opt_debug = FALSE;
+int opt_shiftbracket = -1;
+int opt_ignored;
+char *opt_romfile = NULL;
+char *opt_romfile3 = NULL;
+char *opt_romfile4p = NULL;
+int opt_stepdefault = 1;
+char *opt_stepmap = NULL;
+char *opt_sizemap = NULL;
+char *opt_keys = NULL;
+char *opt_dump = NULL;
+char *opt_savesnapshot = NULL;
+char *opt_forkserver = NULL;
+tstate_t opt_forktstates = 0;
+
+struct option options[] = {
+  /* Name, takes argument?, store int value at, value to store */
+  {"keys",           TRUE,  NULL,                       0     },
+  {"dump",           TRUE,  NULL,                       0     },
+  {"savesnapshot",   TRUE,  NULL,                       0     },
+  {"forkserver",     TRUE,  NULL,                       0     },
+  {"forktstates",    TRUE,  NULL,                       0     },
+  {"debug",	     FALSE, &opt_debug,                 TRUE  },
+  {"nodebug",        FALSE, &opt_debug,                 FALSE },
+  {"romfile",	     TRUE,  NULL,                       0     },
+  {"romfile3",	     TRUE,  NULL,                       0     },
+  {"romfile4p",      TRUE,  NULL,                       0     },
+  {"model",          TRUE,  NULL,                       0     },
+  {"model1",         FALSE, &trs_machine0.model,        1     },
+  {"model3",         FALSE, &trs_machine0.model,        3     },
+  {"model4",         FALSE, &trs_machine0.model,        4     },
+  {"model4p",        FALSE, &trs_machine0.model,        5     },
+  {"delay",          TRUE,  NULL,                       0     },
+  {"autodelay",      FALSE, &trs_machine0.autodelay,    TRUE  },
+  {"noautodelay",    FALSE, &trs_machine0.autodelay,    FALSE },
+  {"pace",           FALSE, &trs_machine0.pace,         TRUE  },
+  {"nopace",         FALSE, &trs_machine0.pace,         FALSE },
+  {"turbo",          FALSE, &trs_machine0.turbo,        TRUE  },
+  {"noturbo",        FALSE, &trs_machine0.turbo,        FALSE },
+  {"autoturbo",      FALSE, &trs_machine0.autoturbo,    TRUE  },
+  {"noautoturbo",    FALSE, &trs_machine0.autoturbo,    FALSE },
+  {"keystretch",     TRUE,  NULL,                       0     },
+  {"shiftbracket",   FALSE, &opt_shiftbracket,          TRUE  },
+  {"noshiftbracket", FALSE, &opt_shiftbracket,          FALSE },
+  {"diskdir",        TRUE,  NULL,                       0     },
+  {"doubler",        TRUE,  NULL,                       0     },
+  {"doublestep",     FALSE, &opt_stepdefault,           2     },
+  {"nodoublestep",   FALSE, &opt_stepdefault,           1     },
+  {"stepmap",        TRUE,  NULL,                       0     },
+  {"sizemap",        TRUE,  NULL,                       0     },
+  {"truedam",        FALSE, &trs_machine0.disk_truedam, TRUE  },
+  {"notruedam",      FALSE, &trs_machine0.disk_truedam, FALSE },
+  {"samplerate",     TRUE,  NULL,                       0     },
+  {"snapshot",       TRUE,  NULL,                       0     },
+  {"deterministic",  FALSE, &trs_deterministic,         TRUE  },
+  {"nodeterministic",FALSE, &trs_deterministic,         FALSE },
+  {"record",         TRUE,  NULL,                       0     },
+  {"replay",         TRUE,  NULL,                       0     },
+  {"serial",         TRUE,  NULL,                       0     },
+  {"switches",       TRUE,  NULL,                       0     },
+  {"emtsafe",        FALSE, &trs_machine0.emtsafe,      TRUE  },
+  {"noemtsafe",      FALSE, &trs_machine0.emtsafe,      FALSE },
+  {"blockcache",     FALSE, &z80_block_cache,           TRUE  },
+  {"noblockcache",   FALSE, &z80_block_cache,           FALSE },
+  {"bulkmove",       FALSE, &z80_bulk_move,             TRUE  },
+  {"nobulkmove",     FALSE, &z80_bulk_move,             FALSE },
+  {"microlabs",      FALSE, NULL,                       0     },
+  {"nomicrolabs",    FALSE, NULL,                       0     },
+  {"huffman",        FALSE, &trs_machine0.huffman,      TRUE  },
+  {"hypermem",       FALSE, &trs_machine0.hyper,        TRUE  },
+  {"supermem",       FALSE, &trs_machine0.super,        TRUE  },
+  {"selector",       FALSE, &trs_machine0.selector_on,  TRUE  },
+  {"le18",           FALSE, &trs_machine0.le18,         TRUE  },
+  {"lower",          FALSE, &trs_machine0.lower,        TRUE  },
+  /* Display options; ignored */
+  {"iconic",         FALSE, &opt_ignored,               TRUE  },
+  {"noiconic",       FALSE, &opt_ignored,               FALSE },
+  {"background",     TRUE,  NULL,                       0     },
+  {"bg",	     TRUE,  NULL,                       0     },
+  {"foreground",     TRUE,  NULL,                       0     },
+  {"fg",             TRUE,  NULL,                       0     },
+  {"title",          TRUE,  NULL,                       0     },
+  {"borderwidth",    TRUE,  NULL,                       0     },
+  {"display",        TRUE,  NULL,                       0     },
+  {"usefont",        FALSE, &opt_ignored,               TRUE  },
+  {"nofont",         FALSE, &opt_ignored,               FALSE },
+  {"font",           TRUE,  NULL,                       0     },
+  {"widefont",       TRUE,  NULL,                       0     },
+  {"charset",        TRUE,  NULL,                       0     },
+  {"scale",          TRUE,  NULL,                       0     },
+  {"scale1",         FALSE, &opt_ignored,               1     },
+  {"scale2",         FALSE, &opt_ignored,               2     },
+  {"scale3",         FALSE, &opt_ignored,               3     },
+  {"scale4",         FALSE, &opt_ignored,               4     },
+  {"resize",	     FALSE, &opt_ignored,               TRUE  },
+  {"noresize",	     FALSE, &opt_ignored,               FALSE },
+  {"framebuffer",    FALSE, &opt_ignored,               TRUE  },
+  {"noframebuffer",  FALSE, &opt_ignored,               FALSE },
+  {"renderthread",   FALSE, &opt_ignored,               TRUE  },
+  {"norenderthread", FALSE, &opt_ignored,               FALSE },
+  {"shm",            FALSE, &opt_ignored,               TRUE  },
+  {"noshm",          FALSE, &opt_ignored,               FALSE },
+  {NULL, 0, 0, 0}
+};
+
+
+int
+trs_parse_command_line(int argc, char **argv, int *debug)
+{
+  int i;
+  int s[8];
+
+  opterr = 0;
+  for (;;) {
+    int c;
+    int option_index = 0;
+    const char *name;
+
+    c = getopt_long_only(argc, argv, "", options, &option_index);
+    if (c == -1) break;
+    if (c == '?') {
+      fatal("unrecognized option %s", argv[optind - 1]);
+    }
+    name = options[option_index].name;
+    if (strcmp(name, "keys") == 0) {
+      opt_keys = optarg;
+    } else if (strcmp(name, "dump") == 0) {
+      opt_dump = optarg;
+    } else if (strcmp(name, "savesnapshot") == 0) {
+      opt_savesnapshot = optarg;
+    } else if (strcmp(name, "forkserver") == 0) {
+      opt_forkserver = optarg;
+    } else if (strcmp(name, "forktstates") == 0) {
+      opt_forktstates = strtoul(optarg, NULL, 0);
+    } else if (strcmp(name, "romfile") == 0) {
+      opt_romfile = optarg;
+    } else if (strcmp(name, "romfile3") == 0) {
+      opt_romfile3 = optarg;
+    } else if (strcmp(name, "romfile4p") == 0) {
+      opt_romfile4p = optarg;
+    } else if (strcmp(name, "model") == 0) {
+      if (strcmp(optarg, "1") == 0 ||
+	  strcasecmp(optarg, "I") == 0) {
+	trs_model = 1;
+      } else if (strcmp(optarg, "3") == 0 ||
+		 strcasecmp(optarg, "III") == 0) {
+	trs_model = 3;
+      } else if (strcmp(optarg, "4") == 0 ||
+		 strcasecmp(optarg, "IV") == 0) {
+	trs_model = 4;
+      } else if (strcasecmp(optarg, "4P") == 0 ||
+		 strcasecmp(optarg, "IVp") == 0) {
+	trs_model = 5;
+      } else {
+	fatal("TRS-80 Model %s not supported", optarg);
+      }
+    } else if (strcmp(name, "delay") == 0) {
+      z80_state.delay = strtol(optarg, NULL, 0);
+    } else if (strcmp(name, "keystretch") == 0) {
+      stretch_amount = strtol(optarg, NULL, 0);
+    } else if (strcmp(name, "diskdir") == 0) {
+      trs_disk_dir = strdup(optarg);
+      if (trs_disk_dir[0] == '~' &&
+	  (trs_disk_dir[1] == '/' || trs_disk_dir[1] == '\0')) {
+	char* home = getenv("HOME");
+	if (home) {
+	  char *p = (char*)malloc(strlen(home) + strlen(trs_disk_dir) + 1);
+	  sprintf(p, "%s/%s", home, trs_disk_dir+1);
+	  trs_disk_dir = p;
+	}
+      }
+    } else if (strcmp(name, "doubler") == 0) {
+      switch (optarg[0]) {
+      case 'p':
+      case 'P':
+	trs_disk_doubler = TRSDISK_PERCOM;
+	break;
+      case 'r':
+      case 'R':
+      case 't':
+      case 'T':
+	trs_disk_doubler = TRSDISK_TANDY;
+	break;
+      case 'b':
+      case 'B':
+	trs_disk_doubler = TRSDISK_BOTH;
+	break;
+      case 'n':
+      case 'N':
+	trs_disk_doubler = TRSDISK_NODOUBLER;
+	break;
+      default:
+	fatal("unrecognized doubler type %s\n", optarg);
+      }
+    } else if (strcmp(name, "stepmap") == 0) {
+      opt_stepmap = optarg;
+    } else if (strcmp(name, "sizemap") == 0) {
+      opt_sizemap = optarg;
+    } else if (strcmp(name, "samplerate") == 0) {
+      cassette_default_sample_rate = strtol(optarg, NULL, 0);
+    } else if (strcmp(name, "snapshot") == 0) {
+      trs_snapshot_file = optarg;
+    } else if (strcmp(name, "record") == 0) {
+      trs_journal_record_file = optarg;
+    } else if (strcmp(name, "replay") == 0) {
+      trs_journal_replay_file = optarg;
+    } else if (strcmp(name, "serial") == 0) {
+      trs_uart_name = strdup(optarg);
+    } else if (strcmp(name, "switches") == 0) {
+      trs_uart_switches = strtol(optarg, NULL, 0);
+    } else if (strcmp(name, "microlabs") == 0) {
+      grafyx_set_microlabs(TRUE);
+    } else if (strcmp(name, "nomicrolabs") == 0) {
+      grafyx_set_microlabs(FALSE);
+    }
+  }
+  if (optind != argc) {
+    fatal("unrecognized argument %s", argv[optind]);
+  }
+
+  /*
+   * Some additional processing needed after all options are parsed.
+   * In some cases the order is important; e.g., trs_model must be known.
+   */
+  *debug = opt_debug;
+
+  if (hypermem) huffman_ram = 0;
+  if (supermem) selector = 0;
+
+  if (opt_shiftbracket == -1) {
+    opt_shiftbracket = trs_model >= 4;
+  }
+  trs_kb_bracket(opt_shiftbracket);
+
+  for (i = 0; i <= 7; i++) {
+    s[i] = opt_stepdefault;
+  }
+  if (opt_stepmap) {
+    sscanf(opt_stepmap, "%d,%d,%d,%d,%d,%d,%d,%d",
+           &s[0], &s[1], &s[2], &s[3], &s[4], &s[5], &s[6], &s[7]);
+  }
+  for (i = 0; i <= 7; i++) {
+    if (s[i] != 1 && s[i] != 2) {
+      fatal("bad value %d for disk %d single/double step\n", s[i], i);
+    } else {
+      trs_disk_setstep(i, s[i]);
+    }
+  }
+
+  /* Defaults for sizemap */
+  s[0] = 5;
+  s[1] = 5;
+  s[2] = 5;
+  s[3] = 5;
+  s[4] = 8;
+  s[5] = 8;
+  s[6] = 8;
+  s[7] = 8;
+  if (opt_sizemap) {
+    sscanf(opt_sizemap, "%d,%d,%d,%d,%d,%d,%d,%d",
+	   &s[0], &s[1], &s[2], &s[3], &s[4], &s[5], &s[6], &s[7]);
+  }
+  for (i = 0; i <= 7; i++) {
+    if (s[i] != 5 && s[i] != 8) {
+      fatal("bad value %d for disk %d size", s[i], i);
+    } else {
+      trs_disk_setsize(i, s[i]);
+    }
+  }
+
+  return 1;
+}
+
+
+static void
+trs_load_romfile()
+{
+  char *romfile = NULL;
+  struct stat statbuf;
+
+  switch (trs_model) {
+  case 1:
+    if (opt_romfile) {
+      romfile = opt_romfile;
+#ifdef DEFAULT_ROM
+    } else if (stat(DEFAULT_ROM, &statbuf) == 0) {
+      romfile = DEFAULT_ROM;
+#endif
+    }
+    if (romfile != NULL) {
+      trs_load_rom(romfile);
+    } else if (trs_rom1_size > 0) {
+      trs_load_compiled_rom(trs_rom1_size, trs_rom1);
+    } else {
+      fatal("ROM file not specified!");
+    }
+    break;
+
+  case 3: case 4:
+    if (opt_romfile3) {
+      romfile = opt_romfile3;
+#ifdef DEFAULT_ROM3
+    } else if (stat(DEFAULT_ROM3, &statbuf) == 0) {
+      romfile = DEFAULT_ROM3;
+#endif
+    }
+    if (romfile != NULL) {
+      trs_load_rom(romfile);
+    } else if (trs_rom3_size > 0) {
+      trs_load_compiled_rom(trs_rom3_size, trs_rom3);
+    } else {
+      fatal("ROM file not specified!");
+    }
+    break;
+
+  default: /* 4P */
+    if (opt_romfile4p) {
+      romfile = opt_romfile4p;
+#ifdef DEFAULT_ROM4P
+    } else if (stat(DEFAULT_ROM4P, &statbuf) == 0) {
+      romfile = DEFAULT_ROM4P;
+#endif
+    }
+    if (romfile != NULL) {
+      trs_load_rom(romfile);
+    } else if (trs_rom4p_size > 0) {
+      trs_load_compiled_rom(trs_rom4p_size, trs_rom4p);
+    } else {
+      fatal("ROM file not specified!");
+    }
+    break;
+  }
+}
+
+
+/*
+ * Read the whole keyboard script into memory.
+ */
+static char *
+read_key_file(FILE *f)
+{
+  char *buf = NULL;
+  size_t len = 0, size = 0;
+  int c;
+
+  do {
+    c = getc(f);
+    if (len + 1 >= size) {
+      size = size ? size * 2 : 1024;
+      buf = (char *) realloc(buf, size);
+      if (buf == NULL) fatal("out of memory");
+    }
+    buf[len++] = (c == EOF) ? '\0' : c;
+  } while (c != EOF);
+  return buf;
+}
+
+/* The same, from a named file; "-" means stdin */
+static char *
+read_key_script(const char *name)
+{
+  FILE *f;
+  char *buf;
+
+  f = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+  if (f == NULL) {
+    fatal("could not read key script %s", name);
+  }
+  buf = read_key_file(f);
+  if (f != stdin) fclose(f);
+  return buf;
+}
+
+/*
+ * Become a fork server, and in each child, run the job sent on the
+ * connection: read the rest of the key script from it, up to the end
+ * of what the client sends, and write the screen dumps back to it.
+ * A job has no terminal, so if it enters the debugger, the debugger
+ * reads end of file and quits.
+ */
+static void
+fork_job(void)
+{
+  int conn = trs_fork_server(opt_forkserver, opt_forktstates);
+  int null = open("/dev/null", O_RDONLY);
+  FILE *in = fdopen(dup(conn), "r");
+
+  if (null >= 0) {
+    dup2(null, 0);
+    close(null);
+  }
+  if (in == NULL || (dump_file = fdopen(conn, "w")) == NULL) {
+    fatal("could not open job connection: %s", strerror(errno));
+  }
+  free(key_buf);
+  key_script = key_buf = read_key_file(in);
+  fclose(in);
+  opt_forkserver = NULL;  /* no nested servers */
+}
+
+/*
+ * Type the next key from the script, if the Z80 program has taken
+ * the previous one.  A newline is ENTER; "\e" is BREAK, "\c" is
+ * CLEAR, and "\\" is a backslash.  "\d" dumps the screen, "\s" saves
+ * a snapshot to the -savesnapshot file, "\f" becomes a fork server on
+ * the -forkserver socket, and "\q" exits.  The script waits while a
+ * -replay journal is being replayed.  Returns 1 if it did anything.
+ */
+static int
+type_next_key()
+{
+  int keysym;
+
+  if (key_script == NULL || *key_script == '\0' || !trs_kb_idle() ||
+      trs_journal_replaying()) return 0;
+  keysym = (unsigned char) *key_script++;
+  if (keysym == '\n') {
+    keysym = 0xff0d;  /* XK_Return */
+  } else if (keysym == '\\' && *key_script != '\0') {
+    switch (*key_script++) {
+    case 'e':
+      keysym = 0xff1b;  /* XK_Escape */
+      break;
+    case 'c':
+      keysym = 0xff0b;  /* XK_Clear */
+      break;
+    case 'd':
+      trs_screen_dump();
+      return 1;
+    case 's':
+      if (opt_savesnapshot == NULL) {
+	error("no -savesnapshot file for \\s in key script");
+      } else {
+	trs_snapshot_save(opt_savesnapshot);
+      }
+      return 1;
+    case 'f':
+      if (opt_forkserver == NULL) {
+	error("no -forkserver socket for \\f in key script");
+      } else {
+	fork_job();
+      }
+      return 1;
+    case 'q':
+      trs_exit();
+      return 1;
+    default:
+      keysym = (unsigned char) key_script[-1];
+      break;
+    }
+  }
+  trs_xlate_keysym(keysym);
+  trs_xlate_keysym(0x10000 | keysym);
+  return 1;
+}
+
+/*
+ * Write the text screen to the -dump file as plain ASCII, one line
+ * per row with trailing blanks removed, followed by a line "--".
+ */
+void
+trs_screen_dump()
+{
+  char line[81];
+  int row, col, len, c;
+  int step = (currentmode & EXPANDED) ? 2 : 1;
+
+  if (dump_file == NULL) return;
+  for (row = 0; row < col_chars; row++) {
+    len = 0;
+    for (col = 0; col < row_chars; col += step) {
+      c = trs_screen[row * row_chars + col];
+      if (trs_model == 1 && c < 0x20) {
+	c += 0x40;  /* no lowercase: shows as uppercase */
+      } else if (c >= 0x80 && c <= 0xbf &&
+		 (trs_model == 1 || !(currentmode & INVERSE))) {
+	c = (c == 0x80) ? ' ' : '#';  /* box graphics */
+      } else if (trs_model > 1 && (currentmode & INVERSE)) {
+	c &= 0x7f;
+      }
+      line[len++] = isprint(c) ? c : '.';
+    }
+    while (len > 0 && line[len - 1] == ' ') len--;
+    fprintf(dump_file, "%.*s\n", len, line);
+  }
+  fprintf(dump_file, "--\n");
+  fflush(dump_file);
+}
+
+static void
+dump_signal(int signo)
+{
+  dump_requested = 1;
+}
+
+static void
+quit_signal(int signo)
+{
+  quit_requested = 1;
+}
+
+/*
+ * Exit the emulator.  With trs_exit_stops (xtrs-batch), only stop
+ * running this machine; the caller sees trs_exited when z80_run
+ * returns.
+ */
+void trs_exit()
+{
+  if (trs_exit_stops) {
+    trs_exited = 1;
+    trs_continuous = 0;
+    z80_wakeup = 1;
+    return;
+  }
+  exit(0);
+}
+
+/* Type the given script file on this machine's keyboard, or stop
+   typing if name is NULL */
+void
+trs_screen_keys(const char *name)
+{
+  free(key_buf);
+  key_script = key_buf = name ? read_key_script(name) : NULL;
+}
+
+/* Send this machine's screen dumps to f, or nowhere if NULL */
+void
+trs_screen_dump_to(FILE *f)
+{
+  dump_file = f;
+}
+
+
+void
+trs_screen_init(void)
+{
+  struct sigaction sa;
+
+  if (opt_keys) {
+    trs_screen_keys(opt_keys);
+  }
+  if (opt_dump == NULL || strcmp(opt_dump, "-") == 0) {
+    dump_file = stdout;
+  } else if ((dump_file = fopen(opt_dump, "w")) == NULL) {
+    fatal("could not write screen dump file %s", opt_dump);
+  }
+  atexit(trs_screen_dump);
+
+  sa.sa_handler = dump_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+  sa.sa_handler = quit_signal;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGHUP, &sa, NULL);
+
+  trs_load_romfile();
+}
+
+
+/*
+ * Get and process events.  There is no display, so this just types
+ * the next scripted key, services the UART, and acts on signals.  If
+ * wait is true and there is no key to type, sleep until the next
+ * timer tick.
+ */
+void trs_get_event(int wait)
+{
+  if (trs_model > 1) {
+    (void)trs_uart_check_avail();
+  }
+
+  if (!type_next_key() && wait) {
+    pause();
+    trs_paused = 1;
+  }
+
+  if (dump_requested) {
+    dump_requested = 0;
+    trs_screen_dump();
+  }
+  if (quit_requested) {
+    trs_exit();
+  }
+}
+
+
+void
+trs_screen_write_char(int position, int char_index)
+{
+  trs_screen[position] = char_index;
+}
+
+void
+trs_screen_refresh()
+{
+}
+
+/*
+ * Copies lines 1 to col_chars - 1 to lines 0 to col_chars - 2.
+ * Does not clear line col_chars - 1.
+ */
+void trs_screen_scroll()
+{
+  int i = 0;
+
+  for (i = row_chars; i < screen_chars; i++)
+    trs_screen[i - row_chars] = trs_screen[i];
+}
+
+void trs_screen_expanded(int flag)
+{
+  currentmode = (currentmode & ~EXPANDED) | (flag ? EXPANDED : 0);
+}
+
+void trs_screen_inverse(int flag)
+{
+  currentmode = (currentmode & ~INVERSE) | (flag ? INVERSE : 0);
+}
+
+void trs_screen_alternate(int flag)
+{
+  currentmode = (currentmode & ~ALTERNATE) | (flag ? ALTERNATE : 0);
+}
+
+void trs_screen_640x240(int flag)
+{
+  if (flag == screen640x240) return;
+  screen640x240 = flag;
+  if (flag) {
+    row_chars = 80;
+    col_chars = 24;
+  } else {
+    row_chars = 64;
+    col_chars = 16;
+  }
+  screen_chars = row_chars * col_chars;
+}
+
+void trs_screen_80x24(int flag)
+{
+  if (!grafyx_enable || grafyx_overlay) {
+    trs_screen_640x240(flag);
+  }
+  text80x24 = flag;
+}
+
+
+/* Grafyx Solution and Radio Shack hi-res: memory only */
+
+void grafyx_write_byte(int x, int y, char byte)
+{
+  grafyx_unscaled[y][x] = byte;
+}
+
+void grafyx_write_x(int value)
+{
+  grafyx_x = value;
+}
+
+void grafyx_write_y(int value)
+{
+  grafyx_y = value;
+}
+
+void grafyx_write_data(int value)
+{
+  grafyx_write_byte(grafyx_x % G_XSIZE, grafyx_y, value);
+  if (!(grafyx_mode & G_XNOCLKW)) {
+    if (grafyx_mode & G_XDEC) {
+      grafyx_x--;
+    } else {
+      grafyx_x++;
+    }
+  }
+  if (!(grafyx_mode & G_YNOCLKW)) {
+    if (grafyx_mode & G_YDEC) {
+      grafyx_y--;
+    } else {
+      grafyx_y++;
+    }
+  }
+}
+
+int grafyx_read_data()
+{
+  int value = grafyx_unscaled[grafyx_y][grafyx_x % G_XSIZE];
+  if (!(grafyx_mode & G_XNOCLKR)) {
+    if (grafyx_mode & G_XDEC) {
+      grafyx_x--;
+    } else {
+      grafyx_x++;
+    }
+  }
+  if (!(grafyx_mode & G_YNOCLKR)) {
+    if (grafyx_mode & G_YDEC) {
+      grafyx_y--;
+    } else {
+      grafyx_y++;
+    }
+  }
+  return value;
+}
+
+void grafyx_write_mode(int value)
+{
+  grafyx_enable = value & G_ENABLE;
+  if (grafyx_microlabs) {
+    grafyx_overlay = (value & G_UL_NOTEXT) == 0;
+  }
+  grafyx_mode = value;
+  trs_screen_640x240((grafyx_enable && !grafyx_overlay) || text80x24);
+}
+
+void grafyx_write_xoffset(int value)
+{
+  grafyx_xoffset = value % G_XSIZE;
+}
+
+void grafyx_write_yoffset(int value)
+{
+  grafyx_yoffset = value;
+}
+
+void grafyx_write_overlay(int value)
+{
+  unsigned char old_overlay = grafyx_overlay;
+  grafyx_overlay = value & 1;
+  if (grafyx_enable && old_overlay != grafyx_overlay) {
+    trs_screen_640x240((grafyx_enable && !grafyx_overlay) || text80x24);
+  }
+}
+
+int grafyx_get_microlabs()
+{
+  return grafyx_microlabs;
+}
+
+void grafyx_set_microlabs(int on_off)
+{
+  grafyx_microlabs = on_off;
+}
+
+/* Model III MicroLabs support */
+void grafyx_m3_reset()
+{
+  if (grafyx_microlabs) grafyx_m3_write_mode(0);
+}
+
+void grafyx_m3_write_mode(int value)
+{
+  int enable = (value & G3_ENABLE) != 0;
+  grafyx_enable = enable;
+  grafyx_overlay = enable;
+  grafyx_mode = value;
+  grafyx_y = G3_YLOW(value);
+}
+
+int grafyx_m3_write_byte(int position, int byte)
+{
+  if (grafyx_microlabs && (grafyx_mode & G3_COORD)) {
+    int x = (position % 64);
+    int y = (position / 64) * 12 + grafyx_y;
+    grafyx_write_byte(x, y, byte);
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+unsigned char grafyx_m3_read_byte(int position)
+{
+  if (grafyx_microlabs && (grafyx_mode & G3_COORD)) {
+    int x = (position % 64);
+    int y = (position / 64) * 12 + grafyx_y;
+    return grafyx_unscaled[y][x];
+  } else {
+    return trs_screen[position];
+  }
+}
+
+int grafyx_m3_active()
+{
+  return (trs_model == 3 && grafyx_microlabs && (grafyx_mode & G3_COORD));
+}
+
+
+/* Model I HRG1B 384*192 graphics card: memory only */
+
+void
+hrg_onoff(int enable)
+{
+  hrg_enable = enable;
+}
+
+void
+hrg_write_addr(int addr, int mask)
+{
+  hrg_addr = (hrg_addr & ~mask) | (addr & mask);
+}
+
+void
+hrg_write_data(int data)
+{
+  if (hrg_addr >= HRG_MEMSIZE) return; /* nonexistent address */
+  hrg_screen[hrg_addr] = data;
+}
+
+int
+hrg_read_data()
+{
+  if (hrg_addr >= HRG_MEMSIZE) return 0xff; /* nonexistent address */
+  return hrg_screen[hrg_addr];
+}
+
+
+/* Lowe Electronics LE18: memory only (see trs_xinterface.c) */
+
+void lowe_le18_reset(void)
+{
+}
+
+void lowe_le18_write_x(int value)
+{
+  le18_x = value & 63;
+}
+
+void lowe_le18_write_y(int value)
+{
+  le18_y = value;
+}
+
+static unsigned char pack8to6(unsigned char c)
+{
+  return ((c & 0x70) >> 1) | (c & 7);
+}
+
+static unsigned char expand6to8(unsigned char c)
+{
+  unsigned char r;
+  r = (c & 0x07);
+  if (r & 0x04)
+    r |= 0x08;
+  r |= (c << 1) & 0x70;
+  if (r & 0x40)
+    r |= 0x80;
+  return r;
+}
+
+int lowe_le18_read(void)
+{
+  if (!lowe_le18)
+    return 0xFF;
+  return pack8to6(grafyx_unscaled[le18_y][le18_x]) | 0x80
+          | ((le18_on) ? 0x40 : 0x00);
+}
+
+void lowe_le18_write_data(int value)
+{
+  if (lowe_le18)
+    grafyx_write_byte(le18_x, le18_y, expand6to8(value & 0x3F));
+}
+
+void lowe_le18_write_control(int value)
+{
+  if (lowe_le18 && ((le18_on ^ value) & 1)) {
+    le18_on = value & 1;
+    grafyx_enable = le18_on;
+    grafyx_overlay = le18_on;
+  }
+}
+
+
+/* Mouse: there is none, so it never moves and no buttons are down */
+
+void trs_get_mouse_pos(int *x, int *y, unsigned int *buttons)
+{
+  *x = mouse_last_x;
+  *y = mouse_last_y;
+  *buttons = mouse_last_buttons;
+}
+
+void trs_set_mouse_pos(int x, int y)
+{
+  mouse_last_x = x;
+  mouse_last_y = y;
+}
+
+void trs_get_mouse_max(int *x, int *y, unsigned int *sens)
+{
+  *x = mouse_x_size - (mouse_old_style ? 0 : 1);
+  *y = mouse_y_size - (mouse_old_style ? 0 : 1);
+  *sens = mouse_sens;
+}
+
+void trs_set_mouse_max(int x, int y, unsigned int sens)
+{
+  if ((x & 1) == 0 && (y & 1) == 0) {
+    /* "Old style" mouse drivers took the size here; new style take
+       the maximum. As a heuristic kludge, we assume old style if
+       the values are even, new style if not. */
+    mouse_old_style = 1;
+  }
+  mouse_x_size = x + (mouse_old_style ? 0 : 1);
+  mouse_y_size = y + (mouse_old_style ? 0 : 1);
+  mouse_sens = sens;
+}
+
+int trs_get_mouse_type()
+{
+  /* Assume 3-button mouse */
+  return 1;
+}
@@ -20,13 +20,15 @@
 
 void trs_printer_write(int value)
 {
+    FILE *f = trs_printer_file ? trs_printer_file : stdout;
+
     if(value == 0x0D)
     {
-	putchar('\n');
+	putc('\n', f);
     }
     else
     {
-	putchar(value);
+	putc(value, f);
     }
 }
 
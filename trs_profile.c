@@ -0,0 +1,369 @@
+/* $Id$ */
+
+/* This software may be copied, modified, and used for any purpose
+ * without fee, provided that (1) the above copyright notice is
+ * retained, and (2) modified versions are clearly marked as having
+ * been modified, with the modifier's name and the date included.  */
+
+/*
+ * trs_profile.c -- where the guest's time goes
+ *
+ * While profiling is on, z80_run charges each instruction it executes,
+ * and the T-states it took, to the instruction's address, to the bank
+ * of memory the address is mapped to, and to the routine it belongs
+ * to.  The counting is a few additions per instruction; with profiling
+ * off it costs a test of one pointer.
+ *
+ * Routines are found by following the stack.  An instruction that
+ * leaves SP two lower and is a CALL or RST enters a new routine at the
+ * new PC, as does an interrupt.  A routine has returned once SP is
+ * above the place where its return address was pushed, which catches
+ * RET, RETI, RETN, and the usual tricks of popping the return address
+ * or resetting SP, but not switching to a different stack lower in
+ * memory.  The calls in progress form a path in a call tree, whose
+ * nodes hold the T-states spent in each routine as called from each
+ * chain of callers; that is what the folded ("flame graph") output
+ * and the per-routine totals are made from.
+ *
+ * The counts are in struct trs_profile (trs_profile.h); the debugger
+ * drives everything else through the profile command.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "z80.h"
+#include "trs.h"
+#include "trs_profile.h"
+
+static void
+profile_clear(struct trs_profile *p)
+{
+  struct profile_node *node = p->node;
+  int on = p->on;
+
+  memset(p, 0, sizeof(*p));
+  memset(node, 0, PROFILE_NODES * sizeof(*node));
+  p->on = on;
+  p->node = node;
+  p->nnodes = 1;
+  p->sp = REG_SP;
+  trs_profile_map();
+}
+
+/* Start counting, from zero if there was no profile yet */
+void
+trs_profile_on(void)
+{
+  struct trs_profile *p = z80_profile;
+
+  if (p == NULL) {
+    p = (struct trs_profile *) malloc(sizeof(*p));
+    if (p == NULL) fatal("out of memory");
+    p->node = (struct profile_node *)
+      malloc(PROFILE_NODES * sizeof(struct profile_node));
+    if (p->node == NULL) fatal("out of memory");
+    z80_profile = p;
+    profile_clear(p);
+  }
+  if (!p->on) {
+    /* Whatever the stack did while we were not looking, start over
+       at the current level */
+    p->sp = REG_SP;
+    trs_profile_map();
+  }
+  p->on = 1;
+}
+
+/* Stop counting but keep the counts */
+void
+trs_profile_off(void)
+{
+  if (z80_profile) z80_profile->on = 0;
+}
+
+void
+trs_profile_reset(void)
+{
+  if (z80_profile) profile_clear(z80_profile);
+}
+
+void
+trs_profile_free(void)
+{
+  if (z80_profile) {
+    free(z80_profile->node);
+    free(z80_profile);
+    z80_profile = NULL;
+  }
+}
+
+/* Called when the memory map changes */
+void
+trs_profile_map(void)
+{
+  struct trs_profile *p = z80_profile;
+  int i, off;
+
+  for (i = 0; i < 256; i++) {
+    off = mem_ram_offset(i << 8);
+    p->page_bank[i] = off < 0 ? 0 : 1 + (off >> 15);
+  }
+}
+
+static void
+profile_call(struct trs_profile *p, int entry)
+{
+  int n;
+
+  if (p->depth == PROFILE_DEPTH) return;
+  for (n = p->node[p->cur].child; n != 0; n = p->node[n].sibling) {
+    if (p->node[n].entry == entry) break;
+  }
+  if (n == 0) {
+    if (p->nnodes == PROFILE_NODES) {
+      /* Charge the routine to its caller */
+      p->lost++;
+      n = p->cur;
+    } else {
+      n = p->nnodes++;
+      p->node[n].entry = entry;
+      p->node[n].parent = p->cur;
+      p->node[n].sibling = p->node[p->cur].child;
+      p->node[p->cur].child = n;
+      p->node[n].calls++;
+    }
+  } else {
+    p->node[n].calls++;
+  }
+  p->stack[p->depth].node = n;
+  p->stack[p->depth].sp = REG_SP;
+  p->depth++;
+  p->cur = n;
+}
+
+/* Called by z80_run after the instruction at pc changed SP */
+void
+trs_profile_stack(int pc)
+{
+  struct trs_profile *p = z80_profile;
+  int op;
+
+  if (REG_SP == ((p->sp - 2) & 0xffff)) {
+    op = mem_read(pc);
+    if (op == 0xCD || (op & 0xC7) == 0xC4 || (op & 0xC7) == 0xC7) {
+      profile_call(p, REG_PC);
+    }
+  } else {
+    while (p->depth > 0 && p->stack[p->depth - 1].sp < REG_SP) {
+      p->depth--;
+      p->cur = p->depth > 0 ? p->stack[p->depth - 1].node : 0;
+    }
+  }
+  p->sp = REG_SP;
+}
+
+/* Called by z80_run after taking an interrupt that began at t0.  The
+   T-states are charged to the first instruction of the handler. */
+void
+trs_profile_interrupt(tstate_t t0)
+{
+  struct trs_profile *p = z80_profile;
+  tstate_t t = z80_state.t_count - t0;
+
+  profile_call(p, REG_PC);
+  p->tstates[REG_PC] += t;
+  p->bank_tstates[p->page_bank[REG_PC >> 8]] += t;
+  p->node[p->cur].tstates += t;
+  p->sp = REG_SP;
+}
+
+/* qsort can't pass an argument to the comparison function */
+static const tstate_t *sort_key;
+
+static int
+by_key(const void *a, const void *b)
+{
+  tstate_t x = sort_key[*(const int *) a], y = sort_key[*(const int *) b];
+
+  if (x != y) return x < y ? 1 : -1;
+  return *(const int *) a - *(const int *) b;
+}
+
+/* Returns an array of the n indices with the largest keys,
+   largest first */
+static int *
+sorted(const tstate_t *key, int n)
+{
+  int *order = (int *) malloc(n * sizeof(int));
+  int i;
+
+  if (order == NULL) fatal("out of memory");
+  for (i = 0; i < n; i++) order[i] = i;
+  sort_key = key;
+  qsort(order, n, sizeof(int), by_key);
+  return order;
+}
+
+static double
+percent(tstate_t part, tstate_t whole)
+{
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+static int
+have_profile(void)
+{
+  if (z80_profile == NULL) {
+    printf("No profile has been taken.  (Use \"profile on\".)\n");
+    return 0;
+  }
+  return 1;
+}
+
+/* Print the n addresses that took the most T-states */
+void
+trs_profile_print(int n)
+{
+  struct trs_profile *p = z80_profile;
+  tstate_t count = 0, total = 0;
+  int *order;
+  int i;
+
+  if (!have_profile()) return;
+  for (i = 0; i < Z80_ADDRESS_LIMIT; i++) {
+    count += p->count[i];
+    total += p->tstates[i];
+  }
+  printf("Profiling is %s; %" TSTATE_T_LEN " instructions, %"
+	 TSTATE_T_LEN " T-states.\n", p->on ? "on" : "off", count, total);
+  order = sorted(p->tstates, Z80_ADDRESS_LIMIT);
+  printf("    T-states      %%        count  instruction\n");
+  for (i = 0; i < n && p->tstates[order[i]] != 0; i++) {
+    printf("%12" TSTATE_T_LEN " %5.1f%% %12" TSTATE_T_LEN "  ",
+	   p->tstates[order[i]], percent(p->tstates[order[i]], total),
+	   p->count[order[i]]);
+    disassemble(order[i]);
+  }
+  free(order);
+}
+
+/* Print the n routines that took the most T-states, counting the
+   routines they called */
+void
+trs_profile_routines(int n)
+{
+  struct trs_profile *p = z80_profile;
+  tstate_t *sum, *self, *incl, *calls;
+  tstate_t total = 0;
+  int *order;
+  int i, a;
+
+  if (!have_profile()) return;
+  sum = (tstate_t *) calloc(p->nnodes, sizeof(tstate_t));
+  self = (tstate_t *) calloc(3 * Z80_ADDRESS_LIMIT, sizeof(tstate_t));
+  if (sum == NULL || self == NULL) fatal("out of memory");
+  incl = self + Z80_ADDRESS_LIMIT;
+  calls = incl + Z80_ADDRESS_LIMIT;
+
+  /* Children come after their parents, so one pass backward totals
+     each subtree */
+  for (i = p->nnodes - 1; i >= 0; i--) {
+    sum[i] += p->node[i].tstates;
+    if (i > 0) sum[p->node[i].parent] += sum[i];
+  }
+  total = sum[0];
+
+  for (i = 1; i < p->nnodes; i++) {
+    self[p->node[i].entry] += p->node[i].tstates;
+    calls[p->node[i].entry] += p->node[i].calls;
+    /* A recursive call is already in its caller's total */
+    for (a = p->node[i].parent; a != 0; a = p->node[a].parent) {
+      if (p->node[a].entry == p->node[i].entry) break;
+    }
+    if (a == 0) incl[p->node[i].entry] += sum[i];
+  }
+
+  printf("   inclusive      %%         self      %%        calls  entry\n");
+  order = sorted(incl, Z80_ADDRESS_LIMIT);
+  for (i = 0; i < n && incl[order[i]] != 0; i++) {
+    a = order[i];
+    printf("%12" TSTATE_T_LEN " %5.1f%% %12" TSTATE_T_LEN " %5.1f%% %12"
+	   TSTATE_T_LEN "  %.4x\n", incl[a], percent(incl[a], total),
+	   self[a], percent(self[a], total), calls[a], a);
+  }
+  printf("%12" TSTATE_T_LEN " %5.1f%%  outside any call\n",
+	 p->node[0].tstates, percent(p->node[0].tstates, total));
+  if (p->lost) {
+    printf("The call tree filled up; %" TSTATE_T_LEN
+	   " calls were charged to their callers.\n", p->lost);
+  }
+  free(order);
+  free(self);
+  free(sum);
+}
+
+/* Print the counts for each bank that was used */
+void
+trs_profile_banks(void)
+{
+  struct trs_profile *p = z80_profile;
+  tstate_t total = 0;
+  int i;
+
+  if (!have_profile()) return;
+  for (i = 0; i < PROFILE_BANKS; i++) total += p->bank_tstates[i];
+  printf("    T-states      %%        count  memory\n");
+  for (i = 0; i < PROFILE_BANKS; i++) {
+    if (p->bank_count[i] == 0 && p->bank_tstates[i] == 0) continue;
+    printf("%12" TSTATE_T_LEN " %5.1f%% %12" TSTATE_T_LEN "  ",
+	   p->bank_tstates[i], percent(p->bank_tstates[i], total),
+	   p->bank_count[i]);
+    if (i == 0) {
+      printf("ROM, video, and I/O\n");
+    } else {
+      printf("RAM %.5x-%.5x\n", (i - 1) << 15, (i << 15) - 1);
+    }
+  }
+}
+
+static void
+fold_path(FILE *f, struct trs_profile *p, int n)
+{
+  if (n == 0) {
+    fputs("top", f);
+  } else {
+    fold_path(f, p, p->node[n].parent);
+    fprintf(f, ";%.4x", p->node[n].entry);
+  }
+}
+
+/* Write the call tree in the "folded stacks" format of flamegraph.pl:
+   one line per node, giving the chain of routines from the root and
+   the T-states spent in the last one.  Returns 0 if OK, -1 if not. */
+int
+trs_profile_fold(const char *name)
+{
+  struct trs_profile *p = z80_profile;
+  FILE *f;
+  int i;
+
+  if (!have_profile()) return -1;
+  f = fopen(name, "w");
+  if (f == NULL) {
+    error("could not write profile %s: %s", name, strerror(errno));
+    return -1;
+  }
+  for (i = 0; i < p->nnodes; i++) {
+    if (p->node[i].tstates == 0) continue;
+    fold_path(f, p, i);
+    fprintf(f, " %" TSTATE_T_LEN "\n", p->node[i].tstates);
+  }
+  if (fclose(f) != 0) {
+    error("could not write profile %s: %s", name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
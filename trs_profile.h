@@ -0,0 +1,75 @@
+/* $Id$ */
+
+/* This software may be copied, modified, and used for any purpose
+ * without fee, provided that (1) the above copyright notice is
+ * retained, and (2) modified versions are clearly marked as having
+ * been modified, with the modifier's name and the date included.  */
+
+/*
+ * trs_profile.h -- guest code profiler; see trs_profile.c
+ *
+ * z80_run does the counting itself, so the counters are out in the
+ * open here; everything else is in trs_profile.c.
+ */
+
+#ifndef _TRS_PROFILE_H
+#define _TRS_PROFILE_H
+
+#include "z80.h"
+
+/* Bank 0 is anything that is not RAM; bank n+1 is the nth 32K of the
+   emulated RAM, counting the 2MB of port 0x94 banks */
+#define PROFILE_BANKS (1 + (0x200000 >> 15))
+
+#define PROFILE_NODES 65536  /* places in the call tree */
+#define PROFILE_DEPTH 256    /* deepest call tracked */
+
+/* A node of the call tree is one routine, as called by the chain of
+   routines above it.  Node 0, the root, is whatever was running when
+   profiling started. */
+struct profile_node {
+    Ushort entry;	/* address called */
+    int parent, child, sibling;
+    tstate_t calls;
+    tstate_t tstates;	/* spent in the routine itself */
+};
+
+struct trs_profile {
+    int on;
+
+    /* Instructions executed and T-states taken, by address */
+    tstate_t count[Z80_ADDRESS_LIMIT];
+    tstate_t tstates[Z80_ADDRESS_LIMIT];
+
+    /* The same, by the bank each page of the address space is
+       mapped to now */
+    Uchar page_bank[256];
+    tstate_t bank_count[PROFILE_BANKS];
+    tstate_t bank_tstates[PROFILE_BANKS];
+
+    /* Call tree, and the stack of calls now in progress */
+    struct profile_node *node;
+    int nnodes;
+    tstate_t lost;	/* calls not tracked because the tree was full */
+    struct {
+	int node;
+	Ushort sp;	/* where the return address is */
+    } stack[PROFILE_DEPTH];
+    int depth;
+    int cur;		/* node now running */
+    Ushort sp;		/* stack pointer after the last instruction */
+};
+
+void trs_profile_on(void);
+void trs_profile_off(void);
+void trs_profile_reset(void);
+void trs_profile_free(void);
+void trs_profile_map(void);
+void trs_profile_stack(int pc);
+void trs_profile_interrupt(tstate_t t0);
+void trs_profile_print(int n);
+void trs_profile_routines(int n);
+void trs_profile_banks(void);
+int trs_profile_fold(const char *name);
+
+#endif /*_TRS_PROFILE_H*/
@@ -0,0 +1,5 @@
+int trs_rom1_size = 1;
+unsigned char trs_rom1[1] = 
+{
+    0x76,
+};
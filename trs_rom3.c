@@ -0,0 +1,5 @@
+int trs_rom3_size = 1;
+unsigned char trs_rom3[1] = 
+{
+    0x76,
+};
@@ -0,0 +1,5 @@
+int trs_rom4p_size = 1;
+unsigned char trs_rom4p[1] = 
+{
+    0x76,
+};
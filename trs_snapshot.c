@@ -0,0 +1,381 @@
+/* $Id$ */
+
+/* This software may be copied, modified, and used for any purpose
+ * without fee, provided that (1) the above copyright notice is
+ * retained, and (2) modified versions are clearly marked as having
+ * been modified, with the modifier's name and the date included.  */
+
+/*
+ * trs_snapshot.c -- save the whole emulated machine to a file, and
+ * restore it later
+ *
+ * A snapshot holds the Z80 registers, all of RAM and the ROM, the
+ * memory map and bank registers, video memory, the keyboard matrix,
+ * the floppy, hard disk, UART, stringy, and cassette controllers, and
+ * the pending events.  It does not hold the contents of disks,
+ * wafers, or tapes: restoring reopens whatever media the emulator is
+ * now configured with, so those should be the same images that were
+ * in use when the snapshot was saved.  Nor does it hold the host side
+ * of anything -- files open through the emt_* calls, the serial port
+ * settings, the -keys script -- or the graphics boards, whose state
+ * lives in the display code.
+ *
+ * The file is a header followed by sections.  Each section is a
+ * header giving a 4-character tag and a length, then that many bytes
+ * copied straight out of the module that owns it.  Section data
+ * starts on a SNAPSHOT_ALIGN boundary, so that restoring is a handful
+ * of large copies out of the mapped file (and a section could be
+ * mapped in place).  Everything is in host byte order and layout; a
+ * snapshot is meant to be restored by the same version of xtrs on the
+ * same kind of host.  Bump SNAPSHOT_VERSION whenever a saved struct
+ * changes.
+ *
+ * Each module has a _snapshot_save routine that hands its sections
+ * to trs_snapshot_put, and a _snapshot_load routine that gets them
+ * back with trs_snapshot_get and puts the module back in order.
+ * Before anything is restored, the save routines are run once more
+ * just to list the sections they would write, and the file must have
+ * exactly those, with the same lengths; so a load routine never sees
+ * a missing or short section, and a bad file leaves the machine as it
+ * was.
+ */
+
+#define _XOPEN_SOURCE 600 /* sys/mman.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "z80.h"
+#include "trs.h"
+
+#define SNAPSHOT_MAGIC   "xtrsSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGN   4096
+#define SNAPSHOT_ORDER   0x01020304
+
+struct snapshot_header {
+  char magic[8];
+  Uint version;
+  Uint order;       /* SNAPSHOT_ORDER, as the host stores it */
+  Uint sizes;       /* sizeof int, long, pointer, tstate_t */
+  Uint nsections;
+  long length;      /* of the whole file, to catch truncation */
+};
+
+struct snapshot_section {
+  char tag[4];
+  Uint length;
+};
+
+/* The hardware the machine was configured with; must match */
+struct snapshot_machine {
+  int model;
+  int huffman;
+  int hyper;
+  int super;
+  int selector_on;
+  int lower;
+  int le18;
+  int rom_size;
+};
+
+#define SNAP_SAVE  0  /* writing sections to file */
+#define SNAP_CHECK 1  /* checking that map has the sections we'd write */
+#define SNAP_LOAD  2  /* handing out sections from map */
+
+/* The snapshot being saved or restored by this thread */
+struct snapshot {
+  int mode;
+  FILE *file;
+  long pos;
+  int nsections;
+  int error;
+  char *map;
+  long length;
+};
+
+static __thread struct snapshot *snap;
+
+char *trs_snapshot_file = NULL;
+
+static long
+snapshot_data_pos(long pos)
+{
+  pos += sizeof(struct snapshot_section);
+  return (pos + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+/* Find a section in the mapped file; return its data, or NULL */
+static const char *
+snapshot_find(const char *tag, Uint *length)
+{
+  struct snapshot_header *h = (struct snapshot_header *) snap->map;
+  long pos = sizeof(struct snapshot_header);
+  Uint i;
+
+  for (i = 0; i < h->nsections; i++) {
+    long data = snapshot_data_pos(pos);
+    struct snapshot_section *s;
+    if (data > snap->length) break;
+    s = (struct snapshot_section *) (snap->map + data) - 1;
+    if (s->length > snap->length - data) break;
+    if (memcmp(s->tag, tag, 4) == 0) {
+      *length = s->length;
+      return snap->map + data;
+    }
+    pos = data + s->length;
+  }
+  return NULL;
+}
+
+/* Called by the _snapshot_save routines for each piece of state */
+void
+trs_snapshot_put(const char *tag, const void *data, int len)
+{
+  static const char zeros[SNAPSHOT_ALIGN];
+  struct snapshot_section s;
+  long pad;
+  Uint length;
+
+  snap->nsections++;
+  if (snap->mode == SNAP_CHECK) {
+    if (snapshot_find(tag, &length) == NULL || length != len) {
+      snap->error = 1;
+    }
+    return;
+  }
+  if (snap->error) return;
+  pad = snapshot_data_pos(snap->pos) - sizeof(s) - snap->pos;
+  memcpy(s.tag, tag, 4);
+  s.length = len;
+  if (fwrite(zeros, 1, pad, snap->file) != pad ||
+      fwrite(&s, sizeof(s), 1, snap->file) != 1 ||
+      fwrite(data, 1, len, snap->file) != len) {
+    snap->error = 1;
+  }
+  snap->pos += pad + sizeof(s) + len;
+}
+
+/* Called by the _snapshot_load routines; the section is known to be
+   there and to be len bytes long */
+const void *
+trs_snapshot_get(const char *tag, int len)
+{
+  Uint length;
+  return snapshot_find(tag, &length);
+}
+
+static void
+machine_snapshot_save(void)
+{
+  struct snapshot_machine m;
+
+  memset(&m, 0, sizeof(m));
+  m.model = trs_model;
+  m.huffman = huffman_ram;
+  m.hyper = hypermem;
+  m.super = supermem;
+  m.selector_on = selector;
+  m.lower = lowercase;
+  m.le18 = lowe_le18;
+  m.rom_size = trs_rom_size;
+  trs_snapshot_put("MACH", &m, sizeof(m));
+  trs_snapshot_put("Z80 ", &z80_state, sizeof(z80_state));
+}
+
+static void
+machine_snapshot_load(void)
+{
+  const struct snapshot_machine *m = trs_snapshot_get("MACH", sizeof(*m));
+  tstate_t before = z80_state.t_count;
+  int delay = z80_state.delay;
+  tstate_t sched = z80_state.sched;
+
+  trs_rom_size = m->rom_size;
+  memcpy(&z80_state, trs_snapshot_get("Z80 ", sizeof(z80_state)),
+	 sizeof(z80_state));
+  /* The speed setting and the event queue are our own */
+  z80_state.delay = delay;
+  z80_state.sched = sched;
+  /* An xtrs-batch or xtrs-bench budget still has as far to go */
+  trs_event_shift(TRS_EV_STOP, z80_state.t_count - before);
+}
+
+/* In the order they are restored.  The display modes (I/O) must be
+   set before memory redraws the screen. */
+static void (*const save_funcs[])(void) = {
+  machine_snapshot_save,
+  trs_io_snapshot_save,
+  mem_snapshot_save,
+  trs_interrupt_snapshot_save,
+  trs_kb_snapshot_save,
+  trs_disk_snapshot_save,
+  trs_hard_snapshot_save,
+  trs_uart_snapshot_save,
+  stringy_snapshot_save,
+  trs_cassette_snapshot_save,
+};
+
+static void (*const load_funcs[])(void) = {
+  machine_snapshot_load,
+  trs_io_snapshot_load,
+  mem_snapshot_load,
+  trs_interrupt_snapshot_load,
+  trs_kb_snapshot_load,
+  trs_disk_snapshot_load,
+  trs_hard_snapshot_load,
+  trs_uart_snapshot_load,
+  stringy_snapshot_load,
+  trs_cassette_snapshot_load,
+};
+
+#define NFUNCS (sizeof(save_funcs) / sizeof(save_funcs[0]))
+
+/* Save the current machine to the named file.  Returns 0 if OK, or
+   -1 after reporting an error. */
+int
+trs_snapshot_save(const char *name)
+{
+  struct snapshot s;
+  struct snapshot_header h;
+  int i;
+
+  memset(&s, 0, sizeof(s));
+  s.mode = SNAP_SAVE;
+  s.file = fopen(name, "w");
+  if (s.file == NULL) {
+    error("could not write snapshot %s: %s", name, strerror(errno));
+    return -1;
+  }
+  snap = &s;
+
+  memset(&h, 0, sizeof(h));
+  s.pos = sizeof(h);
+  if (fwrite(&h, sizeof(h), 1, s.file) != 1) s.error = 1;
+  for (i = 0; i < NFUNCS; i++) {
+    save_funcs[i]();
+  }
+
+  /* Now that we know how much there was, fill in the header */
+  memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+  h.version = SNAPSHOT_VERSION;
+  h.order = SNAPSHOT_ORDER;
+  h.sizes = (sizeof(int) << 24) | (sizeof(long) << 16) |
+    (sizeof(void *) << 8) | sizeof(tstate_t);
+  h.nsections = s.nsections;
+  h.length = s.pos;
+  if (fseek(s.file, 0, SEEK_SET) != 0 ||
+      fwrite(&h, sizeof(h), 1, s.file) != 1) {
+    s.error = 1;
+  }
+  if (fclose(s.file) != 0) s.error = 1;
+  snap = NULL;
+
+  if (s.error) {
+    error("could not write snapshot %s: %s", name, strerror(errno));
+    unlink(name);
+    return -1;
+  }
+  return 0;
+}
+
+/* Check the header of a mapped snapshot; return NULL if it is one we
+   can restore, else what is wrong with it */
+static const char *
+snapshot_check(struct snapshot *s)
+{
+  struct snapshot_header *h = (struct snapshot_header *) s->map;
+  const struct snapshot_machine *m;
+  Uint length;
+  int i;
+
+  if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0) {
+    return "not an xtrs snapshot";
+  }
+  if (h->version != SNAPSHOT_VERSION || h->order != SNAPSHOT_ORDER ||
+      h->sizes != ((sizeof(int) << 24) | (sizeof(long) << 16) |
+		   (sizeof(void *) << 8) | sizeof(tstate_t))) {
+    return "from a different version of xtrs";
+  }
+  if (h->length != s->length) {
+    return "truncated";
+  }
+  m = (const struct snapshot_machine *) snapshot_find("MACH", &length);
+  if (m == NULL || length != sizeof(*m)) {
+    return "from a different version of xtrs";
+  }
+  if (m->model != trs_model || m->huffman != huffman_ram ||
+      m->hyper != hypermem || m->super != supermem ||
+      m->selector_on != selector || m->lower != lowercase ||
+      m->le18 != lowe_le18) {
+    return "of a different model or memory configuration";
+  }
+
+  s->mode = SNAP_CHECK;
+  for (i = 0; i < NFUNCS; i++) {
+    save_funcs[i]();
+  }
+  if (s->error || s->nsections != h->nsections) {
+    return "from a different version of xtrs";
+  }
+  return NULL;
+}
+
+/* Restore the current machine from the named file.  Returns 0 if OK,
+   or -1 after reporting an error, in which case the machine is
+   unchanged.  Call between runs of z80_run, or from an event or
+   trs_get_event. */
+int
+trs_snapshot_load(const char *name)
+{
+  struct snapshot s;
+  struct stat st;
+  const char *problem;
+  int fd, i;
+
+  memset(&s, 0, sizeof(s));
+  fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    error("could not read snapshot %s: %s", name, strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+  s.length = st.st_size;
+  if (s.length < sizeof(struct snapshot_header)) {
+    close(fd);
+    error("snapshot %s is not an xtrs snapshot", name);
+    return -1;
+  }
+  s.map = (char *) mmap(NULL, s.length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (s.map == MAP_FAILED) {
+    error("could not read snapshot %s: %s", name, strerror(errno));
+    return -1;
+  }
+  snap = &s;
+
+  problem = snapshot_check(&s);
+  if (problem == NULL) {
+    s.mode = SNAP_LOAD;
+    for (i = 0; i < NFUNCS; i++) {
+      load_funcs[i]();
+    }
+    trs_screen_refresh();
+    trs_paused = 1;  /* keep autodelay from measuring across the jump */
+  }
+
+  snap = NULL;
+  munmap(s.map, s.length);
+  if (problem != NULL) {
+    error("snapshot %s is %s", name, problem);
+    return -1;
+  }
+  return 0;
+}
@@ -80,7 +80,20 @@ typedef struct {
 #endif
 } stringy_info_t;
 
-stringy_info_t stringy_info[STRINGY_MAX_UNITS];
+/* Per-machine state */
+struct stringy_machine {
+  stringy_info_t info[STRINGY_MAX_UNITS];
+};
+
+#define stringy_info (trs_cur->stringy->info)
+
+void
+stringy_machine_init(struct trs_machine *m)
+{
+  m->stringy = (struct stringy_machine *)
+    calloc(1, sizeof(struct stringy_machine));
+  if (m->stringy == NULL) fatal("out of memory");
+}
 
 /*
  * .esf file format used by TRS32.
@@ -305,6 +318,63 @@ stringy_change_all(void)
   }
 }
 
+/* In a job forked by trs_fork_server, stop sharing the wafers */
+void
+stringy_unshare(void)
+{
+  int i;
+  for (i = 0; i < STRINGY_MAX_UNITS; i++) {
+    trs_fork_unshare(stringy_info[i].file, &stringy_info[i].name);
+  }
+}
+
+/* A snapshot holds where each wafer is and what the drive is doing;
+   offset is where its file was positioned */
+struct stringy_snapshot {
+  stringy_info_t info[STRINGY_MAX_UNITS];
+  long offset[STRINGY_MAX_UNITS];
+};
+
+void
+stringy_snapshot_save(void)
+{
+  struct stringy_snapshot ss;
+  int i;
+
+  memset(&ss, 0, sizeof(ss));
+  for (i = 0; i < STRINGY_MAX_UNITS; i++) {
+    ss.info[i] = stringy_info[i];
+    ss.info[i].name = NULL;
+    ss.info[i].file = NULL;
+    ss.offset[i] = stringy_info[i].file ? ftell(stringy_info[i].file) : -1;
+  }
+  trs_snapshot_put("STRY", &ss, sizeof(ss));
+}
+
+void
+stringy_snapshot_load(void)
+{
+  const struct stringy_snapshot *ss = (const struct stringy_snapshot *)
+    trs_snapshot_get("STRY", sizeof(*ss));
+  int i;
+
+  stringy_change_all();
+  for (i = 0; i < STRINGY_MAX_UNITS; i++) {
+    stringy_info_t *s = &stringy_info[i];
+    const stringy_info_t *saved = &ss->info[i];
+    if (s->file == NULL || ss->offset[i] < 0) continue;
+    s->pos = saved->pos;
+    s->pos_time = saved->pos_time;
+    s->flux_change_pos = saved->flux_change_pos;
+    s->flux_change_to = saved->flux_change_to;
+    s->out_port = saved->out_port;
+    s->esf_bytepos = saved->esf_bytepos;
+    s->esf_bytebuf = saved->esf_bytebuf;
+    s->esf_bitpos = saved->esf_bitpos;
+    fseek(s->file, ss->offset[i], SEEK_SET);
+  }
+}
+
 const char *
 stringy_get_name(int drive)
 {
@@ -21,6 +21,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <signal.h>
+#include <stdlib.h>
 #include "trs.h"
 #include "trs_uart.h"
 
@@ -33,16 +34,13 @@
 /*#define UARTDEBUG2 1*/
 
 #if __linux
-char *trs_uart_name = "/dev/ttyS0";
+#define UART_DEFAULT_NAME "/dev/ttyS0"
 #else
-char *trs_uart_name = "/dev/tty00";
+#define UART_DEFAULT_NAME "/dev/tty00"
 #endif
-int trs_uart_switches =
-  0x7 | TRS_UART_NOPAR | TRS_UART_WORD8; /* Default: 9600 8N1 */
 
-static int initialized = 0;
-
-static struct {
+struct trs_uart_machine {
+  int initialized;
   int modem;
   int switches;
   int baud;
@@ -59,7 +57,21 @@ static struct {
   int fd;
   int fdflags;
   struct termios t;
-} uart;
+};
+
+void
+trs_uart_machine_init(struct trs_machine *m)
+{
+  m->uart = (struct trs_uart_machine *)
+    calloc(1, sizeof(struct trs_uart_machine));
+  if (m->uart == NULL) fatal("out of memory");
+  trs_uart_name = UART_DEFAULT_NAME;
+  trs_uart_switches =
+    0x7 | TRS_UART_NOPAR | TRS_UART_WORD8; /* Default: 9600 8N1 */
+}
+
+#define uart (*trs_cur->uart)
+#define initialized (uart.initialized)
 
 static int trs_uart_wordbits[] = TRS_UART_WORDBITS_TABLE;
 static float trs_uart_baud[] = TRS_UART_BAUD_TABLE;
@@ -270,26 +282,31 @@ trs_uart_check_avail()
       uart.fdflags |= FNONBLOCK;
       fcntl(uart.fd, F_SETFL, uart.fdflags);
     }
-    do {
-      rc = read(uart.fd, uart.buf, BUFSIZE);
-    } while (rc < 0 && errno == EINTR);
+    if (trs_journal_replaying()) {
+      rc = 0;  /* the journal has what was read */
+    } else {
+      do {
+	rc = read(uart.fd, uart.buf, BUFSIZE);
+      } while (rc < 0 && errno == EINTR);
 #if UARTDEBUG
 #if !UARTDEBUG2
-    if (rc >= 0 || errno != EAGAIN)
+      if (rc >= 0 || errno != EAGAIN)
 #endif
-      debug("trs_uart read returns %d, errno %d\n", rc, errno);
+	debug("trs_uart read returns %d, errno %d\n", rc, errno);
 #endif
-    if (rc < 0) {
-      if (errno != EAGAIN) {
-	error("can't read from %s: %s", trs_uart_name, strerror(errno));
+      if (rc < 0) {
+	if (errno != EAGAIN) {
+	  error("can't read from %s: %s", trs_uart_name, strerror(errno));
+	}
+	rc = 0;
       }
-      rc = 0;
     }
+    rc = trs_journal_uart(uart.buf, rc);
     uart.bufp = uart.buf;
     uart.bufleft = rc;
     if (rc > 0) {
       /* be sure events don't happen too fast */
-      trs_schedule_event(trs_uart_set_avail, 1, uart.tstates);
+      trs_schedule_event(TRS_EV_UART_RCV, trs_uart_set_avail, 1, uart.tstates);
     }
   }
 #if UARTDEBUG2
@@ -378,7 +395,7 @@ trs_uart_data_in()
     uart.bufleft--;
     uart.idata = *uart.bufp++;
     if (uart.bufleft) {
-      trs_schedule_event(trs_uart_set_avail, 1, uart.tstates);
+      trs_schedule_event(TRS_EV_UART_RCV, trs_uart_set_avail, 1, uart.tstates);
     }
   }
 #if UARTDEBUG
@@ -414,6 +431,40 @@ trs_uart_data_out(int value)
       fcntl(uart.fd, F_SETFL, uart.fdflags);
     }
     trs_uart_snd_interrupt(0);
-    trs_schedule_event(trs_uart_set_empty, 1, uart.tstates);
+    trs_schedule_event(TRS_EV_UART_SND, trs_uart_set_empty, 1, uart.tstates);
   }    
 }
+
+/* A snapshot restores the UART's registers, but not the host serial
+   port or anything it has sent us that the Z80 hasn't read yet */
+static const trs_event_func uart_rcv_event_funcs[] = {
+  trs_uart_set_avail, NULL
+};
+static const trs_event_func uart_snd_event_funcs[] = {
+  trs_uart_set_empty, NULL
+};
+
+void
+trs_uart_snapshot_save()
+{
+  trs_snapshot_put("UART", &uart, sizeof(struct trs_uart_machine));
+  trs_event_snapshot_save(TRS_EV_UART_RCV, uart_rcv_event_funcs);
+  trs_event_snapshot_save(TRS_EV_UART_SND, uart_snd_event_funcs);
+}
+
+void
+trs_uart_snapshot_load()
+{
+  const struct trs_uart_machine *s = (const struct trs_uart_machine *)
+    trs_snapshot_get("UART", sizeof(struct trs_uart_machine));
+
+  uart.modem = s->modem;
+  uart.baud = s->baud;
+  uart.status = s->status;
+  uart.control = s->control;
+  uart.idata = s->idata;
+  uart.odata = s->odata;
+  uart.tstates = s->tstates;
+  trs_event_snapshot_load(TRS_EV_UART_RCV, uart_rcv_event_funcs);
+  trs_event_snapshot_load(TRS_EV_UART_SND, uart_snd_event_funcs);
+}
@@ -24,8 +24,8 @@ extern int trs_uart_status_in();
 extern void trs_uart_control_out(int value);
 extern int trs_uart_data_in();
 extern void trs_uart_data_out(int value);
-extern char *trs_uart_name;
-extern int trs_uart_switches;
+#define trs_uart_name (trs_cur->uart_name)
+#define trs_uart_switches (trs_cur->uart_switches)
 
 #define TRS_UART_MODEM    0xE8 /* in */
 #define TRS_UART_RESET    0xE8 /* out */
@@ -42,6 +42,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
@@ -49,6 +52,11 @@
 #include <X11/keysym.h>
 #include <X11/keysymdef.h>
 #include <X11/Xresource.h>
+#ifdef XSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
 
 #include "trs_iodefs.h"
 #include "trs.h"
@@ -102,6 +110,12 @@ static int trs_charset;
 static int scale_x = 1;
 static int scale_y = 2;
 
+/* There is only one screen, so its state is not per machine; see
+   trs_machine.h */
+void trs_screen_machine_init(struct trs_machine *m)
+{
+}
+
 static XrmOptionDescRec opts[] = {
 /* Option */    /* Resource */  /* Value from arg? */   /* Value if no arg */
 {"-iconic",     "*iconic",      XrmoptionNoArg,         (caddr_t)""},
@@ -122,6 +136,12 @@ static XrmOptionDescRec opts[] = {
 {"-romfile4p",	"*romfile4p",	XrmoptionSepArg,	(caddr_t)NULL},
 {"-resize",	"*resize",	XrmoptionNoArg,		(caddr_t)"on"},
 {"-noresize",	"*resize",	XrmoptionNoArg,		(caddr_t)"off"},
+{"-framebuffer","*framebuffer",	XrmoptionNoArg,		(caddr_t)"on"},
+{"-noframebuffer","*framebuffer",XrmoptionNoArg,	(caddr_t)"off"},
+{"-renderthread","*renderthread",XrmoptionNoArg,	(caddr_t)"on"},
+{"-norenderthread","*renderthread",XrmoptionNoArg,	(caddr_t)"off"},
+{"-shm",        "*shm",         XrmoptionNoArg,         (caddr_t)"on"},
+{"-noshm",      "*shm",         XrmoptionNoArg,         (caddr_t)"off"},
 {"-doublestep", "*doublestep",  XrmoptionNoArg,         (caddr_t)"on"},
 {"-nodoublestep","*doublestep", XrmoptionNoArg,         (caddr_t)"off"},
 {"-model",      "*model",       XrmoptionSepArg,	(caddr_t)NULL},
@@ -133,6 +153,12 @@ static XrmOptionDescRec opts[] = {
 {"-delay",      "*delay",       XrmoptionSepArg,	(caddr_t)NULL},
 {"-autodelay",  "*autodelay",   XrmoptionNoArg,         (caddr_t)"on"},
 {"-noautodelay","*autodelay",   XrmoptionNoArg,         (caddr_t)"off"},
+{"-pace",       "*pace",        XrmoptionNoArg,         (caddr_t)"on"},
+{"-nopace",     "*pace",        XrmoptionNoArg,         (caddr_t)"off"},
+{"-turbo",      "*turbo",       XrmoptionNoArg,         (caddr_t)"on"},
+{"-noturbo",    "*turbo",       XrmoptionNoArg,         (caddr_t)"off"},
+{"-autoturbo",  "*autoturbo",   XrmoptionNoArg,         (caddr_t)"on"},
+{"-noautoturbo","*autoturbo",   XrmoptionNoArg,         (caddr_t)"off"},
 {"-keystretch", "*keystretch",  XrmoptionSepArg,        (caddr_t)NULL},
 {"-microlabs",  "*microlabs",   XrmoptionNoArg,         (caddr_t)"on"},
 {"-nomicrolabs","*microlabs",   XrmoptionNoArg,         (caddr_t)"off"},
@@ -143,6 +169,11 @@ static XrmOptionDescRec opts[] = {
 {"-truedam",    "*truedam",     XrmoptionNoArg,         (caddr_t)"on"},
 {"-notruedam",  "*truedam",     XrmoptionNoArg,         (caddr_t)"off"},
 {"-samplerate", "*samplerate",  XrmoptionSepArg,        (caddr_t)NULL},
+{"-snapshot",   "*snapshot",    XrmoptionSepArg,        (caddr_t)NULL},
+{"-deterministic","*deterministic",XrmoptionNoArg,      (caddr_t)"on"},
+{"-nodeterministic","*deterministic",XrmoptionNoArg,    (caddr_t)"off"},
+{"-record",     "*record",      XrmoptionSepArg,        (caddr_t)NULL},
+{"-replay",     "*replay",      XrmoptionSepArg,        (caddr_t)NULL},
 {"-title",      "*title",       XrmoptionSepArg,        (caddr_t)NULL},
 {"-scale",      "*scale",       XrmoptionSepArg,        (caddr_t)NULL},
 {"-scale1",     "*scale",       XrmoptionNoArg,         (caddr_t)"1"},
@@ -155,6 +186,10 @@ static XrmOptionDescRec opts[] = {
 {"-noshiftbracket","*shiftbracket",XrmoptionNoArg,      (caddr_t)"off"},
 {"-emtsafe",    "*emtsafe",     XrmoptionNoArg,         (caddr_t)"on"},
 {"-noemtsafe",  "*emtsafe",     XrmoptionNoArg,         (caddr_t)"off"},
+{"-blockcache", "*blockcache",  XrmoptionNoArg,         (caddr_t)"on"},
+{"-noblockcache","*blockcache", XrmoptionNoArg,         (caddr_t)"off"},
+{"-bulkmove",   "*bulkmove",    XrmoptionNoArg,         (caddr_t)"on"},
+{"-nobulkmove", "*bulkmove",    XrmoptionNoArg,         (caddr_t)"off"},
 {"-hypermem",   "*hypermem",    XrmoptionNoArg,         (caddr_t)"on"},
 {"-huffman",    "*huffman",     XrmoptionNoArg,         (caddr_t)"on"},
 {"-supermem",   "*supermem",    XrmoptionNoArg,         (caddr_t)"on"},
@@ -170,6 +205,8 @@ static int num_opts = (sizeof opts / sizeof opts[0]);
 /* True size of graphics memory -- some is offscreen */
 #define G_XSIZE 128
 #define G_YSIZE 256
+/* Only the initial home of the pixels; they are in image.data, which
+   may be moved to shared memory */
 char grafyx[(2*G_YSIZE*MAX_SCALE) * (G_XSIZE*MAX_SCALE)];
 unsigned char grafyx_unscaled[G_YSIZE][G_XSIZE];
 
@@ -179,6 +216,15 @@ unsigned char grafyx_enable = 0;
 unsigned char grafyx_overlay = 0;
 unsigned char grafyx_xoffset = 0, grafyx_yoffset = 0;
 
+/* Each byte of Grafyx memory as it appears in image, scale_x bytes
+   wide, in image's bit order; see grafyx_init */
+static unsigned char grafyx_expand[256][MAX_SCALE];
+
+/* Bytes written since the last grafyx_flush, as a span of x on each
+   line (empty if lo > hi).  Not used in frame mode. */
+static unsigned char grafyx_dirty_lo[G_YSIZE], grafyx_dirty_hi[G_YSIZE];
+static int grafyx_pending = 0;
+
 /* Port 0x83 (grafyx_mode) bits */
 #define G_ENABLE    1
 #define G_UL_NOTEXT 2   /* Micro Labs only */
@@ -215,6 +261,23 @@ XImage image = {
   /*f*/                { NULL, NULL, NULL, NULL, NULL, NULL }
 };
 
+/*
+ * With the MIT-SHM extension, image and frame_image are kept in
+ * shared memory segments that the X server reads directly, instead of
+ * having their pixels copied through the X connection on every
+ * XPutImage.  The server then dictates the bit order, so
+ * image_lsbfirst says whether the leftmost pixel is in the low-order
+ * bit of each byte; images not in shared memory are given the same
+ * order.  If the extension is missing or cannot be used (say, on a
+ * remote display), everything goes through XPutImage as before.
+ */
+static int use_shm = 1;
+static int image_lsbfirst = 0;
+static unsigned char bit_reverse[256];
+#ifdef XSHM
+static XShmSegmentInfo image_shm, frame_shm;
+#endif
+
 #define HRG_MEMSIZE (1024 * 12)	/* 12k * 8 bit graphics memory */
 static unsigned char hrg_screen[HRG_MEMSIZE];
 static int hrg_pixel_x[2][6+1];
@@ -225,12 +288,101 @@ static int hrg_enable = 0;
 static int hrg_addr = 0;
 static void hrg_update_char(int position);
 
+/*
+ * Frame mode (-framebuffer).  Instead of drawing each character as the
+ * program stores it, trs_screen_write_char and friends just mark the
+ * cell dirty.  At most FRAME_HZ times a second of host time,
+ * trs_get_event draws the dirty cells into frame_image, a bitmap of
+ * the whole text area kept here in the client, and sends the rectangle
+ * that encloses them to the server with one XPutImage.  A program that
+ * repaints the screen in a tight loop then costs one image per frame,
+ * not thousands of X requests.
+ *
+ * The cells come from an atlas drawn once at startup, from the
+ * built-in font or the X fonts: for each combination of character
+ * height (64x16 or 80x24 text), EXPANDED, INVERSE, and ALTERNATE, a
+ * page with all 256 character codes as they look in that mode, block
+ * graphics included, already in frame_image's bit order.  A mode
+ * change just points frame_glyphs at another page, and a cell is a
+ * copy of one row of bytes per pixel row.
+ */
+#define FRAME_HZ 60
+#define FRAME_ROW 8	/* bytes per row of an atlas cell */
+static int frame_mode = 0;
+static unsigned char frame_dirty[2048];
+static int frame_pending = 0;
+static struct timeval frame_last;
+static unsigned char *frame_atlas;
+static int frame_atlas_rows;	/* rows in each atlas cell */
+static unsigned char *frame_glyphs;	/* page for the current mode */
+
+XImage frame_image = {
+  /*width, height*/    0, 0,  /* set by frame_init */
+  /*xoffset*/          0,
+  /*format*/           XYBitmap,
+  /*data*/             NULL,
+  /*byte_order*/       LSBFirst,
+  /*bitmap_unit*/      8,
+  /*bitmap_bit_order*/ MSBFirst,
+  /*bitmap_pad*/       8,
+  /*depth*/            1,
+  /*bytes_per_line*/   0,
+  /*bits_per_pixel*/   1,
+  /*red_mask*/         1,
+  /*green_mask*/       1,
+  /*blue_mask*/        1,
+  /*obdata*/           NULL,
+  /*f*/                { NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/*
+ * Render thread (-renderthread, which implies -framebuffer).  Drawing
+ * and sending frames moves to a thread of its own, with its own
+ * connection to the X server, so the emulation never waits for the
+ * server or spends time on pixels.  frame_mark only appends the cell
+ * to render_queue, a ring that the emulation writes and the render
+ * thread reads, with no lock.  The cell is stored before it is queued,
+ * so the render thread always draws it at least as new as the write
+ * that queued it.  If the ring fills, render_overflow has the whole
+ * screen redrawn instead.  The thread wakes FRAME_HZ times a second,
+ * takes what is in the ring, and sends the frame.  The display mode
+ * (text mode, glyph page, geometry, Grafyx and HRG settings) is not
+ * queued; instead the thread draws each frame holding render_lock, and
+ * the emulation holds it across any change to the mode, so a frame is
+ * drawn wholly in one mode.  The lock is recursive because one mode
+ * change can call another.
+ */
+#define RENDER_QUEUE 4096	/* a power of 2 */
+#define RENDER_ALL 0xffff	/* queued to redraw every cell */
+static int render_mode = 0;
+static Display *render_display;
+static GC render_gc;
+static pthread_t render_thread;
+static pthread_mutex_t render_lock;
+static int render_running = 0;
+static unsigned short render_queue[RENDER_QUEUE];
+static atomic_uint render_head;	/* written only by the emulation */
+static atomic_uint render_tail;	/* written only by the render thread */
+static atomic_int render_overflow;
+
 /* dummy buffer for stat() call */
 struct stat statbuf;
 
 /* Private routines */
 void bitmap_init();
 void screen_init();
+static void frame_init(void);
+static void frame_atlas_init(void);
+static void frame_select(void);
+static void frame_tick(int wait);
+static void shm_init(void);
+static void render_open(void);
+static void render_start(void);
+static void render_hold(void);
+static void render_release(void);
+static void grafyx_init(void);
+static void grafyx_init_dirty(void);
+static void grafyx_flush(void);
 
 static XrmDatabase x_db = NULL;
 static XrmDatabase command_db = NULL;
@@ -253,6 +405,11 @@ int trs_parse_command_line(int argc, char **argv, int *debug)
 
   title = program_name; /* default */
 
+  /* -renderthread uses Xlib from two threads, and this must come
+     before any other Xlib call.  We can't know yet whether the
+     resources will ask for it, so always do it (as libX11 1.8 and
+     later does by itself). */
+  XInitThreads();
   XrmInitialize();
 
   /* parse command line options */
@@ -312,6 +469,24 @@ int trs_parse_command_line(int argc, char **argv, int *debug)
     }
   }
 
+  (void) sprintf(option, "%s%s", program_name, ".blockcache");
+  if (XrmGetResource(x_db, option, "Xtrs.Blockcache", &type, &value)) {
+    if (strcmp(value.addr,"on") == 0) {
+      z80_block_cache = True;
+    } else if (strcmp(value.addr,"off") == 0) {
+      z80_block_cache = False;
+    }
+  }
+
+  (void) sprintf(option, "%s%s", program_name, ".bulkmove");
+  if (XrmGetResource(x_db, option, "Xtrs.Bulkmove", &type, &value)) {
+    if (strcmp(value.addr,"on") == 0) {
+      z80_bulk_move = True;
+    } else if (strcmp(value.addr,"off") == 0) {
+      z80_bulk_move = False;
+    }
+  }
+
   (void) sprintf(option, "%s%s", program_name, ".debug");
   if (XrmGetResource(x_db, option, "Xtrs.Debug", &type, &value)) {
     if (strcmp(value.addr,"on") == 0) {
@@ -330,6 +505,33 @@ int trs_parse_command_line(int argc, char **argv, int *debug)
     }
   }
 
+  (void) sprintf(option, "%s%s", program_name, ".pace");
+  if (XrmGetResource(x_db, option, "Xtrs.Pace", &type, &value)) {
+    if (strcmp(value.addr,"on") == 0) {
+      trs_pace = True;
+    } else if (strcmp(value.addr,"off") == 0) {
+      trs_pace = False;
+    }
+  }
+
+  (void) sprintf(option, "%s%s", program_name, ".turbo");
+  if (XrmGetResource(x_db, option, "Xtrs.Turbo", &type, &value)) {
+    if (strcmp(value.addr,"on") == 0) {
+      trs_turbo = True;
+    } else if (strcmp(value.addr,"off") == 0) {
+      trs_turbo = False;
+    }
+  }
+
+  (void) sprintf(option, "%s%s", program_name, ".autoturbo");
+  if (XrmGetResource(x_db, option, "Xtrs.Autoturbo", &type, &value)) {
+    if (strcmp(value.addr,"on") == 0) {
+      trs_autoturbo = True;
+    } else if (strcmp(value.addr,"off") == 0) {
+      trs_autoturbo = False;
+    }
+  }
+
   (void) sprintf(option, "%s%s", program_name, ".model");
   if (XrmGetResource(x_db, option, "Xtrs.Model", &type, &value)) {
     if (strcmp(value.addr, "1") == 0 ||
@@ -589,6 +791,30 @@ int trs_parse_command_line(int argc, char **argv, int *debug)
     cassette_default_sample_rate = strtol(value.addr, NULL, 0);
   }
 
+  (void) sprintf(option, "%s%s", program_name, ".snapshot");
+  if (XrmGetResource(x_db, option, "Xtrs.Snapshot", &type, &value)) {
+    trs_snapshot_file = strdup(value.addr);
+  }
+
+  (void) sprintf(option, "%s%s", program_name, ".deterministic");
+  if (XrmGetResource(x_db, option, "Xtrs.Deterministic", &type, &value)) {
+    if (strcmp(value.addr,"on") == 0) {
+      trs_deterministic = True;
+    } else if (strcmp(value.addr,"off") == 0) {
+      trs_deterministic = False;
+    }
+  }
+
+  (void) sprintf(option, "%s%s", program_name, ".record");
+  if (XrmGetResource(x_db, option, "Xtrs.Record", &type, &value)) {
+    trs_journal_record_file = strdup(value.addr);
+  }
+
+  (void) sprintf(option, "%s%s", program_name, ".replay");
+  if (XrmGetResource(x_db, option, "Xtrs.Replay", &type, &value)) {
+    trs_journal_replay_file = strdup(value.addr);
+  }
+
   (void) sprintf(option, "%s%s", program_name, ".title");
   if (XrmGetResource(x_db, option, "Xtrs.title", &type, &value)) {
       title = strdup(value.addr);
@@ -807,6 +1033,34 @@ void trs_screen_init()
     }
   }
 
+  (void) sprintf(option, "%s%s", program_name, ".shm");
+  if (XrmGetResource(x_db, option, "Xtrs.Shm", &type, &value)) {
+    if (strcmp(value.addr,"on") == 0) {
+      use_shm = 1;
+    } else if (strcmp(value.addr,"off") == 0) {
+      use_shm = 0;
+    }
+  }
+
+  (void) sprintf(option, "%s%s", program_name, ".framebuffer");
+  if (XrmGetResource(x_db, option, "Xtrs.Framebuffer", &type, &value)) {
+    if (strcmp(value.addr,"on") == 0) {
+      frame_mode = 1;
+    } else if (strcmp(value.addr,"off") == 0) {
+      frame_mode = 0;
+    }
+  }
+
+  (void) sprintf(option, "%s%s", program_name, ".renderthread");
+  if (XrmGetResource(x_db, option, "Xtrs.Renderthread", &type, &value)) {
+    if (strcmp(value.addr,"on") == 0) {
+      render_mode = 1;
+      frame_mode = 1;
+    } else if (strcmp(value.addr,"off") == 0) {
+      render_mode = 0;
+    }
+  }
+
   if (usefont) {
     (void) sprintf(option, "%s%s", program_name, ".font");
     if (XrmGetResource(x_db, option, "Xtrs.Font", &type, &value)) {
@@ -982,8 +1236,15 @@ void trs_screen_init()
 
   XMapWindow(display, window);
   bitmap_init(foreground, background);
+  if (frame_mode) frame_init();
+  if (!frame_mode) render_mode = 0;
+  if (render_mode) render_open();
+  shm_init();
+  grafyx_init();
+  if (frame_mode) frame_atlas_init();
   screen_init();
   XClearWindow(display,window);
+  if (render_mode) render_start();
 }
 
 KeySym last_key[256];
@@ -1034,6 +1295,13 @@ void trs_get_event(int wait)
     (void)trs_uart_check_avail();
   }
 
+  if (grafyx_pending) {
+    grafyx_flush();
+  }
+  if (frame_mode && !render_mode) {
+    frame_tick(wait);
+  }
+
   if (wait) {
     pause();
     trs_paused = 1;
@@ -1117,7 +1385,7 @@ void trs_get_event(int wait)
 	trs_skip_next_kbwait();
 	break;
       case XK_F10:
-	trs_reset(0);
+	if (trs_journal_input(TRS_JOURNAL_RESET, 0)) trs_reset(0);
 	key = 0;
 	trs_skip_next_kbwait();
 	break;
@@ -1132,7 +1400,7 @@ void trs_get_event(int wait)
 	trs_skip_next_kbwait();
 	break;
       case XK_F7:
-	trs_change_all();
+	if (trs_journal_input(TRS_JOURNAL_CHANGE, 0)) trs_change_all();
 	key = 0;
 	trs_skip_next_kbwait();
 	break;
@@ -1188,14 +1456,17 @@ void trs_screen_expanded(int flag)
 {
   int bit = flag ? EXPANDED : 0;
   if ((currentmode ^ bit) & EXPANDED) {
+    render_hold();
     currentmode ^= EXPANDED;
+    frame_select();
     if (usefont) {
       curfont = (flag ? mywidefont : myfont);
       XSetFont(display,gc,curfont->fid);
       XSetFont(display,gc_inv,curfont->fid);
     }
-    XClearWindow(display,window);
+    if (!frame_mode) XClearWindow(display,window);
     trs_screen_refresh();
+    render_release();
   }
 }
 
@@ -1204,11 +1475,14 @@ void trs_screen_inverse(int flag)
   int bit = flag ? INVERSE : 0;
   int i;
   if ((currentmode ^ bit) & INVERSE) {
+    render_hold();
     currentmode ^= INVERSE;
+    frame_select();
     for (i = 0; i < screen_chars; i++) {
       if (trs_screen[i] & 0x80)
 	trs_screen_write_char(i, trs_screen[i]);
     }
+    render_release();
   }
 }
 
@@ -1217,18 +1491,23 @@ void trs_screen_alternate(int flag)
   int bit = flag ? ALTERNATE : 0;
   int i;
   if ((currentmode ^ bit) & ALTERNATE) {
+    render_hold();
     currentmode ^= ALTERNATE;
+    frame_select();
     for (i = 0; i < screen_chars; i++) {
       if (trs_screen[i] >= 0xc0)
 	trs_screen_write_char(i, trs_screen[i]);
     }
+    render_release();
   }
 }
 
 void trs_screen_640x240(int flag)
 {
   if (flag == screen640x240) return;
+  render_hold();
   screen640x240 = flag;
+  frame_select();
   if (flag) {
     row_chars = 80;
     col_chars = 24;
@@ -1264,6 +1543,7 @@ void trs_screen_640x240(int flag)
     }
   }
   trs_screen_refresh();
+  render_release();
 }
 
 void trs_screen_80x24(int flag)
@@ -1428,6 +1708,649 @@ void bitmap_init(unsigned long foreground, unsigned long background)
   }
 }
 
+#ifdef XSHM
+static int shm_failed;
+
+static int
+shm_error(Display *d, XErrorEvent *e)
+{
+  shm_failed = 1;
+  return 0;
+}
+
+/* Replace *im by an image of the same size in a shared memory segment
+   attached to the server.  Returns 1 if OK, 0 if not. */
+static int
+shm_image(Display *display, XImage *im, XShmSegmentInfo *info)
+{
+  XImage *si;
+  int (*old_handler)(Display *, XErrorEvent *);
+
+  si = XShmCreateImage(display, DefaultVisual(display, screen), 1,
+		       XYBitmap, NULL, info, im->width, im->height);
+  if (si == NULL) return 0;
+  /* Our pixel code works a byte at a time */
+  if (si->bitmap_unit != 8 && si->byte_order != si->bitmap_bit_order) {
+    XFree(si);
+    return 0;
+  }
+  info->shmid = shmget(IPC_PRIVATE, si->bytes_per_line * si->height,
+		       IPC_CREAT | 0600);
+  if (info->shmid < 0) {
+    XFree(si);
+    return 0;
+  }
+  info->shmaddr = si->data = shmat(info->shmid, NULL, 0);
+  info->readOnly = True;
+  if (info->shmaddr == (char *) -1) {
+    shmctl(info->shmid, IPC_RMID, NULL);
+    XFree(si);
+    return 0;
+  }
+
+  /* XShmAttach fails with an X error if the server cannot see our
+     memory */
+  XSync(display, False);
+  shm_failed = 0;
+  old_handler = XSetErrorHandler(shm_error);
+  XShmAttach(display, info);
+  XSync(display, False);
+  XSetErrorHandler(old_handler);
+  /* The segment goes away once both of us have detached it */
+  shmctl(info->shmid, IPC_RMID, NULL);
+  if (shm_failed) {
+    shmdt(info->shmaddr);
+    XFree(si);
+    return 0;
+  }
+  *im = *si;
+  XFree(si);
+  return 1;
+}
+#endif /*XSHM*/
+
+/* Called once the window exists and frame_init has run */
+static void
+shm_init(void)
+{
+  int i, b;
+
+  for (i = 0; i < 256; i++) {
+    for (b = 0; b < 8; b++) {
+      if (i & (1 << b)) bit_reverse[i] |= 0x80 >> b;
+    }
+  }
+#ifdef XSHM
+  if (use_shm && XShmQueryExtension(display)) {
+    if (shm_image(display, &image, &image_shm)) {
+      image_lsbfirst = image.bitmap_bit_order == LSBFirst;
+      if (frame_mode) {
+	free(frame_image.data);
+	if (!shm_image(render_mode ? render_display : display,
+		       &frame_image, &frame_shm)) {
+	  frame_image.data = (char *)
+	    calloc(frame_image.bytes_per_line, frame_image.height);
+	  if (frame_image.data == NULL) fatal("out of memory");
+	}
+      }
+    }
+  }
+#endif
+  if (image_lsbfirst) {
+    if (!image.obdata) image.bitmap_bit_order = LSBFirst;
+    if (!frame_image.obdata) frame_image.bitmap_bit_order = LSBFirst;
+  }
+}
+
+/* XPutImage to the window, or XShmPutImage if im is shared */
+static void
+put_image_on(Display *display, GC gc, XImage *im, int src_x, int src_y,
+	     int dest_x, int dest_y, unsigned int width, unsigned int height)
+{
+#ifdef XSHM
+  if (im->obdata) {
+    XShmPutImage(display, window, gc, im, src_x, src_y,
+		 dest_x, dest_y, width, height, False);
+    return;
+  }
+#endif
+  XPutImage(display, window, gc, im, src_x, src_y,
+	    dest_x, dest_y, width, height);
+}
+
+static void
+put_image(GC gc, XImage *im, int src_x, int src_y,
+	  int dest_x, int dest_y, unsigned int width, unsigned int height)
+{
+  put_image_on(display, gc, im, src_x, src_y, dest_x, dest_y, width, height);
+}
+
+/* A mask of the n bits starting x bits from the left of a frame row */
+static unsigned long long
+frame_span(int x, int n)
+{
+  if (n <= 0) return 0;
+  return (~0ULL >> x) & (x + n >= 64 ? ~0ULL : ~(~0ULL >> (x + n)));
+}
+
+/* Fetch n <= 64 pixels from bit x of a bitmap line, leftmost pixel in
+   the high-order bit */
+static unsigned long long
+frame_get_bits(const unsigned char *line, int x, int n)
+{
+  const unsigned char *p = line + (x >> 3);
+  unsigned long long v = 0;
+  int s = 56 + (x & 7);
+  int bytes = ((x & 7) + n + 7) >> 3;
+
+  unsigned char b;
+
+  while (bytes-- > 0) {
+    b = image_lsbfirst ? bit_reverse[*p++] : *p++;
+    if (s >= 0) {
+      v |= (unsigned long long) b << s;
+    } else {
+      v |= b >> -s;
+    }
+    s -= 8;
+  }
+  return v & frame_span(0, n);
+}
+
+/* Store the n <= 64 leftmost pixels of v at bit x of a bitmap line */
+static void
+frame_put_bits(unsigned char *line, int x, int n, unsigned long long v)
+{
+  unsigned char *p = line + (x >> 3);
+  int shift = x & 7;
+  int m, b;
+
+  while (n > 0) {
+    m = 0xff >> shift;
+    if (n < 8 - shift) m &= ~(0xff >> (shift + n));
+    b = image_lsbfirst ? bit_reverse[*p] : *p;
+    b = (b & ~m) | ((unsigned char) (v >> (56 + shift)) & m);
+    *p = image_lsbfirst ? bit_reverse[b] : b;
+    v <<= 8 - shift;
+    n -= 8 - shift;
+    shift = 0;
+    p++;
+  }
+}
+
+static void
+frame_init(void)
+{
+  int rows80 = usefont ? cur_char_height : TRS_CHAR_HEIGHT4 * scale_y;
+
+  if (2 * cur_char_width > 8 * FRAME_ROW) {
+    error("font too wide for -framebuffer");
+    frame_mode = 0;
+    return;
+  }
+  /* Big enough for 80x24 or 64x16, whichever is bigger */
+  frame_image.width = 80 * cur_char_width;
+  frame_image.height = 24 * rows80 > 16 * cur_char_height ?
+    24 * rows80 : 16 * cur_char_height;
+  frame_image.bytes_per_line = (frame_image.width + 7) / 8;
+  frame_image.data = (char *)
+    calloc(frame_image.bytes_per_line, frame_image.height);
+  if (frame_image.data == NULL) fatal("out of memory");
+  gettimeofday(&frame_last, NULL);
+}
+
+/* Pixel rows of the 256 characters of the font, scaled to the cell,
+   normal and expanded; the leftmost pixel is the high-order bit */
+static unsigned long long *
+frame_font(void)
+{
+  unsigned long long *font;
+  int rows = frame_atlas_rows;
+  int e, c, y, k, sx, b, w;
+
+  font = (unsigned long long *)
+    calloc(2 * 256 * rows, sizeof(unsigned long long));
+  if (font == NULL) fatal("out of memory");
+
+  if (usefont) {
+    /* Let the server draw each font once, and read back the bits */
+    Pixmap pm;
+    GC gc1;
+    XImage *xi;
+    XFontStruct *f;
+    char ch;
+
+    for (e = 0; e < 2; e++) {
+      f = e ? mywidefont : myfont;
+      w = cur_char_width << e;
+      pm = XCreatePixmap(display, window, 256 * w, rows, 1);
+      gc1 = XCreateGC(display, pm, 0, NULL);
+      XSetForeground(display, gc1, 1);
+      XSetBackground(display, gc1, 0);
+      XSetFont(display, gc1, f->fid);
+      for (c = 0; c < 256; c++) {
+	ch = (char) c;
+	XDrawImageString(display, pm, gc1, c * w, f->ascent, &ch, 1);
+      }
+      xi = XGetImage(display, pm, 0, 0, 256 * w, rows, 1, XYPixmap);
+      if (xi == NULL) fatal("can't read back font for -framebuffer");
+      for (c = 0; c < 256; c++) {
+	for (y = 0; y < rows; y++) {
+	  for (k = 0; k < w; k++) {
+	    if (XGetPixel(xi, c * w + k, y)) {
+	      font[(e * 256 + c) * rows + y] |= frame_span(k, 1);
+	    }
+	  }
+	}
+      }
+      XDestroyImage(xi);
+      XFreeGC(display, gc1);
+      XFreePixmap(display, pm);
+    }
+  } else {
+    /* The built-in bitmaps have their leftmost pixel in the low-order
+       bit */
+    for (e = 0; e < 2; e++) {
+      sx = scale_x << e;
+      for (c = 0; c < 256; c++) {
+	for (y = 0; y < rows; y++) {
+	  b = (unsigned char) trs_char_data[trs_charset][c][y / scale_y];
+	  for (k = 0; k < 8; k++) {
+	    if (b & (1 << k)) {
+	      font[(e * 256 + c) * rows + y] |= frame_span(k * sx, sx);
+	    }
+	  }
+	}
+      }
+    }
+  }
+  return font;
+}
+
+/* Draw one page of the atlas, for the given cell height and mode, the
+   way trs_screen_write_char would draw each character in the window */
+static void
+frame_atlas_page(unsigned char *page, const unsigned long long *font,
+		 int height, int mode)
+{
+  int expanded = (mode & EXPANDED) != 0;
+  int width = cur_char_width << expanded;
+  unsigned long long left = frame_span(0, width / 2);
+  unsigned long long right = frame_span(width / 2, width - width / 2);
+  unsigned long long bits;
+  unsigned char *cell;
+  int c, char_index, box, inv, y, k, third;
+
+  for (c = 0; c < 256; c++) {
+    char_index = c;
+    box = -1;
+    inv = 0;
+    if (trs_model == 1 && char_index >= 0xc0) {
+      /* On Model I, 0xc0-0xff is another copy of 0x80-0xbf */
+      char_index -= 0x40;
+    }
+    if (char_index >= 0x80 && char_index <= 0xbf && !(mode & INVERSE)) {
+      box = char_index - 0x80;
+    } else {
+      if (usefont && trs_model == 1 && !lowercase && char_index < 0x20) {
+	/* Radio Shack lowercase mod; see trs_screen_write_char */
+	char_index += 0x40;
+      }
+      if (trs_model > 1 && char_index >= 0xc0 &&
+	  (mode & (ALTERNATE+INVERSE)) == 0) {
+	char_index -= 0x40;
+      }
+      if (mode & INVERSE) {
+	inv = char_index & 0x80;
+	char_index &= 0x7f;
+      }
+    }
+    cell = page + c * frame_atlas_rows * FRAME_ROW;
+    for (y = 0; y < height; y++) {
+      if (box >= 0) {
+	/* Same 2x3 division as boxes_init */
+	third = (y < height / 3) ? 0 : (y < (height * 2) / 3) ? 1 : 2;
+	bits = 0;
+	if (box & (1 << (2 * third))) bits |= left;
+	if (box & (2 << (2 * third))) bits |= right;
+      } else {
+	bits = font[(expanded * 256 + char_index) * frame_atlas_rows + y];
+	if (inv) bits = ~bits;
+      }
+      bits &= frame_span(0, width);
+      for (k = 0; k < FRAME_ROW; k++) {
+	cell[k] = (unsigned char) (bits >> (56 - 8 * k));
+	if (image_lsbfirst) cell[k] = bit_reverse[cell[k]];
+      }
+      cell += FRAME_ROW;
+    }
+  }
+}
+
+/* The atlas page for cell height h (0 = 64x16, 1 = 80x24) and mode */
+static unsigned char *
+frame_page(int h, int mode)
+{
+  int m = ((mode & EXPANDED) ? 4 : 0) + ((mode & INVERSE) ? 2 : 0) +
+    ((mode & ALTERNATE) ? 1 : 0);
+
+  return frame_atlas + (h * 8 + m) * 256 * frame_atlas_rows * FRAME_ROW;
+}
+
+/* Called after shm_init, which settles the bit order */
+static void
+frame_atlas_init(void)
+{
+  unsigned long long *font;
+  int h, m, mode, height;
+
+  frame_atlas_rows = cur_char_height;
+  frame_atlas = (unsigned char *)
+    calloc(2 * 8 * 256 * frame_atlas_rows, FRAME_ROW);
+  if (frame_atlas == NULL) fatal("out of memory");
+  font = frame_font();
+  for (h = 0; h < 2; h++) {
+    height = (h && !usefont) ? TRS_CHAR_HEIGHT4 * scale_y : cur_char_height;
+    for (m = 0; m < 8; m++) {
+      mode = ((m & 4) ? EXPANDED : 0) + ((m & 2) ? INVERSE : 0) +
+	((m & 1) ? ALTERNATE : 0);
+      frame_atlas_page(frame_page(h, mode), font, height, mode);
+    }
+  }
+  free(font);
+  frame_select();
+}
+
+/* Point frame_glyphs at the page for the current mode */
+static void
+frame_select(void)
+{
+  if (!frame_mode || frame_atlas == NULL) return;
+  frame_glyphs = frame_page(screen640x240 && !usefont, currentmode);
+}
+
+/* The HRG pixels in row y of the cell at position */
+static unsigned long long
+frame_hrg_row(int position, int y, int expanded)
+{
+  int *x = hrg_pixel_x[expanded];
+  int *w = hrg_pixel_width[expanded];
+  unsigned long long bits = 0;
+  int i, j, byte;
+
+  for (i = 0; i < 11 && y >= hrg_pixel_y[i + 1]; i++) /*skip*/;
+  byte = hrg_screen[position + (i << 10)] & 0x3f;
+  for (j = 0; j < 6; j++) {
+    if (byte & (1 << j)) bits |= frame_span(x[j], w[j]);
+  }
+  return bits;
+}
+
+/* Fetch a row of an atlas cell as frame_get_bits would */
+static unsigned long long
+frame_cell_bits(const unsigned char *row)
+{
+  unsigned long long v = 0;
+  int k;
+
+  for (k = 0; k < FRAME_ROW; k++) {
+    v = (v << 8) | (image_lsbfirst ? bit_reverse[row[k]] : row[k]);
+  }
+  return v;
+}
+
+/* Draw the cell at position into frame_image */
+static void
+frame_draw_cell(int position)
+{
+  int text = !grafyx_enable || grafyx_overlay;
+  int expanded = text && (currentmode & EXPANDED);
+  int width = cur_char_width << expanded;
+  int row = position / row_chars;
+  int col = position - (row * row_chars);
+  int x0 = col * cur_char_width;
+  int y0 = row * cur_char_height;
+  const unsigned char *glyph =
+    frame_glyphs + trs_screen[position] * frame_atlas_rows * FRAME_ROW;
+  unsigned char *line = (unsigned char *) frame_image.data +
+    y0 * frame_image.bytes_per_line;
+  unsigned char *gline;
+  unsigned long long bits;
+  int y, k, n;
+
+  if (text && !grafyx_enable && !hrg_enable && ((x0 | width) & 7) == 0) {
+    /* The usual case: whole bytes straight from the atlas */
+    line += x0 >> 3;
+    n = width >> 3;
+    for (y = 0; y < cur_char_height; y++) {
+      for (k = 0; k < n; k++) line[k] = glyph[k];
+      line += frame_image.bytes_per_line;
+      glyph += FRAME_ROW;
+    }
+    return;
+  }
+
+  for (y = 0; y < cur_char_height; y++) {
+    bits = text ? frame_cell_bits(glyph) : 0;
+    if (grafyx_enable) {
+      gline = (unsigned char *) image.data + image.bytes_per_line *
+	((y0 + y + grafyx_yoffset * scale_y) % (G_YSIZE * scale_y));
+      for (k = 0; k <= expanded; k++) {
+	bits ^= frame_get_bits(gline, ((col + k + grafyx_xoffset) % G_XSIZE)
+			       * cur_char_width, cur_char_width)
+	  >> (k * cur_char_width);
+      }
+    }
+    if (hrg_enable && text) {
+      bits |= frame_hrg_row(position, y, expanded);
+    }
+    frame_put_bits(line, x0, width, bits);
+    line += frame_image.bytes_per_line;
+    glyph += FRAME_ROW;
+  }
+}
+
+/* Called only by the emulation */
+static void
+render_push(unsigned short position)
+{
+  unsigned head = atomic_load_explicit(&render_head, memory_order_relaxed);
+
+  if (head - atomic_load_explicit(&render_tail, memory_order_acquire)
+      == RENDER_QUEUE) {
+    atomic_store_explicit(&render_overflow, 1, memory_order_release);
+    return;
+  }
+  render_queue[head & (RENDER_QUEUE - 1)] = position;
+  atomic_store_explicit(&render_head, head + 1, memory_order_release);
+}
+
+static void
+frame_mark(int position)
+{
+  if (render_mode) {
+    render_push(position);
+    return;
+  }
+  frame_dirty[position] = 1;
+  frame_pending = 1;
+}
+
+static void
+frame_mark_all(void)
+{
+  if (render_mode) {
+    /* Whatever we drew on our own connection (say, clearing the
+       margins) must reach the server before the new frame does */
+    XSync(display, False);
+    render_push(RENDER_ALL);
+    return;
+  }
+  memset(frame_dirty, 1, screen_chars);
+  frame_pending = 1;
+}
+
+/* Draw the dirty cells and send them to the server in one piece */
+static void
+frame_flush(void)
+{
+  int expanded = (currentmode & EXPANDED) && (!grafyx_enable || grafyx_overlay);
+  int top = col_chars, bottom = -1, left = row_chars, right = -1;
+  int i, position, row, col;
+
+  if (!frame_pending) return;
+  frame_pending = 0;
+  for (i = 0; i < screen_chars; i++) {
+    if (!frame_dirty[i]) continue;
+    frame_dirty[i] = 0;
+    /* An expanded character covers two cells and is drawn from its
+       even position */
+    position = i;
+    if (expanded) {
+      position &= ~1;
+      frame_dirty[position + 1] = 0;
+    }
+    frame_draw_cell(position);
+    row = position / row_chars;
+    col = position - (row * row_chars);
+    if (row < top) top = row;
+    if (row > bottom) bottom = row;
+    if (col < left) left = col;
+    if (col + expanded > right) right = col + expanded;
+  }
+  if (bottom < 0) return;
+  put_image_on(render_mode ? render_display : display,
+	       render_mode ? render_gc : gc, &frame_image,
+	       left * cur_char_width, top * cur_char_height,
+	       left_margin + left * cur_char_width,
+	       top_margin + top * cur_char_height,
+	       (right - left + 1) * cur_char_width,
+	       (bottom - top + 1) * cur_char_height);
+}
+
+/* Open the render thread's connection, before shm_init */
+static void
+render_open(void)
+{
+  XGCValues gcvals;
+
+  /* The window must exist before the other connection can use it */
+  XSync(display, False);
+  render_display = XOpenDisplay(DisplayString(display));
+  if (render_display == NULL) {
+    error("unable to open display for -renderthread");
+    render_mode = 0;
+    return;
+  }
+  /* The same colors as gc */
+  XGetGCValues(display, gc, GCForeground | GCBackground, &gcvals);
+  gcvals.graphics_exposures = False;
+  render_gc = XCreateGC(render_display, window,
+			GCGraphicsExposures | GCForeground | GCBackground,
+			&gcvals);
+}
+
+/* Move the cells queued by frame_mark into frame_dirty */
+static void
+render_take(void)
+{
+  unsigned head = atomic_load_explicit(&render_head, memory_order_acquire);
+  unsigned tail = atomic_load_explicit(&render_tail, memory_order_relaxed);
+  unsigned short position;
+
+  if (atomic_exchange_explicit(&render_overflow, 0, memory_order_acquire)) {
+    memset(frame_dirty, 1, sizeof(frame_dirty));
+    frame_pending = 1;
+  }
+  for (; tail != head; tail++) {
+    position = render_queue[tail & (RENDER_QUEUE - 1)];
+    if (position == RENDER_ALL) {
+      memset(frame_dirty, 1, sizeof(frame_dirty));
+    } else {
+      frame_dirty[position] = 1;
+    }
+    frame_pending = 1;
+  }
+  atomic_store_explicit(&render_tail, tail, memory_order_release);
+}
+
+static void *
+render_main(void *arg)
+{
+  struct timespec frame;
+
+  frame.tv_sec = 0;
+  frame.tv_nsec = 1000000000 / FRAME_HZ;
+  for (;;) {
+    nanosleep(&frame, NULL);
+    pthread_mutex_lock(&render_lock);
+    render_take();
+    frame_flush();
+    pthread_mutex_unlock(&render_lock);
+    /* The next frame rewrites frame_image, which the server may still
+       be reading from shared memory until the put is done */
+    XSync(render_display, False);
+  }
+  return NULL;
+}
+
+/* Start the render thread, once the window is up */
+static void
+render_start(void)
+{
+  pthread_mutexattr_t attr;
+  sigset_t all, old;
+  int err;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&render_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  /* Have everything we drew so far (clearing the window) done first */
+  XSync(display, False);
+  render_push(RENDER_ALL);
+  /* Leave the heartbeat and the other signals to the emulation */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  err = pthread_create(&render_thread, NULL, render_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0) {
+    fatal("could not start the render thread: %s", strerror(err));
+  }
+  render_running = 1;
+}
+
+/* Keep the render thread from drawing while we change the display
+   mode; see render_lock */
+static void
+render_hold(void)
+{
+  if (render_running) pthread_mutex_lock(&render_lock);
+}
+
+static void
+render_release(void)
+{
+  if (render_running) pthread_mutex_unlock(&render_lock);
+}
+
+/* Called from trs_get_event; flushes the frame if it is time, or if
+   we are about to sleep */
+static void
+frame_tick(int wait)
+{
+  struct timeval now;
+
+  if (!frame_pending) return;
+  gettimeofday(&now, NULL);
+  if (wait || (now.tv_sec - frame_last.tv_sec) * 1000000 +
+      (now.tv_usec - frame_last.tv_usec) >= 1000000 / FRAME_HZ) {
+    frame_last = now;
+    frame_flush();
+    if (wait) XFlush(display);
+  }
+}
+
 void trs_screen_refresh()
 {
   int i, srcx, srcy, dunx, duny;
@@ -1435,10 +2358,15 @@ void trs_screen_refresh()
 #if XDEBUG
   debug("trs_screen_refresh\n");
 #endif
+  if (frame_mode) {
+    frame_mark_all();
+    return;
+  }
+  grafyx_init_dirty();
   if (grafyx_enable && !grafyx_overlay) {
     srcx = cur_char_width * grafyx_xoffset;
     srcy = scale_y * grafyx_yoffset;
-    XPutImage(display, window, gc, &image,
+    put_image(gc, &image,
 	      srcx, srcy,
 	      left_margin, top_margin,
 	      cur_char_width*row_chars,
@@ -1446,7 +2374,7 @@ void trs_screen_refresh()
     /* Draw wrapped portions if any */
     dunx = image.width - srcx;
     if (dunx < cur_char_width*row_chars) {
-      XPutImage(display, window, gc, &image,
+      put_image(gc, &image,
 		0, srcy,
 		left_margin + dunx, top_margin,
 		cur_char_width*row_chars - dunx,
@@ -1454,13 +2382,13 @@ void trs_screen_refresh()
     }
     duny = image.height - srcy;
     if (duny < cur_char_height*col_chars) {
-      XPutImage(display, window, gc, &image,
+      put_image(gc, &image,
 		srcx, 0,
 		left_margin, top_margin + duny,
 		cur_char_width*row_chars,
 		cur_char_height*col_chars - duny);
       if (dunx < cur_char_width*row_chars) {
-	XPutImage(display, window, gc, &image,
+	put_image(gc, &image,
 		  0, 0,
 		  left_margin + dunx, top_margin + duny,
 		  cur_char_width*row_chars - dunx,
@@ -1484,6 +2412,10 @@ void trs_screen_write_char(int position, int char_index)
   if (position >= screen_chars) {
     return;
   }
+  if (frame_mode) {
+    frame_mark(position);
+    return;
+  }
   if ((currentmode & EXPANDED) && (position & 1)) {
     return;
   }
@@ -1574,12 +2506,12 @@ void trs_screen_write_char(int position, int char_index)
     srcx = ((col+grafyx_xoffset) % G_XSIZE)*cur_char_width;
     srcy = (row*cur_char_height + grafyx_yoffset*scale_y)
 	   % (G_YSIZE*scale_y); 
-    XPutImage(display, window, gc_xor, &image, srcx, srcy,
+    put_image(gc_xor, &image, srcx, srcy,
 	      destx, desty, cur_char_width, cur_char_height);
     /* Draw wrapped portion if any */
     duny = image.height - srcy;
     if (duny < cur_char_height) {
-      XPutImage(display, window, gc_xor, &image,
+      put_image(gc_xor, &image,
 		srcx, 0,
 		destx, desty + duny,
 		cur_char_width, cur_char_height - duny);
@@ -1599,7 +2531,9 @@ void trs_screen_scroll()
   for (i = row_chars; i < screen_chars; i++)
     trs_screen[i-row_chars] = trs_screen[i];
 
-  if (grafyx_enable) {
+  if (frame_mode) {
+    frame_mark_all();
+  } else if (grafyx_enable) {
     if (grafyx_overlay) {
       trs_screen_refresh();
     }
@@ -1613,73 +2547,128 @@ void trs_screen_scroll()
   }
 }
 
+/* Called once shm_init has settled image's bit order */
+static void
+grafyx_init(void)
+{
+  int b, p;
+
+  for (b = 0; b < 256; b++) {
+    memset(grafyx_expand[b], 0, MAX_SCALE);
+    for (p = 0; p < 8 * scale_x; p++) {
+      if (b & (0x80 >> (p / scale_x))) {
+	grafyx_expand[b][p / 8] |= 0x80 >> (p % 8);
+      }
+    }
+    for (p = 0; p < scale_x; p++) {
+      if (image_lsbfirst) {
+	grafyx_expand[b][p] = bit_reverse[grafyx_expand[b][p]];
+      }
+    }
+  }
+  grafyx_init_dirty();
+}
+
+static void
+grafyx_init_dirty(void)
+{
+  memset(grafyx_dirty_lo, 0xff, sizeof(grafyx_dirty_lo));
+  memset(grafyx_dirty_hi, 0, sizeof(grafyx_dirty_hi));
+  grafyx_pending = 0;
+}
+
 void grafyx_write_byte(int x, int y, char byte)
 {
-  int i, j;
-  char exp[MAX_SCALE];
+  const unsigned char *exp = grafyx_expand[(unsigned char) byte];
+  char *p = image.data + y*scale_y*image.bytes_per_line + x*scale_x;
+  int j;
   int screen_x = ((x - grafyx_xoffset + G_XSIZE) % G_XSIZE);
   int screen_y = ((y - grafyx_yoffset + G_YSIZE) % G_YSIZE);
   int on_screen = screen_x < row_chars &&
     screen_y < col_chars*cur_char_height/scale_y;
 
-  if (grafyx_enable && grafyx_overlay && on_screen) {
-    /* Erase old byte, preserving text */
-    XPutImage(display, window, gc_xor, &image,
+  /* Save new byte in local memory */
+  grafyx_unscaled[y][x] = byte;
+  for (j = 0; j < scale_y; j++) {
+    memcpy(p, exp, scale_x);
+    p += image.bytes_per_line;
+  }
+
+  if (!grafyx_enable || !on_screen) return;
+  if (frame_mode) {
+    frame_mark(screen_y*scale_y/cur_char_height * row_chars + screen_x);
+  } else {
+    /* Drawn by grafyx_flush */
+    if (x < grafyx_dirty_lo[y]) grafyx_dirty_lo[y] = x;
+    if (x > grafyx_dirty_hi[y]) grafyx_dirty_hi[y] = x;
+    grafyx_pending = 1;
+  }
+}
+
+/* Draw a run of n bytes of line y of Grafyx memory, starting at x,
+   that are on the screen at screen_x, screen_y */
+static void
+grafyx_draw_run(int x, int y, int screen_x, int screen_y, int n,
+		unsigned char *cells)
+{
+  int i;
+
+  if (grafyx_overlay) {
+    /* Redraw the characters, which XORs the new bits over them */
+    for (i = 0; i < n; i++) {
+      cells[screen_y*scale_y/cur_char_height * row_chars + screen_x + i] = 1;
+    }
+  } else {
+    put_image(gc, &image,
 	      x*cur_char_width, y*scale_y,
 	      left_margin + screen_x*cur_char_width,
 	      top_margin + screen_y*scale_y,
-	      cur_char_width, scale_y);
+	      n*cur_char_width, scale_y);
   }
+}
 
-  /* Save new byte in local memory */
-  grafyx_unscaled[y][x] = byte;
-  switch (scale_x) {
-  case 1:
-    exp[0] = byte;
-    break;
-  case 2:
-    exp[1] = ((byte & 0x01) + ((byte & 0x02) << 1)
-	      + ((byte & 0x04) << 2) + ((byte & 0x08) << 3)) * 3;
-    exp[0] = (((byte & 0x10) >> 4) + ((byte & 0x20) >> 3)
-	      + ((byte & 0x40) >> 2) + ((byte & 0x80) >> 1)) * 3;
-    break;
-  case 3:
-    exp[2] = ((byte & 0x01) + ((byte & 0x02) << 2)
-	      + ((byte & 0x04) << 4)) * 7;
-    exp[1] = (((byte & 0x08) >> 2) + (byte & 0x10)
-	      + ((byte & 0x20) << 2)) * 7 + ((byte & 0x04) >> 2);
-    exp[0] = (((byte & 0x40) >> 4) + ((byte & 0x80) >> 2)) * 7
-           + ((byte & 0x20) >> 5) * 3;
-    break;
-  case 4:
-    exp[3] = ((byte & 0x01) + ((byte & 0x02) << 3)) * 15;
-    exp[2] = (((byte & 0x04) >> 2) + ((byte & 0x08) << 1)) * 15;
-    exp[1] = (((byte & 0x10) >> 4) + ((byte & 0x20) >> 1)) * 15;
-    exp[0] = (((byte & 0x40) >> 6) + ((byte & 0x80) >> 3)) * 15;
-    break;
-  default:
-    fatal("scaling graphics by %dx not implemented\n", scale_x);
-  }
-  for (j=0; j<scale_y; j++) {
-    for (i=0; i<scale_x; i++) {
-      grafyx[(y*scale_y + j)*image.bytes_per_line + x*scale_x + i] = exp[i];
+/* Draw the bytes grafyx_write_byte has queued, one XPutImage for each
+   run of adjacent bytes on a line (or, with the text overlaid, one
+   trs_screen_write_char for each character cell they touch) */
+static void
+grafyx_flush(void)
+{
+  unsigned char cells[2048];
+  int x, y, lo, hi, screen_x, screen_y, run_x, run_sx, n, i;
+
+  if (grafyx_overlay) memset(cells, 0, screen_chars);
+  for (y = 0; y < G_YSIZE; y++) {
+    lo = grafyx_dirty_lo[y];
+    hi = grafyx_dirty_hi[y];
+    if (lo > hi) continue;
+    grafyx_dirty_lo[y] = 0xff;
+    grafyx_dirty_hi[y] = 0;
+    screen_y = (y - grafyx_yoffset + G_YSIZE) % G_YSIZE;
+    if (!grafyx_enable || screen_y >= col_chars*cur_char_height/scale_y) {
+      continue;
+    }
+    n = 0;
+    run_x = run_sx = 0;
+    for (x = lo; x <= hi; x++) {
+      screen_x = (x - grafyx_xoffset + G_XSIZE) % G_XSIZE;
+      if (n > 0 && screen_x == run_sx + n) {
+	n++;
+	continue;
+      }
+      if (n > 0) grafyx_draw_run(run_x, y, run_sx, screen_y, n, cells);
+      n = 0;
+      if (screen_x < row_chars) {
+	run_x = x;
+	run_sx = screen_x;
+	n = 1;
+      }
     }
+    if (n > 0) grafyx_draw_run(run_x, y, run_sx, screen_y, n, cells);
   }
-
-  if (grafyx_enable && on_screen) {
-    /* Draw new byte */
-    if (grafyx_overlay) {
-      XPutImage(display, window, gc_xor, &image,
-		x*cur_char_width, y*scale_y,
-		left_margin + screen_x*cur_char_width,
-		top_margin + screen_y*scale_y,
-		cur_char_width, scale_y);
-    } else {
-      XPutImage(display, window, gc, &image,
-		x*cur_char_width, y*scale_y,
-		left_margin + screen_x*cur_char_width,
-		top_margin + screen_y*scale_y,
-		cur_char_width, scale_y);
+  grafyx_pending = 0;
+  if (grafyx_overlay && grafyx_enable) {
+    for (i = 0; i < screen_chars; i++) {
+      if (cells[i]) trs_screen_write_char(i, trs_screen[i]);
     }
   }
 }
@@ -1738,6 +2727,7 @@ void grafyx_write_mode(int value)
   unsigned char old_enable = grafyx_enable;
   unsigned char old_overlay = grafyx_overlay;
 
+  render_hold();
   grafyx_enable = value & G_ENABLE;
   if (grafyx_microlabs) {
     grafyx_overlay = (value & G_UL_NOTEXT) == 0;
@@ -1749,34 +2739,41 @@ void grafyx_write_mode(int value)
     
     trs_screen_refresh();
   }
+  render_release();
 }
 
 void grafyx_write_xoffset(int value)
 {
   unsigned char old_xoffset = grafyx_xoffset;
+  render_hold();
   grafyx_xoffset = value % G_XSIZE;
   if (grafyx_enable && old_xoffset != grafyx_xoffset) {
     trs_screen_refresh();
   }
+  render_release();
 }
 
 void grafyx_write_yoffset(int value)
 {
   unsigned char old_yoffset = grafyx_yoffset;
+  render_hold();
   grafyx_yoffset = value;
   if (grafyx_enable && old_yoffset != grafyx_yoffset) {
     trs_screen_refresh();
   }
+  render_release();
 }
 
 void grafyx_write_overlay(int value)
 {
   unsigned char old_overlay = grafyx_overlay;
+  render_hold();
   grafyx_overlay = value & 1;
   if (grafyx_enable && old_overlay != grafyx_overlay) {
     trs_screen_640x240((grafyx_enable && !grafyx_overlay) || text80x24);
     trs_screen_refresh();
   }
+  render_release();
 }
 
 int grafyx_get_microlabs()
@@ -1799,11 +2796,13 @@ void grafyx_m3_write_mode(int value)
 {
   int enable = (value & G3_ENABLE) != 0;
   int changed = (enable != grafyx_enable);
+  render_hold();
   grafyx_enable = enable;
   grafyx_overlay = enable;
   grafyx_mode = value;
   grafyx_y = G3_YLOW(value);
   if (changed) trs_screen_refresh();
+  render_release();
 }
 
 int grafyx_m3_write_byte(int position, int byte)
@@ -1856,7 +2855,6 @@ int grafyx_m3_active()
  */
 
 static unsigned char le18_x, le18_y, le18_on;
-int lowe_le18;
 
 void lowe_le18_reset(void)
 {
@@ -1910,9 +2908,11 @@ void lowe_le18_write_control(int value)
 {
   if (lowe_le18 && ((le18_on ^ value) & 1)) {
     le18_on = value & 1;
+    render_hold();
     grafyx_enable = le18_on;
     grafyx_overlay = le18_on;
     trs_screen_refresh();
+    render_release();
   }
 }
 
@@ -1987,12 +2987,14 @@ hrg_onoff(int enable)
 
   if ((hrg_enable!=0) == (enable!=0)) return; /* State does not change. */
 
+  render_hold();
   if (!init) {
     hrg_init();
     init = 1;
   }
   hrg_enable = enable;
   trs_screen_refresh();
+  render_release();
 }
 
 /* Write address to latch. */
@@ -2019,6 +3021,10 @@ hrg_write_data(int data)
   if ((data &= 0x3f) == (old_data &= 0x3f)) return;
 
   position = hrg_addr & 0x3ff;	/* bits 0-9: "PRINT @" screen position */
+  if (frame_mode) {
+    if (position < screen_chars) frame_mark(position);
+    return;
+  }
   line = hrg_addr >> 10;	/* vertical offset inside character cell */
   bits0 = ~data & old_data;	/* pattern to clear */
   bits1 = data & ~old_data;	/* pattern to set */
@@ -24,9 +24,8 @@
  * The Z80 emulator should be general and complete enough to be
  * easily adapted to emulate any Z80 machine.  All of the documented
  * Z80 flags and instructions are implemented.  The only documented
- * features we cheat a little on are interrupt handling (modes 0 and 2
- * are not supported) and the refresh register (reading it returns a
- * random number; writing it is ignored).
+ * feature we cheat a little on is interrupt handling (modes 0 and 2
+ * are not supported).
  *
  * All of the undocumented instructions, flags, and features listed in
  * http://www.msxnet.org/tech/Z80/z80undoc.txt are implemented too,
@@ -43,8 +42,9 @@
 #include "z80.h"
 #include "trs.h"
 #include "trs_imp_exp.h"
-#include <stdlib.h>  /* for rand() */
-#include <time.h>    /* for time() */
+#include "trs_profile.h"
+#include <stdlib.h>
+#include <string.h>  /* for memset() */
 
 /*
  * Keep Saber quiet.
@@ -55,9 +55,339 @@
 /*SUPPRESS 115*/
 
 /*
- * The state of our Z80 registers is kept in this structure:
+ * Opcode dispatch.  Normally each opcode page (unprefixed, CB, DD/FD,
+ * ED) is decoded with a plain switch.  If Z80_THREADED is defined,
+ * each page instead jumps straight to its handler through a table of
+ * label addresses (a gcc extension), which gives the host's branch
+ * predictor one indirect jump per page instead of one shared
+ * switch.  The opcode bodies are the same code either way; each case
+ * label simply also gets a named label for the table to point at.
  */
-struct z80_state_struct z80_state;
+#ifdef Z80_THREADED
+#define OPCODE(page, op)      case op: page##_##op
+#define OPCODE_DEFAULT(page)  page##_default: __attribute__((unused)); default
+#define DISPATCH(page, insn)  goto *page##_dispatch[(insn)]
+#else
+#define OPCODE(page, op)      case op
+#define OPCODE_DEFAULT(page)  default
+#define DISPATCH(page, insn)  ((void) 0)
+#endif
+
+/*
+ * Memory access.  Plain RAM and ROM pages are reached directly
+ * through the page tables in trs_memory.c; everything else goes
+ * through the real mem_read and mem_write, after checking for a
+ * watchpoint.
+ */
+static inline int z80_mem_read(int address)
+{
+    Uchar *p = mem_read_page[(address >> 8) & 0xff];
+    int value;
+
+    if (p) return p[address & 0xff];
+    value = (mem_read)(address);
+    if (z80_watch && (z80_watch->mem[address & 0xffff] & WATCH_READ)) {
+	trs_watch_hit(address & 0xffff, value, WATCH_READ);
+    }
+    return value;
+}
+
+static inline void z80_mem_write(int address, int value)
+{
+    int page = (address >> 8) & 0xff;
+    Uchar *p = mem_write_page[page];
+
+    if (p && !z80_code_page[page]) {
+	p[address & 0xff] = value;
+	return;
+    }
+    if (z80_watch && (z80_watch->mem[address & 0xffff] & WATCH_WRITE)) {
+	trs_watch_hit(address & 0xffff, value & 0xff, WATCH_WRITE);
+    }
+    (mem_write)(address, value);
+}
+
+static inline int z80_mem_read_word(int address)
+{
+    int rval;
+
+    rval = z80_mem_read(address);
+    rval |= z80_mem_read((address + 1) & 0xffff) << 8;
+    return rval;
+}
+
+static inline void z80_mem_write_word(int address, int value)
+{
+    z80_mem_write(address, value & 0xff);
+    z80_mem_write((address + 1) & 0xffff, value >> 8);
+}
+
+#define mem_read(address)              z80_mem_read(address)
+#define mem_write(address, value)      z80_mem_write(address, value)
+#define mem_read_word(address)         z80_mem_read_word(address)
+#define mem_write_word(address, value) z80_mem_write_word(address, value)
+
+/* I/O ports likewise */
+static inline int z80_port_in(int port)
+{
+    int value = (z80_in)(port);
+
+    z80_last_in[port & 0xff] = value;
+    if (z80_watch && (z80_watch->port[port & 0xff] & WATCH_IN)) {
+	trs_watch_hit(port & 0xff, value, WATCH_IN);
+    }
+    return value;
+}
+
+static inline void z80_port_out(int port, int value)
+{
+    z80_last_out[port & 0xff] = value;
+    if (z80_watch && (z80_watch->port[port & 0xff] & WATCH_OUT)) {
+	trs_watch_hit(port & 0xff, value, WATCH_OUT);
+    }
+    (z80_out)(port, value);
+}
+
+#define z80_in(port)         z80_port_in(port)
+#define z80_out(port, value) z80_port_out(port, value)
+
+/*
+ * Block cache.  When z80_block_cache is set, z80_run decodes each
+ * straight-line run of instructions (up to the next jump, call,
+ * return, or halt) once, keeps a copy of its bytes keyed by the
+ * starting PC, and satisfies instruction fetches that fall inside
+ * the current block from the copy instead of going through mem_read.
+ * The opcode bodies are the same either way, so each instruction
+ * still does its own T_COUNT, and the event and interrupt checks
+ * still happen between instructions.
+ *
+ * Only pages that mem_page_cacheable says are plain RAM or ROM are
+ * copied.  mem_write to a page holding cached code invalidates that
+ * page (see z80_code_page); any change to the memory map, and any
+ * write through mem_pointer, flushes everything.
+ */
+int z80_block_cache = 0;
+
+#define BLOCK_CACHE_SIZE 4096  /* entries; must be a power of 2 */
+#define BLOCK_MAX 64           /* bytes per block */
+
+struct z80_block {
+    Ushort pc;                 /* address of first byte */
+    Ushort len;                /* length in bytes; 0 if empty */
+    Uint map_gen;              /* block_map_gen when decoded */
+    Uint page_gen[2];          /* block_page_gen of first and last page */
+    Uchar bytes[BLOCK_MAX];
+};
+
+/* Per-machine state; z80_code_page (nonzero if a cached block uses
+   the page) is in struct trs_machine because trs_memory.c uses it */
+struct z80_machine {
+    struct z80_block *block_cache;  /* allocated on first use */
+    Uint block_map_gen;
+    Uint block_page_gen[256];
+
+    /* Block we are currently fetching from; block_len is 0 if none */
+    Ushort block_pc, block_len;
+    Uchar *block_bytes;
+};
+
+#define block_cache    (trs_cur->z80->block_cache)
+#define block_map_gen  (trs_cur->z80->block_map_gen)
+#define block_page_gen (trs_cur->z80->block_page_gen)
+#define block_pc       (trs_cur->z80->block_pc)
+#define block_len      (trs_cur->z80->block_len)
+#define block_bytes    (trs_cur->z80->block_bytes)
+
+/*
+ * Length of each unprefixed instruction in the low bits; 0x80 set if
+ * it transfers control and so ends a block.  The lengths are used
+ * only to find the end of the block, so the cache stays correct (if
+ * less effective) on odd prefix sequences.
+ */
+static const Uchar block_length_table[256] = {
+    0x01, 0x03, 0x01, 0x01, 0x01, 0x01, 0x02, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x02, 0x01,
+    0x82, 0x03, 0x01, 0x01, 0x01, 0x01, 0x02, 0x01,
+    0x82, 0x01, 0x01, 0x01, 0x01, 0x01, 0x02, 0x01,
+    0x82, 0x03, 0x03, 0x01, 0x01, 0x01, 0x02, 0x01,
+    0x82, 0x01, 0x03, 0x01, 0x01, 0x01, 0x02, 0x01,
+    0x82, 0x03, 0x03, 0x01, 0x01, 0x01, 0x02, 0x01,
+    0x82, 0x01, 0x03, 0x01, 0x01, 0x01, 0x02, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x81, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x81, 0x01, 0x83, 0x83, 0x83, 0x01, 0x02, 0x81,
+    0x81, 0x81, 0x83, 0x02, 0x83, 0x83, 0x02, 0x81,
+    0x81, 0x01, 0x83, 0x02, 0x83, 0x01, 0x02, 0x81,
+    0x81, 0x01, 0x83, 0x02, 0x83, 0x01, 0x02, 0x81,
+    0x81, 0x01, 0x83, 0x01, 0x83, 0x01, 0x02, 0x81,
+    0x81, 0x81, 0x83, 0x01, 0x83, 0x01, 0x02, 0x81,
+    0x81, 0x01, 0x83, 0x01, 0x83, 0x01, 0x02, 0x81,
+    0x81, 0x01, 0x83, 0x01, 0x83, 0x01, 0x02, 0x81
+};
+
+static int block_insn_length(Uchar *p, int *ends)
+{
+    int len;
+
+    switch (p[0]) {
+      case 0xCB:
+	*ends = 0;
+	return 2;
+      case 0xED:
+	/* retn, reti, and the emulator traps end a block */
+	*ends = ((p[1] & 0xC7) == 0x45) || (p[1] >= 0x28 && p[1] <= 0x3F);
+	return ((p[1] & 0xC7) == 0x43) ? 4 : 2;
+      case 0xDD:
+      case 0xFD:
+	switch (p[1]) {
+	  case 0xCB:
+	    *ends = 0;
+	    return 4;
+	  case 0xDD: case 0xED: case 0xFD:
+	    *ends = 0;
+	    return 1;
+	  case 0x34: case 0x35: case 0x36:
+	  case 0x46: case 0x4E: case 0x56: case 0x5E: case 0x66: case 0x6E:
+	  case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75:
+	  case 0x77: case 0x7E: case 0x86: case 0x8E: case 0x96: case 0x9E:
+	  case 0xA6: case 0xAE: case 0xB6: case 0xBE:
+	    /* (ix + offset) */
+	    len = 2;
+	    break;
+	  default:
+	    len = 1;
+	    break;
+	}
+	*ends = (block_length_table[p[1]] & 0x80) != 0;
+	return len + (block_length_table[p[1]] & 0x0f);
+      default:
+	*ends = (block_length_table[p[0]] & 0x80) != 0;
+	return block_length_table[p[0]] & 0x0f;
+    }
+}
+
+static int block_last_page(struct z80_block *b)
+{
+    return ((b->pc + b->len - 1) >> 8) & 0xff;
+}
+
+/* Decode the block starting at pc into b.  Returns 0 if pc is not
+   in cacheable memory. */
+static int block_decode(struct z80_block *b, Ushort pc)
+{
+    int limit, len = 0, ends = 0, i;
+
+    if (!mem_page_cacheable(pc)) return 0;
+
+    /* Stay within this page and the next, and read ahead only where
+       it is safe to do so. */
+    limit = 0x100 - (pc & 0xff);
+    if (mem_page_cacheable((pc + 0x100) & 0xffff)) limit += 0x100;
+    if (limit > BLOCK_MAX) limit = BLOCK_MAX;
+
+    while (!ends && len + 4 <= limit) {
+	for (i = 0; i < 4; i++) {
+	    b->bytes[len + i] = mem_read(pc + len + i);
+	}
+	len += block_insn_length(&b->bytes[len], &ends);
+    }
+    if (len == 0) return 0;
+
+    b->pc = pc;
+    b->len = len;
+    b->map_gen = block_map_gen;
+    b->page_gen[0] = block_page_gen[pc >> 8];
+    b->page_gen[1] = block_page_gen[block_last_page(b)];
+    z80_code_page[pc >> 8] = 1;
+    z80_code_page[block_last_page(b)] = 1;
+    return 1;
+}
+
+/* Start fetching from the block at pc, decoding it if needed */
+static void block_enter(Ushort pc)
+{
+    struct z80_block *b;
+
+    if (block_cache == NULL) {
+	block_cache = (struct z80_block *)
+	  calloc(BLOCK_CACHE_SIZE, sizeof(struct z80_block));
+	if (block_cache == NULL) fatal("out of memory");
+    }
+    b = &block_cache[pc & (BLOCK_CACHE_SIZE - 1)];
+
+    if (b->len == 0 || b->pc != pc || b->map_gen != block_map_gen ||
+	b->page_gen[0] != block_page_gen[pc >> 8] ||
+	b->page_gen[1] != block_page_gen[block_last_page(b)]) {
+	if (!block_decode(b, pc)) {
+	    b->len = 0;
+	    block_len = 0;
+	    return;
+	}
+    }
+    block_pc = b->pc;
+    block_len = b->len;
+    block_bytes = b->bytes;
+}
+
+/* Called by mem_write when it hits a page marked in z80_code_page */
+void z80_block_invalidate(int address)
+{
+    int page = (address >> 8) & 0xff;
+
+    z80_code_page[page] = 0;
+    block_page_gen[page]++;
+    if (block_len && (page == (block_pc >> 8) ||
+		      page == (((block_pc + block_len - 1) >> 8) & 0xff))) {
+	block_len = 0;
+    }
+}
+
+/* Called whenever the memory map changes */
+void z80_block_flush(void)
+{
+    memset(z80_code_page, 0, sizeof(z80_code_page));
+    block_map_gen++;
+    block_len = 0;
+}
+
+/*
+ * Instruction stream fetches.  These must be used for every byte
+ * read at or after REG_PC as part of decoding an instruction.  They
+ * are not data reads, so they don't hit read watchpoints.
+ */
+static inline int fetch_byte(int address)
+{
+    Ushort offset = (Ushort) (address - block_pc);
+    Uchar *p;
+
+    if (offset < block_len) return block_bytes[offset];
+    p = mem_read_page[(address >> 8) & 0xff];
+    if (p) return p[address & 0xff];
+    return (mem_read)(address);
+}
+
+static inline int fetch_word(int address)
+{
+    int rval;
+
+    rval = fetch_byte(address);
+    rval |= fetch_byte((address + 1) & 0xffff) << 8;
+    return rval;
+}
 
 /*
  * Tables and routines for computing various flag values:
@@ -111,11 +441,9 @@ static Uchar subtract_half_carry_table[] =
     HALF_CARRY_MASK,
 };
 
-static int parity(unsigned value)
+/* for parity flag, 1 = even parity, 0 = odd parity. */
+static char parity_table[256] =
 {
-    /* for parity flag, 1 = even parity, 0 = odd parity. */
-    static char parity_table[256] =
-    {
 	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 
 	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 
 	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 
@@ -132,12 +460,9 @@ static int parity(unsigned value)
 	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 
 	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 
 	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1
-    };
-
-    return(parity_table[value]);
-}
+};
 
-static void do_add_flags(int a, int b, int result)
+static int add_flags(int a, int b, int result)
 {
     /*
      * Compute the flag values for a + b = result operation
@@ -161,10 +486,10 @@ static void do_add_flags(int a, int b, int result)
 
     if((result & 0xFF) == 0) f |= ZERO_MASK;
 
-    REG_F = f;
+    return f;
 }
 
-static void do_sub_flags(int a, int b, int result)
+static int sub_flags(int a, int b, int result)
 {
     int index;
     int f;
@@ -184,7 +509,7 @@ static void do_sub_flags(int a, int b, int result)
 
     if((result & 0xFF) == 0) f |= ZERO_MASK;
 
-    REG_F = f;
+    return f;
 }
 
 
@@ -262,7 +587,7 @@ static void do_sbc_word_flags(int a, int b, int result)
     REG_F = f;
 }
 
-static void do_flags_dec_byte(int value)
+static int dec_flags(int value)
 {
     Uchar set;
 
@@ -277,11 +602,10 @@ static void do_flags_dec_byte(int value)
     if(value & 0x80)
       set |= SIGN_MASK;
 
-    REG_F = (REG_F & CARRY_MASK) | set
-      | (value & (UNDOC3_MASK | UNDOC5_MASK));
+    return set | (value & (UNDOC3_MASK | UNDOC5_MASK));
 }
 
-static void do_flags_inc_byte(int value)
+static int inc_flags(int value)
 {
     Uchar set;
 
@@ -296,99 +620,115 @@ static void do_flags_inc_byte(int value)
     if(value & 0x80)
       set |= SIGN_MASK;
 
-    REG_F = (REG_F & CARRY_MASK) | set
-      | (value & (UNDOC3_MASK | UNDOC5_MASK));
+    return set | (value & (UNDOC3_MASK | UNDOC5_MASK));
 }
 
 /*
- * Routines for executing or assisting various non-trivial arithmetic
- * instructions:
+ * Flag lookup tables, filled in once by init_flag_tables from the
+ * routines above:
+ *
+ *   szp_table        S, Z, P, and undocumented bits 3 and 5 of a
+ *                    result byte (for logical ops, rotates, in)
+ *   inc_flags_table, dec_flags_table
+ *                    all flags but carry after inc or dec, indexed
+ *                    by the result
+ *   add_flags_table, sub_flags_table
+ *                    all flags after a + b + carry or a - b - carry,
+ *                    indexed by [carry][a][b]
  */
-static void do_and_byte(int value)
-{
-    int result;
-    Uchar set;
+static Uchar szp_table[256];
+static Uchar inc_flags_table[256];
+static Uchar dec_flags_table[256];
+static Uchar add_flags_table[2][256][256];
+static Uchar sub_flags_table[2][256][256];
 
-    result = (REG_A &= value);
-
-    set = HALF_CARRY_MASK;
+static void init_flag_tables()
+{
+    static int done = 0;
+    int a, b, c;
+
+    if (done) return;
+    for (a = 0; a < 256; a++) {
+	szp_table[a] = (a & (SIGN_MASK | UNDOC3_MASK | UNDOC5_MASK)) |
+	  (a == 0 ? ZERO_MASK : 0) | (parity_table[a] ? PARITY_MASK : 0);
+	inc_flags_table[a] = inc_flags(a);
+	dec_flags_table[a] = dec_flags(a);
+	for (b = 0; b < 256; b++) {
+	    for (c = 0; c < 2; c++) {
+		add_flags_table[c][a][b] = add_flags(a, b, a + b + c);
+		sub_flags_table[c][a][b] = sub_flags(a, b, a - b - c);
+	    }
+	}
+    }
+    done = 1;
+}
 
-    if(parity(result))
-      set |= PARITY_MASK;
-    if(result == 0)
-      set |= ZERO_MASK;
-    if(result & 0x80)
-      set |= SIGN_MASK;
+#define do_add_flags(a, b, carry) (REG_F = add_flags_table[carry][a][b])
+#define do_sub_flags(a, b, carry) (REG_F = sub_flags_table[carry][a][b])
 
-    REG_F = set | (result & (UNDOC3_MASK | UNDOC5_MASK));
+static int parity(unsigned value)
+{
+    return(szp_table[value] & PARITY_MASK);
 }
 
-static void do_or_byte(int value)
+static void do_flags_dec_byte(int value)
 {
-    int result;  /* the result of the or operation */
-    Uchar set;
-
-    result = (REG_A |= value);
+    REG_F = (REG_F & CARRY_MASK) | dec_flags_table[value];
+}
 
-    set = 0;
+static void do_flags_inc_byte(int value)
+{
+    REG_F = (REG_F & CARRY_MASK) | inc_flags_table[value];
+}
 
-    if(parity(result))
-      set |= PARITY_MASK;
-    if(result == 0)
-      set |= ZERO_MASK;
-    if(result & 0x80)
-      set |= SIGN_MASK;
+/*
+ * Routines for executing or assisting various non-trivial arithmetic
+ * instructions:
+ */
+static void do_and_byte(int value)
+{
+    REG_A &= value;
+    REG_F = szp_table[REG_A] | HALF_CARRY_MASK;
+}
 
-    REG_F = set | (result & (UNDOC3_MASK | UNDOC5_MASK));
+static void do_or_byte(int value)
+{
+    REG_A |= value;
+    REG_F = szp_table[REG_A];
 }
 
 static void do_xor_byte(int value)
 {
-    int result;  /* the result of the xor operation */
-    Uchar set;
-
-    result = (REG_A ^= value);
-
-    set = 0;
-
-    if(parity(result))
-      set |= PARITY_MASK;
-    if(result == 0)
-      set |= ZERO_MASK;
-    if(result & 0x80)
-      set |= SIGN_MASK;
-
-    REG_F = set | (result & (UNDOC3_MASK | UNDOC5_MASK));
+    REG_A ^= value;
+    REG_F = szp_table[REG_A];
 }
 
 static void do_add_byte(int value)
 {
-    int a, result;
+    int a;
 
-    result = (a = REG_A) + value;
-    REG_A = result;
-    do_add_flags(a, value, result);
+    a = REG_A;
+    REG_A = a + value;
+    do_add_flags(a, value, 0);
 }
 
 static void do_adc_byte(int value)
 {
-    int a, result;
+    int a, carry;
 
-    if(CARRY_FLAG)
-      result = (a = REG_A) + value + 1;
-    else
-      result = (a = REG_A) + value;
-    REG_A = result;
-    do_add_flags(a, value, result);
+    a = REG_A;
+    carry = CARRY_FLAG;
+    REG_A = a + value + carry;
+    do_add_flags(a, value, carry);
 }
 
 static void do_sub_byte(int value)
 {
-    int a, result;
+    int a;
 
-    result = (a = REG_A) - value;
-    REG_A = result;
-    do_sub_flags(a, value, result);
+    a = REG_A;
+    REG_A = a - value;
+    do_sub_flags(a, value, 0);
 }
 
 static void do_negate()
@@ -397,19 +737,17 @@ static void do_negate()
 
     a = REG_A;
     REG_A = - a;
-    do_sub_flags(0, a, REG_A);
+    do_sub_flags(0, a, 0);
 }
 
 static void do_sbc_byte(int value)
 {
-    int a, result;
+    int a, carry;
 
-    if(CARRY_FLAG)
-      result = (a = REG_A) - (value + 1);
-    else
-      result = (a = REG_A) - value;
-    REG_A = result;
-    do_sub_flags(a, value, result);
+    a = REG_A;
+    carry = CARRY_FLAG;
+    REG_A = a - value - carry;
+    do_sub_flags(a, value, carry);
 }
 
 static void do_add_word(int value)
@@ -463,28 +801,10 @@ static void do_add_word_index(Ushort *regp, int value)
 /* compare this value with A's contents */
 static void do_cp(int value)
 {
-    int a, result;
-    int index;
-    int f;
-
-    result = (a = REG_A) - value;
-
-    /*
-     * Sign, carry, and overflow depend upon values of bit 7.
-     * Half-carry depends upon values of bit 3.
-     * We mask those bits, munge them into an index, and look
-     * up the flag values in the above tables.
-     * Undocumented flags in bit 3, 5 of F come from the second operand.
-     */
-
-    index = ((a & 0x88) >> 1) | ((value & 0x88) >> 2) | ((result & 0x88) >> 3);
-    f = SUBTRACT_MASK | subtract_half_carry_table[index & 7] |
-      subtract_sign_carry_overflow_table[index >> 4] |
-      (value & (UNDOC3_MASK|UNDOC5_MASK));
-
-    if((result & 0xFF) == 0) f |= ZERO_MASK;
-
-    REG_F = f;
+    /* Undocumented flags in bit 3, 5 of F come from the second operand. */
+    REG_F = (sub_flags_table[0][REG_A][value] &
+	     ~(UNDOC3_MASK | UNDOC5_MASK)) |
+      (value & (UNDOC3_MASK | UNDOC5_MASK));
 }
 
 static void do_cpd()
@@ -496,7 +816,7 @@ static void do_cpd()
     REG_HL--;
     REG_BC--;
 
-    do_sub_flags(a, value, result);
+    do_sub_flags(a, value, 0);
     REG_F = (REG_F & ~(CARRY_MASK | OVERFLOW_MASK | UNDOC5_MASK))
       | oldcarry | (REG_BC == 0 ? 0 : OVERFLOW_MASK)
       | (((result - ((REG_F & HALF_CARRY_MASK) >> 4)) & 2) << 4);
@@ -516,7 +836,7 @@ static void do_cpi()
     REG_HL++;
     REG_BC--;
 
-    do_sub_flags(a, value, result);
+    do_sub_flags(a, value, 0);
     REG_F = (REG_F & ~(CARRY_MASK | OVERFLOW_MASK | UNDOC5_MASK))
       | oldcarry | (REG_BC == 0 ? 0 : OVERFLOW_MASK)
       | (((result - ((REG_F & HALF_CARRY_MASK) >> 4)) & 2) << 4);
@@ -541,7 +861,7 @@ static void do_cpdr()
 
     } while((REG_BC != 0) && (result != 0));
 
-    do_sub_flags(a, value, result);
+    do_sub_flags(a, value, 0);
     REG_F = (REG_F & ~(CARRY_MASK | OVERFLOW_MASK | UNDOC5_MASK))
       | oldcarry | (REG_BC == 0 ? 0 : OVERFLOW_MASK)
       | (((result - ((REG_F & HALF_CARRY_MASK) >> 4)) & 2) << 4);
@@ -566,7 +886,7 @@ static void do_cpir()
 
     } while((REG_BC != 0) && (result != 0));
 
-    do_sub_flags(a, value, result);
+    do_sub_flags(a, value, 0);
     REG_F = (REG_F & ~(CARRY_MASK | OVERFLOW_MASK | UNDOC5_MASK))
       | oldcarry | (REG_BC == 0 ? 0 : OVERFLOW_MASK)
       | (((result - ((REG_F & HALF_CARRY_MASK) >> 4)) & 2) << 4);
@@ -958,6 +1278,87 @@ static void do_ldi()
     T_COUNT(16);
 }
 
+/*
+ * Bulk block moves.  When z80_bulk_move is set, LDIR and LDDR copy
+ * a run of bytes at once through the page tables instead of going
+ * back around z80_run for every byte.  A run stays within one source
+ * page and one destination page, both plain RAM or ROM that holds no
+ * cached code, and stops short of the LDIR/LDDR instruction itself
+ * and of the last byte of the move.  It is also cut off at the point
+ * where the next scheduled event falls due, and is not attempted at
+ * all while an interrupt is deliverable, the instruction has a trap
+ * (breakpoint, trace, or batch trap) on it, or we are single-stepping
+ * or throttled, so the emulated machine sees exactly what it would have
+ * seen with one byte per instruction.  Each byte in the run is
+ * charged the 21 T-states of a repeating iteration; the caller then
+ * does the next byte with do_ldi or do_ldd as usual, which sets the
+ * flags and decides whether to repeat.  With FASTMEM, LDIR and LDDR
+ * always move the whole block at once, and z80_bulk_move is ignored.
+ */
+int z80_bulk_move = 0;
+
+#ifndef FASTMEM
+static void do_bulk_move(int dir)
+{
+    int src = REG_HL, dst = REG_DE, ed = (REG_PC - 2) & 0xffff;
+    int n, i;
+    Uchar *s, *d;
+    tstate_t left;
+
+    if (trs_continuous <= 0 || z80_state.delay || z80_wakeup ||
+	(z80_traps && z80_traps[ed]) ||
+	(z80_state.nmi && !z80_state.nmi_seen) ||
+	(z80_state.irq && z80_state.iff1)) return;
+    s = mem_read_page[src >> 8];
+    d = mem_write_page[dst >> 8];
+    if (s == NULL || d == NULL || z80_code_page[dst >> 8]) return;
+
+    /* Leave the last byte of the move to the caller */
+    n = ((REG_BC - 1) & 0xffff);
+
+    /* Stay within the source and destination pages */
+    if (dir > 0) {
+	if (0x100 - (src & 0xff) < n) n = 0x100 - (src & 0xff);
+	if (0x100 - (dst & 0xff) < n) n = 0x100 - (dst & 0xff);
+	if (((ed - dst) & 0xffff) < n) n = (ed - dst) & 0xffff;
+	if (((ed + 1 - dst) & 0xffff) < n) n = (ed + 1 - dst) & 0xffff;
+    } else {
+	if ((src & 0xff) + 1 < n) n = (src & 0xff) + 1;
+	if ((dst & 0xff) + 1 < n) n = (dst & 0xff) + 1;
+	if (((dst - ed) & 0xffff) < n) n = (dst - ed) & 0xffff;
+	if (((dst - ed - 1) & 0xffff) < n) n = (dst - ed - 1) & 0xffff;
+    }
+
+    /* Stop where z80_run would have, after the instruction that
+       takes us past the next scheduled event */
+    if (z80_state.sched) {
+	left = z80_state.sched - z80_state.t_count;
+	if (left > TSTATE_T_MID) return;
+	if (left / 21 < n) n = left / 21;
+    }
+    if (n <= 0) return;
+
+    s += src & 0xff;
+    d += dst & 0xff;
+    if (dir > 0) {
+	for (i = 0; i < n; i++) d[i] = s[i];
+    } else {
+	for (i = 0; i < n; i++) d[-i] = s[-i];
+    }
+    REG_HL += dir * n;
+    REG_DE += dir * n;
+    REG_BC -= n;
+    T_COUNT(21 * n);
+    z80_state.r += 2 * n;
+    z80_state.i_count += n;
+    x_poll_count -= n;
+    if (z80_profile && z80_profile->on) {
+	z80_profile->count[ed] += n;
+	z80_profile->bank_count[z80_profile->page_bank[ed >> 8]] += n;
+    }
+}
+#endif /*!FASTMEM*/
+
 static void do_ldir()
 {
 #ifdef FASTMEM
@@ -966,6 +1367,7 @@ static void do_ldir()
 
     moved = mem_block_transfer(REG_DE, REG_HL, 1, REG_BC);
     T_COUNT(((REG_BC-1) & 0xffff) * 21 + 16);
+    z80_state.r += 2 * (REG_BC - 1);
 
     /* set registers to final values */
     REG_DE += REG_BC;
@@ -977,6 +1379,7 @@ static void do_ldir()
     REG_F = (REG_F & (CARRY_MASK | ZERO_MASK | SIGN_MASK)) 
       | (undoc & UNDOC3_MASK) | ((undoc & 2) ? UNDOC5_MASK : 0);
 #else
+    if (z80_bulk_move) do_bulk_move(1);
     do_ldi();
     if(OVERFLOW_FLAG) {
       REG_PC -= 2;
@@ -993,6 +1396,7 @@ static void do_lddr()
 
     moved = mem_block_transfer(REG_DE, REG_HL, -1, REG_BC);
     T_COUNT(((REG_BC-1) & 0xffff) * 21 + 16);
+    z80_state.r += 2 * (REG_BC - 1);
 
     /* set registers to final values */
     REG_DE -= REG_BC;
@@ -1004,6 +1408,7 @@ static void do_lddr()
     REG_F = (REG_F & (CARRY_MASK | ZERO_MASK | SIGN_MASK)) 
       | (undoc & UNDOC3_MASK) | ((undoc & 2) ? UNDOC5_MASK : 0);
 #else
+    if (z80_bulk_move) do_bulk_move(-1);
     do_ldd();
     if(OVERFLOW_FLAG) {
       REG_PC -= 2;
@@ -1037,8 +1442,7 @@ static void do_ld_a_r()
 
     set = 0;
 
-    /* Fetch a random value. */
-    REG_A = (rand() >> 8) & 0xFF;
+    REG_A = REG_R;
 
     if(REG_A & 0x80)
       set |= SIGN_MASK;
@@ -1311,6 +1715,7 @@ static void do_di()
 static void do_ei()
 {
     z80_state.iff1 = z80_state.iff2 = 1;
+    z80_wakeup = 1;
 }
 
 static void do_im0()
@@ -1331,6 +1736,7 @@ static void do_im2()
 static void do_int()
 {
     /* handle a maskable interrupt */
+    z80_state.r++;
     REG_SP -= 2;
     mem_write_word(REG_SP, REG_PC);
     z80_state.iff1 = z80_state.iff2 = 0;
@@ -1352,6 +1758,7 @@ static void do_int()
 static void do_nmi()
 {
     /* handle a non-maskable interrupt */
+    z80_state.r++;
     REG_SP -= 2;
     mem_write_word(REG_SP, REG_PC);
     z80_state.iff1 = 0;
@@ -1364,794 +1771,864 @@ static void do_nmi()
 static void do_CB_instruction()
 {
     Uchar instruction;
+#ifdef Z80_THREADED
+    static void *const cb_dispatch[256] = {
+	&&cb_0x00, &&cb_0x01, &&cb_0x02, &&cb_0x03,
+	&&cb_0x04, &&cb_0x05, &&cb_0x06, &&cb_0x07,
+	&&cb_0x08, &&cb_0x09, &&cb_0x0A, &&cb_0x0B,
+	&&cb_0x0C, &&cb_0x0D, &&cb_0x0E, &&cb_0x0F,
+	&&cb_0x10, &&cb_0x11, &&cb_0x12, &&cb_0x13,
+	&&cb_0x14, &&cb_0x15, &&cb_0x16, &&cb_0x17,
+	&&cb_0x18, &&cb_0x19, &&cb_0x1A, &&cb_0x1B,
+	&&cb_0x1C, &&cb_0x1D, &&cb_0x1E, &&cb_0x1F,
+	&&cb_0x20, &&cb_0x21, &&cb_0x22, &&cb_0x23,
+	&&cb_0x24, &&cb_0x25, &&cb_0x26, &&cb_0x27,
+	&&cb_0x28, &&cb_0x29, &&cb_0x2A, &&cb_0x2B,
+	&&cb_0x2C, &&cb_0x2D, &&cb_0x2E, &&cb_0x2F,
+	&&cb_0x30, &&cb_0x31, &&cb_0x32, &&cb_0x33,
+	&&cb_0x34, &&cb_0x35, &&cb_0x36, &&cb_0x37,
+	&&cb_0x38, &&cb_0x39, &&cb_0x3A, &&cb_0x3B,
+	&&cb_0x3C, &&cb_0x3D, &&cb_0x3E, &&cb_0x3F,
+	&&cb_0x40, &&cb_0x41, &&cb_0x42, &&cb_0x43,
+	&&cb_0x44, &&cb_0x45, &&cb_0x46, &&cb_0x47,
+	&&cb_0x48, &&cb_0x49, &&cb_0x4A, &&cb_0x4B,
+	&&cb_0x4C, &&cb_0x4D, &&cb_0x4E, &&cb_0x4F,
+	&&cb_0x50, &&cb_0x51, &&cb_0x52, &&cb_0x53,
+	&&cb_0x54, &&cb_0x55, &&cb_0x56, &&cb_0x57,
+	&&cb_0x58, &&cb_0x59, &&cb_0x5A, &&cb_0x5B,
+	&&cb_0x5C, &&cb_0x5D, &&cb_0x5E, &&cb_0x5F,
+	&&cb_0x60, &&cb_0x61, &&cb_0x62, &&cb_0x63,
+	&&cb_0x64, &&cb_0x65, &&cb_0x66, &&cb_0x67,
+	&&cb_0x68, &&cb_0x69, &&cb_0x6A, &&cb_0x6B,
+	&&cb_0x6C, &&cb_0x6D, &&cb_0x6E, &&cb_0x6F,
+	&&cb_0x70, &&cb_0x71, &&cb_0x72, &&cb_0x73,
+	&&cb_0x74, &&cb_0x75, &&cb_0x76, &&cb_0x77,
+	&&cb_0x78, &&cb_0x79, &&cb_0x7A, &&cb_0x7B,
+	&&cb_0x7C, &&cb_0x7D, &&cb_0x7E, &&cb_0x7F,
+	&&cb_0x80, &&cb_0x81, &&cb_0x82, &&cb_0x83,
+	&&cb_0x84, &&cb_0x85, &&cb_0x86, &&cb_0x87,
+	&&cb_0x88, &&cb_0x89, &&cb_0x8A, &&cb_0x8B,
+	&&cb_0x8C, &&cb_0x8D, &&cb_0x8E, &&cb_0x8F,
+	&&cb_0x90, &&cb_0x91, &&cb_0x92, &&cb_0x93,
+	&&cb_0x94, &&cb_0x95, &&cb_0x96, &&cb_0x97,
+	&&cb_0x98, &&cb_0x99, &&cb_0x9A, &&cb_0x9B,
+	&&cb_0x9C, &&cb_0x9D, &&cb_0x9E, &&cb_0x9F,
+	&&cb_0xA0, &&cb_0xA1, &&cb_0xA2, &&cb_0xA3,
+	&&cb_0xA4, &&cb_0xA5, &&cb_0xA6, &&cb_0xA7,
+	&&cb_0xA8, &&cb_0xA9, &&cb_0xAA, &&cb_0xAB,
+	&&cb_0xAC, &&cb_0xAD, &&cb_0xAE, &&cb_0xAF,
+	&&cb_0xB0, &&cb_0xB1, &&cb_0xB2, &&cb_0xB3,
+	&&cb_0xB4, &&cb_0xB5, &&cb_0xB6, &&cb_0xB7,
+	&&cb_0xB8, &&cb_0xB9, &&cb_0xBA, &&cb_0xBB,
+	&&cb_0xBC, &&cb_0xBD, &&cb_0xBE, &&cb_0xBF,
+	&&cb_0xC0, &&cb_0xC1, &&cb_0xC2, &&cb_0xC3,
+	&&cb_0xC4, &&cb_0xC5, &&cb_0xC6, &&cb_0xC7,
+	&&cb_0xC8, &&cb_0xC9, &&cb_0xCA, &&cb_0xCB,
+	&&cb_0xCC, &&cb_0xCD, &&cb_0xCE, &&cb_0xCF,
+	&&cb_0xD0, &&cb_0xD1, &&cb_0xD2, &&cb_0xD3,
+	&&cb_0xD4, &&cb_0xD5, &&cb_0xD6, &&cb_0xD7,
+	&&cb_0xD8, &&cb_0xD9, &&cb_0xDA, &&cb_0xDB,
+	&&cb_0xDC, &&cb_0xDD, &&cb_0xDE, &&cb_0xDF,
+	&&cb_0xE0, &&cb_0xE1, &&cb_0xE2, &&cb_0xE3,
+	&&cb_0xE4, &&cb_0xE5, &&cb_0xE6, &&cb_0xE7,
+	&&cb_0xE8, &&cb_0xE9, &&cb_0xEA, &&cb_0xEB,
+	&&cb_0xEC, &&cb_0xED, &&cb_0xEE, &&cb_0xEF,
+	&&cb_0xF0, &&cb_0xF1, &&cb_0xF2, &&cb_0xF3,
+	&&cb_0xF4, &&cb_0xF5, &&cb_0xF6, &&cb_0xF7,
+	&&cb_0xF8, &&cb_0xF9, &&cb_0xFA, &&cb_0xFB,
+	&&cb_0xFC, &&cb_0xFD, &&cb_0xFE, &&cb_0xFF
+    };
+#endif
     
-    instruction = mem_read(REG_PC++);
+    instruction = fetch_byte(REG_PC++);
+    z80_state.r++;
     
+    DISPATCH(cb, instruction);
     switch(instruction)
     {
-      case 0x47:	/* bit 0, a */
+      OPCODE(cb, 0x47):	/* bit 0, a */
 	do_test_bit(instruction, REG_A, 0);  T_COUNT(8);
 	break;
-      case 0x40:	/* bit 0, b */
+      OPCODE(cb, 0x40):	/* bit 0, b */
 	do_test_bit(instruction, REG_B, 0);  T_COUNT(8);
 	break;
-      case 0x41:	/* bit 0, c */
+      OPCODE(cb, 0x41):	/* bit 0, c */
 	do_test_bit(instruction, REG_C, 0);  T_COUNT(8);
 	break;
-      case 0x42:	/* bit 0, d */
+      OPCODE(cb, 0x42):	/* bit 0, d */
 	do_test_bit(instruction, REG_D, 0);  T_COUNT(8);
 	break;
-      case 0x43:	/* bit 0, e */
+      OPCODE(cb, 0x43):	/* bit 0, e */
 	do_test_bit(instruction, REG_E, 0);  T_COUNT(8);
 	break;
-      case 0x44:	/* bit 0, h */
+      OPCODE(cb, 0x44):	/* bit 0, h */
 	do_test_bit(instruction, REG_H, 0);  T_COUNT(8);
 	break;
-      case 0x45:	/* bit 0, l */
+      OPCODE(cb, 0x45):	/* bit 0, l */
 	do_test_bit(instruction, REG_L, 0);  T_COUNT(8);
 	break;
-      case 0x4F:	/* bit 1, a */
+      OPCODE(cb, 0x4F):	/* bit 1, a */
 	do_test_bit(instruction, REG_A, 1);  T_COUNT(8);
 	break;
-      case 0x48:	/* bit 1, b */
+      OPCODE(cb, 0x48):	/* bit 1, b */
 	do_test_bit(instruction, REG_B, 1);  T_COUNT(8);
 	break;
-      case 0x49:	/* bit 1, c */
+      OPCODE(cb, 0x49):	/* bit 1, c */
 	do_test_bit(instruction, REG_C, 1);  T_COUNT(8);
 	break;
-      case 0x4A:	/* bit 1, d */
+      OPCODE(cb, 0x4A):	/* bit 1, d */
 	do_test_bit(instruction, REG_D, 1);  T_COUNT(8);
 	break;
-      case 0x4B:	/* bit 1, e */
+      OPCODE(cb, 0x4B):	/* bit 1, e */
 	do_test_bit(instruction, REG_E, 1);  T_COUNT(8);
 	break;
-      case 0x4C:	/* bit 1, h */
+      OPCODE(cb, 0x4C):	/* bit 1, h */
 	do_test_bit(instruction, REG_H, 1);  T_COUNT(8);
 	break;
-      case 0x4D:	/* bit 1, l */
+      OPCODE(cb, 0x4D):	/* bit 1, l */
 	do_test_bit(instruction, REG_L, 1);  T_COUNT(8);
 	break;
-      case 0x57:	/* bit 2, a */
+      OPCODE(cb, 0x57):	/* bit 2, a */
 	do_test_bit(instruction, REG_A, 2);  T_COUNT(8);
 	break;
-      case 0x50:	/* bit 2, b */
+      OPCODE(cb, 0x50):	/* bit 2, b */
 	do_test_bit(instruction, REG_B, 2);  T_COUNT(8);
 	break;
-      case 0x51:	/* bit 2, c */
+      OPCODE(cb, 0x51):	/* bit 2, c */
 	do_test_bit(instruction, REG_C, 2);  T_COUNT(8);
 	break;
-      case 0x52:	/* bit 2, d */
+      OPCODE(cb, 0x52):	/* bit 2, d */
 	do_test_bit(instruction, REG_D, 2);  T_COUNT(8);
 	break;
-      case 0x53:	/* bit 2, e */
+      OPCODE(cb, 0x53):	/* bit 2, e */
 	do_test_bit(instruction, REG_E, 2);  T_COUNT(8);
 	break;
-      case 0x54:	/* bit 2, h */
+      OPCODE(cb, 0x54):	/* bit 2, h */
 	do_test_bit(instruction, REG_H, 2);  T_COUNT(8);
 	break;
-      case 0x55:	/* bit 2, l */
+      OPCODE(cb, 0x55):	/* bit 2, l */
 	do_test_bit(instruction, REG_L, 2);  T_COUNT(8);
 	break;
-      case 0x5F:	/* bit 3, a */
+      OPCODE(cb, 0x5F):	/* bit 3, a */
 	do_test_bit(instruction, REG_A, 3);  T_COUNT(8);
 	break;
-      case 0x58:	/* bit 3, b */
+      OPCODE(cb, 0x58):	/* bit 3, b */
 	do_test_bit(instruction, REG_B, 3);  T_COUNT(8);
 	break;
-      case 0x59:	/* bit 3, c */
+      OPCODE(cb, 0x59):	/* bit 3, c */
 	do_test_bit(instruction, REG_C, 3);  T_COUNT(8);
 	break;
-      case 0x5A:	/* bit 3, d */
+      OPCODE(cb, 0x5A):	/* bit 3, d */
 	do_test_bit(instruction, REG_D, 3);  T_COUNT(8);
 	break;
-      case 0x5B:	/* bit 3, e */
+      OPCODE(cb, 0x5B):	/* bit 3, e */
 	do_test_bit(instruction, REG_E, 3);  T_COUNT(8);
 	break;
-      case 0x5C:	/* bit 3, h */
+      OPCODE(cb, 0x5C):	/* bit 3, h */
 	do_test_bit(instruction, REG_H, 3);  T_COUNT(8);
 	break;
-      case 0x5D:	/* bit 3, l */
+      OPCODE(cb, 0x5D):	/* bit 3, l */
 	do_test_bit(instruction, REG_L, 3);  T_COUNT(8);
 	break;
-      case 0x67:	/* bit 4, a */
+      OPCODE(cb, 0x67):	/* bit 4, a */
 	do_test_bit(instruction, REG_A, 4);  T_COUNT(8);
 	break;
-      case 0x60:	/* bit 4, b */
+      OPCODE(cb, 0x60):	/* bit 4, b */
 	do_test_bit(instruction, REG_B, 4);  T_COUNT(8);
 	break;
-      case 0x61:	/* bit 4, c */
+      OPCODE(cb, 0x61):	/* bit 4, c */
 	do_test_bit(instruction, REG_C, 4);  T_COUNT(8);
 	break;
-      case 0x62:	/* bit 4, d */
+      OPCODE(cb, 0x62):	/* bit 4, d */
 	do_test_bit(instruction, REG_D, 4);  T_COUNT(8);
 	break;
-      case 0x63:	/* bit 4, e */
+      OPCODE(cb, 0x63):	/* bit 4, e */
 	do_test_bit(instruction, REG_E, 4);  T_COUNT(8);
 	break;
-      case 0x64:	/* bit 4, h */
+      OPCODE(cb, 0x64):	/* bit 4, h */
 	do_test_bit(instruction, REG_H, 4);  T_COUNT(8);
 	break;
-      case 0x65:	/* bit 4, l */
+      OPCODE(cb, 0x65):	/* bit 4, l */
 	do_test_bit(instruction, REG_L, 4);  T_COUNT(8);
 	break;
-      case 0x6F:	/* bit 5, a */
+      OPCODE(cb, 0x6F):	/* bit 5, a */
 	do_test_bit(instruction, REG_A, 5);  T_COUNT(8);
 	break;
-      case 0x68:	/* bit 5, b */
+      OPCODE(cb, 0x68):	/* bit 5, b */
 	do_test_bit(instruction, REG_B, 5);  T_COUNT(8);
 	break;
-      case 0x69:	/* bit 5, c */
+      OPCODE(cb, 0x69):	/* bit 5, c */
 	do_test_bit(instruction, REG_C, 5);  T_COUNT(8);
 	break;
-      case 0x6A:	/* bit 5, d */
+      OPCODE(cb, 0x6A):	/* bit 5, d */
 	do_test_bit(instruction, REG_D, 5);  T_COUNT(8);
 	break;
-      case 0x6B:	/* bit 5, e */
+      OPCODE(cb, 0x6B):	/* bit 5, e */
 	do_test_bit(instruction, REG_E, 5);  T_COUNT(8);
 	break;
-      case 0x6C:	/* bit 5, h */
+      OPCODE(cb, 0x6C):	/* bit 5, h */
 	do_test_bit(instruction, REG_H, 5);  T_COUNT(8);
 	break;
-      case 0x6D:	/* bit 5, l */
+      OPCODE(cb, 0x6D):	/* bit 5, l */
 	do_test_bit(instruction, REG_L, 5);  T_COUNT(8);
 	break;
-      case 0x77:	/* bit 6, a */
+      OPCODE(cb, 0x77):	/* bit 6, a */
 	do_test_bit(instruction, REG_A, 6);  T_COUNT(8);
 	break;
-      case 0x70:	/* bit 6, b */
+      OPCODE(cb, 0x70):	/* bit 6, b */
 	do_test_bit(instruction, REG_B, 6);  T_COUNT(8);
 	break;
-      case 0x71:	/* bit 6, c */
+      OPCODE(cb, 0x71):	/* bit 6, c */
 	do_test_bit(instruction, REG_C, 6);  T_COUNT(8);
 	break;
-      case 0x72:	/* bit 6, d */
+      OPCODE(cb, 0x72):	/* bit 6, d */
 	do_test_bit(instruction, REG_D, 6);  T_COUNT(8);
 	break;
-      case 0x73:	/* bit 6, e */
+      OPCODE(cb, 0x73):	/* bit 6, e */
 	do_test_bit(instruction, REG_E, 6);  T_COUNT(8);
 	break;
-      case 0x74:	/* bit 6, h */
+      OPCODE(cb, 0x74):	/* bit 6, h */
 	do_test_bit(instruction, REG_H, 6);  T_COUNT(8);
 	break;
-      case 0x75:	/* bit 6, l */
+      OPCODE(cb, 0x75):	/* bit 6, l */
 	do_test_bit(instruction, REG_L, 6);  T_COUNT(8);
 	break;
-      case 0x7F:	/* bit 7, a */
+      OPCODE(cb, 0x7F):	/* bit 7, a */
 	do_test_bit(instruction, REG_A, 7);  T_COUNT(8);
 	break;
-      case 0x78:	/* bit 7, b */
+      OPCODE(cb, 0x78):	/* bit 7, b */
 	do_test_bit(instruction, REG_B, 7);  T_COUNT(8);
 	break;
-      case 0x79:	/* bit 7, c */
+      OPCODE(cb, 0x79):	/* bit 7, c */
 	do_test_bit(instruction, REG_C, 7);  T_COUNT(8);
 	break;
-      case 0x7A:	/* bit 7, d */
+      OPCODE(cb, 0x7A):	/* bit 7, d */
 	do_test_bit(instruction, REG_D, 7);  T_COUNT(8);
 	break;
-      case 0x7B:	/* bit 7, e */
+      OPCODE(cb, 0x7B):	/* bit 7, e */
 	do_test_bit(instruction, REG_E, 7);  T_COUNT(8);
 	break;
-      case 0x7C:	/* bit 7, h */
+      OPCODE(cb, 0x7C):	/* bit 7, h */
 	do_test_bit(instruction, REG_H, 7);  T_COUNT(8);
 	break;
-      case 0x7D:	/* bit 7, l */
+      OPCODE(cb, 0x7D):	/* bit 7, l */
 	do_test_bit(instruction, REG_L, 7);  T_COUNT(8);
 	break;
 	
-      case 0x46:	/* bit 0, (hl) */
+      OPCODE(cb, 0x46):	/* bit 0, (hl) */
 	do_test_bit(instruction, mem_read(REG_HL), 0);  T_COUNT(12);
 	break;
-      case 0x4E:	/* bit 1, (hl) */
+      OPCODE(cb, 0x4E):	/* bit 1, (hl) */
 	do_test_bit(instruction, mem_read(REG_HL), 1);  T_COUNT(12);
 	break;
-      case 0x56:	/* bit 2, (hl) */
+      OPCODE(cb, 0x56):	/* bit 2, (hl) */
 	do_test_bit(instruction, mem_read(REG_HL), 2);  T_COUNT(12);
 	break;
-      case 0x5E:	/* bit 3, (hl) */
+      OPCODE(cb, 0x5E):	/* bit 3, (hl) */
 	do_test_bit(instruction, mem_read(REG_HL), 3);  T_COUNT(12);
 	break;
-      case 0x66:	/* bit 4, (hl) */
+      OPCODE(cb, 0x66):	/* bit 4, (hl) */
 	do_test_bit(instruction, mem_read(REG_HL), 4);  T_COUNT(12);
 	break;
-      case 0x6E:	/* bit 5, (hl) */
+      OPCODE(cb, 0x6E):	/* bit 5, (hl) */
 	do_test_bit(instruction, mem_read(REG_HL), 5);  T_COUNT(12);
 	break;
-      case 0x76:	/* bit 6, (hl) */
+      OPCODE(cb, 0x76):	/* bit 6, (hl) */
 	do_test_bit(instruction, mem_read(REG_HL), 6);  T_COUNT(12);
 	break;
-      case 0x7E:	/* bit 7, (hl) */
+      OPCODE(cb, 0x7E):	/* bit 7, (hl) */
 	do_test_bit(instruction, mem_read(REG_HL), 7);  T_COUNT(12);
 	break;
 
-      case 0x87:	/* res 0, a */
+      OPCODE(cb, 0x87):	/* res 0, a */
 	REG_A &= ~(1 << 0);  T_COUNT(8);
 	break;
-      case 0x80:	/* res 0, b */
+      OPCODE(cb, 0x80):	/* res 0, b */
 	REG_B &= ~(1 << 0);  T_COUNT(8);
 	break;
-      case 0x81:	/* res 0, c */
+      OPCODE(cb, 0x81):	/* res 0, c */
 	REG_C &= ~(1 << 0);  T_COUNT(8);
 	break;
-      case 0x82:	/* res 0, d */
+      OPCODE(cb, 0x82):	/* res 0, d */
 	REG_D &= ~(1 << 0);  T_COUNT(8);
 	break;
-      case 0x83:	/* res 0, e */
+      OPCODE(cb, 0x83):	/* res 0, e */
 	REG_E &= ~(1 << 0);  T_COUNT(8);
 	break;
-      case 0x84:	/* res 0, h */
+      OPCODE(cb, 0x84):	/* res 0, h */
 	REG_H &= ~(1 << 0);  T_COUNT(8);
 	break;
-      case 0x85:	/* res 0, l */
+      OPCODE(cb, 0x85):	/* res 0, l */
 	REG_L &= ~(1 << 0);  T_COUNT(8);
 	break;
-      case 0x8F:	/* res 1, a */
+      OPCODE(cb, 0x8F):	/* res 1, a */
 	REG_A &= ~(1 << 1);  T_COUNT(8);
 	break;
-      case 0x88:	/* res 1, b */
+      OPCODE(cb, 0x88):	/* res 1, b */
 	REG_B &= ~(1 << 1);  T_COUNT(8);
 	break;
-      case 0x89:	/* res 1, c */
+      OPCODE(cb, 0x89):	/* res 1, c */
 	REG_C &= ~(1 << 1);  T_COUNT(8);
 	break;
-      case 0x8A:	/* res 1, d */
+      OPCODE(cb, 0x8A):	/* res 1, d */
 	REG_D &= ~(1 << 1);  T_COUNT(8);
 	break;
-      case 0x8B:	/* res 1, e */
+      OPCODE(cb, 0x8B):	/* res 1, e */
 	REG_E &= ~(1 << 1);  T_COUNT(8);
 	break;
-      case 0x8C:	/* res 1, h */
+      OPCODE(cb, 0x8C):	/* res 1, h */
 	REG_H &= ~(1 << 1);  T_COUNT(8);
 	break;
-      case 0x8D:	/* res 1, l */
+      OPCODE(cb, 0x8D):	/* res 1, l */
 	REG_L &= ~(1 << 1);  T_COUNT(8);
 	break;
-      case 0x97:	/* res 2, a */
+      OPCODE(cb, 0x97):	/* res 2, a */
 	REG_A &= ~(1 << 2);  T_COUNT(8);
 	break;
-      case 0x90:	/* res 2, b */
+      OPCODE(cb, 0x90):	/* res 2, b */
 	REG_B &= ~(1 << 2);  T_COUNT(8);
 	break;
-      case 0x91:	/* res 2, c */
+      OPCODE(cb, 0x91):	/* res 2, c */
 	REG_C &= ~(1 << 2);  T_COUNT(8);
 	break;
-      case 0x92:	/* res 2, d */
+      OPCODE(cb, 0x92):	/* res 2, d */
 	REG_D &= ~(1 << 2);  T_COUNT(8);
 	break;
-      case 0x93:	/* res 2, e */
+      OPCODE(cb, 0x93):	/* res 2, e */
 	REG_E &= ~(1 << 2);  T_COUNT(8);
 	break;
-      case 0x94:	/* res 2, h */
+      OPCODE(cb, 0x94):	/* res 2, h */
 	REG_H &= ~(1 << 2);  T_COUNT(8);
 	break;
-      case 0x95:	/* res 2, l */
+      OPCODE(cb, 0x95):	/* res 2, l */
 	REG_L &= ~(1 << 2);  T_COUNT(8);
 	break;
-      case 0x9F:	/* res 3, a */
+      OPCODE(cb, 0x9F):	/* res 3, a */
 	REG_A &= ~(1 << 3);  T_COUNT(8);
 	break;
-      case 0x98:	/* res 3, b */
+      OPCODE(cb, 0x98):	/* res 3, b */
 	REG_B &= ~(1 << 3);  T_COUNT(8);
 	break;
-      case 0x99:	/* res 3, c */
+      OPCODE(cb, 0x99):	/* res 3, c */
 	REG_C &= ~(1 << 3);  T_COUNT(8);
 	break;
-      case 0x9A:	/* res 3, d */
+      OPCODE(cb, 0x9A):	/* res 3, d */
 	REG_D &= ~(1 << 3);  T_COUNT(8);
 	break;
-      case 0x9B:	/* res 3, e */
+      OPCODE(cb, 0x9B):	/* res 3, e */
 	REG_E &= ~(1 << 3);  T_COUNT(8);
 	break;
-      case 0x9C:	/* res 3, h */
+      OPCODE(cb, 0x9C):	/* res 3, h */
 	REG_H &= ~(1 << 3);  T_COUNT(8);
 	break;
-      case 0x9D:	/* res 3, l */
+      OPCODE(cb, 0x9D):	/* res 3, l */
 	REG_L &= ~(1 << 3);  T_COUNT(8);
 	break;
-      case 0xA7:	/* res 4, a */
+      OPCODE(cb, 0xA7):	/* res 4, a */
 	REG_A &= ~(1 << 4);  T_COUNT(8);
 	break;
-      case 0xA0:	/* res 4, b */
+      OPCODE(cb, 0xA0):	/* res 4, b */
 	REG_B &= ~(1 << 4);  T_COUNT(8);
 	break;
-      case 0xA1:	/* res 4, c */
+      OPCODE(cb, 0xA1):	/* res 4, c */
 	REG_C &= ~(1 << 4);  T_COUNT(8);
 	break;
-      case 0xA2:	/* res 4, d */
+      OPCODE(cb, 0xA2):	/* res 4, d */
 	REG_D &= ~(1 << 4);  T_COUNT(8);
 	break;
-      case 0xA3:	/* res 4, e */
+      OPCODE(cb, 0xA3):	/* res 4, e */
 	REG_E &= ~(1 << 4);  T_COUNT(8);
 	break;
-      case 0xA4:	/* res 4, h */
+      OPCODE(cb, 0xA4):	/* res 4, h */
 	REG_H &= ~(1 << 4);  T_COUNT(8);
 	break;
-      case 0xA5:	/* res 4, l */
+      OPCODE(cb, 0xA5):	/* res 4, l */
 	REG_L &= ~(1 << 4);  T_COUNT(8);
 	break;
-      case 0xAF:	/* res 5, a */
+      OPCODE(cb, 0xAF):	/* res 5, a */
 	REG_A &= ~(1 << 5);  T_COUNT(8);
 	break;
-      case 0xA8:	/* res 5, b */
+      OPCODE(cb, 0xA8):	/* res 5, b */
 	REG_B &= ~(1 << 5);  T_COUNT(8);
 	break;
-      case 0xA9:	/* res 5, c */
+      OPCODE(cb, 0xA9):	/* res 5, c */
 	REG_C &= ~(1 << 5);  T_COUNT(8);
 	break;
-      case 0xAA:	/* res 5, d */
+      OPCODE(cb, 0xAA):	/* res 5, d */
 	REG_D &= ~(1 << 5);  T_COUNT(8);
 	break;
-      case 0xAB:	/* res 5, e */
+      OPCODE(cb, 0xAB):	/* res 5, e */
 	REG_E &= ~(1 << 5);  T_COUNT(8);
 	break;
-      case 0xAC:	/* res 5, h */
+      OPCODE(cb, 0xAC):	/* res 5, h */
 	REG_H &= ~(1 << 5);  T_COUNT(8);
 	break;
-      case 0xAD:	/* res 5, l */
+      OPCODE(cb, 0xAD):	/* res 5, l */
 	REG_L &= ~(1 << 5);  T_COUNT(8);
 	break;
-      case 0xB7:	/* res 6, a */
+      OPCODE(cb, 0xB7):	/* res 6, a */
 	REG_A &= ~(1 << 6);  T_COUNT(8);
 	break;
-      case 0xB0:	/* res 6, b */
+      OPCODE(cb, 0xB0):	/* res 6, b */
 	REG_B &= ~(1 << 6);  T_COUNT(8);
 	break;
-      case 0xB1:	/* res 6, c */
+      OPCODE(cb, 0xB1):	/* res 6, c */
 	REG_C &= ~(1 << 6);  T_COUNT(8);
 	break;
-      case 0xB2:	/* res 6, d */
+      OPCODE(cb, 0xB2):	/* res 6, d */
 	REG_D &= ~(1 << 6);  T_COUNT(8);
 	break;
-      case 0xB3:	/* res 6, e */
+      OPCODE(cb, 0xB3):	/* res 6, e */
 	REG_E &= ~(1 << 6);  T_COUNT(8);
 	break;
-      case 0xB4:	/* res 6, h */
+      OPCODE(cb, 0xB4):	/* res 6, h */
 	REG_H &= ~(1 << 6);  T_COUNT(8);
 	break;
-      case 0xB5:	/* res 6, l */
+      OPCODE(cb, 0xB5):	/* res 6, l */
 	REG_L &= ~(1 << 6);  T_COUNT(8);
 	break;
-      case 0xBF:	/* res 7, a */
+      OPCODE(cb, 0xBF):	/* res 7, a */
 	REG_A &= ~(1 << 7);  T_COUNT(8);
 	break;
-      case 0xB8:	/* res 7, b */
+      OPCODE(cb, 0xB8):	/* res 7, b */
 	REG_B &= ~(1 << 7);  T_COUNT(8);
 	break;
-      case 0xB9:	/* res 7, c */
+      OPCODE(cb, 0xB9):	/* res 7, c */
 	REG_C &= ~(1 << 7);  T_COUNT(8);
 	break;
-      case 0xBA:	/* res 7, d */
+      OPCODE(cb, 0xBA):	/* res 7, d */
 	REG_D &= ~(1 << 7);  T_COUNT(8);
 	break;
-      case 0xBB:	/* res 7, e */
+      OPCODE(cb, 0xBB):	/* res 7, e */
 	REG_E &= ~(1 << 7);  T_COUNT(8);
 	break;
-      case 0xBC:	/* res 7, h */
+      OPCODE(cb, 0xBC):	/* res 7, h */
 	REG_H &= ~(1 << 7);  T_COUNT(8);
 	break;
-      case 0xBD:	/* res 7, l */
+      OPCODE(cb, 0xBD):	/* res 7, l */
 	REG_L &= ~(1 << 7);  T_COUNT(8);
 	break;
 
-      case 0x86:	/* res 0, (hl) */
+      OPCODE(cb, 0x86):	/* res 0, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 0));  T_COUNT(15);
 	break;
-      case 0x8E:	/* res 1, (hl) */
+      OPCODE(cb, 0x8E):	/* res 1, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 1));  T_COUNT(15);
 	break;
-      case 0x96:	/* res 2, (hl) */
+      OPCODE(cb, 0x96):	/* res 2, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 2));  T_COUNT(15);
 	break;
-      case 0x9E:	/* res 3, (hl) */
+      OPCODE(cb, 0x9E):	/* res 3, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 3));  T_COUNT(15);
 	break;
-      case 0xA6:	/* res 4, (hl) */
+      OPCODE(cb, 0xA6):	/* res 4, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 4));  T_COUNT(15);
 	break;
-      case 0xAE:	/* res 5, (hl) */
+      OPCODE(cb, 0xAE):	/* res 5, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 5));  T_COUNT(15);
 	break;
-      case 0xB6:	/* res 6, (hl) */
+      OPCODE(cb, 0xB6):	/* res 6, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 6));  T_COUNT(15);
 	break;
-      case 0xBE:	/* res 7, (hl) */
+      OPCODE(cb, 0xBE):	/* res 7, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) & ~(1 << 7));  T_COUNT(15);
 	break;
 
-      case 0x17:	/* rl a */
+      OPCODE(cb, 0x17):	/* rl a */
 	REG_A = rl_byte(REG_A);  T_COUNT(8);
 	break;
-      case 0x10:	/* rl b */
+      OPCODE(cb, 0x10):	/* rl b */
 	REG_B = rl_byte(REG_B);  T_COUNT(8);
 	break;
-      case 0x11:	/* rl c */
+      OPCODE(cb, 0x11):	/* rl c */
 	REG_C = rl_byte(REG_C);  T_COUNT(8);
 	break;
-      case 0x12:	/* rl d */
+      OPCODE(cb, 0x12):	/* rl d */
 	REG_D = rl_byte(REG_D);  T_COUNT(8);
 	break;
-      case 0x13:	/* rl e */
+      OPCODE(cb, 0x13):	/* rl e */
 	REG_E = rl_byte(REG_E);  T_COUNT(8);
 	break;
-      case 0x14:	/* rl h */
+      OPCODE(cb, 0x14):	/* rl h */
 	REG_H = rl_byte(REG_H);  T_COUNT(8);
 	break;
-      case 0x15:	/* rl l */
+      OPCODE(cb, 0x15):	/* rl l */
 	REG_L = rl_byte(REG_L);  T_COUNT(8);
 	break;
-      case 0x16:	/* rl (hl) */
+      OPCODE(cb, 0x16):	/* rl (hl) */
 	mem_write(REG_HL, rl_byte(mem_read(REG_HL)));  T_COUNT(15);
 	break;
 
-      case 0x07:	/* rlc a */
+      OPCODE(cb, 0x07):	/* rlc a */
 	REG_A = rlc_byte(REG_A);  T_COUNT(8);
 	break;
-      case 0x00:	/* rlc b */
+      OPCODE(cb, 0x00):	/* rlc b */
 	REG_B = rlc_byte(REG_B);  T_COUNT(8);
 	break;
-      case 0x01:	/* rlc c */
+      OPCODE(cb, 0x01):	/* rlc c */
 	REG_C = rlc_byte(REG_C);  T_COUNT(8);
 	break;
-      case 0x02:	/* rlc d */
+      OPCODE(cb, 0x02):	/* rlc d */
 	REG_D = rlc_byte(REG_D);  T_COUNT(8);
 	break;
-      case 0x03:	/* rlc e */
+      OPCODE(cb, 0x03):	/* rlc e */
 	REG_E = rlc_byte(REG_E);  T_COUNT(8);
 	break;
-      case 0x04:	/* rlc h */
+      OPCODE(cb, 0x04):	/* rlc h */
 	REG_H = rlc_byte(REG_H);  T_COUNT(8);
 	break;
-      case 0x05:	/* rlc l */
+      OPCODE(cb, 0x05):	/* rlc l */
 	REG_L = rlc_byte(REG_L);  T_COUNT(8);
 	break;
-      case 0x06:	/* rlc (hl) */
+      OPCODE(cb, 0x06):	/* rlc (hl) */
 	mem_write(REG_HL, rlc_byte(mem_read(REG_HL)));  T_COUNT(15);
 	break;
 
-      case 0x1F:	/* rr a */
+      OPCODE(cb, 0x1F):	/* rr a */
 	REG_A = rr_byte(REG_A);  T_COUNT(8);
 	break;
-      case 0x18:	/* rr b */
+      OPCODE(cb, 0x18):	/* rr b */
 	REG_B = rr_byte(REG_B);  T_COUNT(8);
 	break;
-      case 0x19:	/* rr c */
+      OPCODE(cb, 0x19):	/* rr c */
 	REG_C = rr_byte(REG_C);  T_COUNT(8);
 	break;
-      case 0x1A:	/* rr d */
+      OPCODE(cb, 0x1A):	/* rr d */
 	REG_D = rr_byte(REG_D);  T_COUNT(8);
 	break;
-      case 0x1B:	/* rr e */
+      OPCODE(cb, 0x1B):	/* rr e */
 	REG_E = rr_byte(REG_E);  T_COUNT(8);
 	break;
-      case 0x1C:	/* rr h */
+      OPCODE(cb, 0x1C):	/* rr h */
 	REG_H = rr_byte(REG_H);  T_COUNT(8);
 	break;
-      case 0x1D:	/* rr l */
+      OPCODE(cb, 0x1D):	/* rr l */
 	REG_L = rr_byte(REG_L);  T_COUNT(8);
 	break;
-      case 0x1E:	/* rr (hl) */
+      OPCODE(cb, 0x1E):	/* rr (hl) */
 	mem_write(REG_HL, rr_byte(mem_read(REG_HL)));  T_COUNT(15);
 	break;
 
-      case 0x0F:	/* rrc a */
+      OPCODE(cb, 0x0F):	/* rrc a */
 	REG_A = rrc_byte(REG_A);  T_COUNT(8);
 	break;
-      case 0x08:	/* rrc b */
+      OPCODE(cb, 0x08):	/* rrc b */
 	REG_B = rrc_byte(REG_B);  T_COUNT(8);
 	break;
-      case 0x09:	/* rrc c */
+      OPCODE(cb, 0x09):	/* rrc c */
 	REG_C = rrc_byte(REG_C);  T_COUNT(8);
 	break;
-      case 0x0A:	/* rrc d */
+      OPCODE(cb, 0x0A):	/* rrc d */
 	REG_D = rrc_byte(REG_D);  T_COUNT(8);
 	break;
-      case 0x0B:	/* rrc e */
+      OPCODE(cb, 0x0B):	/* rrc e */
 	REG_E = rrc_byte(REG_E);  T_COUNT(8);
 	break;
-      case 0x0C:	/* rrc h */
+      OPCODE(cb, 0x0C):	/* rrc h */
 	REG_H = rrc_byte(REG_H);  T_COUNT(8);
 	break;
-      case 0x0D:	/* rrc l */
+      OPCODE(cb, 0x0D):	/* rrc l */
 	REG_L = rrc_byte(REG_L);  T_COUNT(8);
 	break;
-      case 0x0E:	/* rrc (hl) */
+      OPCODE(cb, 0x0E):	/* rrc (hl) */
 	mem_write(REG_HL, rrc_byte(mem_read(REG_HL)));  T_COUNT(15);
 	break;
 
-      case 0xC7:	/* set 0, a */
+      OPCODE(cb, 0xC7):	/* set 0, a */
 	REG_A |= (1 << 0);  T_COUNT(8);
 	break;
-      case 0xC0:	/* set 0, b */
+      OPCODE(cb, 0xC0):	/* set 0, b */
 	REG_B |= (1 << 0);  T_COUNT(8);
 	break;
-      case 0xC1:	/* set 0, c */
+      OPCODE(cb, 0xC1):	/* set 0, c */
 	REG_C |= (1 << 0);  T_COUNT(8);
 	break;
-      case 0xC2:	/* set 0, d */
+      OPCODE(cb, 0xC2):	/* set 0, d */
 	REG_D |= (1 << 0);  T_COUNT(8);
 	break;
-      case 0xC3:	/* set 0, e */
+      OPCODE(cb, 0xC3):	/* set 0, e */
 	REG_E |= (1 << 0);  T_COUNT(8);
 	break;
-      case 0xC4:	/* set 0, h */
+      OPCODE(cb, 0xC4):	/* set 0, h */
 	REG_H |= (1 << 0);  T_COUNT(8);
 	break;
-      case 0xC5:	/* set 0, l */
+      OPCODE(cb, 0xC5):	/* set 0, l */
 	REG_L |= (1 << 0);  T_COUNT(8);
 	break;
-      case 0xCF:	/* set 1, a */
+      OPCODE(cb, 0xCF):	/* set 1, a */
 	REG_A |= (1 << 1);  T_COUNT(8);
 	break;
-      case 0xC8:	/* set 1, b */
+      OPCODE(cb, 0xC8):	/* set 1, b */
 	REG_B |= (1 << 1);  T_COUNT(8);
 	break;
-      case 0xC9:	/* set 1, c */
+      OPCODE(cb, 0xC9):	/* set 1, c */
 	REG_C |= (1 << 1);  T_COUNT(8);
 	break;
-      case 0xCA:	/* set 1, d */
+      OPCODE(cb, 0xCA):	/* set 1, d */
 	REG_D |= (1 << 1);  T_COUNT(8);
 	break;
-      case 0xCB:	/* set 1, e */
+      OPCODE(cb, 0xCB):	/* set 1, e */
 	REG_E |= (1 << 1);  T_COUNT(8);
 	break;
-      case 0xCC:	/* set 1, h */
+      OPCODE(cb, 0xCC):	/* set 1, h */
 	REG_H |= (1 << 1);  T_COUNT(8);
 	break;
-      case 0xCD:	/* set 1, l */
+      OPCODE(cb, 0xCD):	/* set 1, l */
 	REG_L |= (1 << 1);  T_COUNT(8);
 	break;
-      case 0xD7:	/* set 2, a */
+      OPCODE(cb, 0xD7):	/* set 2, a */
 	REG_A |= (1 << 2);  T_COUNT(8);
 	break;
-      case 0xD0:	/* set 2, b */
+      OPCODE(cb, 0xD0):	/* set 2, b */
 	REG_B |= (1 << 2);  T_COUNT(8);
 	break;
-      case 0xD1:	/* set 2, c */
+      OPCODE(cb, 0xD1):	/* set 2, c */
 	REG_C |= (1 << 2);  T_COUNT(8);
 	break;
-      case 0xD2:	/* set 2, d */
+      OPCODE(cb, 0xD2):	/* set 2, d */
 	REG_D |= (1 << 2);  T_COUNT(8);
 	break;
-      case 0xD3:	/* set 2, e */
+      OPCODE(cb, 0xD3):	/* set 2, e */
 	REG_E |= (1 << 2);  T_COUNT(8);
 	break;
-      case 0xD4:	/* set 2, h */
+      OPCODE(cb, 0xD4):	/* set 2, h */
 	REG_H |= (1 << 2);  T_COUNT(8);
 	break;
-      case 0xD5:	/* set 2, l */
+      OPCODE(cb, 0xD5):	/* set 2, l */
 	REG_L |= (1 << 2);  T_COUNT(8);
 	break;
-      case 0xDF:	/* set 3, a */
+      OPCODE(cb, 0xDF):	/* set 3, a */
 	REG_A |= (1 << 3);  T_COUNT(8);
 	break;
-      case 0xD8:	/* set 3, b */
+      OPCODE(cb, 0xD8):	/* set 3, b */
 	REG_B |= (1 << 3);  T_COUNT(8);
 	break;
-      case 0xD9:	/* set 3, c */
+      OPCODE(cb, 0xD9):	/* set 3, c */
 	REG_C |= (1 << 3);  T_COUNT(8);
 	break;
-      case 0xDA:	/* set 3, d */
+      OPCODE(cb, 0xDA):	/* set 3, d */
 	REG_D |= (1 << 3);  T_COUNT(8);
 	break;
-      case 0xDB:	/* set 3, e */
+      OPCODE(cb, 0xDB):	/* set 3, e */
 	REG_E |= (1 << 3);  T_COUNT(8);
 	break;
-      case 0xDC:	/* set 3, h */
+      OPCODE(cb, 0xDC):	/* set 3, h */
 	REG_H |= (1 << 3);  T_COUNT(8);
 	break;
-      case 0xDD:	/* set 3, l */
+      OPCODE(cb, 0xDD):	/* set 3, l */
 	REG_L |= (1 << 3);  T_COUNT(8);
 	break;
-      case 0xE7:	/* set 4, a */
+      OPCODE(cb, 0xE7):	/* set 4, a */
 	REG_A |= (1 << 4);  T_COUNT(8);
 	break;
-      case 0xE0:	/* set 4, b */
+      OPCODE(cb, 0xE0):	/* set 4, b */
 	REG_B |= (1 << 4);  T_COUNT(8);
 	break;
-      case 0xE1:	/* set 4, c */
+      OPCODE(cb, 0xE1):	/* set 4, c */
 	REG_C |= (1 << 4);  T_COUNT(8);
 	break;
-      case 0xE2:	/* set 4, d */
+      OPCODE(cb, 0xE2):	/* set 4, d */
 	REG_D |= (1 << 4);  T_COUNT(8);
 	break;
-      case 0xE3:	/* set 4, e */
+      OPCODE(cb, 0xE3):	/* set 4, e */
 	REG_E |= (1 << 4);  T_COUNT(8);
 	break;
-      case 0xE4:	/* set 4, h */
+      OPCODE(cb, 0xE4):	/* set 4, h */
 	REG_H |= (1 << 4);  T_COUNT(8);
 	break;
-      case 0xE5:	/* set 4, l */
+      OPCODE(cb, 0xE5):	/* set 4, l */
 	REG_L |= (1 << 4);  T_COUNT(8);
 	break;
-      case 0xEF:	/* set 5, a */
+      OPCODE(cb, 0xEF):	/* set 5, a */
 	REG_A |= (1 << 5);  T_COUNT(8);
 	break;
-      case 0xE8:	/* set 5, b */
+      OPCODE(cb, 0xE8):	/* set 5, b */
 	REG_B |= (1 << 5);  T_COUNT(8);
 	break;
-      case 0xE9:	/* set 5, c */
+      OPCODE(cb, 0xE9):	/* set 5, c */
 	REG_C |= (1 << 5);  T_COUNT(8);
 	break;
-      case 0xEA:	/* set 5, d */
+      OPCODE(cb, 0xEA):	/* set 5, d */
 	REG_D |= (1 << 5);  T_COUNT(8);
 	break;
-      case 0xEB:	/* set 5, e */
+      OPCODE(cb, 0xEB):	/* set 5, e */
 	REG_E |= (1 << 5);  T_COUNT(8);
 	break;
-      case 0xEC:	/* set 5, h */
+      OPCODE(cb, 0xEC):	/* set 5, h */
 	REG_H |= (1 << 5);  T_COUNT(8);
 	break;
-      case 0xED:	/* set 5, l */
+      OPCODE(cb, 0xED):	/* set 5, l */
 	REG_L |= (1 << 5);  T_COUNT(8);
 	break;
-      case 0xF7:	/* set 6, a */
+      OPCODE(cb, 0xF7):	/* set 6, a */
 	REG_A |= (1 << 6);  T_COUNT(8);
 	break;
-      case 0xF0:	/* set 6, b */
+      OPCODE(cb, 0xF0):	/* set 6, b */
 	REG_B |= (1 << 6);  T_COUNT(8);
 	break;
-      case 0xF1:	/* set 6, c */
+      OPCODE(cb, 0xF1):	/* set 6, c */
 	REG_C |= (1 << 6);  T_COUNT(8);
 	break;
-      case 0xF2:	/* set 6, d */
+      OPCODE(cb, 0xF2):	/* set 6, d */
 	REG_D |= (1 << 6);  T_COUNT(8);
 	break;
-      case 0xF3:	/* set 6, e */
+      OPCODE(cb, 0xF3):	/* set 6, e */
 	REG_E |= (1 << 6);  T_COUNT(8);
 	break;
-      case 0xF4:	/* set 6, h */
+      OPCODE(cb, 0xF4):	/* set 6, h */
 	REG_H |= (1 << 6);  T_COUNT(8);
 	break;
-      case 0xF5:	/* set 6, l */
+      OPCODE(cb, 0xF5):	/* set 6, l */
 	REG_L |= (1 << 6);  T_COUNT(8);
 	break;
-      case 0xFF:	/* set 7, a */
+      OPCODE(cb, 0xFF):	/* set 7, a */
 	REG_A |= (1 << 7);  T_COUNT(8);
 	break;
-      case 0xF8:	/* set 7, b */
+      OPCODE(cb, 0xF8):	/* set 7, b */
 	REG_B |= (1 << 7);  T_COUNT(8);
 	break;
-      case 0xF9:	/* set 7, c */
+      OPCODE(cb, 0xF9):	/* set 7, c */
 	REG_C |= (1 << 7);  T_COUNT(8);
 	break;
-      case 0xFA:	/* set 7, d */
+      OPCODE(cb, 0xFA):	/* set 7, d */
 	REG_D |= (1 << 7);  T_COUNT(8);
 	break;
-      case 0xFB:	/* set 7, e */
+      OPCODE(cb, 0xFB):	/* set 7, e */
 	REG_E |= (1 << 7);  T_COUNT(8);
 	break;
-      case 0xFC:	/* set 7, h */
+      OPCODE(cb, 0xFC):	/* set 7, h */
 	REG_H |= (1 << 7);  T_COUNT(8);
 	break;
-      case 0xFD:	/* set 7, l */
+      OPCODE(cb, 0xFD):	/* set 7, l */
 	REG_L |= (1 << 7);  T_COUNT(8);
 	break;
 
-      case 0xC6:	/* set 0, (hl) */
+      OPCODE(cb, 0xC6):	/* set 0, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) | (1 << 0));  T_COUNT(15);
 	break;
-      case 0xCE:	/* set 1, (hl) */
+      OPCODE(cb, 0xCE):	/* set 1, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) | (1 << 1));  T_COUNT(15);
 	break;
-      case 0xD6:	/* set 2, (hl) */
+      OPCODE(cb, 0xD6):	/* set 2, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) | (1 << 2));  T_COUNT(15);
 	break;
-      case 0xDE:	/* set 3, (hl) */
+      OPCODE(cb, 0xDE):	/* set 3, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) | (1 << 3));  T_COUNT(15);
 	break;
-      case 0xE6:	/* set 4, (hl) */
+      OPCODE(cb, 0xE6):	/* set 4, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) | (1 << 4));  T_COUNT(15);
 	break;
-      case 0xEE:	/* set 5, (hl) */
+      OPCODE(cb, 0xEE):	/* set 5, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) | (1 << 5));  T_COUNT(15);
 	break;
-      case 0xF6:	/* set 6, (hl) */
+      OPCODE(cb, 0xF6):	/* set 6, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) | (1 << 6));  T_COUNT(15);
 	break;
-      case 0xFE:	/* set 7, (hl) */
+      OPCODE(cb, 0xFE):	/* set 7, (hl) */
 	mem_write(REG_HL, mem_read(REG_HL) | (1 << 7));  T_COUNT(15);
 	break;
 
-      case 0x27:	/* sla a */
+      OPCODE(cb, 0x27):	/* sla a */
 	REG_A = sla_byte(REG_A);  T_COUNT(8);
 	break;
-      case 0x20:	/* sla b */
+      OPCODE(cb, 0x20):	/* sla b */
 	REG_B = sla_byte(REG_B);  T_COUNT(8);
 	break;
-      case 0x21:	/* sla c */
+      OPCODE(cb, 0x21):	/* sla c */
 	REG_C = sla_byte(REG_C);  T_COUNT(8);
 	break;
-      case 0x22:	/* sla d */
+      OPCODE(cb, 0x22):	/* sla d */
 	REG_D = sla_byte(REG_D);  T_COUNT(8);
 	break;
-      case 0x23:	/* sla e */
+      OPCODE(cb, 0x23):	/* sla e */
 	REG_E = sla_byte(REG_E);  T_COUNT(8);
 	break;
-      case 0x24:	/* sla h */
+      OPCODE(cb, 0x24):	/* sla h */
 	REG_H = sla_byte(REG_H);  T_COUNT(8);
 	break;
-      case 0x25:	/* sla l */
+      OPCODE(cb, 0x25):	/* sla l */
 	REG_L = sla_byte(REG_L);  T_COUNT(8);
 	break;
-      case 0x26:	/* sla (hl) */
+      OPCODE(cb, 0x26):	/* sla (hl) */
 	mem_write(REG_HL, sla_byte(mem_read(REG_HL)));  T_COUNT(15);
 	break;
 
-      case 0x2F:	/* sra a */
+      OPCODE(cb, 0x2F):	/* sra a */
 	REG_A = sra_byte(REG_A);  T_COUNT(8);
 	break;
-      case 0x28:	/* sra b */
+      OPCODE(cb, 0x28):	/* sra b */
 	REG_B = sra_byte(REG_B);  T_COUNT(8);
 	break;
-      case 0x29:	/* sra c */
+      OPCODE(cb, 0x29):	/* sra c */
 	REG_C = sra_byte(REG_C);  T_COUNT(8);
 	break;
-      case 0x2A:	/* sra d */
+      OPCODE(cb, 0x2A):	/* sra d */
 	REG_D = sra_byte(REG_D);  T_COUNT(8);
 	break;
-      case 0x2B:	/* sra e */
+      OPCODE(cb, 0x2B):	/* sra e */
 	REG_E = sra_byte(REG_E);  T_COUNT(8);
 	break;
-      case 0x2C:	/* sra h */
+      OPCODE(cb, 0x2C):	/* sra h */
 	REG_H = sra_byte(REG_H);  T_COUNT(8);
 	break;
-      case 0x2D:	/* sra l */
+      OPCODE(cb, 0x2D):	/* sra l */
 	REG_L = sra_byte(REG_L);  T_COUNT(8);
 	break;
-      case 0x2E:	/* sra (hl) */
+      OPCODE(cb, 0x2E):	/* sra (hl) */
 	mem_write(REG_HL, sra_byte(mem_read(REG_HL)));  T_COUNT(15);
 	break;
 
-      case 0x37:	/* slia a [undocumented] */
+      OPCODE(cb, 0x37):	/* slia a [undocumented] */
 	REG_A = slia_byte(REG_A);  T_COUNT(8);
 	break;
-      case 0x30:	/* slia b [undocumented] */
+      OPCODE(cb, 0x30):	/* slia b [undocumented] */
 	REG_B = slia_byte(REG_B);  T_COUNT(8);
 	break;
-      case 0x31:	/* slia c [undocumented] */
+      OPCODE(cb, 0x31):	/* slia c [undocumented] */
 	REG_C = slia_byte(REG_C);  T_COUNT(8);
 	break;
-      case 0x32:	/* slia d [undocumented] */
+      OPCODE(cb, 0x32):	/* slia d [undocumented] */
 	REG_D = slia_byte(REG_D);  T_COUNT(8);
 	break;
-      case 0x33:	/* slia e [undocumented] */
+      OPCODE(cb, 0x33):	/* slia e [undocumented] */
 	REG_E = slia_byte(REG_E);  T_COUNT(8);
 	break;
-      case 0x34:	/* slia h [undocumented] */
+      OPCODE(cb, 0x34):	/* slia h [undocumented] */
 	REG_H = slia_byte(REG_H);  T_COUNT(8);
 	break;
-      case 0x35:	/* slia l [undocumented] */
+      OPCODE(cb, 0x35):	/* slia l [undocumented] */
 	REG_L = slia_byte(REG_L);  T_COUNT(8);
 	break;
-      case 0x36:	/* slia (hl) [undocumented] */
+      OPCODE(cb, 0x36):	/* slia (hl) [undocumented] */
 	mem_write(REG_HL, slia_byte(mem_read(REG_HL)));  T_COUNT(15);
 	break;
 
-      case 0x3F:	/* srl a */
+      OPCODE(cb, 0x3F):	/* srl a */
 	REG_A = srl_byte(REG_A);  T_COUNT(8);
 	break;
-      case 0x38:	/* srl b */
+      OPCODE(cb, 0x38):	/* srl b */
 	REG_B = srl_byte(REG_B);  T_COUNT(8);
 	break;
-      case 0x39:	/* srl c */
+      OPCODE(cb, 0x39):	/* srl c */
 	REG_C = srl_byte(REG_C);  T_COUNT(8);
 	break;
-      case 0x3A:	/* srl d */
+      OPCODE(cb, 0x3A):	/* srl d */
 	REG_D = srl_byte(REG_D);  T_COUNT(8);
 	break;
-      case 0x3B:	/* srl e */
+      OPCODE(cb, 0x3B):	/* srl e */
 	REG_E = srl_byte(REG_E);  T_COUNT(8);
 	break;
-      case 0x3C:	/* srl h */
+      OPCODE(cb, 0x3C):	/* srl h */
 	REG_H = srl_byte(REG_H);  T_COUNT(8);
 	break;
-      case 0x3D:	/* srl l */
+      OPCODE(cb, 0x3D):	/* srl l */
 	REG_L = srl_byte(REG_L);  T_COUNT(8);
 	break;
-      case 0x3E:	/* srl (hl) */
+      OPCODE(cb, 0x3E):	/* srl (hl) */
 	mem_write(REG_HL, srl_byte(mem_read(REG_HL)));  T_COUNT(15);
 	break;
 
-      default:
+      OPCODE_DEFAULT(cb):
 	disassemble(REG_PC - 2);
 	error("unsupported instruction");
     }
@@ -2164,51 +2641,121 @@ static void do_CB_instruction()
 static void do_indexed_instruction(Ushort *ixp)
 {
     Uchar instruction;
+#ifdef Z80_THREADED
+    static void *const ix_dispatch[256] = {
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_0x09, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_0x19, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_0x21, &&ix_0x22, &&ix_0x23,
+	&&ix_0x24, &&ix_0x25, &&ix_0x26, &&ix_default,
+	&&ix_default, &&ix_0x29, &&ix_0x2A, &&ix_0x2B,
+	&&ix_0x2C, &&ix_0x2D, &&ix_0x2E, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0x34, &&ix_0x35, &&ix_0x36, &&ix_default,
+	&&ix_default, &&ix_0x39, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0x44, &&ix_0x45, &&ix_0x46, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0x4C, &&ix_0x4D, &&ix_0x4E, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0x54, &&ix_0x55, &&ix_0x56, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0x5C, &&ix_0x5D, &&ix_0x5E, &&ix_default,
+	&&ix_0x60, &&ix_0x61, &&ix_0x62, &&ix_0x63,
+	&&ix_0x64, &&ix_0x65, &&ix_0x66, &&ix_0x67,
+	&&ix_0x68, &&ix_0x69, &&ix_0x6A, &&ix_0x6B,
+	&&ix_0x6C, &&ix_0x6D, &&ix_0x6E, &&ix_0x6F,
+	&&ix_0x70, &&ix_0x71, &&ix_0x72, &&ix_0x73,
+	&&ix_0x74, &&ix_0x75, &&ix_default, &&ix_0x77,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0x7C, &&ix_0x7D, &&ix_0x7E, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0x84, &&ix_0x85, &&ix_0x86, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0x8C, &&ix_0x8D, &&ix_0x8E, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0x94, &&ix_0x95, &&ix_0x96, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0x9C, &&ix_0x9D, &&ix_0x9E, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0xA4, &&ix_0xA5, &&ix_0xA6, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0xAC, &&ix_0xAD, &&ix_0xAE, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0xB4, &&ix_0xB5, &&ix_0xB6, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_0xBC, &&ix_0xBD, &&ix_0xBE, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_0xCB,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_0xE1, &&ix_default, &&ix_0xE3,
+	&&ix_default, &&ix_0xE5, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_0xE9, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_0xF9, &&ix_default, &&ix_default,
+	&&ix_default, &&ix_default, &&ix_default, &&ix_default
+    };
+#endif
     
-    instruction = mem_read(REG_PC++);
+    instruction = fetch_byte(REG_PC++);
+    z80_state.r++;
     
+    DISPATCH(ix, instruction);
     switch(instruction)
     {
 	/* same for FD, except uses IY */
 
-      case 0x8E:	/* adc a, (ix + offset) */
-	do_adc_byte(mem_read(*ixp + (signed char) mem_read(REG_PC++)));
+      OPCODE(ix, 0x8E):	/* adc a, (ix + offset) */
+	do_adc_byte(mem_read(*ixp + (signed char) fetch_byte(REG_PC++)));
 	T_COUNT(19);
 	break;
 
-      case 0x86:	/* add a, (ix + offset) */
-	do_add_byte(mem_read(*ixp + (signed char) mem_read(REG_PC++)));
+      OPCODE(ix, 0x86):	/* add a, (ix + offset) */
+	do_add_byte(mem_read(*ixp + (signed char) fetch_byte(REG_PC++)));
 	T_COUNT(19);
 	break;
 
-      case 0x09:	/* add ix, bc */
+      OPCODE(ix, 0x09):	/* add ix, bc */
 	do_add_word_index(ixp, REG_BC);  T_COUNT(15);
 	break;
-      case 0x19:	/* add ix, de */
+      OPCODE(ix, 0x19):	/* add ix, de */
 	do_add_word_index(ixp, REG_DE);  T_COUNT(15);
 	break;
-      case 0x29:	/* add ix, ix */
+      OPCODE(ix, 0x29):	/* add ix, ix */
 	do_add_word_index(ixp, *ixp);  T_COUNT(15);
 	break;
-      case 0x39:	/* add ix, sp */
+      OPCODE(ix, 0x39):	/* add ix, sp */
 	do_add_word_index(ixp, REG_SP);  T_COUNT(15);
 	break;
 
-      case 0xA6:	/* and (ix + offset) */
-	do_and_byte(mem_read(*ixp + (signed char) mem_read(REG_PC++)));
+      OPCODE(ix, 0xA6):	/* and (ix + offset) */
+	do_and_byte(mem_read(*ixp + (signed char) fetch_byte(REG_PC++)));
 	T_COUNT(19);
 	break;
 
-      case 0xBE:	/* cp (ix + offset) */
-	do_cp(mem_read(*ixp + (signed char) mem_read(REG_PC++)));
+      OPCODE(ix, 0xBE):	/* cp (ix + offset) */
+	do_cp(mem_read(*ixp + (signed char) fetch_byte(REG_PC++)));
 	T_COUNT(19);
 	break;
 
-      case 0x35:	/* dec (ix + offset) */
+      OPCODE(ix, 0x35):	/* dec (ix + offset) */
         {
 	  Ushort address;
 	  Uchar value;
-	  address = *ixp + (signed char) mem_read(REG_PC++);
+	  address = *ixp + (signed char) fetch_byte(REG_PC++);
 	  value = mem_read(address) - 1;
 	  mem_write(address, value);
 	  do_flags_dec_byte(value);
@@ -2216,12 +2763,12 @@ static void do_indexed_instruction(Ushort *ixp)
 	T_COUNT(23);
 	break;
 
-      case 0x2B:	/* dec ix */
+      OPCODE(ix, 0x2B):	/* dec ix */
 	(*ixp)--;
 	T_COUNT(10);
 	break;
 
-      case 0xE3:	/* ex (sp), ix */
+      OPCODE(ix, 0xE3):	/* ex (sp), ix */
         {
 	  Ushort temp;
 	  temp = mem_read_word(REG_SP);
@@ -2231,11 +2778,11 @@ static void do_indexed_instruction(Ushort *ixp)
 	T_COUNT(23);
 	break;
 
-      case 0x34:	/* inc (ix + offset) */
+      OPCODE(ix, 0x34):	/* inc (ix + offset) */
         {
 	  Ushort address;
 	  Uchar value;
-	  address = *ixp + (signed char) mem_read(REG_PC++);
+	  address = *ixp + (signed char) fetch_byte(REG_PC++);
 	  value = mem_read(address) + 1;
 	  mem_write(address, value);
 	  do_flags_inc_byte(value);
@@ -2243,142 +2790,142 @@ static void do_indexed_instruction(Ushort *ixp)
 	T_COUNT(23);
 	break;
 
-      case 0x23:	/* inc ix */
+      OPCODE(ix, 0x23):	/* inc ix */
 	(*ixp)++;
 	T_COUNT(10);
 	break;
 
-      case 0xE9:	/* jp (ix) */
+      OPCODE(ix, 0xE9):	/* jp (ix) */
 	REG_PC = *ixp;
 	T_COUNT(8);
 	break;
 
-      case 0x7E:	/* ld a, (ix + offset) */
-	REG_A = mem_read(*ixp + (signed char) mem_read(REG_PC++));
+      OPCODE(ix, 0x7E):	/* ld a, (ix + offset) */
+	REG_A = mem_read(*ixp + (signed char) fetch_byte(REG_PC++));
 	T_COUNT(19);
 	break;
-      case 0x46:	/* ld b, (ix + offset) */
-	REG_B = mem_read(*ixp + (signed char) mem_read(REG_PC++));
+      OPCODE(ix, 0x46):	/* ld b, (ix + offset) */
+	REG_B = mem_read(*ixp + (signed char) fetch_byte(REG_PC++));
 	T_COUNT(19);
 	break;
-      case 0x4E:	/* ld c, (ix + offset) */
-	REG_C = mem_read(*ixp + (signed char) mem_read(REG_PC++));
+      OPCODE(ix, 0x4E):	/* ld c, (ix + offset) */
+	REG_C = mem_read(*ixp + (signed char) fetch_byte(REG_PC++));
 	T_COUNT(19);
 	break;
-      case 0x56:	/* ld d, (ix + offset) */
-	REG_D = mem_read(*ixp + (signed char) mem_read(REG_PC++));
+      OPCODE(ix, 0x56):	/* ld d, (ix + offset) */
+	REG_D = mem_read(*ixp + (signed char) fetch_byte(REG_PC++));
 	T_COUNT(19);
 	break;
-      case 0x5E:	/* ld e, (ix + offset) */
-	REG_E = mem_read(*ixp + (signed char) mem_read(REG_PC++));
+      OPCODE(ix, 0x5E):	/* ld e, (ix + offset) */
+	REG_E = mem_read(*ixp + (signed char) fetch_byte(REG_PC++));
 	T_COUNT(19);
 	break;
-      case 0x66:	/* ld h, (ix + offset) */
-	REG_H = mem_read(*ixp + (signed char) mem_read(REG_PC++));
+      OPCODE(ix, 0x66):	/* ld h, (ix + offset) */
+	REG_H = mem_read(*ixp + (signed char) fetch_byte(REG_PC++));
 	T_COUNT(19);
 	break;
-      case 0x6E:	/* ld l, (ix + offset) */
-	REG_L = mem_read(*ixp + (signed char) mem_read(REG_PC++));
+      OPCODE(ix, 0x6E):	/* ld l, (ix + offset) */
+	REG_L = mem_read(*ixp + (signed char) fetch_byte(REG_PC++));
 	T_COUNT(19);
 	break;
 
-      case 0x36:	/* ld (ix + offset), value */
-	mem_write(*ixp + (signed char) mem_read(REG_PC), mem_read(REG_PC+1));
+      OPCODE(ix, 0x36):	/* ld (ix + offset), value */
+	mem_write(*ixp + (signed char) fetch_byte(REG_PC), fetch_byte(REG_PC+1));
 	REG_PC += 2;
 	T_COUNT(19);
 	break;
 
-      case 0x77:	/* ld (ix + offset), a */
-	mem_write(*ixp + (signed char) mem_read(REG_PC++), REG_A);
+      OPCODE(ix, 0x77):	/* ld (ix + offset), a */
+	mem_write(*ixp + (signed char) fetch_byte(REG_PC++), REG_A);
 	T_COUNT(19);
 	break;
-      case 0x70:	/* ld (ix + offset), b */
-	mem_write(*ixp + (signed char) mem_read(REG_PC++), REG_B);
+      OPCODE(ix, 0x70):	/* ld (ix + offset), b */
+	mem_write(*ixp + (signed char) fetch_byte(REG_PC++), REG_B);
 	T_COUNT(19);
 	break;
-      case 0x71:	/* ld (ix + offset), c */
-	mem_write(*ixp + (signed char) mem_read(REG_PC++), REG_C);
+      OPCODE(ix, 0x71):	/* ld (ix + offset), c */
+	mem_write(*ixp + (signed char) fetch_byte(REG_PC++), REG_C);
 	T_COUNT(19);
 	break;
-      case 0x72:	/* ld (ix + offset), d */
-	mem_write(*ixp + (signed char) mem_read(REG_PC++), REG_D);
+      OPCODE(ix, 0x72):	/* ld (ix + offset), d */
+	mem_write(*ixp + (signed char) fetch_byte(REG_PC++), REG_D);
 	T_COUNT(19);
 	break;
-      case 0x73:	/* ld (ix + offset), e */
-	mem_write(*ixp + (signed char) mem_read(REG_PC++), REG_E);
+      OPCODE(ix, 0x73):	/* ld (ix + offset), e */
+	mem_write(*ixp + (signed char) fetch_byte(REG_PC++), REG_E);
 	T_COUNT(19);
 	break;
-      case 0x74:	/* ld (ix + offset), h */
-	mem_write(*ixp + (signed char) mem_read(REG_PC++), REG_H);
+      OPCODE(ix, 0x74):	/* ld (ix + offset), h */
+	mem_write(*ixp + (signed char) fetch_byte(REG_PC++), REG_H);
 	T_COUNT(19);
 	break;
-      case 0x75:	/* ld (ix + offset), l */
-	mem_write(*ixp + (signed char) mem_read(REG_PC++), REG_L);
+      OPCODE(ix, 0x75):	/* ld (ix + offset), l */
+	mem_write(*ixp + (signed char) fetch_byte(REG_PC++), REG_L);
 	T_COUNT(19);
 	break;
 
-      case 0x22:	/* ld (address), ix */
-	mem_write_word(mem_read_word(REG_PC), *ixp);
+      OPCODE(ix, 0x22):	/* ld (address), ix */
+	mem_write_word(fetch_word(REG_PC), *ixp);
 	REG_PC += 2;
 	T_COUNT(20);
 	break;
 
-      case 0xF9:	/* ld sp, ix */
+      OPCODE(ix, 0xF9):	/* ld sp, ix */
 	REG_SP = *ixp;
 	T_COUNT(10);
 	break;
 
-      case 0x21:	/* ld ix, value */
-	*ixp = mem_read_word(REG_PC);
+      OPCODE(ix, 0x21):	/* ld ix, value */
+	*ixp = fetch_word(REG_PC);
         REG_PC += 2;
 	T_COUNT(14);
 	break;
 
-      case 0x2A:	/* ld ix, (address) */
-	*ixp = mem_read_word(mem_read_word(REG_PC));
+      OPCODE(ix, 0x2A):	/* ld ix, (address) */
+	*ixp = mem_read_word(fetch_word(REG_PC));
 	REG_PC += 2;
 	T_COUNT(20);
 	break;
 
-      case 0xB6:	/* or (ix + offset) */
-	do_or_byte(mem_read(*ixp + (signed char) mem_read(REG_PC++)));
+      OPCODE(ix, 0xB6):	/* or (ix + offset) */
+	do_or_byte(mem_read(*ixp + (signed char) fetch_byte(REG_PC++)));
 	T_COUNT(19);
 	break;
 
-      case 0xE1:	/* pop ix */
+      OPCODE(ix, 0xE1):	/* pop ix */
 	*ixp = mem_read_word(REG_SP);
 	REG_SP += 2;
 	T_COUNT(14);
 	break;
 
-      case 0xE5:	/* push ix */
+      OPCODE(ix, 0xE5):	/* push ix */
 	REG_SP -= 2;
 	mem_write_word(REG_SP, *ixp);
 	T_COUNT(15);
 	break;
 
-      case 0x9E:	/* sbc a, (ix + offset) */
-	do_sbc_byte(mem_read(*ixp + (signed char) mem_read(REG_PC++)));
+      OPCODE(ix, 0x9E):	/* sbc a, (ix + offset) */
+	do_sbc_byte(mem_read(*ixp + (signed char) fetch_byte(REG_PC++)));
 	T_COUNT(19);
 	break;
 
-      case 0x96:	/* sub a, (ix + offset) */
-	do_sub_byte(mem_read(*ixp + (signed char) mem_read(REG_PC++)));
+      OPCODE(ix, 0x96):	/* sub a, (ix + offset) */
+	do_sub_byte(mem_read(*ixp + (signed char) fetch_byte(REG_PC++)));
 	T_COUNT(19);
 	break;
 
-      case 0xAE:	/* xor (ix + offset) */
-	do_xor_byte(mem_read(*ixp + (signed char) mem_read(REG_PC++)));
+      OPCODE(ix, 0xAE):	/* xor (ix + offset) */
+	do_xor_byte(mem_read(*ixp + (signed char) fetch_byte(REG_PC++)));
 	T_COUNT(19);
 	break;
 
-      case 0xCB:
+      OPCODE(ix, 0xCB):
         {
 	  signed char offset, result = 0;
 	  Uchar sub_instruction;
 
-	  offset = (signed char) mem_read(REG_PC++);
-	  sub_instruction = mem_read(REG_PC++);
+	  offset = (signed char) fetch_byte(REG_PC++);
+	  sub_instruction = fetch_byte(REG_PC++);
 
 	  /* Instructions with (sub_instruction & 7) != 6 are undocumented;
 	     their extra effect is handled after this switch */
@@ -2492,149 +3039,149 @@ static void do_indexed_instruction(Ushort *ixp)
 	break;
 
       /* begin undocumented instructions -- timings are a (good) guess */
-      case 0x8C:	/* adc a, ixh */
+      OPCODE(ix, 0x8C):	/* adc a, ixh */
 	do_adc_byte(HIGH(ixp));  T_COUNT(8);
 	break;
-      case 0x8D:	/* adc a, ixl */
+      OPCODE(ix, 0x8D):	/* adc a, ixl */
 	do_adc_byte(LOW(ixp));  T_COUNT(8);
 	break;
-      case 0x84:	/* add a, ixh */
+      OPCODE(ix, 0x84):	/* add a, ixh */
 	do_add_byte(HIGH(ixp));  T_COUNT(8);
 	break;
-      case 0x85:	/* add a, ixl */
+      OPCODE(ix, 0x85):	/* add a, ixl */
 	do_add_byte(LOW(ixp));  T_COUNT(8);
 	break;
-      case 0xA4:	/* and ixh */
+      OPCODE(ix, 0xA4):	/* and ixh */
 	do_and_byte(HIGH(ixp));  T_COUNT(8);
 	break;
-      case 0xA5:	/* and ixl */
+      OPCODE(ix, 0xA5):	/* and ixl */
 	do_and_byte(LOW(ixp));  T_COUNT(8);
 	break;
-      case 0xBC:	/* cp ixh */
+      OPCODE(ix, 0xBC):	/* cp ixh */
 	do_cp(HIGH(ixp));  T_COUNT(8);
 	break;
-      case 0xBD:	/* cp ixl */
+      OPCODE(ix, 0xBD):	/* cp ixl */
 	do_cp(LOW(ixp));  T_COUNT(8);
 	break;
-      case 0x25:	/* dec ixh */
+      OPCODE(ix, 0x25):	/* dec ixh */
 	do_flags_dec_byte(--HIGH(ixp));  T_COUNT(8);
 	break;
-      case 0x2D:	/* dec ixl */
+      OPCODE(ix, 0x2D):	/* dec ixl */
 	do_flags_dec_byte(--LOW(ixp));  T_COUNT(8);
 	break;
-      case 0x24:	/* inc ixh */
+      OPCODE(ix, 0x24):	/* inc ixh */
 	HIGH(ixp)++;
 	do_flags_inc_byte(HIGH(ixp));  T_COUNT(8);
 	break;
-      case 0x2C:	/* inc ixl */
+      OPCODE(ix, 0x2C):	/* inc ixl */
 	LOW(ixp)++;
 	do_flags_inc_byte(LOW(ixp));  T_COUNT(8);
 	break;
-      case 0x7C:	/* ld a, ixh */
+      OPCODE(ix, 0x7C):	/* ld a, ixh */
 	REG_A = HIGH(ixp);  T_COUNT(8);
 	break;
-      case 0x7D:	/* ld a, ixl */
+      OPCODE(ix, 0x7D):	/* ld a, ixl */
 	REG_A = LOW(ixp);  T_COUNT(8);
 	break;
-      case 0x44:	/* ld b, ixh */
+      OPCODE(ix, 0x44):	/* ld b, ixh */
 	REG_B = HIGH(ixp);  T_COUNT(8);
 	break;
-      case 0x45:	/* ld b, ixl */
+      OPCODE(ix, 0x45):	/* ld b, ixl */
 	REG_B = LOW(ixp);  T_COUNT(8);
 	break;
-      case 0x4C:	/* ld c, ixh */
+      OPCODE(ix, 0x4C):	/* ld c, ixh */
 	REG_C = HIGH(ixp);  T_COUNT(8);
 	break;
-      case 0x4D:	/* ld c, ixl */
+      OPCODE(ix, 0x4D):	/* ld c, ixl */
 	REG_C = LOW(ixp);  T_COUNT(8);
 	break;
-      case 0x54:	/* ld d, ixh */
+      OPCODE(ix, 0x54):	/* ld d, ixh */
 	REG_D = HIGH(ixp);  T_COUNT(8);
 	break;
-      case 0x55:	/* ld d, ixl */
+      OPCODE(ix, 0x55):	/* ld d, ixl */
 	REG_D = LOW(ixp);  T_COUNT(8);
 	break;
-      case 0x5C:	/* ld e, ixh */
+      OPCODE(ix, 0x5C):	/* ld e, ixh */
 	REG_E = HIGH(ixp);  T_COUNT(8);
 	break;
-      case 0x5D:	/* ld e, ixl */
+      OPCODE(ix, 0x5D):	/* ld e, ixl */
 	REG_E = LOW(ixp);  T_COUNT(8);
 	break;
-      case 0x67:	/* ld ixh, a */
+      OPCODE(ix, 0x67):	/* ld ixh, a */
 	HIGH(ixp) = REG_A;  T_COUNT(8);
 	break;
-      case 0x60:	/* ld ixh, b */
+      OPCODE(ix, 0x60):	/* ld ixh, b */
 	HIGH(ixp) = REG_B;  T_COUNT(8);
 	break;
-      case 0x61:	/* ld ixh, c */
+      OPCODE(ix, 0x61):	/* ld ixh, c */
 	HIGH(ixp) = REG_C;  T_COUNT(8);
 	break;
-      case 0x62:	/* ld ixh, d */
+      OPCODE(ix, 0x62):	/* ld ixh, d */
 	HIGH(ixp) = REG_D;  T_COUNT(8);
 	break;
-      case 0x63:	/* ld ixh, e */
+      OPCODE(ix, 0x63):	/* ld ixh, e */
 	HIGH(ixp) = REG_E;  T_COUNT(8);
 	break;
-      case 0x64:	/* ld ixh, ixh */
+      OPCODE(ix, 0x64):	/* ld ixh, ixh */
 	HIGH(ixp) = HIGH(ixp);  T_COUNT(8);
 	break;
-      case 0x65:	/* ld ixh, ixl */
+      OPCODE(ix, 0x65):	/* ld ixh, ixl */
 	HIGH(ixp) = LOW(ixp);  T_COUNT(8);
 	break;
-      case 0x6F:	/* ld ixl, a */
+      OPCODE(ix, 0x6F):	/* ld ixl, a */
 	LOW(ixp) = REG_A;  T_COUNT(8);
 	break;
-      case 0x68:	/* ld ixl, b */
+      OPCODE(ix, 0x68):	/* ld ixl, b */
 	LOW(ixp) = REG_B;  T_COUNT(8);
 	break;
-      case 0x69:	/* ld ixl, c */
+      OPCODE(ix, 0x69):	/* ld ixl, c */
 	LOW(ixp) = REG_C;  T_COUNT(8);
 	break;
-      case 0x6A:	/* ld ixl, d */
+      OPCODE(ix, 0x6A):	/* ld ixl, d */
 	LOW(ixp) = REG_D;  T_COUNT(8);
 	break;
-      case 0x6B:	/* ld ixl, e */
+      OPCODE(ix, 0x6B):	/* ld ixl, e */
 	LOW(ixp) = REG_E;  T_COUNT(8);
 	break;
-      case 0x6C:	/* ld ixl, ixh */
+      OPCODE(ix, 0x6C):	/* ld ixl, ixh */
 	LOW(ixp) = HIGH(ixp);  T_COUNT(8);
 	break;
-      case 0x6D:	/* ld ixl, ixl */
+      OPCODE(ix, 0x6D):	/* ld ixl, ixl */
 	LOW(ixp) = LOW(ixp);  T_COUNT(8);
 	break;
-      case 0x26:	/* ld ixh, value */
-	HIGH(ixp) = mem_read(REG_PC++);  T_COUNT(11);
+      OPCODE(ix, 0x26):	/* ld ixh, value */
+	HIGH(ixp) = fetch_byte(REG_PC++);  T_COUNT(11);
 	break;
-      case 0x2E:	/* ld ixl, value */
-	LOW(ixp) = mem_read(REG_PC++);  T_COUNT(11);
+      OPCODE(ix, 0x2E):	/* ld ixl, value */
+	LOW(ixp) = fetch_byte(REG_PC++);  T_COUNT(11);
 	break;
-      case 0xB4:	/* or ixh */
+      OPCODE(ix, 0xB4):	/* or ixh */
 	do_or_byte(HIGH(ixp));  T_COUNT(8);
 	break;
-      case 0xB5:	/* or ixl */
+      OPCODE(ix, 0xB5):	/* or ixl */
 	do_or_byte(LOW(ixp));  T_COUNT(8);
 	break;
-      case 0x9C:	/* sbc a, ixh */
+      OPCODE(ix, 0x9C):	/* sbc a, ixh */
 	do_sbc_byte(HIGH(ixp));  T_COUNT(8);
 	break;
-      case 0x9D:	/* sbc a, ixl */
+      OPCODE(ix, 0x9D):	/* sbc a, ixl */
 	do_sbc_byte(LOW(ixp));  T_COUNT(8);
 	break;
-      case 0x94:	/* sub a, ixh */
+      OPCODE(ix, 0x94):	/* sub a, ixh */
 	do_sub_byte(HIGH(ixp));  T_COUNT(8);
 	break;
-      case 0x95:	/* sub a, ixl */
+      OPCODE(ix, 0x95):	/* sub a, ixl */
 	do_sub_byte(LOW(ixp));  T_COUNT(8);
 	break;
-      case 0xAC:	/* xor ixh */
+      OPCODE(ix, 0xAC):	/* xor ixh */
 	do_xor_byte(HIGH(ixp));  T_COUNT(8);
 	break;
-      case 0xAD:	/* xor ixl */
+      OPCODE(ix, 0xAD):	/* xor ixl */
 	do_xor_byte(LOW(ixp));  T_COUNT(8);
 	break;
       /* end undocumented instructions */
 
-      default:
+      OPCODE_DEFAULT(ix):
 	/* Ignore DD or FD prefix and retry as normal instruction;
 	   this is a correct emulation. [undocumented, timing guessed] */
 	REG_PC--;
@@ -2651,342 +3198,414 @@ static int do_ED_instruction()
 {
     Uchar instruction;
     int debug = 0;
+#ifdef Z80_THREADED
+    static void *const ed_dispatch[256] = {
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_0x28, &&ed_0x29, &&ed_0x2A, &&ed_0x2B,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_0x2F,
+	&&ed_0x30, &&ed_0x31, &&ed_0x32, &&ed_0x33,
+	&&ed_0x34, &&ed_0x35, &&ed_0x36, &&ed_0x37,
+	&&ed_0x38, &&ed_0x39, &&ed_0x3A, &&ed_0x3B,
+	&&ed_0x3C, &&ed_0x3D, &&ed_0x3E, &&ed_0x3F,
+	&&ed_0x40, &&ed_0x41, &&ed_0x42, &&ed_0x43,
+	&&ed_0x44, &&ed_0x45, &&ed_0x46, &&ed_0x47,
+	&&ed_0x48, &&ed_0x49, &&ed_0x4A, &&ed_0x4B,
+	&&ed_0x4C, &&ed_0x4D, &&ed_default, &&ed_0x4F,
+	&&ed_0x50, &&ed_0x51, &&ed_0x52, &&ed_0x53,
+	&&ed_0x54, &&ed_0x55, &&ed_0x56, &&ed_0x57,
+	&&ed_0x58, &&ed_0x59, &&ed_0x5A, &&ed_0x5B,
+	&&ed_0x5C, &&ed_0x5D, &&ed_0x5E, &&ed_0x5F,
+	&&ed_0x60, &&ed_0x61, &&ed_0x62, &&ed_0x63,
+	&&ed_0x64, &&ed_0x65, &&ed_0x66, &&ed_0x67,
+	&&ed_0x68, &&ed_0x69, &&ed_0x6A, &&ed_0x6B,
+	&&ed_0x6C, &&ed_0x6D, &&ed_default, &&ed_0x6F,
+	&&ed_0x70, &&ed_0x71, &&ed_0x72, &&ed_0x73,
+	&&ed_0x74, &&ed_0x75, &&ed_0x76, &&ed_default,
+	&&ed_0x78, &&ed_0x79, &&ed_0x7A, &&ed_0x7B,
+	&&ed_0x7C, &&ed_0x7D, &&ed_0x7E, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_0xA0, &&ed_0xA1, &&ed_0xA2, &&ed_0xA3,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_0xA8, &&ed_0xA9, &&ed_0xAA, &&ed_0xAB,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_0xB0, &&ed_0xB1, &&ed_0xB2, &&ed_0xB3,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_0xB8, &&ed_0xB9, &&ed_0xBA, &&ed_0xBB,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default,
+	&&ed_default, &&ed_default, &&ed_default, &&ed_default
+    };
+#endif
     
-    instruction = mem_read(REG_PC++);
+    instruction = fetch_byte(REG_PC++);
+    z80_state.r++;
     
+    DISPATCH(ed, instruction);
     switch(instruction)
     {
-      case 0x4A:	/* adc hl, bc */
+      OPCODE(ed, 0x4A):	/* adc hl, bc */
 	do_adc_word(REG_BC);  T_COUNT(15);
 	break;
-      case 0x5A:	/* adc hl, de */
+      OPCODE(ed, 0x5A):	/* adc hl, de */
 	do_adc_word(REG_DE);  T_COUNT(15);
 	break;
-      case 0x6A:	/* adc hl, hl */
+      OPCODE(ed, 0x6A):	/* adc hl, hl */
 	do_adc_word(REG_HL);  T_COUNT(15);
 	break;
-      case 0x7A:	/* adc hl, sp */
+      OPCODE(ed, 0x7A):	/* adc hl, sp */
 	do_adc_word(REG_SP);  T_COUNT(15);
 	break;
 
-      case 0xA9:	/* cpd */
+      OPCODE(ed, 0xA9):	/* cpd */
 	do_cpd();
 	break;
-      case 0xB9:	/* cpdr */
+      OPCODE(ed, 0xB9):	/* cpdr */
 	do_cpdr();
 	break;
 
-      case 0xA1:	/* cpi */
+      OPCODE(ed, 0xA1):	/* cpi */
 	do_cpi();
 	break;
-      case 0xB1:	/* cpir */
+      OPCODE(ed, 0xB1):	/* cpir */
 	do_cpir();
 	break;
 
-      case 0x46:	/* im 0 */
-      case 0x66:	/* im 0 [undocumented]*/
+      OPCODE(ed, 0x46):	/* im 0 */
+      OPCODE(ed, 0x66):	/* im 0 [undocumented]*/
 	do_im0();  T_COUNT(8);
 	break;
-      case 0x56:	/* im 1 */
-      case 0x76:	/* im 1 [undocumented] */
+      OPCODE(ed, 0x56):	/* im 1 */
+      OPCODE(ed, 0x76):	/* im 1 [undocumented] */
 	do_im1();  T_COUNT(8);
 	break;
-      case 0x5E:	/* im 2 */
-      case 0x7E:	/* im 2 [undocumented] */
+      OPCODE(ed, 0x5E):	/* im 2 */
+      OPCODE(ed, 0x7E):	/* im 2 [undocumented] */
 	do_im2();  T_COUNT(8);
 	break;
 
-      case 0x78:	/* in a, (c) */
+      OPCODE(ed, 0x78):	/* in a, (c) */
 	REG_A = in_with_flags(REG_C);  T_COUNT(11);
 	break;
-      case 0x40:	/* in b, (c) */
+      OPCODE(ed, 0x40):	/* in b, (c) */
 	REG_B = in_with_flags(REG_C);  T_COUNT(11);
 	break;
-      case 0x48:	/* in c, (c) */
+      OPCODE(ed, 0x48):	/* in c, (c) */
 	REG_C = in_with_flags(REG_C);  T_COUNT(11);
 	break;
-      case 0x50:	/* in d, (c) */
+      OPCODE(ed, 0x50):	/* in d, (c) */
 	REG_D = in_with_flags(REG_C);  T_COUNT(11);
 	break;
-      case 0x58:	/* in e, (c) */
+      OPCODE(ed, 0x58):	/* in e, (c) */
 	REG_E = in_with_flags(REG_C);  T_COUNT(11);
 	break;
-      case 0x60:	/* in h, (c) */
+      OPCODE(ed, 0x60):	/* in h, (c) */
 	REG_H = in_with_flags(REG_C);  T_COUNT(11);
 	break;
-      case 0x68:	/* in l, (c) */
+      OPCODE(ed, 0x68):	/* in l, (c) */
 	REG_L = in_with_flags(REG_C);  T_COUNT(11);
 	break;
-      case 0x70:	/* in (c) [undocumented] */
+      OPCODE(ed, 0x70):	/* in (c) [undocumented] */
 	(void) in_with_flags(REG_C);  T_COUNT(11);
 	break;
 
-      case 0xAA:	/* ind */
+      OPCODE(ed, 0xAA):	/* ind */
 	do_ind();
 	break;
-      case 0xBA:	/* indr */
+      OPCODE(ed, 0xBA):	/* indr */
 	do_indr();
 	break;
-      case 0xA2:	/* ini */
+      OPCODE(ed, 0xA2):	/* ini */
 	do_ini();
 	break;
-      case 0xB2:	/* inir */
+      OPCODE(ed, 0xB2):	/* inir */
 	do_inir();
 	break;
 
-      case 0x57:	/* ld a, i */
+      OPCODE(ed, 0x57):	/* ld a, i */
 	do_ld_a_i();  T_COUNT(9);
 	break;
-      case 0x47:	/* ld i, a */
+      OPCODE(ed, 0x47):	/* ld i, a */
 	REG_I = REG_A;  T_COUNT(9);
 	break;
 
-      case 0x5F:	/* ld a, r */
+      OPCODE(ed, 0x5F):	/* ld a, r */
 	do_ld_a_r();  T_COUNT(9);
 	break;
-      case 0x4F:	/* ld r, a */
-	/* unimplemented; ignore */
-	T_COUNT(9);
+      OPCODE(ed, 0x4F):	/* ld r, a */
+	z80_state.r = z80_state.r7 = REG_A;  T_COUNT(9);
 	break;
 
-      case 0x4B:	/* ld bc, (address) */
-	REG_BC = mem_read_word(mem_read_word(REG_PC));
+      OPCODE(ed, 0x4B):	/* ld bc, (address) */
+	REG_BC = mem_read_word(fetch_word(REG_PC));
 	REG_PC += 2;
 	T_COUNT(20);
 	break;
-      case 0x5B:	/* ld de, (address) */
-	REG_DE = mem_read_word(mem_read_word(REG_PC));
+      OPCODE(ed, 0x5B):	/* ld de, (address) */
+	REG_DE = mem_read_word(fetch_word(REG_PC));
 	REG_PC += 2;
 	T_COUNT(20);
 	break;
-      case 0x6B:	/* ld hl, (address) */
+      OPCODE(ed, 0x6B):	/* ld hl, (address) */
 	/* this instruction is redundant with the 2A instruction */
-	REG_HL = mem_read_word(mem_read_word(REG_PC));
+	REG_HL = mem_read_word(fetch_word(REG_PC));
 	REG_PC += 2;
 	T_COUNT(20);
 	break;
-      case 0x7B:	/* ld sp, (address) */
-	REG_SP = mem_read_word(mem_read_word(REG_PC));
+      OPCODE(ed, 0x7B):	/* ld sp, (address) */
+	REG_SP = mem_read_word(fetch_word(REG_PC));
 	REG_PC += 2;
 	T_COUNT(20);
 	break;
 
-      case 0x43:	/* ld (address), bc */
-	mem_write_word(mem_read_word(REG_PC), REG_BC);
+      OPCODE(ed, 0x43):	/* ld (address), bc */
+	mem_write_word(fetch_word(REG_PC), REG_BC);
 	REG_PC += 2;
 	T_COUNT(20);
 	break;
-      case 0x53:	/* ld (address), de */
-	mem_write_word(mem_read_word(REG_PC), REG_DE);
+      OPCODE(ed, 0x53):	/* ld (address), de */
+	mem_write_word(fetch_word(REG_PC), REG_DE);
 	REG_PC += 2;
 	T_COUNT(20);
 	break;
-      case 0x63:	/* ld (address), hl */
+      OPCODE(ed, 0x63):	/* ld (address), hl */
 	/* this instruction is redundant with the 22 instruction */
-	mem_write_word(mem_read_word(REG_PC), REG_HL);
+	mem_write_word(fetch_word(REG_PC), REG_HL);
 	REG_PC += 2;
 	T_COUNT(20);
 	break;
-      case 0x73:	/* ld (address), sp */
-	mem_write_word(mem_read_word(REG_PC), REG_SP);
+      OPCODE(ed, 0x73):	/* ld (address), sp */
+	mem_write_word(fetch_word(REG_PC), REG_SP);
 	REG_PC += 2;
 	T_COUNT(20);
 	break;
 
-      case 0xA8:	/* ldd */
+      OPCODE(ed, 0xA8):	/* ldd */
 	do_ldd();
 	break;
-      case 0xB8:	/* lddr */
+      OPCODE(ed, 0xB8):	/* lddr */
 	do_lddr();
 	break;
-      case 0xA0:	/* ldi */
+      OPCODE(ed, 0xA0):	/* ldi */
 	do_ldi();
 	break;
-      case 0xB0:	/* ldir */
+      OPCODE(ed, 0xB0):	/* ldir */
 	do_ldir();
 	break;
 
-      case 0x44:	/* neg */
-      case 0x4C:	/* neg [undocumented] */
-      case 0x54:	/* neg [undocumented] */
-      case 0x5C:	/* neg [undocumented] */
-      case 0x64:	/* neg [undocumented] */
-      case 0x6C:	/* neg [undocumented] */
-      case 0x74:	/* neg [undocumented] */
-      case 0x7C:	/* neg [undocumented] */
+      OPCODE(ed, 0x44):	/* neg */
+      OPCODE(ed, 0x4C):	/* neg [undocumented] */
+      OPCODE(ed, 0x54):	/* neg [undocumented] */
+      OPCODE(ed, 0x5C):	/* neg [undocumented] */
+      OPCODE(ed, 0x64):	/* neg [undocumented] */
+      OPCODE(ed, 0x6C):	/* neg [undocumented] */
+      OPCODE(ed, 0x74):	/* neg [undocumented] */
+      OPCODE(ed, 0x7C):	/* neg [undocumented] */
 	do_negate();
 	T_COUNT(8);
 	break;
 
-      case 0x79:	/* out (c), a */
+      OPCODE(ed, 0x79):	/* out (c), a */
 	z80_out(REG_C, REG_A);
 	T_COUNT(12);
 	break;
-      case 0x41:	/* out (c), b */
+      OPCODE(ed, 0x41):	/* out (c), b */
 	z80_out(REG_C, REG_B);
 	T_COUNT(12);
 	break;
-      case 0x49:	/* out (c), c */
+      OPCODE(ed, 0x49):	/* out (c), c */
 	z80_out(REG_C, REG_C);
 	T_COUNT(12);
 	break;
-      case 0x51:	/* out (c), d */
+      OPCODE(ed, 0x51):	/* out (c), d */
 	z80_out(REG_C, REG_D);
 	T_COUNT(12);
 	break;
-      case 0x59:	/* out (c), e */
+      OPCODE(ed, 0x59):	/* out (c), e */
 	z80_out(REG_C, REG_E);
 	T_COUNT(12);
 	break;
-      case 0x61:	/* out (c), h */
+      OPCODE(ed, 0x61):	/* out (c), h */
 	z80_out(REG_C, REG_H);
 	T_COUNT(12);
 	break;
-      case 0x69:	/* out (c), l */
+      OPCODE(ed, 0x69):	/* out (c), l */
 	z80_out(REG_C, REG_L);
 	T_COUNT(12);
 	break;
-      case 0x71:	/* out (c), 0 [undocumented] */
+      OPCODE(ed, 0x71):	/* out (c), 0 [undocumented] */
         /* Note: on a CMOS part this outputs 0xFF */
 	z80_out(REG_C, 0);
 	T_COUNT(12);
 	break;
 
-      case 0xAB:	/* outd */
+      OPCODE(ed, 0xAB):	/* outd */
 	do_outd();
 	break;
-      case 0xBB:	/* outdr */
+      OPCODE(ed, 0xBB):	/* outdr */
 	do_outdr();
 	break;
-      case 0xA3:	/* outi */
+      OPCODE(ed, 0xA3):	/* outi */
 	do_outi();
 	break;
-      case 0xB3:	/* outir */
+      OPCODE(ed, 0xB3):	/* outir */
 	do_outir();
 	break;
 
-      case 0x4D:	/* reti */
+      OPCODE(ed, 0x4D):	/* reti */
 	/* no support for alerting peripherals, just like ret */
 	REG_PC = mem_read_word(REG_SP);
 	REG_SP += 2;
 	/* Yes RETI does this, it's not mentioned in the documentation but
 	   it happens on real silicon */
 	z80_state.iff1 = z80_state.iff2;  /* restore the iff state */
+	z80_wakeup = 1;
 	T_COUNT(14);
 	break;
 
-      case 0x45:	/* retn */
+      OPCODE(ed, 0x45):	/* retn */
 	REG_PC = mem_read_word(REG_SP);
 	REG_SP += 2;
 	z80_state.iff1 = z80_state.iff2;  /* restore the iff state */
+	z80_wakeup = 1;
 	T_COUNT(14);
 	break;
 
-      case 0x55:	/* ret [undocumented] */
-      case 0x5D:	/* ret [undocumented] */
-      case 0x65:	/* ret [undocumented] */
-      case 0x6D:	/* ret [undocumented] */
-      case 0x75:	/* ret [undocumented] */
-      case 0x7D:	/* ret [undocumented] */
+      OPCODE(ed, 0x55):	/* ret [undocumented] */
+      OPCODE(ed, 0x5D):	/* ret [undocumented] */
+      OPCODE(ed, 0x65):	/* ret [undocumented] */
+      OPCODE(ed, 0x6D):	/* ret [undocumented] */
+      OPCODE(ed, 0x75):	/* ret [undocumented] */
+      OPCODE(ed, 0x7D):	/* ret [undocumented] */
 	REG_PC = mem_read_word(REG_SP);
 	REG_SP += 2;
 	T_COUNT(14);
 	break;
 
-      case 0x6F:	/* rld */
+      OPCODE(ed, 0x6F):	/* rld */
 	do_rld();
 	T_COUNT(18);
 	break;
 
-      case 0x67:	/* rrd */
+      OPCODE(ed, 0x67):	/* rrd */
 	do_rrd();
 	T_COUNT(18);
 	break;
 
-      case 0x42:	/* sbc hl, bc */
+      OPCODE(ed, 0x42):	/* sbc hl, bc */
 	do_sbc_word(REG_BC);
 	T_COUNT(15);
 	break;
-      case 0x52:	/* sbc hl, de */
+      OPCODE(ed, 0x52):	/* sbc hl, de */
 	do_sbc_word(REG_DE);
 	T_COUNT(15);
 	break;
-      case 0x62:	/* sbc hl, hl */
+      OPCODE(ed, 0x62):	/* sbc hl, hl */
 	do_sbc_word(REG_HL);
 	T_COUNT(15);
 	break;
-      case 0x72:	/* sbc hl, sp */
+      OPCODE(ed, 0x72):	/* sbc hl, sp */
 	do_sbc_word(REG_SP);
 	T_COUNT(15);
 	break;
 
       /* Emulator traps -- not real Z80 instructions */
-      case 0x28:        /* emt_system */
+      OPCODE(ed, 0x28):        /* emt_system */
 	do_emt_system();
 	break;
-      case 0x29:        /* emt_mouse */
+      OPCODE(ed, 0x29):        /* emt_mouse */
 	do_emt_mouse();
 	break;
-      case 0x2a:        /* emt_getddir */
+      OPCODE(ed, 0x2A):        /* emt_getddir */
 	do_emt_getddir();
 	break;
-      case 0x2b:        /* emt_setddir */
+      OPCODE(ed, 0x2B):        /* emt_setddir */
 	do_emt_setddir();
 	break;
-      case 0x2f:        /* emt_debug */
+      OPCODE(ed, 0x2F):        /* emt_debug */
 	if (trs_continuous > 0) trs_continuous = 0;
+	z80_wakeup = 1;
 	debug = 1;
 	break;
-      case 0x30:        /* emt_open */
+      OPCODE(ed, 0x30):        /* emt_open */
 	do_emt_open();
 	break;
-      case 0x31:	/* emt_close */
+      OPCODE(ed, 0x31):	/* emt_close */
 	do_emt_close();
 	break;
-      case 0x32:	/* emt_read */
+      OPCODE(ed, 0x32):	/* emt_read */
 	do_emt_read();
 	break;
-      case 0x33:	/* emt_write */
+      OPCODE(ed, 0x33):	/* emt_write */
 	do_emt_write();
 	break;
-      case 0x34:	/* emt_lseek */
+      OPCODE(ed, 0x34):	/* emt_lseek */
 	do_emt_lseek();
 	break;
-      case 0x35:	/* emt_strerror */
+      OPCODE(ed, 0x35):	/* emt_strerror */
 	do_emt_strerror();
 	break;
-      case 0x36:	/* emt_time */
+      OPCODE(ed, 0x36):	/* emt_time */
 	do_emt_time();
 	break;
-      case 0x37:        /* emt_opendir */
+      OPCODE(ed, 0x37):        /* emt_opendir */
 	do_emt_opendir();
 	break;
-      case 0x38:	/* emt_closedir */
+      OPCODE(ed, 0x38):	/* emt_closedir */
 	do_emt_closedir();
 	break;
-      case 0x39:	/* emt_readdir */
+      OPCODE(ed, 0x39):	/* emt_readdir */
 	do_emt_readdir();
 	break;
-      case 0x3a:	/* emt_chdir */
+      OPCODE(ed, 0x3A):	/* emt_chdir */
 	do_emt_chdir();
 	break;
-      case 0x3b:	/* emt_getcwd */
+      OPCODE(ed, 0x3B):	/* emt_getcwd */
 	do_emt_getcwd();
 	break;
-      case 0x3c:	/* emt_misc */
+      OPCODE(ed, 0x3C):	/* emt_misc */
 	do_emt_misc();
 	break;
-      case 0x3d:	/* emt_ftruncate */
+      OPCODE(ed, 0x3D):	/* emt_ftruncate */
 	do_emt_ftruncate();
 	break;
-      case 0x3e:        /* emt_opendisk */
+      OPCODE(ed, 0x3E):        /* emt_opendisk */
 	do_emt_opendisk();
 	break;
-      case 0x3f:	/* emt_closedisk */
+      OPCODE(ed, 0x3F):	/* emt_closedisk */
 	do_emt_closedisk();
 	break;
 
-      default:
+      OPCODE_DEFAULT(ed):
 	disassemble(REG_PC - 2);
 	error("unsupported instruction");
     }
@@ -2994,10 +3613,32 @@ static int do_ED_instruction()
     return debug;
 }
 
-volatile int x_poll_count = 0;
 #define X_POLL_INTERVAL 10000
 
-int trs_continuous;
+/* Charge the instruction at pc, begun at t0, to the profile */
+static inline void profile_count(struct trs_profile *p, Ushort pc,
+				 tstate_t t0)
+{
+    tstate_t t = z80_state.t_count - t0;
+    int bank = p->page_bank[pc >> 8];
+
+    p->count[pc]++;
+    p->tstates[pc] += t;
+    p->bank_count[bank]++;
+    p->bank_tstates[bank] += t;
+    p->node[p->cur].tstates += t;
+    if (REG_SP != p->sp) trs_profile_stack(pc);
+}
+
+/* z80_wakeup is set by anything that changes the IRQ/NMI lines, the
+   IFFs, the event schedule, or trs_continuous, so that z80_run
+   notices at the end of the current instruction.  Otherwise it checks
+   only when due.
+
+   If z80_traps is set, z80_run also returns when the next instruction
+   is at an address whose entry in it is nonzero.  Calling z80_run
+   again executes that instruction before looking at the traps. */
+
 volatile int dummy;
 
 int z80_run(int continuous)
@@ -3011,15 +3652,90 @@ int z80_run(int continuous)
     Ushort address; /* generic temps */
     int ret = 0;
     int i;
+    int budget, slice;
+    tstate_t deadline;
+    Uchar *traps;
+    struct trs_profile *prof;
+    Ushort prof_pc = 0;
+    tstate_t prof_t = 0;
+#ifdef Z80_THREADED
+    static void *const base_dispatch[256] = {
+	&&base_0x00, &&base_0x01, &&base_0x02, &&base_0x03,
+	&&base_0x04, &&base_0x05, &&base_0x06, &&base_0x07,
+	&&base_0x08, &&base_0x09, &&base_0x0A, &&base_0x0B,
+	&&base_0x0C, &&base_0x0D, &&base_0x0E, &&base_0x0F,
+	&&base_0x10, &&base_0x11, &&base_0x12, &&base_0x13,
+	&&base_0x14, &&base_0x15, &&base_0x16, &&base_0x17,
+	&&base_0x18, &&base_0x19, &&base_0x1A, &&base_0x1B,
+	&&base_0x1C, &&base_0x1D, &&base_0x1E, &&base_0x1F,
+	&&base_0x20, &&base_0x21, &&base_0x22, &&base_0x23,
+	&&base_0x24, &&base_0x25, &&base_0x26, &&base_0x27,
+	&&base_0x28, &&base_0x29, &&base_0x2A, &&base_0x2B,
+	&&base_0x2C, &&base_0x2D, &&base_0x2E, &&base_0x2F,
+	&&base_0x30, &&base_0x31, &&base_0x32, &&base_0x33,
+	&&base_0x34, &&base_0x35, &&base_0x36, &&base_0x37,
+	&&base_0x38, &&base_0x39, &&base_0x3A, &&base_0x3B,
+	&&base_0x3C, &&base_0x3D, &&base_0x3E, &&base_0x3F,
+	&&base_0x40, &&base_0x41, &&base_0x42, &&base_0x43,
+	&&base_0x44, &&base_0x45, &&base_0x46, &&base_0x47,
+	&&base_0x48, &&base_0x49, &&base_0x4A, &&base_0x4B,
+	&&base_0x4C, &&base_0x4D, &&base_0x4E, &&base_0x4F,
+	&&base_0x50, &&base_0x51, &&base_0x52, &&base_0x53,
+	&&base_0x54, &&base_0x55, &&base_0x56, &&base_0x57,
+	&&base_0x58, &&base_0x59, &&base_0x5A, &&base_0x5B,
+	&&base_0x5C, &&base_0x5D, &&base_0x5E, &&base_0x5F,
+	&&base_0x60, &&base_0x61, &&base_0x62, &&base_0x63,
+	&&base_0x64, &&base_0x65, &&base_0x66, &&base_0x67,
+	&&base_0x68, &&base_0x69, &&base_0x6A, &&base_0x6B,
+	&&base_0x6C, &&base_0x6D, &&base_0x6E, &&base_0x6F,
+	&&base_0x70, &&base_0x71, &&base_0x72, &&base_0x73,
+	&&base_0x74, &&base_0x75, &&base_0x76, &&base_0x77,
+	&&base_0x78, &&base_0x79, &&base_0x7A, &&base_0x7B,
+	&&base_0x7C, &&base_0x7D, &&base_0x7E, &&base_0x7F,
+	&&base_0x80, &&base_0x81, &&base_0x82, &&base_0x83,
+	&&base_0x84, &&base_0x85, &&base_0x86, &&base_0x87,
+	&&base_0x88, &&base_0x89, &&base_0x8A, &&base_0x8B,
+	&&base_0x8C, &&base_0x8D, &&base_0x8E, &&base_0x8F,
+	&&base_0x90, &&base_0x91, &&base_0x92, &&base_0x93,
+	&&base_0x94, &&base_0x95, &&base_0x96, &&base_0x97,
+	&&base_0x98, &&base_0x99, &&base_0x9A, &&base_0x9B,
+	&&base_0x9C, &&base_0x9D, &&base_0x9E, &&base_0x9F,
+	&&base_0xA0, &&base_0xA1, &&base_0xA2, &&base_0xA3,
+	&&base_0xA4, &&base_0xA5, &&base_0xA6, &&base_0xA7,
+	&&base_0xA8, &&base_0xA9, &&base_0xAA, &&base_0xAB,
+	&&base_0xAC, &&base_0xAD, &&base_0xAE, &&base_0xAF,
+	&&base_0xB0, &&base_0xB1, &&base_0xB2, &&base_0xB3,
+	&&base_0xB4, &&base_0xB5, &&base_0xB6, &&base_0xB7,
+	&&base_0xB8, &&base_0xB9, &&base_0xBA, &&base_0xBB,
+	&&base_0xBC, &&base_0xBD, &&base_0xBE, &&base_0xBF,
+	&&base_0xC0, &&base_0xC1, &&base_0xC2, &&base_0xC3,
+	&&base_0xC4, &&base_0xC5, &&base_0xC6, &&base_0xC7,
+	&&base_0xC8, &&base_0xC9, &&base_0xCA, &&base_0xCB,
+	&&base_0xCC, &&base_0xCD, &&base_0xCE, &&base_0xCF,
+	&&base_0xD0, &&base_0xD1, &&base_0xD2, &&base_0xD3,
+	&&base_0xD4, &&base_0xD5, &&base_0xD6, &&base_0xD7,
+	&&base_0xD8, &&base_0xD9, &&base_0xDA, &&base_0xDB,
+	&&base_0xDC, &&base_0xDD, &&base_0xDE, &&base_0xDF,
+	&&base_0xE0, &&base_0xE1, &&base_0xE2, &&base_0xE3,
+	&&base_0xE4, &&base_0xE5, &&base_0xE6, &&base_0xE7,
+	&&base_0xE8, &&base_0xE9, &&base_0xEA, &&base_0xEB,
+	&&base_0xEC, &&base_0xED, &&base_0xEE, &&base_0xEF,
+	&&base_0xF0, &&base_0xF1, &&base_0xF2, &&base_0xF3,
+	&&base_0xF4, &&base_0xF5, &&base_0xF6, &&base_0xF7,
+	&&base_0xF8, &&base_0xF9, &&base_0xFA, &&base_0xFB,
+	&&base_0xFC, &&base_0xFD, &&base_0xFE, &&base_0xFF
+    };
+#endif
     trs_continuous = continuous;
 
-    /* loop to do a z80 instruction */
+    /* loop to do a slice of z80 instructions */
     do {
         /* We need to poll for X events periodically.  That also
 	   flushes output to the X server. */
 	if (x_poll_count <= 0) {
 	    x_poll_count = X_POLL_INTERVAL;
 	    trs_get_event(FALSE);
+	    trs_journal_poll();
 	} else {
 	    x_poll_count--;
 	}
@@ -3028,132 +3744,166 @@ int z80_run(int continuous)
 	  while (--i) dummy = i;
 	}
 
-	instruction = mem_read(REG_PC++);
+	/* Decide how many more instructions may run before we have
+	   to look at the outside world again.  If we are throttled,
+	   single-stepping, or an interrupt is already deliverable,
+	   the answer is none; otherwise we run until the next host
+	   poll, the next scheduled event, or a z80_wakeup. */
+	if (trs_continuous <= 0 || z80_state.delay ||
+	    (z80_state.nmi && !z80_state.nmi_seen) ||
+	    (z80_state.irq && z80_state.iff1)) {
+	    budget = 0;
+	} else {
+	    budget = x_poll_count;
+	}
+	slice = budget;
+	if (z80_state.sched) {
+	    deadline = z80_state.sched;
+	} else {
+	    deadline = z80_state.t_count + TSTATE_T_MID;
+	}
+	z80_wakeup = 0;
+	traps = z80_traps;
+	prof = z80_profile;
+	if (prof && !prof->on) prof = NULL;
+
+      for (;;) {
+	if (z80_block_cache &&
+	    (Ushort) (REG_PC - block_pc) >= block_len) {
+	    block_enter(REG_PC);
+	}
+	if (prof) {
+	    prof_pc = REG_PC;
+	    prof_t = z80_state.t_count;
+	}
+	instruction = fetch_byte(REG_PC++);
+	z80_state.r++;
 	
+	DISPATCH(base, instruction);
 	switch(instruction)
 	{
-	  case 0xCB:	/* CB.. extended instruction */
+	  OPCODE(base, 0xCB):	/* CB.. extended instruction */
 	    do_CB_instruction();
 	    break;
-	  case 0xDD:	/* DD.. extended instruction */
+	  OPCODE(base, 0xDD):	/* DD.. extended instruction */
 	    do_indexed_instruction(&REG_IX);
 	    break;
-	  case 0xED:	/* ED.. extended instruction */
+	  OPCODE(base, 0xED):	/* ED.. extended instruction */
 	    ret = do_ED_instruction();
 	    break;
-	  case 0xFD:	/* FD.. extended instruction */
+	  OPCODE(base, 0xFD):	/* FD.. extended instruction */
 	    do_indexed_instruction(&REG_IY);
 	    break;
 	    
-	  case 0x8F:	/* adc a, a */
+	  OPCODE(base, 0x8F):	/* adc a, a */
 	    do_adc_byte(REG_A);	 T_COUNT(4);
 	    break;
-	  case 0x88:	/* adc a, b */
+	  OPCODE(base, 0x88):	/* adc a, b */
 	    do_adc_byte(REG_B);	 T_COUNT(4);
 	    break;
-	  case 0x89:	/* adc a, c */
+	  OPCODE(base, 0x89):	/* adc a, c */
 	    do_adc_byte(REG_C);	 T_COUNT(4);
 	    break;
-	  case 0x8A:	/* adc a, d */
+	  OPCODE(base, 0x8A):	/* adc a, d */
 	    do_adc_byte(REG_D);	 T_COUNT(4);
 	    break;
-	  case 0x8B:	/* adc a, e */
+	  OPCODE(base, 0x8B):	/* adc a, e */
 	    do_adc_byte(REG_E);	 T_COUNT(4);
 	    break;
-	  case 0x8C:	/* adc a, h */
+	  OPCODE(base, 0x8C):	/* adc a, h */
 	    do_adc_byte(REG_H);	 T_COUNT(4);
 	    break;
-	  case 0x8D:	/* adc a, l */
+	  OPCODE(base, 0x8D):	/* adc a, l */
 	    do_adc_byte(REG_L);	 T_COUNT(4);
 	    break;
-	  case 0xCE:	/* adc a, value */
-	    do_adc_byte(mem_read(REG_PC++));  T_COUNT(7);
+	  OPCODE(base, 0xCE):	/* adc a, value */
+	    do_adc_byte(fetch_byte(REG_PC++));  T_COUNT(7);
 	    break;
-	  case 0x8E:	/* adc a, (hl) */
+	  OPCODE(base, 0x8E):	/* adc a, (hl) */
 	    do_adc_byte(mem_read(REG_HL));  T_COUNT(7);
 	    break;
 	    
-	  case 0x87:	/* add a, a */
+	  OPCODE(base, 0x87):	/* add a, a */
 	    do_add_byte(REG_A);	 T_COUNT(4);
 	    break;
-	  case 0x80:	/* add a, b */
+	  OPCODE(base, 0x80):	/* add a, b */
 	    do_add_byte(REG_B);	 T_COUNT(4);
 	    break;
-	  case 0x81:	/* add a, c */
+	  OPCODE(base, 0x81):	/* add a, c */
 	    do_add_byte(REG_C);	 T_COUNT(4);
 	    break;
-	  case 0x82:	/* add a, d */
+	  OPCODE(base, 0x82):	/* add a, d */
 	    do_add_byte(REG_D);	 T_COUNT(4);
 	    break;
-	  case 0x83:	/* add a, e */
+	  OPCODE(base, 0x83):	/* add a, e */
 	    do_add_byte(REG_E);	 T_COUNT(4);
 	    break;
-	  case 0x84:	/* add a, h */
+	  OPCODE(base, 0x84):	/* add a, h */
 	    do_add_byte(REG_H);	 T_COUNT(4);
 	    break;
-	  case 0x85:	/* add a, l */
+	  OPCODE(base, 0x85):	/* add a, l */
 	    do_add_byte(REG_L);	 T_COUNT(4);
 	    break;
-	  case 0xC6:	/* add a, value */
-	    do_add_byte(mem_read(REG_PC++));  T_COUNT(7);
+	  OPCODE(base, 0xC6):	/* add a, value */
+	    do_add_byte(fetch_byte(REG_PC++));  T_COUNT(7);
 	    break;
-	  case 0x86:	/* add a, (hl) */
+	  OPCODE(base, 0x86):	/* add a, (hl) */
 	    do_add_byte(mem_read(REG_HL));  T_COUNT(7);
 	    break;
 	    
-	  case 0x09:	/* add hl, bc */
+	  OPCODE(base, 0x09):	/* add hl, bc */
 	    do_add_word(REG_BC);  T_COUNT(11);
 	    break;
-	  case 0x19:	/* add hl, de */
+	  OPCODE(base, 0x19):	/* add hl, de */
 	    do_add_word(REG_DE);  T_COUNT(11);
 	    break;
-	  case 0x29:	/* add hl, hl */
+	  OPCODE(base, 0x29):	/* add hl, hl */
 	    do_add_word(REG_HL);  T_COUNT(11);
 	    break;
-	  case 0x39:	/* add hl, sp */
+	  OPCODE(base, 0x39):	/* add hl, sp */
 	    do_add_word(REG_SP);  T_COUNT(11);
 	    break;
 	    
-	  case 0xA7:	/* and a */
+	  OPCODE(base, 0xA7):	/* and a */
 	    do_and_byte(REG_A);	 T_COUNT(4);
 	    break;
-	  case 0xA0:	/* and b */
+	  OPCODE(base, 0xA0):	/* and b */
 	    do_and_byte(REG_B);	 T_COUNT(4);
 	    break;
-	  case 0xA1:	/* and c */
+	  OPCODE(base, 0xA1):	/* and c */
 	    do_and_byte(REG_C);	 T_COUNT(4);
 	    break;
-	  case 0xA2:	/* and d */
+	  OPCODE(base, 0xA2):	/* and d */
 	    do_and_byte(REG_D);	 T_COUNT(4);
 	    break;
-	  case 0xA3:	/* and e */
+	  OPCODE(base, 0xA3):	/* and e */
 	    do_and_byte(REG_E);	 T_COUNT(4);
 	    break;
-	  case 0xA4:	/* and h */
+	  OPCODE(base, 0xA4):	/* and h */
 	    do_and_byte(REG_H);	 T_COUNT(4);
 	    break;
-	  case 0xA5:	/* and l */
+	  OPCODE(base, 0xA5):	/* and l */
 	    do_and_byte(REG_L);  T_COUNT(4);
 	    break;
-	  case 0xE6:	/* and value */
-	    do_and_byte(mem_read(REG_PC++));  T_COUNT(7);
+	  OPCODE(base, 0xE6):	/* and value */
+	    do_and_byte(fetch_byte(REG_PC++));  T_COUNT(7);
 	    break;
-	  case 0xA6:	/* and (hl) */
+	  OPCODE(base, 0xA6):	/* and (hl) */
 	    do_and_byte(mem_read(REG_HL));  T_COUNT(7);
 	    break;
 	    
-	  case 0xCD:	/* call address */
-	    address = mem_read_word(REG_PC);
+	  OPCODE(base, 0xCD):	/* call address */
+	    address = fetch_word(REG_PC);
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_PC + 2);
 	    REG_PC = address;
 	    T_COUNT(17);
 	    break;
 	    
-	  case 0xC4:	/* call nz, address */
+	  OPCODE(base, 0xC4):	/* call nz, address */
 	    if(!ZERO_FLAG)
 	    {
-		address = mem_read_word(REG_PC);
+		address = fetch_word(REG_PC);
 		REG_SP -= 2;
 		mem_write_word(REG_SP, REG_PC + 2);
 		REG_PC = address;
@@ -3165,10 +3915,10 @@ int z80_run(int continuous)
 		T_COUNT(10);
 	    }
 	    break;
-	  case 0xCC:	/* call z, address */
+	  OPCODE(base, 0xCC):	/* call z, address */
 	    if(ZERO_FLAG)
 	    {
-		address = mem_read_word(REG_PC);
+		address = fetch_word(REG_PC);
 		REG_SP -= 2;
 		mem_write_word(REG_SP, REG_PC + 2);
 		REG_PC = address;
@@ -3180,10 +3930,10 @@ int z80_run(int continuous)
 		T_COUNT(10);
 	    }
 	    break;
-	  case 0xD4:	/* call nc, address */
+	  OPCODE(base, 0xD4):	/* call nc, address */
 	    if(!CARRY_FLAG)
 	    {
-		address = mem_read_word(REG_PC);
+		address = fetch_word(REG_PC);
 		REG_SP -= 2;
 		mem_write_word(REG_SP, REG_PC + 2);
 		REG_PC = address;
@@ -3195,10 +3945,10 @@ int z80_run(int continuous)
 		T_COUNT(10);
 	    }
 	    break;
-	  case 0xDC:	/* call c, address */
+	  OPCODE(base, 0xDC):	/* call c, address */
 	    if(CARRY_FLAG)
 	    {
-		address = mem_read_word(REG_PC);
+		address = fetch_word(REG_PC);
 		REG_SP -= 2;
 		mem_write_word(REG_SP, REG_PC + 2);
 		REG_PC = address;
@@ -3210,10 +3960,10 @@ int z80_run(int continuous)
 		T_COUNT(10);
 	    }
 	    break;
-	  case 0xE4:	/* call po, address */
+	  OPCODE(base, 0xE4):	/* call po, address */
 	    if(!PARITY_FLAG)
 	    {
-		address = mem_read_word(REG_PC);
+		address = fetch_word(REG_PC);
 		REG_SP -= 2;
 		mem_write_word(REG_SP, REG_PC + 2);
 		REG_PC = address;
@@ -3225,10 +3975,10 @@ int z80_run(int continuous)
 		T_COUNT(10);
 	    }
 	    break;
-	  case 0xEC:	/* call pe, address */
+	  OPCODE(base, 0xEC):	/* call pe, address */
 	    if(PARITY_FLAG)
 	    {
-		address = mem_read_word(REG_PC);
+		address = fetch_word(REG_PC);
 		REG_SP -= 2;
 		mem_write_word(REG_SP, REG_PC + 2);
 		REG_PC = address;
@@ -3240,10 +3990,10 @@ int z80_run(int continuous)
 		T_COUNT(10);
 	    }
 	    break;
-	  case 0xF4:	/* call p, address */
+	  OPCODE(base, 0xF4):	/* call p, address */
 	    if(!SIGN_FLAG)
 	    {
-		address = mem_read_word(REG_PC);
+		address = fetch_word(REG_PC);
 		REG_SP -= 2;
 		mem_write_word(REG_SP, REG_PC + 2);
 		REG_PC = address;
@@ -3255,10 +4005,10 @@ int z80_run(int continuous)
 		T_COUNT(10);
 	    }
 	    break;
-	  case 0xFC:	/* call m, address */
+	  OPCODE(base, 0xFC):	/* call m, address */
 	    if(SIGN_FLAG)
 	    {
-		address = mem_read_word(REG_PC);
+		address = fetch_word(REG_PC);
 		REG_SP -= 2;
 		mem_write_word(REG_SP, REG_PC + 2);
 		REG_PC = address;
@@ -3272,7 +4022,7 @@ int z80_run(int continuous)
 	    break;
 	    
 	    
-	  case 0x3F:	/* ccf */
+	  OPCODE(base, 0x3F):	/* ccf */
 	    REG_F = (REG_F & (ZERO_MASK|PARITY_MASK|SIGN_MASK))
 	      | (~REG_F & CARRY_MASK)
 	      | ((REG_F & CARRY_MASK) ? HALF_CARRY_MASK : 0)
@@ -3280,35 +4030,35 @@ int z80_run(int continuous)
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0xBF:	/* cp a */
+	  OPCODE(base, 0xBF):	/* cp a */
 	    do_cp(REG_A);  T_COUNT(4);
 	    break;
-	  case 0xB8:	/* cp b */
+	  OPCODE(base, 0xB8):	/* cp b */
 	    do_cp(REG_B);  T_COUNT(4);
 	    break;
-	  case 0xB9:	/* cp c */
+	  OPCODE(base, 0xB9):	/* cp c */
 	    do_cp(REG_C);  T_COUNT(4);
 	    break;
-	  case 0xBA:	/* cp d */
+	  OPCODE(base, 0xBA):	/* cp d */
 	    do_cp(REG_D);  T_COUNT(4);
 	    break;
-	  case 0xBB:	/* cp e */
+	  OPCODE(base, 0xBB):	/* cp e */
 	    do_cp(REG_E);  T_COUNT(4);
 	    break;
-	  case 0xBC:	/* cp h */
+	  OPCODE(base, 0xBC):	/* cp h */
 	    do_cp(REG_H);  T_COUNT(4);
 	    break;
-	  case 0xBD:	/* cp l */
+	  OPCODE(base, 0xBD):	/* cp l */
 	    do_cp(REG_L);  T_COUNT(4);
 	    break;
-	  case 0xFE:	/* cp value */
-	    do_cp(mem_read(REG_PC++));  T_COUNT(7);
+	  OPCODE(base, 0xFE):	/* cp value */
+	    do_cp(fetch_byte(REG_PC++));  T_COUNT(7);
 	    break;
-	  case 0xBE:	/* cp (hl) */
+	  OPCODE(base, 0xBE):	/* cp (hl) */
 	    do_cp(mem_read(REG_HL));  T_COUNT(7);
 	    break;
 	    
-	  case 0x2F:	/* cpl */
+	  OPCODE(base, 0x2F):	/* cpl */
 	    REG_A = ~REG_A;
 	    REG_F = (REG_F & (CARRY_MASK|PARITY_MASK|ZERO_MASK|SIGN_MASK))
 	      | (HALF_CARRY_MASK|SUBTRACT_MASK)
@@ -3316,34 +4066,34 @@ int z80_run(int continuous)
 	    T_COUNT(4);
 	    break;
 
-	  case 0x27:	/* daa */
+	  OPCODE(base, 0x27):	/* daa */
 	    do_daa();
 	    T_COUNT(4);
 	    break;
 
-	  case 0x3D:	/* dec a */
+	  OPCODE(base, 0x3D):	/* dec a */
 	    do_flags_dec_byte(--REG_A);  T_COUNT(4);
 	    break;
-	  case 0x05:	/* dec b */
+	  OPCODE(base, 0x05):	/* dec b */
 	    do_flags_dec_byte(--REG_B);  T_COUNT(4);
 	    break;
-	  case 0x0D:	/* dec c */
+	  OPCODE(base, 0x0D):	/* dec c */
 	    do_flags_dec_byte(--REG_C);  T_COUNT(4);
 	    break;
-	  case 0x15:	/* dec d */
+	  OPCODE(base, 0x15):	/* dec d */
 	    do_flags_dec_byte(--REG_D);  T_COUNT(4);
 	    break;
-	  case 0x1D:	/* dec e */
+	  OPCODE(base, 0x1D):	/* dec e */
 	    do_flags_dec_byte(--REG_E);  T_COUNT(4);
 	    break;
-	  case 0x25:	/* dec h */
+	  OPCODE(base, 0x25):	/* dec h */
 	    do_flags_dec_byte(--REG_H);  T_COUNT(4);
 	    break;
-	  case 0x2D:	/* dec l */
+	  OPCODE(base, 0x2D):	/* dec l */
 	    do_flags_dec_byte(--REG_L);  T_COUNT(4);
 	    break;
 	    
-	  case 0x35:	/* dec (hl) */
+	  OPCODE(base, 0x35):	/* dec (hl) */
 	    {
 	      Uchar value = mem_read(REG_HL) - 1;
 	      mem_write(REG_HL, value);
@@ -3352,34 +4102,34 @@ int z80_run(int continuous)
 	    T_COUNT(11);
 	    break;
 	    
-	  case 0x0B:	/* dec bc */
+	  OPCODE(base, 0x0B):	/* dec bc */
 	    REG_BC--;
 	    T_COUNT(6);
 	    break;
-	  case 0x1B:	/* dec de */
+	  OPCODE(base, 0x1B):	/* dec de */
 	    REG_DE--;
 	    T_COUNT(6);
 	    break;
-	  case 0x2B:	/* dec hl */
+	  OPCODE(base, 0x2B):	/* dec hl */
 	    REG_HL--;
 	    T_COUNT(6);
 	    break;
-	  case 0x3B:	/* dec sp */
+	  OPCODE(base, 0x3B):	/* dec sp */
 	    REG_SP--;
 	    T_COUNT(6);
 	    break;
 	    
-	  case 0xF3:	/* di */
+	  OPCODE(base, 0xF3):	/* di */
 	    do_di();
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0x10:	/* djnz offset */
+	  OPCODE(base, 0x10):	/* djnz offset */
 	    /* Zaks says no flag changes. */
 	    if(--REG_B != 0)
 	    {
 		signed char byte_value;
-		byte_value = (signed char) mem_read(REG_PC++);
+		byte_value = (signed char) fetch_byte(REG_PC++);
 		REG_PC += byte_value;
 		T_COUNT(13);
 	    }
@@ -3390,12 +4140,12 @@ int z80_run(int continuous)
 	    }
 	    break;
 	    
-	  case 0xFB:	/* ei */
+	  OPCODE(base, 0xFB):	/* ei */
 	    do_ei();
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0x08:	/* ex af, af' */
+	  OPCODE(base, 0x08):	/* ex af, af' */
 	  {
 	      Ushort temp;
 	      temp = REG_AF;
@@ -3405,7 +4155,7 @@ int z80_run(int continuous)
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0xEB:	/* ex de, hl */
+	  OPCODE(base, 0xEB):	/* ex de, hl */
 	  {
 	      Ushort temp;
 	      temp = REG_DE;
@@ -3415,7 +4165,7 @@ int z80_run(int continuous)
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0xE3:	/* ex (sp), hl */
+	  OPCODE(base, 0xE3):	/* ex (sp), hl */
 	  {
 	      Ushort temp;
 	      temp = mem_read_word(REG_SP);
@@ -3425,7 +4175,7 @@ int z80_run(int continuous)
 	    T_COUNT(19);
 	    break;
 	    
-	  case 0xD9:	/* exx */
+	  OPCODE(base, 0xD9):	/* exx */
 	  {
 	      Ushort tmp;
 	      tmp = REG_BC_PRIME;
@@ -3441,7 +4191,7 @@ int z80_run(int continuous)
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0x76:	/* halt */
+	  OPCODE(base, 0x76):	/* halt */
 	    if (trs_model == 1) {
 		/* Z80 HALT output is tied to reset button circuit */
 		trs_reset(0);
@@ -3458,48 +4208,48 @@ int z80_run(int continuous)
 		if (continuous > 0 &&
 		    !(z80_state.nmi && !z80_state.nmi_seen) &&
 		    !(z80_state.irq && z80_state.iff1) &&
-		    !trs_event_scheduled()) {
+		    !trs_event_scheduled(TRS_EV_ANY)) {
 		  trs_get_event(TRUE);
 		}
 	    }
 	    T_COUNT(4);
 	    break;
 
-	  case 0xDB:	/* in a, (port) */
-	    REG_A = z80_in(mem_read(REG_PC++));
+	  OPCODE(base, 0xDB):	/* in a, (port) */
+	    REG_A = z80_in(fetch_byte(REG_PC++));
 	    T_COUNT(10);
 	    break;
 	    
-	  case 0x3C:	/* inc a */
+	  OPCODE(base, 0x3C):	/* inc a */
 	    REG_A++;
 	    do_flags_inc_byte(REG_A);  T_COUNT(4);
 	    break;
-	  case 0x04:	/* inc b */
+	  OPCODE(base, 0x04):	/* inc b */
 	    REG_B++;
 	    do_flags_inc_byte(REG_B);  T_COUNT(4);
 	    break;
-	  case 0x0C:	/* inc c */
+	  OPCODE(base, 0x0C):	/* inc c */
 	    REG_C++;
 	    do_flags_inc_byte(REG_C);  T_COUNT(4);
 	    break;
-	  case 0x14:	/* inc d */
+	  OPCODE(base, 0x14):	/* inc d */
 	    REG_D++;
 	    do_flags_inc_byte(REG_D);  T_COUNT(4);
 	    break;
-	  case 0x1C:	/* inc e */
+	  OPCODE(base, 0x1C):	/* inc e */
 	    REG_E++;
 	    do_flags_inc_byte(REG_E);  T_COUNT(4);
 	    break;
-	  case 0x24:	/* inc h */
+	  OPCODE(base, 0x24):	/* inc h */
 	    REG_H++;
 	    do_flags_inc_byte(REG_H);  T_COUNT(4);
 	    break;
-	  case 0x2C:	/* inc l */
+	  OPCODE(base, 0x2C):	/* inc l */
 	    REG_L++;
 	    do_flags_inc_byte(REG_L);  T_COUNT(4);
 	    break;
 	    
-	  case 0x34:	/* inc (hl) */
+	  OPCODE(base, 0x34):	/* inc (hl) */
 	  {
 	      Uchar value = mem_read(REG_HL) + 1;
 	      mem_write(REG_HL, value);
@@ -3508,37 +4258,37 @@ int z80_run(int continuous)
 	    T_COUNT(11);
 	    break;
 	    
-	  case 0x03:	/* inc bc */
+	  OPCODE(base, 0x03):	/* inc bc */
 	    REG_BC++;
 	    T_COUNT(6);
 	    break;
-	  case 0x13:	/* inc de */
+	  OPCODE(base, 0x13):	/* inc de */
 	    REG_DE++;
 	    T_COUNT(6);
 	    break;
-	  case 0x23:	/* inc hl */
+	  OPCODE(base, 0x23):	/* inc hl */
 	    REG_HL++;
 	    T_COUNT(6);
 	    break;
-	  case 0x33:	/* inc sp */
+	  OPCODE(base, 0x33):	/* inc sp */
 	    REG_SP++;
 	    T_COUNT(6);
 	    break;
 	    
-	  case 0xC3:	/* jp address */
-	    REG_PC = mem_read_word(REG_PC);
+	  OPCODE(base, 0xC3):	/* jp address */
+	    REG_PC = fetch_word(REG_PC);
 	    T_COUNT(10);
 	    break;
 	    
-	  case 0xE9:	/* jp (hl) */
+	  OPCODE(base, 0xE9):	/* jp (hl) */
 	    REG_PC = REG_HL;
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0xC2:	/* jp nz, address */
+	  OPCODE(base, 0xC2):	/* jp nz, address */
 	    if(!ZERO_FLAG)
 	    {
-		REG_PC = mem_read_word(REG_PC);
+		REG_PC = fetch_word(REG_PC);
 	    }
 	    else
 	    {
@@ -3546,10 +4296,10 @@ int z80_run(int continuous)
 	    }
 	    T_COUNT(10);
 	    break;
-	  case 0xCA:	/* jp z, address */
+	  OPCODE(base, 0xCA):	/* jp z, address */
 	    if(ZERO_FLAG)
 	    {
-		REG_PC = mem_read_word(REG_PC);
+		REG_PC = fetch_word(REG_PC);
 	    }
 	    else
 	    {
@@ -3557,10 +4307,10 @@ int z80_run(int continuous)
 	    }
 	    T_COUNT(10);
 	    break;
-	  case 0xD2:	/* jp nc, address */
+	  OPCODE(base, 0xD2):	/* jp nc, address */
 	    if(!CARRY_FLAG)
 	    {
-		REG_PC = mem_read_word(REG_PC);
+		REG_PC = fetch_word(REG_PC);
 	    }
 	    else
 	    {
@@ -3568,10 +4318,10 @@ int z80_run(int continuous)
 	    }
 	    T_COUNT(10);
 	    break;
-	  case 0xDA:	/* jp c, address */
+	  OPCODE(base, 0xDA):	/* jp c, address */
 	    if(CARRY_FLAG)
 	    {
-		REG_PC = mem_read_word(REG_PC);
+		REG_PC = fetch_word(REG_PC);
 	    }
 	    else
 	    {
@@ -3579,10 +4329,10 @@ int z80_run(int continuous)
 	    }
 	    T_COUNT(10);
 	    break;
-	  case 0xE2:	/* jp po, address */
+	  OPCODE(base, 0xE2):	/* jp po, address */
 	    if(!PARITY_FLAG)
 	    {
-		REG_PC = mem_read_word(REG_PC);
+		REG_PC = fetch_word(REG_PC);
 	    }
 	    else
 	    {
@@ -3590,10 +4340,10 @@ int z80_run(int continuous)
 	    }
 	    T_COUNT(10);
 	    break;
-	  case 0xEA:	/* jp pe, address */
+	  OPCODE(base, 0xEA):	/* jp pe, address */
 	    if(PARITY_FLAG)
 	    {
-		REG_PC = mem_read_word(REG_PC);
+		REG_PC = fetch_word(REG_PC);
 	    }
 	    else
 	    {
@@ -3601,10 +4351,10 @@ int z80_run(int continuous)
 	    }
 	    T_COUNT(10);
 	    break;
-	  case 0xF2:	/* jp p, address */
+	  OPCODE(base, 0xF2):	/* jp p, address */
 	    if(!SIGN_FLAG)
 	    {
-		REG_PC = mem_read_word(REG_PC);
+		REG_PC = fetch_word(REG_PC);
 	    }
 	    else
 	    {
@@ -3612,10 +4362,10 @@ int z80_run(int continuous)
 	    }
 	    T_COUNT(10);
 	    break;
-	  case 0xFA:	/* jp m, address */
+	  OPCODE(base, 0xFA):	/* jp m, address */
 	    if(SIGN_FLAG)
 	    {
-		REG_PC = mem_read_word(REG_PC);
+		REG_PC = fetch_word(REG_PC);
 	    }
 	    else
 	    {
@@ -3624,20 +4374,20 @@ int z80_run(int continuous)
 	    T_COUNT(10);
 	    break;
 	    
-	  case 0x18:	/* jr offset */
+	  OPCODE(base, 0x18):	/* jr offset */
 	  {
 	      signed char byte_value;
-	      byte_value = (signed char) mem_read(REG_PC++);
+	      byte_value = (signed char) fetch_byte(REG_PC++);
 	      REG_PC += byte_value;
 	  }
 	    T_COUNT(12);
 	    break;
 	    
-	  case 0x20:	/* jr nz, offset */
+	  OPCODE(base, 0x20):	/* jr nz, offset */
 	    if(!ZERO_FLAG)
 	    {
 		signed char byte_value;
-		byte_value = (signed char) mem_read(REG_PC++);
+		byte_value = (signed char) fetch_byte(REG_PC++);
 		REG_PC += byte_value;
 		T_COUNT(12);
 	    }
@@ -3647,11 +4397,11 @@ int z80_run(int continuous)
 		T_COUNT(7);
 	    }
 	    break;
-	  case 0x28:	/* jr z, offset */
+	  OPCODE(base, 0x28):	/* jr z, offset */
 	    if(ZERO_FLAG)
 	    {
 		signed char byte_value;
-		byte_value = (signed char) mem_read(REG_PC++);
+		byte_value = (signed char) fetch_byte(REG_PC++);
 		REG_PC += byte_value;
 		T_COUNT(12);
 	    }
@@ -3661,11 +4411,11 @@ int z80_run(int continuous)
 		T_COUNT(7);
 	    }
 	    break;
-	  case 0x30:	/* jr nc, offset */
+	  OPCODE(base, 0x30):	/* jr nc, offset */
 	    if(!CARRY_FLAG)
 	    {
 		signed char byte_value;
-		byte_value = (signed char) mem_read(REG_PC++);
+		byte_value = (signed char) fetch_byte(REG_PC++);
 		REG_PC += byte_value;
 		T_COUNT(12);
 	    }
@@ -3675,11 +4425,11 @@ int z80_run(int continuous)
 		T_COUNT(7);
 	    }
 	    break;
-	  case 0x38:	/* jr c, offset */
+	  OPCODE(base, 0x38):	/* jr c, offset */
 	    if(CARRY_FLAG)
 	    {
 		signed char byte_value;
-		byte_value = (signed char) mem_read(REG_PC++);
+		byte_value = (signed char) fetch_byte(REG_PC++);
 		REG_PC += byte_value;
 		T_COUNT(12);
 	    }
@@ -3690,381 +4440,381 @@ int z80_run(int continuous)
 	    }
 	    break;
 	    
-	  case 0x7F:	/* ld a, a */
+	  OPCODE(base, 0x7F):	/* ld a, a */
 	    REG_A = REG_A;  T_COUNT(4);
 	    break;
-	  case 0x78:	/* ld a, b */
+	  OPCODE(base, 0x78):	/* ld a, b */
 	    REG_A = REG_B;  T_COUNT(4);
 	    break;
-	  case 0x79:	/* ld a, c */
+	  OPCODE(base, 0x79):	/* ld a, c */
 	    REG_A = REG_C;  T_COUNT(4);
 	    break;
-	  case 0x7A:	/* ld a, d */
+	  OPCODE(base, 0x7A):	/* ld a, d */
 	    REG_A = REG_D;  T_COUNT(4);
 	    break;
-	  case 0x7B:	/* ld a, e */
+	  OPCODE(base, 0x7B):	/* ld a, e */
 	    REG_A = REG_E;  T_COUNT(4);
 	    break;
-	  case 0x7C:	/* ld a, h */
+	  OPCODE(base, 0x7C):	/* ld a, h */
 	    REG_A = REG_H;  T_COUNT(4);
 	    break;
-	  case 0x7D:	/* ld a, l */
+	  OPCODE(base, 0x7D):	/* ld a, l */
 	    REG_A = REG_L;  T_COUNT(4);
 	    break;
-	  case 0x47:	/* ld b, a */
+	  OPCODE(base, 0x47):	/* ld b, a */
 	    REG_B = REG_A;  T_COUNT(4);
 	    break;
-	  case 0x40:	/* ld b, b */
+	  OPCODE(base, 0x40):	/* ld b, b */
 	    REG_B = REG_B;  T_COUNT(4);
 	    break;
-	  case 0x41:	/* ld b, c */
+	  OPCODE(base, 0x41):	/* ld b, c */
 	    REG_B = REG_C;  T_COUNT(4);
 	    break;
-	  case 0x42:	/* ld b, d */
+	  OPCODE(base, 0x42):	/* ld b, d */
 	    REG_B = REG_D;  T_COUNT(4);
 	    break;
-	  case 0x43:	/* ld b, e */
+	  OPCODE(base, 0x43):	/* ld b, e */
 	    REG_B = REG_E;  T_COUNT(4);
 	    break;
-	  case 0x44:	/* ld b, h */
+	  OPCODE(base, 0x44):	/* ld b, h */
 	    REG_B = REG_H;  T_COUNT(4);
 	    break;
-	  case 0x45:	/* ld b, l */
+	  OPCODE(base, 0x45):	/* ld b, l */
 	    REG_B = REG_L;  T_COUNT(4);
 	    break;
-	  case 0x4F:	/* ld c, a */
+	  OPCODE(base, 0x4F):	/* ld c, a */
 	    REG_C = REG_A;  T_COUNT(4);
 	    break;
-	  case 0x48:	/* ld c, b */
+	  OPCODE(base, 0x48):	/* ld c, b */
 	    REG_C = REG_B;  T_COUNT(4);
 	    break;
-	  case 0x49:	/* ld c, c */
+	  OPCODE(base, 0x49):	/* ld c, c */
 	    REG_C = REG_C;  T_COUNT(4);
 	    break;
-	  case 0x4A:	/* ld c, d */
+	  OPCODE(base, 0x4A):	/* ld c, d */
 	    REG_C = REG_D;  T_COUNT(4);
 	    break;
-	  case 0x4B:	/* ld c, e */
+	  OPCODE(base, 0x4B):	/* ld c, e */
 	    REG_C = REG_E;  T_COUNT(4);
 	    break;
-	  case 0x4C:	/* ld c, h */
+	  OPCODE(base, 0x4C):	/* ld c, h */
 	    REG_C = REG_H;  T_COUNT(4);
 	    break;
-	  case 0x4D:	/* ld c, l */
+	  OPCODE(base, 0x4D):	/* ld c, l */
 	    REG_C = REG_L;  T_COUNT(4);
 	    break;
-	  case 0x57:	/* ld d, a */
+	  OPCODE(base, 0x57):	/* ld d, a */
 	    REG_D = REG_A;  T_COUNT(4);
 	    break;
-	  case 0x50:	/* ld d, b */
+	  OPCODE(base, 0x50):	/* ld d, b */
 	    REG_D = REG_B;  T_COUNT(4);
 	    break;
-	  case 0x51:	/* ld d, c */
+	  OPCODE(base, 0x51):	/* ld d, c */
 	    REG_D = REG_C;  T_COUNT(4);
 	    break;
-	  case 0x52:	/* ld d, d */
+	  OPCODE(base, 0x52):	/* ld d, d */
 	    REG_D = REG_D;  T_COUNT(4);
 	    break;
-	  case 0x53:	/* ld d, e */
+	  OPCODE(base, 0x53):	/* ld d, e */
 	    REG_D = REG_E;  T_COUNT(4);
 	    break;
-	  case 0x54:	/* ld d, h */
+	  OPCODE(base, 0x54):	/* ld d, h */
 	    REG_D = REG_H;  T_COUNT(4);
 	    break;
-	  case 0x55:	/* ld d, l */
+	  OPCODE(base, 0x55):	/* ld d, l */
 	    REG_D = REG_L;  T_COUNT(4);
 	    break;
-	  case 0x5F:	/* ld e, a */
+	  OPCODE(base, 0x5F):	/* ld e, a */
 	    REG_E = REG_A;  T_COUNT(4);
 	    break;
-	  case 0x58:	/* ld e, b */
+	  OPCODE(base, 0x58):	/* ld e, b */
 	    REG_E = REG_B;  T_COUNT(4);
 	    break;
-	  case 0x59:	/* ld e, c */
+	  OPCODE(base, 0x59):	/* ld e, c */
 	    REG_E = REG_C;  T_COUNT(4);
 	    break;
-	  case 0x5A:	/* ld e, d */
+	  OPCODE(base, 0x5A):	/* ld e, d */
 	    REG_E = REG_D;  T_COUNT(4);
 	    break;
-	  case 0x5B:	/* ld e, e */
+	  OPCODE(base, 0x5B):	/* ld e, e */
 	    REG_E = REG_E;  T_COUNT(4);
 	    break;
-	  case 0x5C:	/* ld e, h */
+	  OPCODE(base, 0x5C):	/* ld e, h */
 	    REG_E = REG_H;  T_COUNT(4);
 	    break;
-	  case 0x5D:	/* ld e, l */
+	  OPCODE(base, 0x5D):	/* ld e, l */
 	    REG_E = REG_L;  T_COUNT(4);
 	    break;
-	  case 0x67:	/* ld h, a */
+	  OPCODE(base, 0x67):	/* ld h, a */
 	    REG_H = REG_A;  T_COUNT(4);
 	    break;
-	  case 0x60:	/* ld h, b */
+	  OPCODE(base, 0x60):	/* ld h, b */
 	    REG_H = REG_B;  T_COUNT(4);
 	    break;
-	  case 0x61:	/* ld h, c */
+	  OPCODE(base, 0x61):	/* ld h, c */
 	    REG_H = REG_C;  T_COUNT(4);
 	    break;
-	  case 0x62:	/* ld h, d */
+	  OPCODE(base, 0x62):	/* ld h, d */
 	    REG_H = REG_D;  T_COUNT(4);
 	    break;
-	  case 0x63:	/* ld h, e */
+	  OPCODE(base, 0x63):	/* ld h, e */
 	    REG_H = REG_E;  T_COUNT(4);
 	    break;
-	  case 0x64:	/* ld h, h */
+	  OPCODE(base, 0x64):	/* ld h, h */
 	    REG_H = REG_H;  T_COUNT(4);
 	    break;
-	  case 0x65:	/* ld h, l */
+	  OPCODE(base, 0x65):	/* ld h, l */
 	    REG_H = REG_L;  T_COUNT(4);
 	    break;
-	  case 0x6F:	/* ld l, a */
+	  OPCODE(base, 0x6F):	/* ld l, a */
 	    REG_L = REG_A;  T_COUNT(4);
 	    break;
-	  case 0x68:	/* ld l, b */
+	  OPCODE(base, 0x68):	/* ld l, b */
 	    REG_L = REG_B;  T_COUNT(4);
 	    break;
-	  case 0x69:	/* ld l, c */
+	  OPCODE(base, 0x69):	/* ld l, c */
 	    REG_L = REG_C;  T_COUNT(4);
 	    break;
-	  case 0x6A:	/* ld l, d */
+	  OPCODE(base, 0x6A):	/* ld l, d */
 	    REG_L = REG_D;  T_COUNT(4);
 	    break;
-	  case 0x6B:	/* ld l, e */
+	  OPCODE(base, 0x6B):	/* ld l, e */
 	    REG_L = REG_E;  T_COUNT(4);
 	    break;
-	  case 0x6C:	/* ld l, h */
+	  OPCODE(base, 0x6C):	/* ld l, h */
 	    REG_L = REG_H;  T_COUNT(4);
 	    break;
-	  case 0x6D:	/* ld l, l */
+	  OPCODE(base, 0x6D):	/* ld l, l */
 	    REG_L = REG_L;  T_COUNT(4);
 	    break;
 	    
-	  case 0x02:	/* ld (bc), a */
+	  OPCODE(base, 0x02):	/* ld (bc), a */
 	    mem_write(REG_BC, REG_A);  T_COUNT(7);
 	    break;
-	  case 0x12:	/* ld (de), a */
+	  OPCODE(base, 0x12):	/* ld (de), a */
 	    mem_write(REG_DE, REG_A);  T_COUNT(7);
 	    break;
-	  case 0x77:	/* ld (hl), a */
+	  OPCODE(base, 0x77):	/* ld (hl), a */
 	    mem_write(REG_HL, REG_A);  T_COUNT(7);
 	    break;
-	  case 0x70:	/* ld (hl), b */
+	  OPCODE(base, 0x70):	/* ld (hl), b */
 	    mem_write(REG_HL, REG_B);  T_COUNT(7);
 	    break;
-	  case 0x71:	/* ld (hl), c */
+	  OPCODE(base, 0x71):	/* ld (hl), c */
 	    mem_write(REG_HL, REG_C);  T_COUNT(7);
 	    break;
-	  case 0x72:	/* ld (hl), d */
+	  OPCODE(base, 0x72):	/* ld (hl), d */
 	    mem_write(REG_HL, REG_D);  T_COUNT(7);
 	    break;
-	  case 0x73:	/* ld (hl), e */
+	  OPCODE(base, 0x73):	/* ld (hl), e */
 	    mem_write(REG_HL, REG_E);  T_COUNT(7);
 	    break;
-	  case 0x74:	/* ld (hl), h */
+	  OPCODE(base, 0x74):	/* ld (hl), h */
 	    mem_write(REG_HL, REG_H);  T_COUNT(7);
 	    break;
-	  case 0x75:	/* ld (hl), l */
+	  OPCODE(base, 0x75):	/* ld (hl), l */
 	    mem_write(REG_HL, REG_L);  T_COUNT(7);
 	    break;
 	    
-	  case 0x7E:	/* ld a, (hl) */
+	  OPCODE(base, 0x7E):	/* ld a, (hl) */
 	    REG_A = mem_read(REG_HL);  T_COUNT(7);
 	    break;
-	  case 0x46:	/* ld b, (hl) */
+	  OPCODE(base, 0x46):	/* ld b, (hl) */
 	    REG_B = mem_read(REG_HL);  T_COUNT(7);
 	    break;
-	  case 0x4E:	/* ld c, (hl) */
+	  OPCODE(base, 0x4E):	/* ld c, (hl) */
 	    REG_C = mem_read(REG_HL);  T_COUNT(7);
 	    break;
-	  case 0x56:	/* ld d, (hl) */
+	  OPCODE(base, 0x56):	/* ld d, (hl) */
 	    REG_D = mem_read(REG_HL);  T_COUNT(7);
 	    break;
-	  case 0x5E:	/* ld e, (hl) */
+	  OPCODE(base, 0x5E):	/* ld e, (hl) */
 	    REG_E = mem_read(REG_HL);  T_COUNT(7);
 	    break;
-	  case 0x66:	/* ld h, (hl) */
+	  OPCODE(base, 0x66):	/* ld h, (hl) */
 	    REG_H = mem_read(REG_HL);  T_COUNT(7);
 	    break;
-	  case 0x6E:	/* ld l, (hl) */
+	  OPCODE(base, 0x6E):	/* ld l, (hl) */
 	    REG_L = mem_read(REG_HL);  T_COUNT(7);
 	    break;
 	    
-	  case 0x3E:	/* ld a, value */
-	    REG_A = mem_read(REG_PC++);  T_COUNT(7);
+	  OPCODE(base, 0x3E):	/* ld a, value */
+	    REG_A = fetch_byte(REG_PC++);  T_COUNT(7);
 	    break;
-	  case 0x06:	/* ld b, value */
-	    REG_B = mem_read(REG_PC++);  T_COUNT(7);
+	  OPCODE(base, 0x06):	/* ld b, value */
+	    REG_B = fetch_byte(REG_PC++);  T_COUNT(7);
 	    break;
-	  case 0x0E:	/* ld c, value */
-	    REG_C = mem_read(REG_PC++);  T_COUNT(7);
+	  OPCODE(base, 0x0E):	/* ld c, value */
+	    REG_C = fetch_byte(REG_PC++);  T_COUNT(7);
 	    break;
-	  case 0x16:	/* ld d, value */
-	    REG_D = mem_read(REG_PC++);  T_COUNT(7);
+	  OPCODE(base, 0x16):	/* ld d, value */
+	    REG_D = fetch_byte(REG_PC++);  T_COUNT(7);
 	    break;
-	  case 0x1E:	/* ld e, value */
-	    REG_E = mem_read(REG_PC++);  T_COUNT(7);
+	  OPCODE(base, 0x1E):	/* ld e, value */
+	    REG_E = fetch_byte(REG_PC++);  T_COUNT(7);
 	    break;
-	  case 0x26:	/* ld h, value */
-	    REG_H = mem_read(REG_PC++);  T_COUNT(7);
+	  OPCODE(base, 0x26):	/* ld h, value */
+	    REG_H = fetch_byte(REG_PC++);  T_COUNT(7);
 	    break;
-	  case 0x2E:	/* ld l, value */
-	    REG_L = mem_read(REG_PC++);  T_COUNT(7);
+	  OPCODE(base, 0x2E):	/* ld l, value */
+	    REG_L = fetch_byte(REG_PC++);  T_COUNT(7);
 	    break;
 	    
-	  case 0x01:	/* ld bc, value */
-	    REG_BC = mem_read_word(REG_PC);
+	  OPCODE(base, 0x01):	/* ld bc, value */
+	    REG_BC = fetch_word(REG_PC);
 	    REG_PC += 2;
 	    T_COUNT(10);
 	    break;
-	  case 0x11:	/* ld de, value */
-	    REG_DE = mem_read_word(REG_PC);
+	  OPCODE(base, 0x11):	/* ld de, value */
+	    REG_DE = fetch_word(REG_PC);
 	    REG_PC += 2;
 	    T_COUNT(10);
 	    break;
-	  case 0x21:	/* ld hl, value */
-	    REG_HL = mem_read_word(REG_PC);
+	  OPCODE(base, 0x21):	/* ld hl, value */
+	    REG_HL = fetch_word(REG_PC);
 	    REG_PC += 2;
 	    T_COUNT(10);
 	    break;
-	  case 0x31:	/* ld sp, value */
-	    REG_SP = mem_read_word(REG_PC);
+	  OPCODE(base, 0x31):	/* ld sp, value */
+	    REG_SP = fetch_word(REG_PC);
 	    REG_PC += 2;
 	    T_COUNT(10);
 	    break;
 	    
 	    
-	  case 0x3A:	/* ld a, (address) */
+	  OPCODE(base, 0x3A):	/* ld a, (address) */
 	    /* this one is missing from Zaks */
-	    REG_A = mem_read(mem_read_word(REG_PC));
+	    REG_A = mem_read(fetch_word(REG_PC));
 	    REG_PC += 2;
 	    T_COUNT(13);
 	    break;
 	    
-	  case 0x0A:	/* ld a, (bc) */
+	  OPCODE(base, 0x0A):	/* ld a, (bc) */
 	    REG_A = mem_read(REG_BC);
 	    T_COUNT(7);
 	    break;
-	  case 0x1A:	/* ld a, (de) */
+	  OPCODE(base, 0x1A):	/* ld a, (de) */
 	    REG_A = mem_read(REG_DE);
 	    T_COUNT(7);
 	    break;
 	    
-	  case 0x32:	/* ld (address), a */
-	    mem_write(mem_read_word(REG_PC), REG_A);
+	  OPCODE(base, 0x32):	/* ld (address), a */
+	    mem_write(fetch_word(REG_PC), REG_A);
 	    REG_PC += 2;
 	    T_COUNT(13);
 	    break;
 	    
-	  case 0x22:	/* ld (address), hl */
-	    mem_write_word(mem_read_word(REG_PC), REG_HL);
+	  OPCODE(base, 0x22):	/* ld (address), hl */
+	    mem_write_word(fetch_word(REG_PC), REG_HL);
 	    REG_PC += 2;
 	    T_COUNT(16);
 	    break;
 	    
-	  case 0x36:	/* ld (hl), value */
-	    mem_write(REG_HL, mem_read(REG_PC++));
+	  OPCODE(base, 0x36):	/* ld (hl), value */
+	    mem_write(REG_HL, fetch_byte(REG_PC++));
 	    T_COUNT(10);
 	    break;
 	    
-	  case 0x2A:	/* ld hl, (address) */
-	    REG_HL = mem_read_word(mem_read_word(REG_PC));
+	  OPCODE(base, 0x2A):	/* ld hl, (address) */
+	    REG_HL = mem_read_word(fetch_word(REG_PC));
 	    REG_PC += 2;
 	    T_COUNT(16);
 	    break;
 	    
-	  case 0xF9:	/* ld sp, hl */
+	  OPCODE(base, 0xF9):	/* ld sp, hl */
 	    REG_SP = REG_HL;
 	    T_COUNT(6);
 	    break;
 	    
-	  case 0x00:	/* nop */
+	  OPCODE(base, 0x00):	/* nop */
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0xF6:	/* or value */
-	    do_or_byte(mem_read(REG_PC++));
+	  OPCODE(base, 0xF6):	/* or value */
+	    do_or_byte(fetch_byte(REG_PC++));
 	    T_COUNT(7);
 	    break;
 	    
-	  case 0xB7:	/* or a */
+	  OPCODE(base, 0xB7):	/* or a */
 	    do_or_byte(REG_A);  T_COUNT(4);
 	    break;
-	  case 0xB0:	/* or b */
+	  OPCODE(base, 0xB0):	/* or b */
 	    do_or_byte(REG_B);  T_COUNT(4);
 	    break;
-	  case 0xB1:	/* or c */
+	  OPCODE(base, 0xB1):	/* or c */
 	    do_or_byte(REG_C);  T_COUNT(4);
 	    break;
-	  case 0xB2:	/* or d */
+	  OPCODE(base, 0xB2):	/* or d */
 	    do_or_byte(REG_D);  T_COUNT(4);
 	    break;
-	  case 0xB3:	/* or e */
+	  OPCODE(base, 0xB3):	/* or e */
 	    do_or_byte(REG_E);  T_COUNT(4);
 	    break;
-	  case 0xB4:	/* or h */
+	  OPCODE(base, 0xB4):	/* or h */
 	    do_or_byte(REG_H);  T_COUNT(4);
 	    break;
-	  case 0xB5:	/* or l */
+	  OPCODE(base, 0xB5):	/* or l */
 	    do_or_byte(REG_L);  T_COUNT(4);
 	    break;
 	    
-	  case 0xB6:	/* or (hl) */
+	  OPCODE(base, 0xB6):	/* or (hl) */
 	    do_or_byte(mem_read(REG_HL));  T_COUNT(7);
 	    break;
 	    
-	  case 0xD3:	/* out (port), a */
-	    z80_out(mem_read(REG_PC++), REG_A);
+	  OPCODE(base, 0xD3):	/* out (port), a */
+	    z80_out(fetch_byte(REG_PC++), REG_A);
 	    T_COUNT(11);
 	    break;
 	    
-	  case 0xC1:	/* pop bc */
+	  OPCODE(base, 0xC1):	/* pop bc */
 	    REG_BC = mem_read_word(REG_SP);
 	    REG_SP += 2;
 	    T_COUNT(10);
 	    break;
-	  case 0xD1:	/* pop de */
+	  OPCODE(base, 0xD1):	/* pop de */
 	    REG_DE = mem_read_word(REG_SP);
 	    REG_SP += 2;
 	    T_COUNT(10);
 	    break;
-	  case 0xE1:	/* pop hl */
+	  OPCODE(base, 0xE1):	/* pop hl */
 	    REG_HL = mem_read_word(REG_SP);
 	    REG_SP += 2;
 	    T_COUNT(10);
 	    break;
-	  case 0xF1:	/* pop af */
+	  OPCODE(base, 0xF1):	/* pop af */
 	    REG_AF = mem_read_word(REG_SP);
 	    REG_SP += 2;
 	    T_COUNT(10);
 	    break;
 	    
-	  case 0xC5:	/* push bc */
+	  OPCODE(base, 0xC5):	/* push bc */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_BC);
 	    T_COUNT(11);
 	    break;
-	  case 0xD5:	/* push de */
+	  OPCODE(base, 0xD5):	/* push de */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_DE);
 	    T_COUNT(11);
 	    break;
-	  case 0xE5:	/* push hl */
+	  OPCODE(base, 0xE5):	/* push hl */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_HL);
 	    T_COUNT(11);
 	    break;
-	  case 0xF5:	/* push af */
+	  OPCODE(base, 0xF5):	/* push af */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_AF);
 	    T_COUNT(11);
 	    break;
 	    
-	  case 0xC9:	/* ret */
+	  OPCODE(base, 0xC9):	/* ret */
 	    REG_PC = mem_read_word(REG_SP);
 	    REG_SP += 2;
 	    T_COUNT(10);
 	    break;
 	    
-	  case 0xC0:	/* ret nz */
+	  OPCODE(base, 0xC0):	/* ret nz */
 	    if(!ZERO_FLAG)
 	    {
 		REG_PC = mem_read_word(REG_SP);
@@ -4074,7 +4824,7 @@ int z80_run(int continuous)
 	        T_COUNT(5);
 	    }
 	    break;
-	  case 0xC8:	/* ret z */
+	  OPCODE(base, 0xC8):	/* ret z */
 	    if(ZERO_FLAG)
 	    {
 		REG_PC = mem_read_word(REG_SP);
@@ -4084,7 +4834,7 @@ int z80_run(int continuous)
 	        T_COUNT(5);
 	    }
 	    break;
-	  case 0xD0:	/* ret nc */
+	  OPCODE(base, 0xD0):	/* ret nc */
 	    if(!CARRY_FLAG)
 	    {
 		REG_PC = mem_read_word(REG_SP);
@@ -4094,7 +4844,7 @@ int z80_run(int continuous)
 	        T_COUNT(5);
 	    }
 	    break;
-	  case 0xD8:	/* ret c */
+	  OPCODE(base, 0xD8):	/* ret c */
 	    if(CARRY_FLAG)
 	    {
 		REG_PC = mem_read_word(REG_SP);
@@ -4104,7 +4854,7 @@ int z80_run(int continuous)
 	        T_COUNT(5);
 	    }
 	    break;
-	  case 0xE0:	/* ret po */
+	  OPCODE(base, 0xE0):	/* ret po */
 	    if(!PARITY_FLAG)
 	    {
 		REG_PC = mem_read_word(REG_SP);
@@ -4114,7 +4864,7 @@ int z80_run(int continuous)
 	        T_COUNT(5);
 	    }
 	    break;
-	  case 0xE8:	/* ret pe */
+	  OPCODE(base, 0xE8):	/* ret pe */
 	    if(PARITY_FLAG)
 	    {
 		REG_PC = mem_read_word(REG_SP);
@@ -4124,7 +4874,7 @@ int z80_run(int continuous)
 	        T_COUNT(5);
 	    }
 	    break;
-	  case 0xF0:	/* ret p */
+	  OPCODE(base, 0xF0):	/* ret p */
 	    if(!SIGN_FLAG)
 	    {
 		REG_PC = mem_read_word(REG_SP);
@@ -4134,7 +4884,7 @@ int z80_run(int continuous)
 	        T_COUNT(5);
 	    }
 	    break;
-	  case 0xF8:	/* ret m */
+	  OPCODE(base, 0xF8):	/* ret m */
 	    if(SIGN_FLAG)
 	    {
 		REG_PC = mem_read_word(REG_SP);
@@ -4145,171 +4895,182 @@ int z80_run(int continuous)
 	    }
 	    break;
 	    
-	  case 0x17:	/* rla */
+	  OPCODE(base, 0x17):	/* rla */
 	    do_rla();
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0x07:	/* rlca */
+	  OPCODE(base, 0x07):	/* rlca */
 	    do_rlca();
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0x1F:	/* rra */
+	  OPCODE(base, 0x1F):	/* rra */
 	    do_rra();
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0x0F:	/* rrca */
+	  OPCODE(base, 0x0F):	/* rrca */
 	    do_rrca();
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0xC7:	/* rst 00h */
+	  OPCODE(base, 0xC7):	/* rst 00h */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_PC);
 	    REG_PC = 0x00;
 	    T_COUNT(11);
 	    break;
-	  case 0xCF:	/* rst 08h */
+	  OPCODE(base, 0xCF):	/* rst 08h */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_PC);
 	    REG_PC = 0x08;
 	    T_COUNT(11);
 	    break;
-	  case 0xD7:	/* rst 10h */
+	  OPCODE(base, 0xD7):	/* rst 10h */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_PC);
 	    REG_PC = 0x10;
 	    T_COUNT(11);
 	    break;
-	  case 0xDF:	/* rst 18h */
+	  OPCODE(base, 0xDF):	/* rst 18h */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_PC);
 	    REG_PC = 0x18;
 	    T_COUNT(11);
 	    break;
-	  case 0xE7:	/* rst 20h */
+	  OPCODE(base, 0xE7):	/* rst 20h */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_PC);
 	    REG_PC = 0x20;
 	    T_COUNT(11);
 	    break;
-	  case 0xEF:	/* rst 28h */
+	  OPCODE(base, 0xEF):	/* rst 28h */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_PC);
 	    REG_PC = 0x28;
 	    T_COUNT(11);
 	    break;
-	  case 0xF7:	/* rst 30h */
+	  OPCODE(base, 0xF7):	/* rst 30h */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_PC);
 	    REG_PC = 0x30;
 	    T_COUNT(11);
 	    break;
-	  case 0xFF:	/* rst 38h */
+	  OPCODE(base, 0xFF):	/* rst 38h */
 	    REG_SP -= 2;
 	    mem_write_word(REG_SP, REG_PC);
 	    REG_PC = 0x38;
 	    T_COUNT(11);
 	    break;
 	    
-	  case 0x37:	/* scf */
+	  OPCODE(base, 0x37):	/* scf */
 	    REG_F = (REG_F & (ZERO_FLAG|PARITY_FLAG|SIGN_FLAG))
 	      | CARRY_MASK
 	      | (REG_A & (UNDOC3_MASK|UNDOC5_MASK));
 	    T_COUNT(4);
 	    break;
 	    
-	  case 0x9F:	/* sbc a, a */
+	  OPCODE(base, 0x9F):	/* sbc a, a */
 	    do_sbc_byte(REG_A);  T_COUNT(4);
 	    break;
-	  case 0x98:	/* sbc a, b */
+	  OPCODE(base, 0x98):	/* sbc a, b */
 	    do_sbc_byte(REG_B);  T_COUNT(4);
 	    break;
-	  case 0x99:	/* sbc a, c */
+	  OPCODE(base, 0x99):	/* sbc a, c */
 	    do_sbc_byte(REG_C);  T_COUNT(4);
 	    break;
-	  case 0x9A:	/* sbc a, d */
+	  OPCODE(base, 0x9A):	/* sbc a, d */
 	    do_sbc_byte(REG_D);  T_COUNT(4);
 	    break;
-	  case 0x9B:	/* sbc a, e */
+	  OPCODE(base, 0x9B):	/* sbc a, e */
 	    do_sbc_byte(REG_E);  T_COUNT(4);
 	    break;
-	  case 0x9C:	/* sbc a, h */
+	  OPCODE(base, 0x9C):	/* sbc a, h */
 	    do_sbc_byte(REG_H);  T_COUNT(4);
 	    break;
-	  case 0x9D:	/* sbc a, l */
+	  OPCODE(base, 0x9D):	/* sbc a, l */
 	    do_sbc_byte(REG_L);  T_COUNT(4);
 	    break;
-	  case 0xDE:	/* sbc a, value */
-	    do_sbc_byte(mem_read(REG_PC++));  T_COUNT(7);
+	  OPCODE(base, 0xDE):	/* sbc a, value */
+	    do_sbc_byte(fetch_byte(REG_PC++));  T_COUNT(7);
 	    break;
-	  case 0x9E:	/* sbc a, (hl) */
+	  OPCODE(base, 0x9E):	/* sbc a, (hl) */
 	    do_sbc_byte(mem_read(REG_HL));  T_COUNT(7);
 	    break;
 	    
-	  case 0x97:	/* sub a, a */
+	  OPCODE(base, 0x97):	/* sub a, a */
 	    do_sub_byte(REG_A);  T_COUNT(4);
 	    break;
-	  case 0x90:	/* sub a, b */
+	  OPCODE(base, 0x90):	/* sub a, b */
 	    do_sub_byte(REG_B);  T_COUNT(4);
 	    break;
-	  case 0x91:	/* sub a, c */
+	  OPCODE(base, 0x91):	/* sub a, c */
 	    do_sub_byte(REG_C);  T_COUNT(4);
 	    break;
-	  case 0x92:	/* sub a, d */
+	  OPCODE(base, 0x92):	/* sub a, d */
 	    do_sub_byte(REG_D);  T_COUNT(4);
 	    break;
-	  case 0x93:	/* sub a, e */
+	  OPCODE(base, 0x93):	/* sub a, e */
 	    do_sub_byte(REG_E);  T_COUNT(4);
 	    break;
-	  case 0x94:	/* sub a, h */
+	  OPCODE(base, 0x94):	/* sub a, h */
 	    do_sub_byte(REG_H);  T_COUNT(4);
 	    break;
-	  case 0x95:	/* sub a, l */
+	  OPCODE(base, 0x95):	/* sub a, l */
 	    do_sub_byte(REG_L);  T_COUNT(4);
 	    break;
-	  case 0xD6:	/* sub a, value */
-	    do_sub_byte(mem_read(REG_PC++));  T_COUNT(7);
+	  OPCODE(base, 0xD6):	/* sub a, value */
+	    do_sub_byte(fetch_byte(REG_PC++));  T_COUNT(7);
 	    break;
-	  case 0x96:	/* sub a, (hl) */
+	  OPCODE(base, 0x96):	/* sub a, (hl) */
 	    do_sub_byte(mem_read(REG_HL));  T_COUNT(7);
 	    break;
 	    
-	  case 0xEE:	/* xor value */
-	    do_xor_byte(mem_read(REG_PC++));  T_COUNT(7);
+	  OPCODE(base, 0xEE):	/* xor value */
+	    do_xor_byte(fetch_byte(REG_PC++));  T_COUNT(7);
 	    break;
 	    
-	  case 0xAF:	/* xor a */
+	  OPCODE(base, 0xAF):	/* xor a */
 	    do_xor_byte(REG_A);  T_COUNT(4);
 	    break;
-	  case 0xA8:	/* xor b */
+	  OPCODE(base, 0xA8):	/* xor b */
 	    do_xor_byte(REG_B);  T_COUNT(4);
 	    break;
-	  case 0xA9:	/* xor c */
+	  OPCODE(base, 0xA9):	/* xor c */
 	    do_xor_byte(REG_C);  T_COUNT(4);
 	    break;
-	  case 0xAA:	/* xor d */
+	  OPCODE(base, 0xAA):	/* xor d */
 	    do_xor_byte(REG_D);  T_COUNT(4);
 	    break;
-	  case 0xAB:	/* xor e */
+	  OPCODE(base, 0xAB):	/* xor e */
 	    do_xor_byte(REG_E);  T_COUNT(4);
 	    break;
-	  case 0xAC:	/* xor h */
+	  OPCODE(base, 0xAC):	/* xor h */
 	    do_xor_byte(REG_H);  T_COUNT(4);
 	    break;
-	  case 0xAD:	/* xor l */
+	  OPCODE(base, 0xAD):	/* xor l */
 	    do_xor_byte(REG_L);  T_COUNT(4);
 	    break;
-	  case 0xAE:	/* xor (hl) */
+	  OPCODE(base, 0xAE):	/* xor (hl) */
 	    do_xor_byte(mem_read(REG_HL));  T_COUNT(7);
 	    break;
 	    
-	  default:
+	  OPCODE_DEFAULT(base):
 	    disassemble(REG_PC - 1);
 	    error("unsupported instruction");
 	}
+	if (prof) profile_count(prof, prof_pc, prof_t);
+
+	/* Stop at the end of the slice, when something external
+	   changed, once the scheduled event is due, or at a trap */
+	if (budget <= 0 || z80_wakeup ||
+	    (deadline - z80_state.t_count > TSTATE_T_MID) ||
+	    (traps && traps[REG_PC])) break;
+	budget--;
+      }
+	x_poll_count -= slice - budget;
+	z80_state.i_count += slice - budget + 1;
 
 	/* Event scheduler */
 	if (z80_state.sched &&
@@ -4328,7 +5089,9 @@ int z80_run(int continuous)
 		    /* Taking a NMI gets us out of a halt */
 		    REG_PC++;
 		}
+		prof_t = z80_state.t_count;
 	        do_nmi();
+		if (prof) trs_profile_interrupt(prof_t);
 	        z80_state.nmi_seen = TRUE;
                 if (trs_model == 1) {
 		  /* Simulate releasing the pushbutton here; ugh. */
@@ -4343,14 +5106,31 @@ int z80_run(int continuous)
 		    /* Taking an interrupt gets us out of a halt */
 		    REG_PC++;
 		}
+		prof_t = z80_state.t_count;
 	        do_int();
+		if (prof) trs_profile_interrupt(prof_t);
 	    }
 	}
-    } while (trs_continuous > 0);
+    } while (trs_continuous > 0 && !(traps && traps[REG_PC]));
     return ret;
 }
 
 
+void z80_machine_init(struct trs_machine *m)
+{
+    m->z80 = (struct z80_machine *) calloc(1, sizeof(struct z80_machine));
+    if (m->z80 == NULL) fatal("out of memory");
+    block_map_gen = 1;
+    init_flag_tables();
+}
+
+void z80_machine_free(struct trs_machine *m)
+{
+    free(block_cache);
+    trs_profile_free();
+    free(m->z80);
+}
+
 void z80_reset()
 {
     REG_PC = 0;
@@ -4362,9 +5142,8 @@ void z80_reset()
     z80_state.iff2 = 0;
     z80_state.interrupt_mode = 0;
     z80_state.irq = z80_state.nmi = FALSE;
-    z80_state.sched = 0;
+    z80_block_flush();
 
-    /* z80_state.r = 0; */
-    srand(time(NULL));  /* Seed the RNG, for reading the refresh register */
+    z80_state.r = z80_state.r7 = 0;
 }
 
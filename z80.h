@@ -87,7 +87,8 @@ struct z80_state_struct
     wordregister hl_prime;
 
     Uchar i;	/* interrupt-page address register */
-    /* Uchar r; */  /* no memory-refresh register, just fetch random values */
+    Uchar r;	/* memory-refresh register; counts every opcode fetch */
+    Uchar r7;	/* bit 7 of r, which only ld r, a changes */
 
     Uchar iff1, iff2;
     Uchar interrupt_mode;
@@ -121,11 +122,15 @@ struct z80_state_struct
     /* Cyclic T-state counter */
     tstate_t t_count;
 
+    /* Count of instructions executed, for benchmarking */
+    tstate_t i_count;
+
     /* Clock in MHz = T-states per microsecond */
     float clockMHz;
 
-    /* Simple event scheduler.  If nonzero, when t_count passes sched,
-     * trs_do_event() is called and sched is set to zero. */
+    /* Event scheduler.  If nonzero, when t_count passes sched,
+     * trs_do_event() is called.  sched is the due time of the soonest
+     * pending event, or zero if there is none. */
     tstate_t sched;
 };
 
@@ -165,6 +170,7 @@ struct z80_state_struct
 #define REG_IY	(z80_state.iy.word)
 
 #define REG_I	(z80_state.i)
+#define REG_R	((z80_state.r & 0x7F) | (z80_state.r7 & 0x80))
 
 #define HIGH(p) (((struct twobyte *)(p))->high)
 #define LOW(p) (((struct twobyte *)(p))->low)
@@ -222,17 +228,56 @@ struct z80_state_struct
 #define SUBTRACT_FLAG		(REG_F & SUBTRACT_MASK)
 #define CARRY_FLAG		(REG_F & CARRY_MASK)
 
-extern struct z80_state_struct z80_state;
+#include "trs_machine.h"
+
+#define z80_state      (trs_cur->regs)
+#define z80_code_page  (trs_cur->code_page)
+#define z80_wakeup     (trs_cur->wakeup)
+#define z80_traps      (trs_cur->traps)
+#define z80_profile    (trs_cur->profile)
+#define z80_watch      (trs_cur->watch)
+#define z80_last_in    (trs_cur->last_in)
+#define z80_last_out   (trs_cur->last_out)
+#define mem_read_page  (trs_cur->read_page)
+#define mem_write_page (trs_cur->write_page)
+
+/*
+ * Watchpoints.  When z80_watch is set, the Z80's reads and writes of
+ * the memory addresses and I/O ports marked in it call trs_watch_hit
+ * (in the debugger).  Memory pages with a mark anywhere in them are
+ * left out of the page tables, so only accesses to those pages pay
+ * for the check.
+ */
+#define WATCH_READ  1  /* mem[], page[] */
+#define WATCH_WRITE 2
+#define WATCH_IN    4  /* port[] */
+#define WATCH_OUT   8
+
+struct z80_watches {
+    Uchar mem[Z80_ADDRESS_LIMIT];
+    Uchar page[256];	/* the marks in mem[] for each page, or'ed */
+    Uchar port[256];
+};
+
+extern void trs_watch_hit(int address, int value, int kind);
 
 extern void z80_reset(void);
 extern int z80_run(int continuous);
+extern int z80_block_cache;
+extern int z80_bulk_move;
+extern void z80_block_invalidate(int address);
+extern void z80_block_flush(void);
 extern void mem_init(void);
 extern int mem_read(int address);
 extern void mem_write(int address, int value);
 extern void mem_write_rom(int address, int value);
+extern void mem_write_ram(int address, int value);
 extern int mem_read_word(int address);
 extern void mem_write_word(int address, int value);
 Uchar *mem_pointer(int address, int writing);
+extern int mem_ram_offset(int address);
+extern void mem_watch_pages(void);
+extern int mem_page_cacheable(int address);
 extern int mem_block_transfer(Ushort dest, Ushort source, int direction,
 			      Ushort count);
 extern int load_hex(); /* returns highest address loaded + 1 */